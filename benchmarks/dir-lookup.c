@@ -0,0 +1,141 @@
+/* Time lookups in a large directory.
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This file is part of the GNU Hurd.
+
+   The GNU Hurd is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   The GNU Hurd is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+/* Create COUNT (default 100000) empty files in the empty directory DIR,
+   then report the average time of looking up present names, of looking
+   up absent names and of removing the files.  Run it on an ext2fs with
+   and without the dir_index feature to compare the hashed directory
+   index with linear scans.  Only POSIX calls are used, so this can be
+   run on any system.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <error.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static uint64_t
+now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* A simple xorshift generator, so that the runs are reproducible.  */
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t
+rng (void)
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+/* Names like those of a mail spool.  */
+static void
+make_name (char *name, size_t size, unsigned long i, int present)
+{
+  snprintf (name, size, "%lu.M%luP%s", i, i * 2654435761UL % 1000000,
+	    present ? "host" : "absent");
+}
+
+static void
+report (const char *what, uint64_t elapsed, unsigned long n)
+{
+  printf ("%-8s %10.1f\n", what, (double) elapsed / n / 1000);
+}
+
+int
+main (int argc, char **argv)
+{
+  unsigned long count = 100000;
+  unsigned long i, n;
+  char name[64];
+  struct stat st;
+  uint64_t start;
+  int dirfd, fd;
+
+  if (argc < 2 || argc > 3)
+    {
+      fprintf (stderr, "usage: %s DIR [COUNT]\n", argv[0]);
+      exit (1);
+    }
+  if (argc == 3)
+    count = strtoul (argv[2], NULL, 0);
+  if (count == 0)
+    error (1, 0, "COUNT must not be zero");
+
+  dirfd = open (argv[1], O_RDONLY | O_DIRECTORY);
+  if (dirfd < 0)
+    error (1, errno, "%s", argv[1]);
+
+  printf ("%-8s %10s   (microseconds per name, %lu names)\n",
+	  "op", "time", count);
+
+  start = now ();
+  for (i = 0; i < count; i++)
+    {
+      make_name (name, sizeof name, i, 1);
+      fd = openat (dirfd, name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+      if (fd < 0)
+	error (1, errno, "%s", name);
+      close (fd);
+    }
+  report ("create", now () - start, count);
+
+  n = count < 100000 ? 100000 : count;
+  start = now ();
+  for (i = 0; i < n; i++)
+    {
+      make_name (name, sizeof name, rng () % count, 1);
+      if (fstatat (dirfd, name, &st, 0))
+	error (1, errno, "%s", name);
+    }
+  report ("hit", now () - start, n);
+
+  start = now ();
+  for (i = 0; i < n; i++)
+    {
+      make_name (name, sizeof name, rng () % count, 0);
+      if (fstatat (dirfd, name, &st, 0) == 0)
+	error (1, 0, "%s unexpectedly found", name);
+      if (errno != ENOENT)
+	error (1, errno, "%s", name);
+    }
+  report ("miss", now () - start, n);
+
+  start = now ();
+  for (i = 0; i < count; i++)
+    {
+      make_name (name, sizeof name, i, 1);
+      if (unlinkat (dirfd, name, 0))
+	error (1, errno, "%s", name);
+    }
+  report ("unlink", now () - start, count);
+
+  close (dirfd);
+  return 0;
+}
@@ -0,0 +1,119 @@
+/* Measure the latency of insertions into libihash hash tables.
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This file is part of the GNU Hurd.
+
+   The GNU Hurd is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   The GNU Hurd is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+/* For every table size N from 1024 up to MAX-ITEMS (doubling each
+   time), insert N items into an empty table and report the median and
+   the tail latencies of the single insertions, once with the default
+   rehashing and once with incremental rehashing.  Only the host's libc
+   and libihash are needed, so this can be run on any system.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <error.h>
+#include <hurd/ihash.h>
+
+struct item
+{
+  hurd_ihash_locp_t locp;
+};
+
+static uint64_t
+now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+compare_u64 (const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* Insert N items into a fresh table and print the latency
+   distribution.  */
+static void
+run (size_t n, int incremental, struct item *items, uint64_t *lat)
+{
+  struct hurd_ihash ht;
+  size_t i;
+
+  hurd_ihash_init (&ht, offsetof (struct item, locp));
+  hurd_ihash_set_incremental (&ht, incremental);
+
+  for (i = 0; i < n; i++)
+    {
+      /* Spread the keys like port names.  */
+      hurd_ihash_key_t key = (i << 8) | 3;
+      uint64_t start = now ();
+      if (hurd_ihash_add (&ht, key, &items[i]))
+	error (1, 0, "hurd_ihash_add failed");
+      lat[i] = now () - start;
+    }
+
+  qsort (lat, n, sizeof *lat, compare_u64);
+  printf ("%10zu %-11s %8llu %8llu %8llu %10llu\n", n,
+	  incremental ? "incremental" : "default",
+	  (unsigned long long) lat[n / 2],
+	  (unsigned long long) lat[n * 99 / 100],
+	  (unsigned long long) lat[n * 999 / 1000],
+	  (unsigned long long) lat[n - 1]);
+
+  hurd_ihash_destroy (&ht);
+}
+
+int
+main (int argc, char **argv)
+{
+  size_t max = 1 << 20;
+  size_t n;
+  struct item *items;
+  uint64_t *lat;
+
+  if (argc > 2)
+    {
+      fprintf (stderr, "usage: %s [MAX-ITEMS]\n", argv[0]);
+      exit (1);
+    }
+  if (argc == 2)
+    max = strtoul (argv[1], NULL, 0);
+  if (max < 1024)
+    max = 1024;
+
+  items = calloc (max, sizeof *items);
+  lat = calloc (max, sizeof *lat);
+  if (items == NULL || lat == NULL)
+    error (1, 0, "out of memory");
+
+  printf ("%10s %-11s %8s %8s %8s %10s   (nanoseconds)\n",
+	  "items", "mode", "p50", "p99", "p999", "max");
+  for (n = 1024; n <= max; n <<= 1)
+    {
+      run (n, 0, items, lat);
+      run (n, 1, items, lat);
+    }
+
+  free (items);
+  free (lat);
+  return 0;
+}
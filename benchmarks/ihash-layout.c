@@ -0,0 +1,183 @@
+/* Compare the lookup speed of the libihash table layouts.
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This file is part of the GNU Hurd.
+
+   The GNU Hurd is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   The GNU Hurd is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+/* Fill a table of SIZE slots (default 2^20) up to several load
+   factors, and report the average time of successful and failing
+   lookups, with and without the control byte layout, for integer keys
+   and for keys using the generalized key interface the way the
+   libdiskfs node cache does.  Only the host's libc and libihash are
+   needed, so this can be run on any system.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <error.h>
+#include <hurd/ihash.h>
+
+/* A key like the one of the libdiskfs node cache.  */
+struct key
+{
+  uint64_t cache_id;
+  uint64_t dev;
+};
+
+struct item
+{
+  hurd_ihash_locp_t locp;
+  struct key key;
+};
+
+static hurd_ihash_key_t
+key_hash (const void *key)
+{
+  return (hurd_ihash_key_t) hurd_ihash_hash32 (key, sizeof (struct key), 0);
+}
+
+static int
+key_cmp (const void *a, const void *b)
+{
+  return memcmp (a, b, sizeof (struct key)) == 0;
+}
+
+static uint64_t
+now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* A simple xorshift generator, so that the runs are reproducible.  */
+static uint64_t rng_state;
+
+static uint64_t
+rng (void)
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static hurd_ihash_key_t
+key_of (struct item *item, int gki)
+{
+  return (gki ? (hurd_ihash_key_t) &item->key
+	  : (hurd_ihash_key_t) item->key.cache_id);
+}
+
+/* Fill a table using layout CTRL up to LOAD binary percent of SIZE
+   slots, then time N lookups of present and N lookups of absent
+   keys.  */
+static void
+run (size_t size, unsigned int load, int gki, int ctrl,
+     struct item *items, struct item *absent, size_t n)
+{
+  struct hurd_ihash ht;
+  size_t count = size * load / 128;
+  volatile uintptr_t sink = 0;
+  uint64_t start, hit, miss;
+  size_t i;
+
+  hurd_ihash_init (&ht, offsetof (struct item, locp));
+  if (gki)
+    hurd_ihash_set_gki (&ht, key_hash, key_cmp);
+  hurd_ihash_set_ctrl (&ht, ctrl);
+  /* Only grow once the table is full, so that COUNT items end up in a
+     table of SIZE slots.  */
+  hurd_ihash_set_max_load (&ht, 128);
+
+  for (i = 0; i < count; i++)
+    if (hurd_ihash_add (&ht, key_of (&items[i], gki), &items[i]))
+      error (1, 0, "hurd_ihash_add failed");
+  if (ht.size != size)
+    error (1, 0, "unexpected table size %zu", ht.size);
+
+  start = now ();
+  for (i = 0; i < n; i++)
+    sink += (uintptr_t) hurd_ihash_find (&ht,
+					 key_of (&items[rng () % count], gki));
+  hit = now () - start;
+
+  start = now ();
+  for (i = 0; i < n; i++)
+    sink += (uintptr_t) hurd_ihash_find (&ht, key_of (&absent[i], gki));
+  miss = now () - start;
+
+  printf ("%5.1f%% %-4s %-7s %10.1f %10.1f\n", load * 100.0 / 128,
+	  gki ? "gki" : "int", ctrl ? "ctrl" : "default",
+	  (double) hit / n, (double) miss / n);
+
+  hurd_ihash_destroy (&ht);
+}
+
+int
+main (int argc, char **argv)
+{
+  static const unsigned int loads[] = { 72, 96, 112, 120 };
+  size_t size = 1 << 20;
+  size_t n = 1 << 20;
+  struct item *items, *absent;
+  size_t i, l;
+  int gki;
+
+  if (argc > 2)
+    {
+      fprintf (stderr, "usage: %s [SIZE]\n", argv[0]);
+      exit (1);
+    }
+  if (argc == 2)
+    size = strtoul (argv[1], NULL, 0);
+  if (size < HURD_IHASH_MIN_SIZE || (size & (size - 1)))
+    error (1, 0, "SIZE must be a power of two of at least %d",
+	   HURD_IHASH_MIN_SIZE);
+
+  items = calloc (size, sizeof *items);
+  absent = calloc (n, sizeof *absent);
+  if (items == NULL || absent == NULL)
+    error (1, 0, "out of memory");
+
+  /* Odd keys are present, even keys are absent.  */
+  rng_state = 88172645463325252ULL;
+  for (i = 0; i < size; i++)
+    {
+      items[i].key.cache_id = (rng () | 1) & UINTPTR_MAX;
+      items[i].key.dev = 1;
+    }
+  for (i = 0; i < n; i++)
+    {
+      absent[i].key.cache_id = (rng () & ~(uint64_t) 1) & UINTPTR_MAX;
+      absent[i].key.dev = 1;
+    }
+
+  printf ("%6s %-4s %-7s %10s %10s   (nanoseconds per lookup)\n",
+	  "load", "keys", "layout", "hit", "miss");
+  for (gki = 0; gki <= 1; gki++)
+    for (l = 0; l < sizeof loads / sizeof loads[0]; l++)
+      {
+	run (size, loads[l], gki, 0, items, absent, n);
+	run (size, loads[l], gki, 1, items, absent, n);
+      }
+
+  free (items);
+  free (absent);
+  return 0;
+}
@@ -0,0 +1,282 @@
+/* A loopback nbd server for testing the nbd store.
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This file is part of the GNU Hurd.
+
+   The GNU Hurd is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   The GNU Hurd is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+/* Serve a zero-filled image of SIZE bytes (default 64 MiB) kept in
+   memory to nbd clients connecting to PORT on the loopback interface,
+   one connection at a time.  Each request is answered from its own
+   thread after a delay of DELAY microseconds (default 1000), plus up to
+   as much again at random, so that replies come back out of order and
+   the cost of a round trip can be set at will.  Point the nbd store at
+   it with, for instance, `storeread nbd://localhost:PORT/512 ...' to
+   compare queue depths (store_nbd_queue_depth) for latency-bound
+   access.  Only POSIX calls are used, so this can be run on any
+   system.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <error.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define NBD_INIT_MAGIC		"NBDMAGIC\x00\x00\x42\x02\x81\x86\x12\x53"
+#define NBD_REQUEST_MAGIC	0x25609513
+#define NBD_REPLY_MAGIC		0x67446698
+
+struct nbd_startup
+{
+  char magic[16];
+  uint64_t size;
+  char reserved[128];
+} __attribute__ ((packed));
+
+struct nbd_request
+{
+  uint32_t magic;
+  uint32_t type;
+  uint64_t handle;
+  uint64_t from;
+  uint32_t len;
+} __attribute__ ((packed));
+
+struct nbd_reply
+{
+  uint32_t magic;
+  uint32_t error;
+  uint64_t handle;
+} __attribute__ ((packed));
+
+/* A request being answered.  */
+struct job
+{
+  int sock;
+  struct nbd_request req;	/* In host order, apart from HANDLE.  */
+  char *data;			/* Malloced; the data of a write.  */
+};
+
+static char *image;
+static uint64_t image_size;
+static unsigned long delay = 1000;
+
+/* Held while sending a reply.  */
+static pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Held while touching IMAGE or OUTSTANDING.  */
+static pthread_mutex_t image_lock = PTHREAD_MUTEX_INITIALIZER;
+/* The number of requests not answered yet, and its wait queue.  */
+static unsigned long outstanding;
+static pthread_cond_t answered = PTHREAD_COND_INITIALIZER;
+
+static int
+read_all (int fd, void *buf, size_t len)
+{
+  while (len > 0)
+    {
+      ssize_t cc = read (fd, buf, len);
+      if (cc <= 0)
+	return -1;
+      buf += cc;
+      len -= cc;
+    }
+  return 0;
+}
+
+static int
+write_all (int fd, const void *buf, size_t len)
+{
+  while (len > 0)
+    {
+      ssize_t cc = write (fd, buf, len);
+      if (cc <= 0)
+	return -1;
+      buf += cc;
+      len -= cc;
+    }
+  return 0;
+}
+
+static void *
+answer (void *arg)
+{
+  struct job *job = arg;
+  struct nbd_reply reply;
+  char *data = 0;
+  int bad = job->req.from > image_size
+	    || job->req.len > image_size - job->req.from;
+
+  usleep (delay + (delay ? random () % delay : 0));
+
+  reply.magic = htonl (NBD_REPLY_MAGIC);
+  reply.error = htonl (bad ? EINVAL : 0);
+  reply.handle = job->req.handle;
+
+  if (! bad)
+    {
+      pthread_mutex_lock (&image_lock);
+      if (job->req.type == 1)
+	memcpy (image + job->req.from, job->data, job->req.len);
+      else
+	{
+	  data = malloc (job->req.len);
+	  if (data)
+	    memcpy (data, image + job->req.from, job->req.len);
+	  else
+	    reply.error = htonl (ENOMEM);
+	}
+      pthread_mutex_unlock (&image_lock);
+    }
+
+  pthread_mutex_lock (&send_lock);
+  if (write_all (job->sock, &reply, sizeof reply) == 0 && data)
+    write_all (job->sock, data, job->req.len);
+  pthread_mutex_unlock (&send_lock);
+
+  free (data);
+  free (job->data);
+  free (job);
+
+  pthread_mutex_lock (&image_lock);
+  if (--outstanding == 0)
+    pthread_cond_broadcast (&answered);
+  pthread_mutex_unlock (&image_lock);
+  return 0;
+}
+
+/* Answer requests on SOCK until the client disconnects.  Returns when all
+   answers have been sent.  */
+static void
+serve (int sock)
+{
+  struct nbd_startup ns;
+  pthread_attr_t attr;
+  unsigned long requests = 0;
+
+  memset (&ns, 0, sizeof ns);
+  memcpy (ns.magic, NBD_INIT_MAGIC, sizeof ns.magic);
+  ns.size = htobe64 (image_size);
+  if (write_all (sock, &ns, sizeof ns))
+    return;
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+
+  for (;;)
+    {
+      struct job *job = malloc (sizeof *job);
+      pthread_t thread;
+
+      if (! job)
+	error (1, errno, "malloc");
+      job->sock = sock;
+      job->data = 0;
+
+      if (read_all (sock, &job->req, sizeof job->req)
+	  || ntohl (job->req.magic) != NBD_REQUEST_MAGIC)
+	{
+	  free (job);
+	  break;
+	}
+      job->req.type = ntohl (job->req.type);
+      job->req.from = be64toh (job->req.from);
+      job->req.len = ntohl (job->req.len);
+
+      if (job->req.type == 2)
+	{
+	  free (job);
+	  break;
+	}
+
+      if (job->req.type == 1)
+	{
+	  job->data = malloc (job->req.len);
+	  if (! job->data)
+	    error (1, errno, "malloc");
+	  if (read_all (sock, job->data, job->req.len))
+	    {
+	      free (job->data);
+	      free (job);
+	      break;
+	    }
+	}
+
+      requests++;
+      pthread_mutex_lock (&image_lock);
+      outstanding++;
+      pthread_mutex_unlock (&image_lock);
+      if (pthread_create (&thread, &attr, answer, job))
+	answer (job);
+    }
+
+  pthread_mutex_lock (&image_lock);
+  while (outstanding > 0)
+    pthread_cond_wait (&answered, &image_lock);
+  pthread_mutex_unlock (&image_lock);
+  pthread_attr_destroy (&attr);
+  printf ("served %lu requests\n", requests);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct sockaddr_in sin;
+  int lsock, one = 1;
+  unsigned long port;
+
+  if (argc < 2 || argc > 4)
+    {
+      fprintf (stderr, "usage: %s PORT [SIZE [DELAY]]\n", argv[0]);
+      return 1;
+    }
+  port = strtoul (argv[1], NULL, 0);
+  image_size = argc > 2 ? strtoull (argv[2], NULL, 0) : 64 << 20;
+  if (argc > 3)
+    delay = strtoul (argv[3], NULL, 0);
+
+  image = calloc (1, image_size);
+  if (! image)
+    error (1, errno, "allocating %llu bytes",
+	   (unsigned long long) image_size);
+
+  lsock = socket (PF_INET, SOCK_STREAM, 0);
+  if (lsock < 0)
+    error (1, errno, "socket");
+  setsockopt (lsock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+
+  memset (&sin, 0, sizeof sin);
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (port);
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  if (bind (lsock, (struct sockaddr *) &sin, sizeof sin)
+      || listen (lsock, 1))
+    error (1, errno, "port %lu", port);
+
+  for (;;)
+    {
+      int sock = accept (lsock, NULL, NULL);
+      if (sock < 0)
+	error (1, errno, "accept");
+      serve (sock);
+      close (sock);
+    }
+}
@@ -0,0 +1,394 @@
+/* A loopback NFS server for testing the nfs translator.
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This file is part of the GNU Hurd.
+
+   The GNU Hurd is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   The GNU Hurd is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+/* Serve an NFS version 2 file system over UDP on PORT of the loopback
+   interface.  The file system is a root directory holding a single file,
+   `data', of SIZE bytes (default 64 MiB) kept in memory.  The MOUNT
+   protocol is answered on the same port, so no portmapper is needed.
+   Each call is answered from its own thread after a delay of DELAY
+   microseconds (default 1000), plus up to as much again at random, so
+   that a round trip costs what a slow link would.  Mount it with
+
+     settrans -a /mnt /hurd/nfs --mount-port=PORT --nfs-port=PORT \
+       localhost:/
+
+   and time copies of /mnt/data with different --rpc-window and
+   --read-ahead settings.  Only POSIX calls are used, so this can be run
+   on any system.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define MOUNTPROG	100005
+#define NFSPROG		100003
+
+#define FHSIZE		32
+#define ROOT_ID		1
+#define DATA_ID		2
+
+/* The largest call or reply.  */
+#define MAXMSG		(64 * 1024)
+
+/* A call being answered.  */
+struct call
+{
+  struct sockaddr_in from;
+  size_t len;
+  uint32_t msg[MAXMSG / 4];
+};
+
+static int sock;
+static char *image;
+static uint32_t image_size;
+static unsigned long delay = 1000;
+static time_t mtime;
+
+/* Held while touching IMAGE, IMAGE_SIZE or MTIME.  */
+static pthread_mutex_t image_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Fill in a file handle for file ID at P, and return the end.  */
+static uint32_t *
+put_fh (uint32_t *p, int id)
+{
+  memset (p, 0, FHSIZE);
+  p[0] = htonl (id);
+  return p + FHSIZE / 4;
+}
+
+/* Return the file ID from the file handle at P.  */
+static int
+get_fh (const uint32_t *p)
+{
+  return ntohl (p[0]);
+}
+
+/* Fill in the attributes of file ID at P, and return the end.
+   IMAGE_LOCK must be held.  */
+static uint32_t *
+put_fattr (uint32_t *p, int id)
+{
+  int dir = id == ROOT_ID;
+
+  *p++ = htonl (dir ? 2 : 1);			/* type */
+  *p++ = htonl (dir ? 040755 : 0100644);	/* mode */
+  *p++ = htonl (dir ? 2 : 1);			/* nlink */
+  *p++ = htonl (getuid ());			/* uid */
+  *p++ = htonl (getgid ());			/* gid */
+  *p++ = htonl (dir ? 512 : image_size);	/* size */
+  *p++ = htonl (8192);				/* blocksize */
+  *p++ = 0;					/* rdev */
+  *p++ = htonl (dir ? 1 : (image_size + 511) / 512); /* blocks */
+  *p++ = htonl (1);				/* fsid */
+  *p++ = htonl (id);				/* fileid */
+  *p++ = htonl (mtime);				/* atime */
+  *p++ = 0;
+  *p++ = htonl (mtime);				/* mtime */
+  *p++ = 0;
+  *p++ = htonl (mtime);				/* ctime */
+  *p++ = 0;
+  return p;
+}
+
+/* Answer the NFS call with procedure PROC and arguments at ARGS (which
+   end at END), putting the results at P.  Return the end of the results,
+   or 0 if the procedure isn't supported.  */
+static uint32_t *
+nfs_call (int proc, const uint32_t *args, const uint32_t *end, uint32_t *p)
+{
+  int id = args + FHSIZE / 4 <= end ? get_fh (args) : 0;
+  const uint32_t *a = args + FHSIZE / 4;
+
+  if (proc != 0 && id != ROOT_ID && id != DATA_ID)
+    {
+      *p++ = htonl (70);			/* NFSERR_STALE */
+      return p;
+    }
+
+  pthread_mutex_lock (&image_lock);
+  switch (proc)
+    {
+    case 0:					/* NULL */
+      break;
+
+    case 1:					/* GETATTR */
+      *p++ = 0;
+      p = put_fattr (p, id);
+      break;
+
+    case 2:					/* SETATTR */
+      if (id == DATA_ID && ntohl (a[3]) != (uint32_t) -1)
+	{
+	  uint32_t size = ntohl (a[3]);
+	  char *new = realloc (image, size ?: 1);
+	  if (! new)
+	    {
+	      *p++ = htonl (28);		/* NFSERR_NOSPC */
+	      break;
+	    }
+	  if (size > image_size)
+	    memset (new + image_size, 0, size - image_size);
+	  image = new;
+	  image_size = size;
+	  mtime = time (0);
+	}
+      *p++ = 0;
+      p = put_fattr (p, id);
+      break;
+
+    case 4:					/* LOOKUP */
+      if (id == ROOT_ID && ntohl (a[0]) == 4 && ! memcmp (&a[1], "data", 4))
+	{
+	  *p++ = 0;
+	  p = put_fh (p, DATA_ID);
+	  p = put_fattr (p, DATA_ID);
+	}
+      else
+	*p++ = htonl (2);			/* NFSERR_NOENT */
+      break;
+
+    case 6:					/* READ */
+      {
+	uint32_t offset = ntohl (a[0]), count = ntohl (a[1]);
+
+	if (id != DATA_ID)
+	  {
+	    *p++ = htonl (21);			/* NFSERR_ISDIR */
+	    break;
+	  }
+	if (count > 8192)
+	  count = 8192;
+	if (offset > image_size)
+	  offset = image_size;
+	if (count > image_size - offset)
+	  count = image_size - offset;
+	*p++ = 0;
+	p = put_fattr (p, id);
+	*p++ = htonl (count);
+	memcpy (p, image + offset, count);
+	memset ((char *) p + count, 0, (4 - count % 4) % 4);
+	p += (count + 3) / 4;
+	break;
+      }
+
+    case 8:					/* WRITE */
+      {
+	uint32_t offset = ntohl (a[1]), count = ntohl (a[3]);
+
+	if (id != DATA_ID)
+	  {
+	    *p++ = htonl (21);			/* NFSERR_ISDIR */
+	    break;
+	  }
+	if ((const char *) &a[4] + count > (const char *) end)
+	  {
+	    *p++ = htonl (5);			/* NFSERR_IO */
+	    break;
+	  }
+	if (offset + count > image_size)
+	  {
+	    char *new = realloc (image, offset + count);
+	    if (! new)
+	      {
+		*p++ = htonl (28);		/* NFSERR_NOSPC */
+		break;
+	      }
+	    memset (new + image_size, 0, offset + count - image_size);
+	    image = new;
+	    image_size = offset + count;
+	  }
+	memcpy (image + offset, &a[4], count);
+	mtime = time (0);
+	*p++ = 0;
+	p = put_fattr (p, id);
+	break;
+      }
+
+    case 16:					/* READDIR */
+      {
+	uint32_t cookie = ntohl (a[0]);
+	static const char *const names[] = { ".", "..", "data" };
+	static const int ids[] = { ROOT_ID, ROOT_ID, DATA_ID };
+
+	*p++ = 0;
+	for (; cookie < 3; cookie++)
+	  {
+	    size_t len = strlen (names[cookie]);
+	    *p++ = htonl (1);
+	    *p++ = htonl (ids[cookie]);
+	    *p++ = htonl (len);
+	    memset (p, 0, (len + 3) & ~3);
+	    memcpy (p, names[cookie], len);
+	    p += (len + 3) / 4;
+	    *p++ = htonl (cookie + 1);
+	  }
+	*p++ = 0;
+	*p++ = htonl (1);			/* eof */
+	break;
+      }
+
+    case 17:					/* STATFS */
+      *p++ = 0;
+      *p++ = htonl (8192);
+      *p++ = htonl (512);
+      *p++ = htonl (image_size / 512 + 1024);
+      *p++ = htonl (1024);
+      *p++ = htonl (1024);
+      break;
+
+    default:
+      p = 0;
+    }
+  pthread_mutex_unlock (&image_lock);
+
+  return p;
+}
+
+static void *
+answer (void *arg)
+{
+  struct call *call = arg;
+  const uint32_t *m = call->msg, *end = call->msg + call->len / 4;
+  uint32_t *reply = malloc (MAXMSG), *p, *results;
+  int prog, proc;
+
+  usleep (delay + (delay ? random () % delay : 0));
+
+  if (! reply || call->len < 40 || ntohl (m[1]) != 0)
+    goto out;
+
+  prog = ntohl (m[3]);
+  proc = ntohl (m[5]);
+
+  /* Skip the credentials and verifier.  */
+  m += 6;
+  m += 2 + (ntohl (m[1]) + 3) / 4;
+  if (m + 2 > end)
+    goto out;
+  m += 2 + (ntohl (m[1]) + 3) / 4;
+  if (m > end)
+    goto out;
+
+  p = reply;
+  *p++ = call->msg[0];				/* xid */
+  *p++ = htonl (1);				/* REPLY */
+  *p++ = 0;					/* MSG_ACCEPTED */
+  *p++ = 0;					/* AUTH_NONE */
+  *p++ = 0;
+  *p++ = 0;					/* SUCCESS */
+  results = p;
+
+  if (prog == MOUNTPROG)
+    switch (proc)
+      {
+      case 1:					/* MNT */
+	*p++ = 0;
+	p = put_fh (p, ROOT_ID);
+	break;
+      case 0:					/* NULL */
+      case 3:					/* UMNT */
+	break;
+      default:
+	p = 0;
+      }
+  else if (prog == NFSPROG)
+    p = nfs_call (proc, m, end, p);
+  else
+    p = 0;
+
+  if (! p)
+    {
+      results[-1] = htonl (prog == MOUNTPROG || prog == NFSPROG
+			   ? 3 : 1);	/* PROC_UNAVAIL or PROG_UNAVAIL */
+      p = results;
+    }
+
+  sendto (sock, reply, (char *) p - (char *) reply, 0,
+	  (struct sockaddr *) &call->from, sizeof call->from);
+
+ out:
+  free (reply);
+  free (call);
+  return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  struct sockaddr_in sin;
+  pthread_attr_t attr;
+  unsigned long port;
+
+  if (argc < 2 || argc > 4)
+    {
+      fprintf (stderr, "usage: %s PORT [SIZE [DELAY]]\n", argv[0]);
+      return 1;
+    }
+  port = strtoul (argv[1], NULL, 0);
+  image_size = argc > 2 ? strtoul (argv[2], NULL, 0) : 64 << 20;
+  if (argc > 3)
+    delay = strtoul (argv[3], NULL, 0);
+
+  image = calloc (1, image_size ?: 1);
+  if (! image)
+    error (1, errno, "allocating %lu bytes", (unsigned long) image_size);
+  mtime = time (0);
+
+  sock = socket (PF_INET, SOCK_DGRAM, 0);
+  if (sock < 0)
+    error (1, errno, "socket");
+
+  memset (&sin, 0, sizeof sin);
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (port);
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  if (bind (sock, (struct sockaddr *) &sin, sizeof sin))
+    error (1, errno, "port %lu", port);
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+
+  for (;;)
+    {
+      struct call *call = malloc (sizeof *call);
+      socklen_t fromlen = sizeof call->from;
+      ssize_t cc;
+      pthread_t thread;
+
+      if (! call)
+	error (1, errno, "malloc");
+      cc = recvfrom (sock, call->msg, sizeof call->msg, 0,
+		     (struct sockaddr *) &call->from, &fromlen);
+      if (cc < 0)
+	error (1, errno, "recvfrom");
+      call->len = cc;
+
+      if (pthread_create (&thread, &attr, answer, call))
+	answer (call);
+    }
+}
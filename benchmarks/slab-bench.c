@@ -0,0 +1,152 @@
+/* Multi-threaded allocation benchmark for libhurd-slab.
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This file is part of the GNU Hurd.
+
+   The GNU Hurd is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   The GNU Hurd is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+/* Every thread repeatedly allocates a batch of objects and frees them
+   again, once with the slab layer alone and once with the magazine
+   layer.  For every number of threads from 1 to MAX-THREADS, print
+   the throughput and the statistics of the slab space.  Only POSIX
+   threads and libhurd-slab are needed, so this can be run on any
+   system.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <error.h>
+#include <pthread.h>
+#include <hurd/slab.h>
+
+/* An object roughly the size of a pflocal socket or a pager request.  */
+struct object
+{
+  char data[96];
+};
+
+static struct hurd_slab_space space;
+static unsigned long iterations = 100000;
+static unsigned int batch = 100;
+
+static uint64_t
+now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *
+worker (void *arg)
+{
+  void *objs[batch];
+  unsigned long i;
+  unsigned int j;
+  error_t err;
+
+  for (i = 0; i < iterations; i++)
+    {
+      for (j = 0; j < batch; j++)
+	{
+	  err = hurd_slab_alloc (&space, &objs[j]);
+	  if (err)
+	    error (1, err, "hurd_slab_alloc");
+	  ((struct object *) objs[j])->data[0] = j;
+	}
+      for (j = 0; j < batch; j++)
+	hurd_slab_dealloc (&space, objs[j]);
+    }
+
+  return NULL;
+}
+
+static void
+run (unsigned int nthreads, int magazines)
+{
+  pthread_t threads[nthreads];
+  struct hurd_slab_stats stats;
+  unsigned long ops, cached;
+  uint64_t start, elapsed;
+  unsigned int i;
+  error_t err;
+
+  err = hurd_slab_init (&space, sizeof (struct object), 0,
+			NULL, NULL, NULL, NULL, NULL);
+  if (err)
+    error (1, err, "hurd_slab_init");
+  if (magazines)
+    {
+      err = hurd_slab_enable_magazines (&space, 0);
+      if (err)
+	error (1, err, "hurd_slab_enable_magazines");
+    }
+
+  start = now ();
+  for (i = 0; i < nthreads; i++)
+    {
+      err = pthread_create (&threads[i], NULL, worker, NULL);
+      if (err)
+	error (1, err, "pthread_create");
+    }
+  for (i = 0; i < nthreads; i++)
+    pthread_join (threads[i], NULL);
+  elapsed = now () - start;
+
+  hurd_slab_get_stats (&space, &stats);
+  ops = 2 * iterations * batch * nthreads;
+  cached = stats.magazine_allocs + stats.magazine_deallocs;
+  printf ("%7u %-9s %10.2f %8.1f%% %10lu\n", nthreads,
+	  magazines ? "magazine" : "slab",
+	  ops * 1000.0 / elapsed, cached * 100.0 / ops,
+	  stats.depot_exchanges);
+
+  err = hurd_slab_destroy (&space);
+  if (err)
+    error (1, err, "hurd_slab_destroy");
+}
+
+int
+main (int argc, char **argv)
+{
+  unsigned int max_threads = 8;
+  unsigned int n;
+
+  if (argc > 4)
+    {
+      fprintf (stderr, "usage: %s [MAX-THREADS [ITERATIONS [BATCH]]]\n",
+	       argv[0]);
+      exit (1);
+    }
+  if (argc > 1)
+    max_threads = strtoul (argv[1], NULL, 0);
+  if (argc > 2)
+    iterations = strtoul (argv[2], NULL, 0);
+  if (argc > 3)
+    batch = strtoul (argv[3], NULL, 0);
+  if (max_threads == 0 || batch == 0)
+    error (1, 0, "MAX-THREADS and BATCH must not be zero");
+
+  printf ("%7s %-9s %10s %9s %10s\n", "threads", "layer", "Mops/s",
+	  "hit rate", "exchanges");
+  for (n = 1; n <= max_threads; n <<= 1)
+    {
+      run (n, 0);
+      run (n, 1);
+    }
+
+  return 0;
+}
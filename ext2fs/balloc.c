@@ -54,6 +54,97 @@ memscan (void *buf, unsigned char ch, size_t len)
 
 #define in_range(b, first, len) ((b) >= (first) && (b) <= (first) + (len) - 1)
 
+/* The number of free blocks set aside, either for delayed allocations,
+   which only the allocations they were set aside for may use, or for
+   allocations searching the bitmaps.  Protected by GLOBAL_LOCK, like the
+   free counts in the superblock.  The block bitmap and descriptor of a
+   group are protected by its lock in GROUP_LOCKS instead: an allocation
+   first sets aside the blocks it wants, then searches the groups holding
+   only the lock of one at a time, and at last accounts for the blocks it
+   got.  */
+static block_t reserved_blocks;
+
+/* Blocks freed in a group already searched while others are allocated in
+   one not searched yet can make an allocation miss the free blocks it has
+   set aside.  How many times to search again before giving up.  */
+#define ALLOC_RETRIES	3
+
+error_t
+ext2_reserve_blocks (block_t *reservation, block_t count)
+{
+  error_t err = 0;
+
+  pthread_spin_lock (&global_lock);
+  if (sblock->s_free_blocks_count - reserved_blocks < count)
+    err = ENOSPC;
+  else
+    {
+      reserved_blocks += count;
+      *reservation += count;
+    }
+  pthread_spin_unlock (&global_lock);
+
+  return err;
+}
+
+void
+ext2_release_blocks (block_t *reservation, block_t count)
+{
+  pthread_spin_lock (&global_lock);
+  assert (*reservation >= count && reserved_blocks >= count);
+  reserved_blocks -= count;
+  *reservation -= count;
+  pthread_spin_unlock (&global_lock);
+}
+
+block_t
+ext2_count_reserved_blocks (void)
+{
+  return __atomic_load_n (&reserved_blocks, __ATOMIC_RELAXED);
+}
+
+/* Set aside up to COUNT free blocks for an allocation, counting those in
+   *RESERVATION, if RESERVATION isn't null, as free.  Return how many
+   blocks the allocation may take, and set *EXTRA to the number set aside
+   beyond *RESERVATION.  */
+static block_t
+claim_blocks (block_t count, block_t *reservation, block_t *extra)
+{
+  block_t own = reservation ? *reservation : 0;
+  block_t avail;
+
+  pthread_spin_lock (&global_lock);
+  avail = sblock->s_free_blocks_count - reserved_blocks + own;
+  if (count > avail)
+    count = avail;
+  *extra = count > own ? count - own : 0;
+  reserved_blocks += *extra;
+  pthread_spin_unlock (&global_lock);
+
+  return count;
+}
+
+/* Account for the USED blocks taken by an allocation for which
+   claim_blocks returned EXTRA, using up *RESERVATION first.  */
+static void
+unclaim_blocks (block_t used, block_t extra, block_t *reservation)
+{
+  pthread_spin_lock (&global_lock);
+  reserved_blocks -= extra;
+  if (reservation)
+    {
+      block_t own = used < *reservation ? used : *reservation;
+      *reservation -= own;
+      reserved_blocks -= own;
+    }
+  if (used)
+    {
+      sblock->s_free_blocks_count -= used;
+      sblock_dirty = 1;
+    }
+  pthread_spin_unlock (&global_lock);
+}
+
 void
 ext2_free_blocks (block_t block, unsigned long count)
 {
@@ -61,16 +152,14 @@ ext2_free_blocks (block_t block, unsigned long count)
   unsigned long block_group;
   unsigned long bit;
   unsigned long i;
+  unsigned long freed = 0;
   struct ext2_group_desc *gdp;
 
-  pthread_spin_lock (&global_lock);
-
   if (block < sblock->s_first_data_block ||
       (block + count) > sblock->s_blocks_count)
     {
       ext2_error ("freeing blocks not in datazone - "
 		  "block = %u, count = %lu", block, count);
-      pthread_spin_unlock (&global_lock);
       return;
     }
 
@@ -92,6 +181,9 @@ ext2_free_blocks (block_t block, unsigned long count)
 		      block, count);
 	}
       gdp = group_desc (block_group);
+
+      pthread_spin_lock (&group_locks[block_group]);
+
       bh = disk_cache_block_ref (gdp->bg_block_bitmap);
 
       if (in_range (gdp->bg_block_bitmap, block, gcount) ||
@@ -109,7 +201,7 @@ ext2_free_blocks (block_t block, unsigned long count)
 	  else
 	    {
 	      gdp->bg_free_blocks_count++;
-	      sblock->s_free_blocks_count++;
+	      freed++;
 	    }
 	}
 
@@ -117,12 +209,15 @@ ext2_free_blocks (block_t block, unsigned long count)
       disk_cache_block_ref_ptr (gdp);
       record_global_poke (gdp);
 
+      pthread_spin_unlock (&group_locks[block_group]);
+
       block += gcount;
       count -= gcount;
     } while (count > 0);
 
+  pthread_spin_lock (&global_lock);
+  sblock->s_free_blocks_count += freed;
   sblock_dirty = 1;
-
   pthread_spin_unlock (&global_lock);
 
   alloc_sync (0);
@@ -140,28 +235,35 @@ ext2_new_block (block_t goal,
 		block_t prealloc_goal,
 		block_t *prealloc_count, block_t *prealloc_block)
 {
+  unsigned long blocks_per_group = sblock->s_blocks_per_group;
   unsigned char *bh = NULL;
   unsigned char *p, *r;
-  int i, j, k, tmp;
-  unsigned long lmap;
+  int i, j, k, n, tmp, retries = ALLOC_RETRIES;
+  block_t claimed, extra, used = 0;
   struct ext2_group_desc *gdp;
 
 #ifdef EXT2FS_DEBUG
   static int goal_hits = 0, goal_attempts = 0;
 #endif
 
-  pthread_spin_lock (&global_lock);
-
 #ifdef XXX /* Auth check to use reserved blocks  */
   if (sblock->s_free_blocks_count <= sblock->s_r_blocks_count &&
       (!fsuser () && (sb->u.ext2_sb.s_resuid != current->fsuid) &&
        (sb->u.ext2_sb.s_resgid == 0 ||
 	!in_group_p (sb->u.ext2_sb.s_resgid))))
-    {
-      pthread_spin_unlock (&global_lock);
-      return 0;
-    }
+    return 0;
+#endif
+
+  /* Leave the blocks set aside for delayed allocations alone.  */
+#ifdef EXT2_PREALLOCATE
+  claimed = claim_blocks (prealloc_goal ?: 1, NULL, &extra);
+  if (prealloc_goal > claimed)
+    prealloc_goal = claimed;
+#else
+  claimed = claim_blocks (1, NULL, &extra);
 #endif
+  if (claimed == 0)
+    return 0;
 
   ext2_debug ("goal=%u", goal);
 
@@ -172,15 +274,18 @@ repeat:
    */
   if (goal < sblock->s_first_data_block || goal >= sblock->s_blocks_count)
     goal = sblock->s_first_data_block;
-  i = (goal - sblock->s_first_data_block) / sblock->s_blocks_per_group;
+  i = (goal - sblock->s_first_data_block) / blocks_per_group;
   gdp = group_desc (i);
+  /* The free counts of the groups are looked at without their locks, to
+     skip full groups cheaply; they are checked again with the lock held.  */
   if (gdp->bg_free_blocks_count > 0)
     {
-      j = ((goal - sblock->s_first_data_block) % sblock->s_blocks_per_group);
+      j = ((goal - sblock->s_first_data_block) % blocks_per_group);
 #ifdef EXT2FS_DEBUG
       if (j)
 	goal_attempts++;
 #endif
+      pthread_spin_lock (&group_locks[i]);
       bh = disk_cache_block_ref (gdp->bg_block_bitmap);
 
       ext2_debug ("goal is at %d:%d", i, j);
@@ -199,24 +304,11 @@ repeat:
 	     * The goal was occupied; search forward for a free
 	     * block within the next 32 blocks
 	   */
-	  if ((j & 31) == 31)
-	    lmap = 0;
-	  else
-	    lmap = ((((unsigned long *) bh)[j >> 5]) >>
-		    ((j & 31) + 1));
-	  if (j < sblock->s_blocks_per_group - 32)
-	    lmap |= (((unsigned long *) bh)[(j >> 5) + 1]) <<
-	      (31 - (j & 31));
-	  else
-	    lmap |= 0xffffffff << (31 - (j & 31));
-	  if (lmap != 0xffffffffl)
+	  k = find_next_zero_bit (bh, blocks_per_group, j);
+	  if (k <= j + 32 && k < blocks_per_group)
 	    {
-	      k = ffz (lmap) + 1;
-	      if ((j + k) < sblock->s_blocks_per_group)
-		{
-		  j += k;
-		  goto got_block;
-		}
+	      j = k;
+	      goto got_block;
 	    }
 	}
 
@@ -232,17 +324,15 @@ repeat:
        * cyclicly search through the rest of the groups.
        */
       p = bh + (j >> 3);
-      r = memscan (p, 0, (sblock->s_blocks_per_group - j + 7) >> 3);
+      r = memscan (p, 0, (blocks_per_group - j + 7) >> 3);
       k = (r - bh) << 3;
-      if (k < sblock->s_blocks_per_group)
+      if (k < blocks_per_group)
 	{
 	  j = k;
 	  goto search_back;
 	}
-      k = find_next_zero_bit ((unsigned long *) bh,
-			      sblock->s_blocks_per_group,
-			      j);
-      if (k < sblock->s_blocks_per_group)
+      k = find_next_zero_bit (bh, blocks_per_group, j);
+      if (k < blocks_per_group)
 	{
 	  j = k;
 	  goto got_block;
@@ -250,6 +340,7 @@ repeat:
 
       disk_cache_block_deref (bh);
       bh = NULL;
+      pthread_spin_unlock (&group_locks[i]);
     }
 
   ext2_debug ("bit not found in block group %d", i);
@@ -258,38 +349,39 @@ repeat:
      * Now search the rest of the groups.  We assume that
      * i and gdp correctly point to the last group visited.
    */
-  for (k = 0; k < groups_count; k++)
+  for (n = 0; n < groups_count; n++)
     {
       i++;
       if (i >= groups_count)
 	i = 0;
       gdp = group_desc (i);
+      if (gdp->bg_free_blocks_count == 0)
+	continue;
+
+      pthread_spin_lock (&group_locks[i]);
       if (gdp->bg_free_blocks_count > 0)
-	break;
-    }
-  if (k >= groups_count)
-    {
-      pthread_spin_unlock (&global_lock);
-      return 0;
-    }
-  assert (bh == NULL);
-  bh = disk_cache_block_ref (gdp->bg_block_bitmap);
-  r = memscan (bh, 0, sblock->s_blocks_per_group >> 3);
-  j = (r - bh) << 3;
-  if (j < sblock->s_blocks_per_group)
-    goto search_back;
-  else
-    j = find_first_zero_bit ((unsigned long *) bh,
-			     sblock->s_blocks_per_group);
-  if (j >= sblock->s_blocks_per_group)
-    {
-      disk_cache_block_deref (bh);
-      bh = NULL;
-      ext2_error ("free blocks count corrupted for block group %d", i);
-      pthread_spin_unlock (&global_lock);
-      return 0;
+	{
+	  bh = disk_cache_block_ref (gdp->bg_block_bitmap);
+	  r = memscan (bh, 0, blocks_per_group >> 3);
+	  j = (r - bh) << 3;
+	  if (j < blocks_per_group)
+	    goto search_back;
+	  j = find_first_zero_bit (bh, blocks_per_group);
+	  if (j < blocks_per_group)
+	    goto got_block;
+
+	  disk_cache_block_deref (bh);
+	  bh = NULL;
+	  ext2_error ("free blocks count corrupted for block group %d", i);
+	}
+      pthread_spin_unlock (&group_locks[i]);
     }
 
+  if (retries-- > 0)
+    goto repeat;
+  j = 0;
+  goto out;
+
 search_back:
   assert (bh != NULL);
   /*
@@ -304,7 +396,18 @@ got_block:
 
   ext2_debug ("using block group %d (%d)", i, gdp->bg_free_blocks_count);
 
-  tmp = j + i * sblock->s_blocks_per_group + sblock->s_first_data_block;
+  tmp = j + i * blocks_per_group + sblock->s_first_data_block;
+
+  if (tmp >= sblock->s_blocks_count)
+    {
+      ext2_error ("block >= blocks count - block_group = %d, block=%d",
+		  i, tmp);
+      disk_cache_block_deref (bh);
+      bh = NULL;
+      pthread_spin_unlock (&group_locks[i]);
+      j = 0;
+      goto out;
+    }
 
   if (tmp == gdp->bg_block_bitmap ||
       tmp == gdp->bg_inode_bitmap ||
@@ -316,6 +419,7 @@ got_block:
       ext2_warning ("bit already set for block %d", j);
       disk_cache_block_deref (bh);
       bh = NULL;
+      pthread_spin_unlock (&group_locks[i]);
       goto repeat;
     }
 
@@ -340,7 +444,8 @@ got_block:
       *prealloc_count = 0;
       *prealloc_block = tmp + 1;
       for (k = 1;
-	   k < prealloc_goal && (j + k) < sblock->s_blocks_per_group; k++)
+	   k < prealloc_goal && (j + k) < blocks_per_group
+	     && tmp + k < sblock->s_blocks_count; k++)
 	{
 	  if (set_bit (j + k, bh))
 	    break;
@@ -355,7 +460,7 @@ got_block:
 	    }
 	}
       gdp->bg_free_blocks_count -= *prealloc_count;
-      sblock->s_free_blocks_count -= *prealloc_count;
+      used += *prealloc_count;
       ext2_debug ("preallocated a further %u bits", *prealloc_count);
     }
 #endif
@@ -365,31 +470,192 @@ got_block:
   record_global_poke (bh);
   bh = NULL;
 
-  if (j >= sblock->s_blocks_count)
-    {
-      ext2_error ("block >= blocks count - block_group = %d, block=%d", i, j);
-      j = 0;
-      goto sync_out;
-    }
-
   ext2_debug ("allocating block %d; goal hits %d of %d",
 	      j, goal_hits, goal_attempts);
 
   gdp->bg_free_blocks_count--;
+  used++;
   disk_cache_block_ref_ptr (gdp);
   record_global_poke (gdp);
 
-  sblock->s_free_blocks_count--;
-  sblock_dirty = 1;
+  pthread_spin_unlock (&group_locks[i]);
 
- sync_out:
+ out:
   assert (bh == NULL);
-  pthread_spin_unlock (&global_lock);
+  unclaim_blocks (used, extra, NULL);
   alloc_sync (0);
 
   return j;
 }
 
+/* The number of block groups with free blocks that ext2_new_blocks
+   searches for a long enough run of free blocks, once it has found a
+   shorter one.  */
+#define NEW_BLOCKS_SEARCH_GROUPS	8
+
+/* Return how many of the blocks from bit BIT on in the block bitmap BH
+   are free, counting up to MAX.  */
+static inline block_t
+free_run (unsigned char *bh, unsigned long bit, block_t max)
+{
+  return find_next_set_bit (bh, bit + max, bit) - bit;
+}
+
+block_t
+ext2_new_blocks (block_t goal, block_t count, block_t *allocated,
+		 block_t *reservation)
+{
+  unsigned long blocks_per_group = sblock->s_blocks_per_group;
+  unsigned long group, bit, best_group, best_bit;
+  block_t len, best_len, block, extra, i;
+  struct ext2_group_desc *gdp;
+  unsigned char *bh;
+  int n, searched, retries = ALLOC_RETRIES;
+
+  *allocated = 0;
+
+  count = claim_blocks (count, reservation, &extra);
+  if (count == 0)
+    return 0;
+
+  if (goal < sblock->s_first_data_block || goal >= sblock->s_blocks_count)
+    goal = sblock->s_first_data_block;
+  group = (goal - sblock->s_first_data_block) / blocks_per_group;
+  bit = (goal - sblock->s_first_data_block) % blocks_per_group;
+
+ again:
+  /* A free goal is taken even if fewer than COUNT blocks follow it,
+     since that keeps the file contiguous.  */
+  best_group = group;
+  best_bit = bit;
+  gdp = group_desc (group);
+  pthread_spin_lock (&group_locks[group]);
+  bh = disk_cache_block_ref (gdp->bg_block_bitmap);
+  best_len = free_run (bh, bit, (count < blocks_per_group - bit
+				 ? count : blocks_per_group - bit));
+  if (best_len > 0)
+    goto got_run;
+  disk_cache_block_deref (bh);
+  pthread_spin_unlock (&group_locks[group]);
+
+  /* Otherwise search from the goal to the end of its group, then the
+     following groups, and at last the goal's group again from its start.
+     The first run of COUNT free blocks is taken, or the longest run seen
+     once a few groups have been searched.  Only one group is locked at a
+     time, so the longest run must be looked at again at the end.  */
+  searched = 0;
+  for (n = 0; n <= groups_count; n++)
+    {
+      gdp = group_desc (group);
+      if (gdp->bg_free_blocks_count > 0)
+	{
+	  pthread_spin_lock (&group_locks[group]);
+	  bh = disk_cache_block_ref (gdp->bg_block_bitmap);
+	  while (bit < blocks_per_group)
+	    {
+	      bit = find_next_zero_bit (bh, blocks_per_group, bit);
+	      if (bit >= blocks_per_group)
+		break;
+	      len = free_run (bh, bit, (count < blocks_per_group - bit
+					? count : blocks_per_group - bit));
+	      if (len > best_len)
+		{
+		  best_len = len;
+		  best_group = group;
+		  best_bit = bit;
+		}
+	      if (len >= count)
+		goto got_run;
+	      bit += len;
+	    }
+	  disk_cache_block_deref (bh);
+	  pthread_spin_unlock (&group_locks[group]);
+
+	  if (best_len > 0 && ++searched >= NEW_BLOCKS_SEARCH_GROUPS)
+	    break;
+	}
+
+      group = (group + 1) % groups_count;
+      bit = 0;
+    }
+
+  if (best_len == 0 && retries-- > 0)
+    {
+      group = best_group;
+      bit = best_bit;
+      goto again;
+    }
+  if (best_len == 0)
+    {
+      ext2_error ("free blocks count corrupted");
+      unclaim_blocks (0, extra, reservation);
+      return 0;
+    }
+
+  /* Take what is still free of the longest run.  */
+  gdp = group_desc (best_group);
+  pthread_spin_lock (&group_locks[best_group]);
+  bh = disk_cache_block_ref (gdp->bg_block_bitmap);
+  best_len = free_run (bh, best_bit, best_len);
+  if (best_len == 0)
+    {
+      /* Taken meanwhile.  */
+      disk_cache_block_deref (bh);
+      pthread_spin_unlock (&group_locks[best_group]);
+      group = best_group;
+      bit = best_bit;
+      goto again;
+    }
+
+ got_run:
+  /* The lock of BEST_GROUP is held, and BH is its bitmap.  */
+  block = (best_group * blocks_per_group + best_bit
+	   + sblock->s_first_data_block);
+  if (block + best_len > sblock->s_blocks_count)
+    {
+      ext2_error ("block >= blocks count - block_group = %lu, block=%u",
+		  best_group, block + best_len - 1);
+      disk_cache_block_deref (bh);
+      pthread_spin_unlock (&group_locks[best_group]);
+      unclaim_blocks (0, extra, reservation);
+      return 0;
+    }
+  if (in_range (gdp->bg_block_bitmap, block, best_len) ||
+      in_range (gdp->bg_inode_bitmap, block, best_len) ||
+      in_range (block, gdp->bg_inode_table, itb_per_group) ||
+      in_range (block + best_len - 1, gdp->bg_inode_table, itb_per_group))
+    ext2_panic ("allocating blocks in system zone - "
+		"block = %u, count = %u", block, best_len);
+
+  for (i = 0; i < best_len; i++)
+    set_bit (best_bit + i, bh);
+  record_global_poke (bh);
+
+  /* See the comment in ext2_new_block.  */
+  if (modified_global_blocks)
+    {
+      pthread_spin_lock (&modified_global_blocks_lock);
+      for (i = 0; i < best_len; i++)
+	clear_bit (block + i, modified_global_blocks);
+      pthread_spin_unlock (&modified_global_blocks_lock);
+    }
+
+  ext2_debug ("allocating blocks %u[%u] for goal %u[%u]",
+	      block, best_len, goal, count);
+
+  gdp->bg_free_blocks_count -= best_len;
+  disk_cache_block_ref_ptr (gdp);
+  record_global_poke (gdp);
+
+  pthread_spin_unlock (&group_locks[best_group]);
+
+  unclaim_blocks (best_len, extra, reservation);
+  alloc_sync (0);
+
+  *allocated = best_len;
+  return block;
+}
+
 unsigned long
 ext2_count_free_blocks ()
 {
@@ -398,8 +664,6 @@ ext2_count_free_blocks ()
   struct ext2_group_desc *gdp;
   int i;
 
-  pthread_spin_lock (&global_lock);
-
   desc_count = 0;
   bitmap_count = 0;
   gdp = NULL;
@@ -407,17 +671,18 @@ ext2_count_free_blocks ()
     {
       void *bh;
       gdp = group_desc (i);
+      pthread_spin_lock (&group_locks[i]);
       desc_count += gdp->bg_free_blocks_count;
       bh = disk_cache_block_ref (gdp->bg_block_bitmap);
       x = count_free (bh, block_size);
       disk_cache_block_deref (bh);
+      pthread_spin_unlock (&group_locks[i]);
       printf ("group %d: stored = %d, counted = %lu",
 	      i, gdp->bg_free_blocks_count, x);
       bitmap_count += x;
     }
   printf ("ext2_count_free_blocks: stored = %u, computed = %lu, %lu",
 	  sblock->s_free_blocks_count, desc_count, bitmap_count);
-  pthread_spin_unlock (&global_lock);
   return bitmap_count;
 #else
   return sblock->s_free_blocks_count;
@@ -440,8 +705,6 @@ ext2_check_blocks_bitmap ()
   struct ext2_group_desc *gdp;
   int i, j;
 
-  pthread_spin_lock (&global_lock);
-
   desc_count = 0;
   bitmap_count = 0;
   gdp = NULL;
@@ -470,6 +733,7 @@ ext2_check_blocks_bitmap ()
 	}
 
       gdp = group_desc (i);
+      pthread_spin_lock (&group_locks[i]);
       desc_count += gdp->bg_free_blocks_count;
       bh = disk_cache_block_ref (gdp->bg_block_bitmap);
 
@@ -502,8 +766,10 @@ ext2_check_blocks_bitmap ()
 	ext2_error ("wrong free blocks count for group %d,"
 		    " stored = %d, counted = %lu",
 		    i, gdp->bg_free_blocks_count, x);
+      pthread_spin_unlock (&group_locks[i]);
       bitmap_count += x;
     }
+  pthread_spin_lock (&global_lock);
   if (sblock->s_free_blocks_count != bitmap_count)
     ext2_error ("wrong free blocks count in super block,"
 		" stored = %lu, counted = %lu",
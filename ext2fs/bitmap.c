@@ -18,91 +18,90 @@
    along with this program; if not, write to the Free Software
    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
 
-#define ffz(word)	(ffs (~(unsigned int) (word)) - 1)
-
-/*
- *  linux/fs/ext2/bitmap.c (&c)
- *
- * Copyright (C) 1992, 1993, 1994, 1995
- * Remy Card (card@masi.ibp.fr)
- * Laboratoire MASI - Institut Blaise Pascal
- * Universite Pierre et Marie Curie (Paris VI)
- */
-
-static int nibblemap[] = {4, 3, 3, 2, 3, 2, 2, 1, 3, 2, 2, 1, 2, 1, 1, 0};
-
-static inline
-unsigned long count_free (unsigned char *map, unsigned int numchars)
+/* The bitmaps are searched a word at a time.  Bit N of a bitmap is bit
+   N % 8 of byte N / 8, which is bit N % BITS_PER_WORD of word
+   N / BITS_PER_WORD on the little-endian machines we run on.  Bitmaps are
+   block-aligned and a whole number of words long.  */
+#define BITS_PER_WORD	(sizeof (unsigned long) * 8)
+
+/* How many words are tested at once when skipping over uniform parts of a
+   bitmap.  Testing them together leaves a single branch per group, and
+   lets the compiler use vector instructions for it.  */
+#define SKIP_WORDS	4
+
+/* Return the number of zero bits in the first NUMCHARS bytes of MAP.  */
+static inline unsigned long
+count_free (unsigned char *map, unsigned int numchars)
 {
-	unsigned int i;
-	unsigned long sum = 0;
-
-	if (!map)
-		return (0);
-	for (i = 0; i < numchars; i++)
-		sum += nibblemap[map[i] & 0xf] +
-			nibblemap[(map[i] >> 4) & 0xf];
-	return (sum);
+  unsigned long *words = (unsigned long *) map;
+  unsigned int nwords = numchars / sizeof (unsigned long);
+  unsigned long sum = 0;
+  unsigned int i;
+
+  if (!map)
+    return 0;
+  for (i = 0; i < nwords; i++)
+    sum += BITS_PER_WORD - __builtin_popcountl (words[i]);
+  for (i *= sizeof (unsigned long); i < numchars; i++)
+    sum += 8 - __builtin_popcount (map[i]);
+  return sum;
 }
-
-/* ---------------------------------------------------------------- */
-
-/*
- * Copyright 1994, David S. Miller (davem@caip.rutgers.edu).
- */
-
-/* find_next_zero_bit() finds the first zero bit in a bit string of length
- * 'size' bits, starting the search at bit 'offset'. This is largely based
- * on Linus's ALPHA routines, which are pretty portable BTW.
- */
 
+/* Return the first bit from OFFSET on in the bitmap ADDR of SIZE bits
+   that is set if SET, or clear otherwise; SIZE if there is none.  */
 static inline unsigned long
-find_next_zero_bit(void *addr, unsigned long size, unsigned long offset)
+find_next_bit (void *addr, unsigned long size, unsigned long offset, int set)
 {
-  unsigned long *p = ((unsigned long *) addr) + (offset >> 5);
-  unsigned long result = offset & ~31UL;
-  unsigned long tmp;
+  unsigned long *p = addr;
+  unsigned long nwords = (size + BITS_PER_WORD - 1) / BITS_PER_WORD;
+  unsigned long skip = set ? 0 : ~0UL;	/* A word with nothing to find.  */
+  unsigned long i, tmp, result;
 
   if (offset >= size)
     return size;
-  size -= result;
-  offset &= 31UL;
-  if (offset)
-    {
-      tmp = *(p++);
-      tmp |= ~0UL >> (32-offset);
-      if (size < 32)
-	goto found_first;
-      if (~tmp)
-	goto found_middle;
-      size -= 32;
-      result += 32;
-    }
-  while (size & ~31UL)
+
+  i = offset / BITS_PER_WORD;
+  tmp = (p[i] ^ skip) & (~0UL << (offset % BITS_PER_WORD));
+  while (tmp == 0)
     {
-      if (~(tmp = *(p++)))
-	goto found_middle;
-      result += 32;
-      size -= 32;
+      i++;
+      while (i + SKIP_WORDS <= nwords)
+	{
+	  unsigned long any = 0;
+	  int k;
+
+	  for (k = 0; k < SKIP_WORDS; k++)
+	    any |= p[i + k] ^ skip;
+	  if (any)
+	    break;
+	  i += SKIP_WORDS;
+	}
+      if (i >= nwords)
+	return size;
+      tmp = p[i] ^ skip;
     }
-  if (!size)
-    return result;
-  tmp = *p;
-
-found_first:
-  tmp |= ~0UL << size;
-  if (!~tmp)
-    return result + size;
-found_middle:
-  return result + ffz(tmp);
+
+  result = i * BITS_PER_WORD + __builtin_ctzl (tmp);
+  return result < size ? result : size;
+}
+
+/* Return the first zero bit from OFFSET on in the bitmap ADDR of SIZE
+   bits, or SIZE if there is none.  */
+static inline unsigned long
+find_next_zero_bit (void *addr, unsigned long size, unsigned long offset)
+{
+  return find_next_bit (addr, size, offset, 0);
 }
 
-/* Linus sez that gcc can optimize the following correctly, we'll see if this
- * holds on the Sparc as it does for the ALPHA.
- */
+/* Likewise, but return the first bit that is set.  */
+static inline unsigned long
+find_next_set_bit (void *addr, unsigned long size, unsigned long offset)
+{
+  return find_next_bit (addr, size, offset, 1);
+}
 
 static inline int
-find_first_zero_bit(void *buf, unsigned len)
+find_first_zero_bit (void *buf, unsigned len)
 {
-  return find_next_zero_bit(buf, len, 0);
+  return find_next_zero_bit (buf, len, 0);
 }
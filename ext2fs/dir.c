@@ -54,6 +54,10 @@ enum slot_status
      entry. */
   EXTEND,
 
+  /* This means that the leaf block of the directory index the entry
+     belongs to has to be split to make room for it.  */
+  SPLIT,
+
   /* For removal and rename, this means that this is the location
      of the entry found.  */
   HERE_TIS,
@@ -86,6 +90,14 @@ struct dirstat
   /* For stat COMPRESS, this is the number of bytes needed to be copied
      in order to undertake the compression. */
   size_t nbytes;
+
+  /* Whether the entry was looked up through the index of the
+     directory, which must then be kept up to date.  */
+  int indexed;
+
+  /* For stat SPLIT, this is the way through the index to the leaf
+     block IDX.  */
+  struct ext2_dx_path dx;
 };
 
 const size_t diskfs_dirstat_size = sizeof (struct dirstat);
@@ -102,6 +114,11 @@ dirscanblock (vm_address_t blockoff, struct node *dp, int idx,
 	      const char *name, size_t namelen, enum lookup_type type,
 	      struct dirstat *ds, ino_t *inum);
 
+static error_t
+dirscanindex (vm_address_t buf, struct node *dp,
+	      const char *name, size_t namelen, enum lookup_type type,
+	      struct dirstat *ds, ino_t *inum);
+
 
 #if 0				/* XXX unused for now */
 static const unsigned char ext2_file_type[EXT2_FT_MAX] =
@@ -149,6 +166,7 @@ diskfs_lookup_hard (struct node *dp, const char *name, enum lookup_type type,
   vm_address_t blockaddr;
   int idx, lastidx;
   int looped;
+  int indexed;
 
   if ((type == REMOVE) || (type == RENAME))
     assert (npp);
@@ -174,6 +192,7 @@ diskfs_lookup_hard (struct node *dp, const char *name, enum lookup_type type,
       ds->type = LOOKUP;
       ds->mapbuf = 0;
       ds->mapextent = 0;
+      ds->indexed = 0;
     }
   if (buf)
     {
@@ -190,8 +209,9 @@ diskfs_lookup_hard (struct node *dp, const char *name, enum lookup_type type,
     return errno;
 
   buf = 0;
-  /* We allow extra space in case we have to do an EXTEND. */
-  buflen = round_page (dp->dn_stat.st_size + DIRBLKSIZ);
+  /* We allow extra space in case we have to do an EXTEND, or a SPLIT,
+     which can add two blocks.  */
+  buflen = round_page (dp->dn_stat.st_size + 2 * DIRBLKSIZ);
   err = vm_map (mach_task_self (),
 		&buf, buflen, 0, 1, memobj, 0, 0, prot, prot, 0);
   mach_port_deallocate (mach_task_self (), memobj);
@@ -202,38 +222,58 @@ diskfs_lookup_hard (struct node *dp, const char *name, enum lookup_type type,
 
   diskfs_set_node_atime (dp);
 
-  /* Start the lookup at diskfs_node_disknode (DP)->dir_idx.  */
-  idx = diskfs_node_disknode (dp)->dir_idx;
-  if (idx * DIRBLKSIZ > dp->dn_stat.st_size)
-    idx = 0;			/* just in case */
-  blockaddr = buf + idx * DIRBLKSIZ;
-  looped = (idx == 0);
-  lastidx = idx;
-  if (lastidx == 0)
-    lastidx = dp->dn_stat.st_size / DIRBLKSIZ;
-
-  while (!looped || idx < lastidx)
+  /* Only look at the blocks the name can be in if the directory is
+     indexed.  */
+  indexed = ext2_dir_is_indexed (dp);
+  if (indexed)
     {
-      err = dirscanblock (blockaddr, dp, idx, name, namelen, type, ds, &inum);
-      if (!err)
-	{
-	  diskfs_node_disknode (dp)->dir_idx = idx;
-	  break;
-	}
-      if (err != ENOENT)
+      err = dirscanindex (buf, dp, name, namelen, type, ds, &inum);
+      if (err == EIO)
+	/* The index is corrupt; scan the whole directory instead.  */
+	indexed = 0;
+      else if (err && err != ENOENT)
 	{
 	  munmap ((caddr_t) buf, buflen);
 	  return err;
 	}
+    }
 
-      blockaddr += DIRBLKSIZ;
-      idx++;
-      if (blockaddr - buf >= dp->dn_stat.st_size && !looped)
+  if (!indexed)
+    {
+      /* Start the lookup at diskfs_node_disknode (DP)->dir_idx.  */
+      idx = diskfs_node_disknode (dp)->dir_idx;
+      if (idx * DIRBLKSIZ > dp->dn_stat.st_size)
+	idx = 0;			/* just in case */
+      blockaddr = buf + idx * DIRBLKSIZ;
+      looped = (idx == 0);
+      lastidx = idx;
+      if (lastidx == 0)
+	lastidx = dp->dn_stat.st_size / DIRBLKSIZ;
+
+      while (!looped || idx < lastidx)
 	{
-	  /* We've gotten to the end; start back at the beginning */
-	  looped = 1;
-	  blockaddr = buf;
-	  idx = 0;
+	  err = dirscanblock (blockaddr, dp, idx, name, namelen, type, ds,
+			      &inum);
+	  if (!err)
+	    {
+	      diskfs_node_disknode (dp)->dir_idx = idx;
+	      break;
+	    }
+	  if (err != ENOENT)
+	    {
+	      munmap ((caddr_t) buf, buflen);
+	      return err;
+	    }
+
+	  blockaddr += DIRBLKSIZ;
+	  idx++;
+	  if (blockaddr - buf >= dp->dn_stat.st_size && !looped)
+	    {
+	      /* We've gotten to the end; start back at the beginning */
+	      looped = 1;
+	      blockaddr = buf;
+	      idx = 0;
+	    }
 	}
     }
 
@@ -516,6 +556,104 @@ dirscanblock (vm_address_t blockaddr, struct node *dp, int idx,
   return 0;
 }
 
+/* Look up NAME of length NAMELEN in the index of directory DP, mapped
+   at BUF, only scanning the leaf blocks it can be in.  Args TYPE, DS
+   and INUM are as for dirscanblock.  Return EIO if the index is
+   corrupt.  */
+static error_t
+dirscanindex (vm_address_t buf, struct node *dp,
+	      const char *name, size_t namelen, enum lookup_type type,
+	      struct dirstat *ds, ino_t *inum)
+{
+  struct ext2_dx_path path;
+  block_t leaf;
+  error_t err;
+
+  err = ext2_dx_probe (dp, buf, name, namelen, &path, &leaf);
+  if (err)
+    return err;
+
+  do
+    err = dirscanblock (buf + leaf * DIRBLKSIZ, dp, leaf, name, namelen,
+			type, ds, inum);
+  while (err == ENOENT && ext2_dx_next_leaf (dp, buf, &path, &leaf));
+
+  if (ds)
+    {
+      /* "." and ".." are found without the index.  Removing or
+	 rewriting them leaves the index intact, but it cannot be used
+	 to add them.  */
+      ds->indexed = path.levels > 0 || err == 0;
+      if (err == ENOENT && (type == CREATE || type == RENAME)
+	  && ds->stat == LOOKING && path.levels > 0)
+	{
+	  /* There is no room for the name in its leaf block.  */
+	  ds->type = CREATE;
+	  ds->stat = SPLIT;
+	  ds->idx = leaf;
+	  ds->dx = path;
+	}
+    }
+
+  return err;
+}
+
+/* The directory DP has grown from OLDSIZE bytes.  Extend its count of
+   entries per block, if it has one, with unknown counts.  */
+static void
+dirents_grow (struct node *dp, size_t oldsize)
+{
+  int i;
+
+  if (! diskfs_node_disknode (dp)->dirents)
+    return;
+
+  diskfs_node_disknode (dp)->dirents =
+    realloc (diskfs_node_disknode (dp)->dirents,
+	     (dp->dn_stat.st_size / DIRBLKSIZ * sizeof (int)));
+  for (i = oldsize / DIRBLKSIZ; i < dp->dn_stat.st_size / DIRBLKSIZ; i++)
+    diskfs_node_disknode (dp)->dirents[i] = -1;
+}
+
+/* DS is the result of a lookup for CREATE of NAME of length NAMELEN in
+   directory DP that found no room for it, and says to SPLIT a leaf of
+   the index of DP or to EXTEND DP beyond its first block.  Make room by
+   splitting the leaf, or by indexing DP, and update DS to point
+   there.  Return EINVAL if DP cannot be indexed.  */
+static error_t
+dir_make_room (struct node *dp, const char *name, size_t namelen,
+	       struct dirstat *ds, struct protid *cred)
+{
+  size_t oldsize = dp->dn_stat.st_size;
+  block_t leaf = ds->idx;
+  ino_t inum;
+  error_t err;
+
+  assert (ds->mapextent >= oldsize + 2 * DIRBLKSIZ);
+
+  if (ds->stat == SPLIT)
+    err = ext2_dx_split (dp, ds->mapbuf, &ds->dx, &leaf, cred);
+  else
+    err = ext2_dx_make_indexed (dp, ds->mapbuf, name, namelen, &ds->dx,
+				&leaf, cred);
+
+  /* Entries have moved between blocks, and blocks may have been added
+     even if there was an error.  */
+  dirents_grow (dp, oldsize);
+  if (diskfs_node_disknode (dp)->dirents)
+    diskfs_node_disknode (dp)->dirents[ds->stat == SPLIT ? ds->idx : 0] = -1;
+  if (err)
+    return err;
+
+  ds->indexed = 1;
+  ds->stat = LOOKING;
+  err = dirscanblock (ds->mapbuf + leaf * DIRBLKSIZ, dp, leaf,
+		      name, namelen, CREATE, ds, &inum);
+  if (err != ENOENT || ds->stat == LOOKING)
+    return EIO;
+  return 0;
+}
+
 /* Following a lookup call for CREATE, this adds a node to a directory.
    DP is the directory to be modified; NAME is the name to be entered;
    NP is the node being linked in; DS is the cached information returned
@@ -541,6 +679,20 @@ diskfs_direnter_hard (struct node *dp, const char *name, struct node *np,
 
   dp->dn_set_mtime = 1;
 
+  if (ds->stat == SPLIT
+      || (ds->stat == EXTEND && dp->dn_stat.st_size == DIRBLKSIZ
+	  && EXT2_HAS_COMPAT_FEATURE (sblock, EXT2_FEATURE_COMPAT_DIR_INDEX)))
+    {
+      /* Make room in a leaf block of the index of the directory,
+	 indexing it as it outgrows its first block.  */
+      err = dir_make_room (dp, name, namelen, ds, cred);
+      if (err && (err != EINVAL || ds->stat != EXTEND))
+	{
+	  munmap ((caddr_t) ds->mapbuf, ds->mapextent);
+	  return err;
+	}
+    }
+
   /* Select a location for the new directory entry.  Each branch of this
      switch is responsible for setting NEW to point to the on-disk
      directory entry being written, and setting NEW->rec_len appropriately.  */
@@ -652,8 +804,10 @@ diskfs_direnter_hard (struct node *dp, const char *name, struct node *np,
   new->name_len = namelen;
   memcpy (new->name, name, namelen);
 
-  /* Mark the directory inode has having been written.  */
-  diskfs_node_disknode (dp)->info.i_flags &= ~EXT2_BTREE_FL;
+  /* Mark the directory inode has having been written, invalidating its
+     index unless it was kept up to date.  */
+  if (! ds->indexed)
+    diskfs_node_disknode (dp)->info.i_flags &= ~EXT2_INDEX_FL;
   dp->dn_set_mtime = 1;
 
   munmap ((caddr_t) ds->mapbuf, ds->mapextent);
@@ -673,14 +827,7 @@ diskfs_direnter_hard (struct node *dp, const char *name, struct node *np,
 	 anything at all. */
       if (diskfs_node_disknode (dp)->dirents)
 	{
-	  diskfs_node_disknode (dp)->dirents =
-	    realloc (diskfs_node_disknode (dp)->dirents,
-		     (dp->dn_stat.st_size / DIRBLKSIZ * sizeof (int)));
-	  for (i = oldsize / DIRBLKSIZ;
-	       i < dp->dn_stat.st_size / DIRBLKSIZ;
-	       i++)
-	    diskfs_node_disknode (dp)->dirents[i] = -1;
-
+	  dirents_grow (dp, oldsize);
 	  diskfs_node_disknode (dp)->dirents[ds->idx] = 1;
 	}
       else
@@ -721,7 +868,8 @@ diskfs_dirremove_hard (struct node *dp, struct dirstat *ds)
     }
 
   dp->dn_set_mtime = 1;
-  diskfs_node_disknode (dp)->info.i_flags &= ~EXT2_BTREE_FL;
+  if (! ds->indexed)
+    diskfs_node_disknode (dp)->info.i_flags &= ~EXT2_INDEX_FL;
 
   munmap ((caddr_t) ds->mapbuf, ds->mapextent);
 
@@ -753,7 +901,8 @@ diskfs_dirrewrite_hard (struct node *dp, struct node *np, struct dirstat *ds)
 
   ds->entry->inode = np->cache_id;
   dp->dn_set_mtime = 1;
-  diskfs_node_disknode (dp)->info.i_flags &= ~EXT2_BTREE_FL;
+  if (! ds->indexed)
+    diskfs_node_disknode (dp)->info.i_flags &= ~EXT2_INDEX_FL;
 
   munmap ((caddr_t) ds->mapbuf, ds->mapextent);
 
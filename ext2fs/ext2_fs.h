@@ -198,6 +198,8 @@ struct ext2_group_desc
 #define EXT2_ECOMPR_FL			0x00000800 /* Compression error */
 /* End compression flags --- maybe not all used */
 #define EXT2_BTREE_FL			0x00001000 /* btree format dir */
+#define EXT2_INDEX_FL			0x00001000 /* hash-indexed directory */
+#define EXT2_EXTENTS_FL			0x00080000 /* Inode uses extents */
 #define EXT2_RESERVED_FL		0x80000000 /* reserved for ext2 lib */
 
 #define EXT2_FL_USER_VISIBLE		0x00001FFF /* User visible flags */
@@ -418,9 +420,36 @@ struct ext2_super_block {
 	__u8	s_prealloc_blocks;	/* Nr of blocks to try to preallocate*/
 	__u8	s_prealloc_dir_blocks;	/* Nr to preallocate for dirs */
 	__u16	s_padding1;
-	__u32	s_reserved[204];	/* Padding to the end of the block */
+	/*
+	 * Journaling support valid if EXT3_FEATURE_COMPAT_HAS_JOURNAL set.
+	 */
+	__u8	s_journal_uuid[16];	/* uuid of journal superblock */
+	__u32	s_journal_inum;		/* inode number of journal file */
+	__u32	s_journal_dev;		/* device number of journal file */
+	__u32	s_last_orphan;		/* start of list of inodes to delete */
+	__u32	s_hash_seed[4];		/* HTREE hash seed */
+	__u8	s_def_hash_version;	/* Default hash version to use */
+	__u8	s_jnl_backup_type;
+	__u16	s_desc_size;		/* size of group descriptor */
+	__u32	s_default_mount_opts;
+	__u32	s_first_meta_bg; 	/* First metablock block group */
+	__u32	s_mkfs_time;		/* When the filesystem was created */
+	__u32	s_jnl_blocks[17]; 	/* Backup of the journal inode */
+	__u32	s_blocks_count_hi;	/* Blocks count */
+	__u32	s_r_blocks_count_hi;	/* Reserved blocks count */
+	__u32	s_free_blocks_hi; 	/* Free blocks count */
+	__u16	s_min_extra_isize;	/* All inodes have at least # bytes */
+	__u16	s_want_extra_isize; 	/* New inodes should reserve # bytes */
+	__u32	s_flags;		/* Miscellaneous flags */
+	__u32	s_reserved[167];	/* Padding to the end of the block */
 };
 
+/*
+ * Miscellaneous superblock flags
+ */
+#define EXT2_FLAGS_SIGNED_HASH		0x0001	/* Signed dirhash in use */
+#define EXT2_FLAGS_UNSIGNED_HASH	0x0002	/* Unsigned dirhash in use */
+
 #ifdef __KERNEL__
 #define EXT2_SB(sb)	(&((sb)->u.ext2_sb))
 #else
@@ -462,6 +491,7 @@ struct ext2_super_block {
 	( EXT2_SB(sb)->s_feature_incompat & (mask) )
 
 #define EXT2_FEATURE_COMPAT_DIR_PREALLOC	0x0001
+#define EXT2_FEATURE_COMPAT_DIR_INDEX		0x0020
 
 #define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER	0x0001
 #define EXT2_FEATURE_RO_COMPAT_LARGE_FILE	0x0002
@@ -469,9 +499,11 @@ struct ext2_super_block {
 
 #define EXT2_FEATURE_INCOMPAT_COMPRESSION	0x0001
 #define EXT2_FEATURE_INCOMPAT_FILETYPE		0x0002
+#define EXT2_FEATURE_INCOMPAT_EXTENTS		0x0040
 
-#define EXT2_FEATURE_COMPAT_SUPP	0
-#define EXT2_FEATURE_INCOMPAT_SUPP	EXT2_FEATURE_INCOMPAT_FILETYPE
+#define EXT2_FEATURE_COMPAT_SUPP	EXT2_FEATURE_COMPAT_DIR_INDEX
+#define EXT2_FEATURE_INCOMPAT_SUPP	(EXT2_FEATURE_INCOMPAT_FILETYPE| \
+					 EXT2_FEATURE_INCOMPAT_EXTENTS)
 #define EXT2_FEATURE_RO_COMPAT_SUPP	(EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER| \
 					 EXT2_FEATURE_RO_COMPAT_LARGE_FILE| \
 					 EXT2_FEATURE_RO_COMPAT_BTREE_DIR)
@@ -533,6 +565,90 @@ struct ext2_dir_entry_2 {
 #define EXT2_DIR_REC_LEN(name_len)	(((name_len) + 8 + EXT2_DIR_ROUND) & \
 					 ~EXT2_DIR_ROUND)
 
+/*
+ * Hashed directory index (htree).  The first block of an indexed
+ * directory holds the "." and ".." entries, the latter spanning the
+ * rest of the block, followed by the root of the index.  Interior index
+ * blocks look like a single empty directory entry covering the whole
+ * block.  Both are followed by sorted (hash, block) pairs, the hash of
+ * the first one being replaced by the count and limit of the pairs.
+ * The leaf blocks are ordinary directory blocks.
+ */
+struct ext2_dx_root_info {
+	__u32	reserved_zero;
+	__u8	hash_version;
+	__u8	info_length;		/* 8 */
+	__u8	indirect_levels;
+	__u8	unused_flags;
+};
+
+struct ext2_dx_entry {
+	__u32	hash;
+	__u32	block;
+};
+
+struct ext2_dx_countlimit {
+	__u16	limit;
+	__u16	count;
+};
+
+/* Offset of ext2_dx_root_info in the first block of the directory.  */
+#define EXT2_DX_ROOT_INFO_OFFSET	(EXT2_DIR_REC_LEN (1) + EXT2_DIR_REC_LEN (2))
+/* Offset of the entries in an interior index block.  */
+#define EXT2_DX_NODE_OFFSET		8
+
+/* At most this many index levels below the root.  */
+#define EXT2_DX_MAX_INDIRECT_LEVELS	1
+
+/*
+ * Hash versions
+ */
+#define EXT2_DX_HASH_LEGACY		0
+#define EXT2_DX_HASH_HALF_MD4		1
+#define EXT2_DX_HASH_TEA		2
+#define EXT2_DX_HASH_LEGACY_UNSIGNED	3
+#define EXT2_DX_HASH_HALF_MD4_UNSIGNED	4
+#define EXT2_DX_HASH_TEA_UNSIGNED	5
+
+/*
+ * Extent trees.  The blocks of an inode with EXT2_EXTENTS_FL set are
+ * mapped by a tree rooted in i_block.  Every node starts with a header;
+ * interior nodes continue with index entries pointing to the nodes one
+ * level below, leaves with extents, both sorted by logical block.
+ */
+struct ext2_extent_header {
+	__u16	eh_magic;	/* EXT2_EXTENT_MAGIC */
+	__u16	eh_entries;	/* Number of valid entries */
+	__u16	eh_max;		/* Capacity of the node in entries */
+	__u16	eh_depth;	/* 0 for leaves */
+	__u32	eh_generation;
+};
+
+struct ext2_extent_idx {
+	__u32	ei_block;	/* First logical block covered */
+	__u32	ei_leaf;	/* Low 32 bits of the node below */
+	__u16	ei_leaf_hi;	/* High 16 bits of the node below */
+	__u16	ei_unused;
+};
+
+struct ext2_extent {
+	__u32	ee_block;	/* First logical block */
+	__u16	ee_len;		/* Number of blocks */
+	__u16	ee_start_hi;	/* High 16 bits of the first physical block */
+	__u32	ee_start;	/* Low 32 bits of the first physical block */
+};
+
+#define EXT2_EXTENT_MAGIC	0xf30a
+
+/* Extents longer than this are uninitialized: they have blocks
+   allocated which read as zeros, and their length is EE_LEN minus
+   this.  */
+#define EXT2_EXTENT_INIT_MAX_LEN	32768
+#define EXT2_EXTENT_UNINIT_MAX_LEN	(EXT2_EXTENT_INIT_MAX_LEN - 1)
+
+/* No extent tree is deeper than this.  */
+#define EXT2_EXTENT_MAX_DEPTH	5
+
 #ifdef __KERNEL__
 /*
  * Function prototypes
@@ -60,6 +60,13 @@ char *diskfs_disk_name;
 int ext2_debug_flag;
 #endif
 
+#define OPT_WRITE_CLUSTER	(-1)
+#define OPT_DISK_CACHE_SIZE	(-2)
+#define OPT_DISK_CACHE_STATS	(-3)
+#define OPT_DELALLOC		(-4)
+#define OPT_NO_DELALLOC		(-5)
+#define OPT_BMAP_CACHE_STATS	(-6)
+
 /* Ext2fs-specific options.  */
 static const struct argp_option
 options[] =
@@ -71,6 +78,23 @@ options[] =
   },
   {"sblock", 'S', "BLOCKNO", 0,
    "Use alternate superblock location (1kb blocks)"},
+  {"pager-workers", 'W', "NUM", 0,
+   "Serve file pager requests with NUM threads (only at startup)"},
+  {"write-cluster", OPT_WRITE_CLUSTER, "PAGES", 0,
+   "Write at most PAGES pages of a file with one device write"},
+  {"disk-cache-size", OPT_DISK_CACHE_SIZE, "BLOCKS", 0,
+   "Cache at most BLOCKS metadata blocks (at runtime, at most as many as"
+   " at startup)"},
+  {"disk-cache-stats", OPT_DISK_CACHE_STATS,
+   "HITS,MISSES,GHOST-HITS,RETURNS,RECENT,FREQUENT,TARGET", OPTION_HIDDEN,
+   "Disk cache counters and state (ignored when given)"},
+  {"bmap-cache-stats", OPT_BMAP_CACHE_STATS, "HITS,MISSES", OPTION_HIDDEN,
+   "Block map cache hits and misses so far (ignored when given)"},
+  {"delalloc", OPT_DELALLOC, 0, 0,
+   "Allocate the blocks of written file pages when writing them back"
+   " (default)"},
+  {"no-delalloc", OPT_NO_DELALLOC, 0, 0,
+   "Allocate the blocks of file pages when they are made writable"},
   {0}
 };
 
@@ -84,6 +108,10 @@ parse_opt (int key, char *arg, struct argp_state *state)
   {
     int debug_flag;
     unsigned int sb_block;
+    unsigned int pager_workers;
+    unsigned int write_cluster;
+    unsigned int disk_cache_size;
+    int delalloc;
   } *values = state->hook;
 
   switch (key)
@@ -99,6 +127,40 @@ parse_opt (int key, char *arg, struct argp_state *state)
 	  return EINVAL;
 	}
       break;
+    case 'W':
+      values->pager_workers = strtoul (arg, &arg, 0);
+      if (!arg || *arg != '\0' || values->pager_workers == 0)
+	{
+	  argp_error (state, "invalid number for --pager-workers");
+	  return EINVAL;
+	}
+      break;
+    case OPT_WRITE_CLUSTER:
+      values->write_cluster = strtoul (arg, &arg, 0);
+      if (!arg || *arg != '\0' || values->write_cluster == 0)
+	{
+	  argp_error (state, "invalid number for --write-cluster");
+	  return EINVAL;
+	}
+      break;
+    case OPT_DISK_CACHE_SIZE:
+      values->disk_cache_size = strtoul (arg, &arg, 0);
+      if (!arg || *arg != '\0'
+	  || values->disk_cache_size < DISK_CACHE_MIN_BLOCKS)
+	{
+	  argp_error (state, "invalid number for --disk-cache-size");
+	  return EINVAL;
+	}
+      break;
+    case OPT_DISK_CACHE_STATS:
+    case OPT_BMAP_CACHE_STATS:
+      break;			/* Only reported, never set.  */
+    case OPT_DELALLOC:
+      values->delalloc = 1;
+      break;
+    case OPT_NO_DELALLOC:
+      values->delalloc = -1;
+      break;
 
     case ARGP_KEY_INIT:
       state->child_inputs[0] = state->input;
@@ -122,6 +184,26 @@ parse_opt (int key, char *arg, struct argp_state *state)
 #endif
 	}
 
+      /* The worker threads are started only once, so this has no
+	 effect at runtime.  */
+      if (values->pager_workers && file_pager_requests == NULL)
+	file_pager_worker_count = values->pager_workers;
+      if (values->write_cluster)
+	file_pager_write_cluster = values->write_cluster;
+      if (values->delalloc)
+	file_pager_delalloc = values->delalloc > 0;
+
+      /* The disk cache is mapped at startup.  Later on, it can only
+	 use less of that space.  */
+      if (values->disk_cache_size && disk_cache_info == NULL)
+	disk_cache_blocks = values->disk_cache_size;
+      else if (values->disk_cache_size
+	       && disk_cache_resize (values->disk_cache_size))
+	{
+	  argp_error (state, "--disk-cache-size must be between %d and %d",
+		      DISK_CACHE_MIN_BLOCKS, disk_cache_blocks);
+	  return EINVAL;
+	}
       break;
 
     default:
@@ -143,6 +225,44 @@ diskfs_append_args (char **argz, size_t *argz_len)
   if (!err && ext2_debug_flag)
     err = argz_add (argz, argz_len, "--debug");
 #endif
+  if (!err && file_pager_worker_count != PAGER_DEFAULT_WORKER_COUNT)
+    {
+      char buf[100];
+      sprintf (buf, "--pager-workers=%u", file_pager_worker_count);
+      err = argz_add (argz, argz_len, buf);
+    }
+  if (!err && file_pager_write_cluster != FILE_WRITE_CLUSTER)
+    {
+      char buf[100];
+      sprintf (buf, "--write-cluster=%u", file_pager_write_cluster);
+      err = argz_add (argz, argz_len, buf);
+    }
+  if (!err && ! file_pager_delalloc)
+    err = argz_add (argz, argz_len, "--no-delalloc");
+  if (!err && disk_cache_active_blocks != DISK_CACHE_BLOCKS)
+    {
+      char buf[100];
+      sprintf (buf, "--disk-cache-size=%d", disk_cache_active_blocks);
+      err = argz_add (argz, argz_len, buf);
+    }
+  if (!err && disk_cache_info != NULL)
+    {
+      struct disk_cache_stats stats;
+      char buf[200];
+      disk_cache_get_stats (&stats);
+      sprintf (buf, "--disk-cache-stats=%lu,%lu,%lu,%lu,%d,%d,%d",
+	       stats.hits, stats.misses, stats.ghost_hits, stats.returns,
+	       stats.recent, stats.frequent, stats.target);
+      err = argz_add (argz, argz_len, buf);
+    }
+  if (! err)
+    {
+      unsigned long hits, misses;
+      char buf[100];
+      ext2_bmap_cache_get_stats (&hits, &misses);
+      sprintf (buf, "--bmap-cache-stats=%lu,%lu", hits, misses);
+      err = argz_add (argz, argz_len, buf);
+    }
   if (! err)
     err = store_parsed_append_args (store_parsed, argz, argz_len);
 
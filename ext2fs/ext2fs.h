@@ -154,6 +154,18 @@ clear_bit (unsigned num, unsigned char *bitmap)
 /* ---------------------------------------------------------------- */
 
 /* ext2fs specific per-file data.  */
+/* The number of runs of blocks of a file remembered by its block map
+   cache.  */
+#define BMAP_CACHE_SIZE		8
+
+/* A run of blocks of a file.  */
+struct bmap_cache_entry
+{
+  block_t block;		/* First logical block.  */
+  block_t len;			/* Number of blocks, 0 if unused.  */
+  block_t start;		/* First disk block, 0 for a hole.  */
+};
+
 struct disknode
 {
   /* For a directory, this array holds the number of directory entries in
@@ -179,6 +191,28 @@ struct disknode
 
   /* Index to start a directory lookup at.  */
   int dir_idx;
+
+  /* Recently looked up runs of blocks of this file, the slot of
+     BMAP_CACHE to be replaced next, and the number of times runs have
+     been invalidated (see getblk.c).  */
+  pthread_spinlock_t bmap_cache_lock;
+  struct bmap_cache_entry bmap_cache[BMAP_CACHE_SIZE];
+  unsigned int bmap_cache_next;
+  unsigned int bmap_cache_gen;
+
+  /* Sequential read-ahead state of the file pager.  Only used while
+     paging in for this node, which libpager never does concurrently.  */
+  vm_offset_t ra_next;		/* Where a sequential reader faults next.  */
+  unsigned int ra_window;	/* Pages to read at once, 0 if random.  */
+
+  /* Delayed allocation (see pager.c).  DELALLOC_PAGES maps the pages
+     made writable without allocating their blocks to the mask of those
+     blocks, of which there are DELALLOC_BLOCKS; DELALLOC_RESERVED free
+     blocks are set aside for them.  Protected by ALLOC_LOCK held for
+     writing; DELALLOC_RESERVED is changed with GLOBAL_LOCK held too.  */
+  struct hurd_ihash delalloc_pages;
+  block_t delalloc_blocks;
+  block_t delalloc_reserved;
 };
 
 struct user_pager_info
@@ -197,8 +231,29 @@ struct user_pager_info
 
 #define DISK_CACHE_BLOCKS	65536
 
+/* The smallest size of the disk cache that can be set at runtime.  */
+#define DISK_CACHE_MIN_BLOCKS	512
+
+/* The default for the largest number of pages written at once when
+   the kernel returns several pages of a file.  */
+#define FILE_WRITE_CLUSTER	32
+
 #include <hurd/diskfs-pager.h>
 
+/* The worker threads of the file pager, once they are started.  */
+extern struct pager_requests *file_pager_requests;
+
+/* The number of threads serving the file pager, set by --pager-workers.  */
+extern unsigned int file_pager_worker_count;
+
+/* The largest number of pages written at once by the file pager, set by
+   --write-cluster.  */
+extern unsigned int file_pager_write_cluster;
+
+/* True if blocks of regular files are only allocated when their pages
+   are written back, cleared by --no-delalloc.  */
+extern int file_pager_delalloc;
+
 /* Set up the disk pager.  */
 void create_disk_pager (void);
 
@@ -218,6 +273,11 @@ void allow_pager_softrefs (struct node *node);
 
 /* Invalidate any pager data associated with NODE.  */
 void flush_node_pager (struct node *node);
+
+/* Forget the delayed blocks of NODE from block END on, and release the
+   space set aside for them.  NODE's ALLOC_LOCK must be held for
+   writing.  */
+void delalloc_truncate (struct node *node, block_t end);
 
 /* ---------------------------------------------------------------- */
 
@@ -230,11 +290,39 @@ extern struct store_parsed *store_parsed;
 extern void *disk_cache;
 extern store_offset_t disk_cache_size;
 extern int disk_cache_blocks;
+/* The number of those blocks actually used, set by --disk-cache-size.  */
+extern int disk_cache_active_blocks;
+
+/* Use only the first BLOCKS blocks of the disk cache, returning the
+   others to the kernel.  */
+error_t disk_cache_resize (int blocks);
+
+/* The state of the disk cache and its counters, see
+   disk_cache_get_stats.  */
+struct disk_cache_stats
+{
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long ghost_hits;	/* Misses on recently evicted blocks.  */
+  unsigned long returns;	/* Pages returned to the kernel.  */
+  int recent, frequent, target;
+};
 
-#define DC_INCORE	0x01	/* Not in core.  */
-#define DC_UNTOUCHED	0x02	/* Not touched by disk_pager_read_paged
-				   or disk_cache_block_ref.  */
-#define DC_FIXED	0x04	/* Must not be re-associated.  */
+/* Store the state of the disk cache and its counters in STATS.  */
+void disk_cache_get_stats (struct disk_cache_stats *stats);
+
+#define DC_INCORE	0x010000	/* Not in core.  */
+#define DC_UNTOUCHED	0x020000	/* Not touched by disk_pager_read_paged
+					   or disk_cache_block_ref.  */
+#define DC_FIXED	0x040000	/* Must not be re-associated.  */
+#define DC_REFERENCED	0x080000	/* Referenced since the replacement
+					   policy last looked at it.  */
+#define DC_FREQUENT	0x100000	/* Referenced again after it was
+					   mapped.  */
+
+/* The part of the state of a cached block holding its reference
+   count.  */
+#define DC_REF_MASK	0x00ffff
 
 /* Flags that forbid re-association of page.  DC_UNTOUCHED is included
    because this flag is used only when page is already to be
@@ -252,22 +340,22 @@ extern int disk_cache_blocks;
 struct disk_cache_info
 {
   block_t block;
-  uint16_t flags;
-  uint16_t ref_count;
+  uint32_t state;		/* DC_* flags and reference count, only
+				   changed by atomic operations.  */
   struct disk_cache_info *next;	/* List of reusable entries.  */
 #ifdef DEBUG_DISK_CACHE
   block_t last_read, last_read_xor;
 #endif
 };
 
-/* block num --> pointer to in-memory block */
-extern hurd_ihash_t disk_cache_bptr;
+/* block num --> pointer to in-memory block, can be looked up without
+   locking.  */
+extern struct hurd_cihash disk_cache_bptr;
 /* Metadata about cached block. */
 extern struct disk_cache_info *disk_cache_info;
-/* Lock for these mappings */
+/* Serializes changes of these mappings.  Taking a reference to a block
+   that is already mapped does not need it.  */
 extern pthread_mutex_t disk_cache_lock;
-/* Fired when a re-association is done.  */
-extern pthread_cond_t disk_cache_reassociation;
 
 void *disk_cache_block_ref (block_t block);
 void disk_cache_block_ref_ptr (void *ptr);
@@ -354,9 +442,7 @@ EXT2FS_EI char *
 boffs_ptr (off_t offset)
 {
   block_t block = boffs_block (offset);
-  pthread_mutex_lock (&disk_cache_lock);
-  char *ptr = hurd_ihash_find (disk_cache_bptr, block);
-  pthread_mutex_unlock (&disk_cache_lock);
+  char *ptr = hurd_cihash_find (&disk_cache_bptr, block);
   assert (ptr);
   ptr += offset % block_size;
   ext2_debug ("(%lld) = %p", offset, ptr);
@@ -370,12 +456,11 @@ bptr_offs (void *ptr)
   vm_offset_t mem_offset = (char *)ptr - (char *)disk_cache;
   off_t offset;
   assert (mem_offset < disk_cache_size);
-  pthread_mutex_lock (&disk_cache_lock);
-  offset = (off_t) disk_cache_info[boffs_block (mem_offset)].block
+  offset = (off_t) __atomic_load_n (&disk_cache_info[boffs_block (mem_offset)]
+				     .block, __ATOMIC_ACQUIRE)
     << log2_block_size;
   assert (offset || mem_offset < block_size);
   offset += mem_offset % block_size;
-  pthread_mutex_unlock (&disk_cache_lock);
   ext2_debug ("(%p) = %lld", ptr, offset);
   return offset;
 }
@@ -405,8 +490,8 @@ dino_ref (ino_t inum)
   unsigned long group_inum = (inum - 1) % inodes_per_group;
   struct ext2_group_desc *bg = group_desc (bg_num);
   block_t block = bg->bg_inode_table + (group_inum / inodes_per_block);
-  struct ext2_inode *inode = disk_cache_block_ref (block);
-  inode += group_inum % inodes_per_block;
+  struct ext2_inode *inode = disk_cache_block_ref (block)
+    + (group_inum % inodes_per_block) * EXT2_INODE_SIZE (sblock);
   ext2_debug ("(%llu) = %p", inum, inode);
   return inode;
 }
@@ -427,10 +512,14 @@ void write_all_disknodes ();
 
 /* ---------------------------------------------------------------- */
 
-/* What to lock if changing global data data (e.g., the superblock or block
-   group descriptors or bitmaps).  */
+/* What to lock if changing global data data (e.g., the superblock).  */
 pthread_spinlock_t global_lock;
 
+/* What to lock if changing the descriptor or bitmaps of a block group,
+   one lock per group.  GLOBAL_LOCK may be taken while holding one of these,
+   but not the other way round.  */
+pthread_spinlock_t *group_locks;
+
 /* Where to record such changes.  */
 struct pokel global_pokel;
 
@@ -530,20 +619,140 @@ alloc_sync (struct node *np)
 }
 #endif /* Use extern inlines.  */
 
+/* ---------------------------------------------------------------- */
+/* htree.c */
+
+/* One level of the way from the root of a directory index to a leaf
+   block.  */
+struct ext2_dx_frame
+{
+  struct ext2_dx_entry *entries; /* The entries of this index block.  */
+  struct ext2_dx_entry *at;	/* The one followed.  */
+};
+
+/* The way to the leaf block a name belongs to.  */
+struct ext2_dx_path
+{
+  uint32_t hash;		/* The hash of the name.  */
+  int version;			/* The hash function of the index.  */
+  int levels;			/* The number of valid FRAMES.  */
+  struct ext2_dx_frame frames[EXT2_DX_MAX_INDIRECT_LEVELS + 1];
+};
+
+/* Return whether directory DP has an index to be used and updated.  */
+int ext2_dir_is_indexed (struct node *dp);
+
+/* Return the hash of NAME, of length NAMELEN, computed with the
+   EXT2_DX_HASH_* function VERSION.  */
+uint32_t ext2_dirhash (const char *name, size_t namelen, int version);
+
+/* Look up NAME, of length NAMELEN, in the index of directory DP, which
+   is mapped at BUF.  Set *LEAF to the block NAME belongs to, and PATH
+   to the way there.  Return EIO if the index is corrupt.  */
+error_t ext2_dx_probe (struct node *dp, vm_address_t buf,
+		       const char *name, size_t namelen,
+		       struct ext2_dx_path *path, block_t *leaf);
+
+/* If names with the hash of PATH continue in the next leaf block of
+   the index of directory DP, mapped at BUF, advance PATH, set *LEAF to
+   that block and return true.  */
+int ext2_dx_next_leaf (struct node *dp, vm_address_t buf,
+		       struct ext2_dx_path *path, block_t *leaf);
+
+/* Split leaf block *LEAF of the index of directory DP, mapped at BUF,
+   that ext2_dx_probe found for a name with PATH, and set *LEAF to the
+   half the name belongs to.  Up to two blocks are appended to DP, so
+   the mapping must extend that far beyond its end.  */
+error_t ext2_dx_split (struct node *dp, vm_address_t buf,
+		       struct ext2_dx_path *path, block_t *leaf,
+		       struct protid *cred);
+
+/* Turn directory DP, mapped at BUF, whose only block is full, into an
+   indexed one, and make room for NAME, of length NAMELEN, like
+   ext2_dx_split does.  Return EINVAL if DP cannot be indexed.  */
+error_t ext2_dx_make_indexed (struct node *dp, vm_address_t buf,
+			      const char *name, size_t namelen,
+			      struct ext2_dx_path *path, block_t *leaf,
+			      struct protid *cred);
+
+/* ---------------------------------------------------------------- */
+/* extents.c */
+
+/* Like ext2_getblk, for NODE whose blocks are mapped by extents.  */
+error_t ext2_extent_getblk (struct node *node, block_t block, int create,
+			    block_t *disk_block);
+
+/* Free the blocks of extent-mapped NODE from block END on.  */
+void ext2_extent_truncate (struct node *node, block_t end);
+
+/* Make NODE, which has no blocks, an extent-mapped one.  */
+void ext2_extent_init (struct node *node);
+
 /* ---------------------------------------------------------------- */
 /* getblk.c */
 
 void ext2_discard_prealloc (struct node *node);
 
+/* Allocate a new block for the file NODE, as close to block GOAL as
+   possible, and return it, or 0 if none could be had.  If ZERO is true,
+   then zero the block (and add it to NODE's list of modified indirect
+   blocks).  */
+block_t ext2_alloc_block (struct node *node, block_t goal, int zero);
+
 /* Returns in DISK_BLOCK the disk block corresponding to BLOCK in NODE.
    If there is no such block yet, but CREATE is true, then it is created,
    otherwise EINVAL is returned.  */
 error_t ext2_getblk (struct node *node, block_t block, int create, block_t *disk_block);
 
+/* Like ext2_getblk without CREATE, but return 0 with *DISK_BLOCK set to
+   0 if BLOCK is in a hole, and return in *COUNT how many blocks from
+   BLOCK on are known to follow *DISK_BLOCK contiguously on disk (or to
+   be in the hole as well).  */
+error_t ext2_getblk_run (struct node *node, block_t block,
+			 block_t *disk_block, block_t *count);
+
+/* Return the current generation of NODE's block map cache, to be passed
+   to ext2_bmap_cache_add for a run looked up after this call.  */
+unsigned int ext2_bmap_cache_gen (struct node *node);
+
+/* Remember that the LEN blocks of NODE from BLOCK on are mapped to the
+   disk blocks from START on, or are a hole if START is 0, unless the
+   runs of NODE have been invalidated since GEN was returned by
+   ext2_bmap_cache_gen.  */
+void ext2_bmap_cache_add (struct node *node, unsigned int gen,
+			  block_t block, block_t len, block_t start);
+
+/* Forget the runs of blocks of NODE that have been looked up.  */
+void ext2_bmap_cache_flush (struct node *node);
+
+/* Return the number of lookups the block map caches answered in *HITS
+   and the number of those they could not answer in *MISSES.  */
+void ext2_bmap_cache_get_stats (unsigned long *hits, unsigned long *misses);
+
 block_t ext2_new_block (block_t goal,
 			block_t prealloc_goal,
 			block_t *prealloc_count, block_t *prealloc_block);
 
+/* Allocate up to COUNT blocks that are contiguous on disk, as close to
+   block GOAL as possible, with one search of the bitmaps.  Return the
+   first of them, and their number in *ALLOCATED, which is less than COUNT
+   if no long enough run of free blocks was found nearby; return 0 if the
+   disk is full.  If RESERVATION is not NULL, the blocks are taken out of
+   the free blocks it has set aside first.  */
+block_t ext2_new_blocks (block_t goal, block_t count, block_t *allocated,
+			 block_t *reservation);
+
+/* Set aside COUNT free blocks for later allocations, adding them to
+   *RESERVATION, or return ENOSPC if there aren't that many that are not
+   set aside already.  */
+error_t ext2_reserve_blocks (block_t *reservation, block_t count);
+
+/* Return COUNT of the blocks set aside in *RESERVATION.  */
+void ext2_release_blocks (block_t *reservation, block_t count);
+
+/* Return the number of free blocks that are set aside.  */
+block_t ext2_count_reserved_blocks (void);
+
 void ext2_free_blocks (block_t block, unsigned long count);
 
 /* ---------------------------------------------------------------- */
@@ -0,0 +1,789 @@
+/* Extent-mapped files
+
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+
+/* The blocks of a file with EXT2_EXTENTS_FL set are mapped by a tree in
+   the format of Linux's ext4, rooted in the block pointers of the inode.
+   Each extent maps a run of up to 32768 contiguous blocks, so that one
+   lookup serves a whole run of a large file.  The extents looked up are
+   remembered in the block map cache of the node (see getblk.c), which
+   spares even that lookup to sequential accesses.  */
+
+#include <string.h>
+#include "ext2fs.h"
+
+/* The way from the root of the extent tree of a node down to a leaf.  */
+struct extent_path
+{
+  struct ext2_extent_header *header;
+  block_t block;		/* Disk block of the node, 0 for the root.  */
+  int pos;			/* The entry covering the block looked for,
+				   or -1 if that comes before the first.  */
+  int dirty;
+};
+
+/* Index and leaf entries have the same size, and both start with the
+   first logical block they cover.  */
+#define EXTENT(header, i) ((struct ext2_extent *) ((header) + 1) + (i))
+#define EXTENT_IDX(header, i) ((struct ext2_extent_idx *) ((header) + 1) + (i))
+
+/* The capacity of the root of the tree, in the inode.  */
+#define EXTENT_ROOT_MAX \
+  ((EXT2_N_BLOCKS * sizeof (__u32) - sizeof (struct ext2_extent_header)) \
+   / sizeof (struct ext2_extent))
+
+static inline struct ext2_extent_header *
+extent_root (struct node *node)
+{
+  return (struct ext2_extent_header *) diskfs_node_disknode (node)->info.i_data;
+}
+
+/* The capacity of a tree node in a disk block.  */
+static inline unsigned int
+extent_block_max (void)
+{
+  return ((block_size - sizeof (struct ext2_extent_header))
+	  / sizeof (struct ext2_extent));
+}
+
+static inline int
+extent_uninit (struct ext2_extent *ext)
+{
+  return ext->ee_len > EXT2_EXTENT_INIT_MAX_LEN;
+}
+
+static inline block_t
+extent_len (struct ext2_extent *ext)
+{
+  return (extent_uninit (ext)
+	  ? ext->ee_len - EXT2_EXTENT_INIT_MAX_LEN : ext->ee_len);
+}
+
+/* Return whether HEADER, the node of the extent tree of NODE in disk
+   block BLOCK (0 for the root), is sane.  DEPTH is the depth the node
+   should have, or -1 if that is not known.  */
+static int
+extent_header_ok (struct node *node, struct ext2_extent_header *header,
+		  block_t block, int depth)
+{
+  unsigned int max = block ? extent_block_max () : EXTENT_ROOT_MAX;
+
+  if (header->eh_magic == EXT2_EXTENT_MAGIC
+      && header->eh_max > 0 && header->eh_max <= max
+      && header->eh_entries <= header->eh_max
+      && (depth < 0
+	  ? header->eh_depth <= EXT2_EXTENT_MAX_DEPTH
+	  : header->eh_depth == depth)
+      && (header->eh_depth == 0 || header->eh_entries > 0))
+    return 1;
+
+  ext2_warning ("bad extent tree node: inode: %Ld block: %u",
+		node->cache_id, block);
+  return 0;
+}
+
+/* Return whether the COUNT disk blocks starting at START, which NODE
+   maps, lie in the file system.  */
+static int
+extent_blocks_ok (struct node *node, block_t start, block_t count,
+		  unsigned int start_hi)
+{
+  if (start_hi == 0 && start >= sblock->s_first_data_block
+      && start < sblock->s_blocks_count
+      && count <= sblock->s_blocks_count - start)
+    return 1;
+
+  ext2_warning ("bad extent: inode: %Ld block: %u count: %u",
+		node->cache_id, start, count);
+  return 0;
+}
+
+/* Mark the node of PATH as modified, and release it.  */
+static void
+extent_node_release (struct node *node, struct extent_path *path)
+{
+  if (path->block == 0)
+    {
+      if (path->dirty)
+	node->dn_stat_dirty = 1;
+    }
+  else if (path->dirty)
+    {
+      if (diskfs_synchronous || diskfs_node_disknode (node)->info.i_osync)
+	sync_global_ptr (path->header, 1);
+      else
+	record_indir_poke (node, path->header);
+    }
+  else
+    disk_cache_block_deref (path->header);
+}
+
+/* Release the nodes of PATH, from the root down to DEPTH.  */
+static void
+extent_path_release (struct node *node, struct extent_path *path, int depth)
+{
+  int level;
+
+  for (level = 0; level <= depth; level++)
+    extent_node_release (node, &path[level]);
+}
+
+/* Fill PATH with the way from the root of the extent tree of NODE down
+   to the leaf that covers BLOCK, and set *DEPTH to the depth of the
+   tree.  If the tree is corrupt, return EIO with nothing referenced.  */
+static error_t
+extent_find (struct node *node, block_t block, struct extent_path *path,
+	     int *depth)
+{
+  struct ext2_extent_header *header = extent_root (node);
+  struct ext2_extent_idx *idx;
+  int level, lo, hi, mid;
+  block_t child;
+
+  if (! extent_header_ok (node, header, 0, -1))
+    return EIO;
+
+  *depth = header->eh_depth;
+  path[0].header = header;
+  path[0].block = 0;
+  path[0].dirty = 0;
+
+  for (level = 0; ; level++)
+    {
+      /* Find the last entry starting at or before BLOCK.  */
+      lo = 0;
+      hi = header->eh_entries - 1;
+      while (lo <= hi)
+	{
+	  mid = lo + (hi - lo) / 2;
+	  if (EXTENT (header, mid)->ee_block <= block)
+	    lo = mid + 1;
+	  else
+	    hi = mid - 1;
+	}
+      path[level].pos = hi;
+
+      if (level == *depth)
+	return 0;
+
+      /* Blocks before the first index entry are looked for below it.  */
+      if (path[level].pos < 0)
+	path[level].pos = 0;
+
+      idx = EXTENT_IDX (header, path[level].pos);
+      child = idx->ei_leaf;
+      if (! extent_blocks_ok (node, child, 1, idx->ei_leaf_hi))
+	{
+	  extent_path_release (node, path, level);
+	  return EIO;
+	}
+
+      header = disk_cache_block_ref (child);
+      path[level + 1].header = header;
+      path[level + 1].block = child;
+      path[level + 1].dirty = 0;
+      if (! extent_header_ok (node, header, child, *depth - level - 1))
+	{
+	  extent_path_release (node, path, level + 1);
+	  return EIO;
+	}
+    }
+}
+
+/* Return the first logical block after the leaf entry of PATH, down to
+   DEPTH, that is mapped by a later entry, or the largest block number
+   if there is none.  */
+static block_t
+extent_next_start (struct extent_path *path, int depth)
+{
+  int level;
+
+  for (level = depth; level >= 0; level--)
+    if (path[level].pos + 1 < path[level].header->eh_entries)
+      return EXTENT (path[level].header, path[level].pos + 1)->ee_block;
+
+  return (block_t) -1;
+}
+
+/* Return whether the entries of PATH above LEVEL are the last ones of
+   their nodes.  */
+static int
+extent_path_rightmost (struct extent_path *path, int level)
+{
+  int l;
+
+  for (l = 0; l < level; l++)
+    if (path[l].pos + 1 < path[l].header->eh_entries)
+      return 0;
+  return 1;
+}
+
+/* The first entry of the node at LEVEL of PATH has changed; update the
+   index entries above it.  */
+static void
+extent_fix_index (struct extent_path *path, int level)
+{
+  struct ext2_extent_idx *idx;
+  block_t start;
+
+  for (; level > 0; level--)
+    {
+      start = EXTENT (path[level].header, 0)->ee_block;
+      idx = EXTENT_IDX (path[level - 1].header, path[level - 1].pos);
+      if (idx->ei_block == start)
+	break;
+      idx->ei_block = start;
+      path[level - 1].dirty = 1;
+      if (path[level - 1].pos != 0)
+	break;
+    }
+}
+
+/* Add COUNT blocks to the blocks used by NODE.  */
+static inline void
+extent_account (struct node *node, long count)
+{
+  node->dn_stat.st_blocks += count * (1 << log2_stat_blocks_per_fs_block);
+  node->dn_stat_dirty = 1;
+}
+
+/* Allocate and reference a new tree node for NODE, near GOAL, and
+   initialize it with DEPTH.  Return it in *HEADER and its disk block in
+   *BLOCK.  */
+static error_t
+extent_new_node (struct node *node, block_t goal, int depth,
+		 struct ext2_extent_header **header, block_t *block)
+{
+  *block = ext2_alloc_block (node, goal, 0);
+  if (! *block)
+    return ENOSPC;
+  extent_account (node, 1);
+
+  *header = disk_cache_block_ref (*block);
+  memset (*header, 0, block_size);
+  (*header)->eh_magic = EXT2_EXTENT_MAGIC;
+  (*header)->eh_max = extent_block_max ();
+  (*header)->eh_depth = depth;
+  return 0;
+}
+
+/* Make room for NEEDED more entries in the node at LEVEL of PATH, the
+   tree of NODE having depth *DEPTH, for entries to be inserted after
+   the one of PATH, the first of which starts at logical block START.
+   Split the nodes on the way and grow the tree as necessary, keeping
+   PATH pointing to the same entry; the node of LEVEL is then at LEVEL
+   plus the growth of *DEPTH.  If APPEND is true and the entries go to
+   the end of the tree, the full nodes are left alone instead, and PATH
+   points before the start of new, empty ones.  */
+static error_t
+extent_make_room (struct node *node, struct extent_path *path, int *depth,
+		  int level, block_t start, int needed, int append)
+{
+  struct ext2_extent_header *header = path[level].header, *new, *parent;
+  struct ext2_extent_idx *idx;
+  unsigned int count = header->eh_entries, split;
+  int ins = path[level].pos + 1, old_depth = *depth;
+  block_t block;
+  error_t err;
+
+  if (count + needed <= header->eh_max)
+    return 0;
+
+  if (level == 0)
+    /* Move the entries of the root into a new node, which becomes its
+       only child.  */
+    {
+      if (*depth == EXT2_EXTENT_MAX_DEPTH)
+	return EFBIG;
+
+      err = extent_new_node (node,
+			     (diskfs_node_disknode (node)->info.i_block_group
+			      * EXT2_BLOCKS_PER_GROUP (sblock))
+			     + sblock->s_first_data_block,
+			     header->eh_depth, &new, &block);
+      if (err)
+	return err;
+
+      memcpy (EXTENT (new, 0), EXTENT (header, 0),
+	      count * sizeof (struct ext2_extent));
+      new->eh_entries = count;
+
+      idx = EXTENT_IDX (header, 0);
+      memset (idx, 0, sizeof *idx);
+      idx->ei_block = count ? EXTENT (new, 0)->ee_block : start;
+      idx->ei_leaf = block;
+      header->eh_entries = 1;
+      header->eh_depth++;
+
+      memmove (path + 2, path + 1, *depth * sizeof *path);
+      path[1].header = new;
+      path[1].block = block;
+      path[1].pos = path[0].pos;
+      path[1].dirty = 1;
+      path[0].pos = 0;
+      path[0].dirty = 1;
+      (*depth)++;
+      return 0;
+    }
+
+  /* Appending to the end of the tree leaves full nodes behind; other
+     nodes are split in the middle.  */
+  if (append && ins == count && extent_path_rightmost (path, level))
+    split = count;
+  else
+    split = count / 2;
+
+  /* Make room for the new node in the parent.  */
+  err = extent_make_room (node, path, depth, level - 1,
+			  split < count ? EXTENT (header, split)->ee_block
+			  : start, 1, split == count);
+  if (err)
+    return err;
+  level += *depth - old_depth;
+
+  err = extent_new_node (node, path[level].block, header->eh_depth,
+			 &new, &block);
+  if (err)
+    return err;
+
+  memcpy (EXTENT (new, 0), EXTENT (header, split),
+	  (count - split) * sizeof (struct ext2_extent));
+  new->eh_entries = count - split;
+  header->eh_entries = split;
+  path[level].dirty = 1;
+
+  parent = path[level - 1].header;
+  idx = EXTENT_IDX (parent, path[level - 1].pos + 1);
+  memmove (idx + 1, idx,
+	   ((parent->eh_entries - path[level - 1].pos - 1)
+	    * sizeof (struct ext2_extent_idx)));
+  memset (idx, 0, sizeof *idx);
+  idx->ei_block = split < count ? EXTENT (new, 0)->ee_block : start;
+  idx->ei_leaf = block;
+  parent->eh_entries++;
+  path[level - 1].dirty = 1;
+
+  if (ins > split || split == count)
+    /* The entries go into the new node.  */
+    {
+      extent_node_release (node, &path[level]);
+      path[level].header = new;
+      path[level].block = block;
+      path[level].pos = ins - split - 1;
+      path[level].dirty = 1;
+      path[level - 1].pos++;
+    }
+  else
+    {
+      struct extent_path newpath = { new, block, 0, 1 };
+      extent_node_release (node, &newpath);
+    }
+
+  return 0;
+}
+
+/* Insert NEW after the leaf entry of PATH, down to DEPTH, which must
+   have room for it, and point PATH to it.  */
+static void
+extent_insert_here (struct extent_path *path, int depth,
+		    struct ext2_extent *new)
+{
+  struct ext2_extent_header *leaf = path[depth].header;
+  int ins = path[depth].pos + 1;
+
+  memmove (EXTENT (leaf, ins + 1), EXTENT (leaf, ins),
+	   (leaf->eh_entries - ins) * sizeof (struct ext2_extent));
+  *EXTENT (leaf, ins) = *new;
+  leaf->eh_entries++;
+  path[depth].pos = ins;
+  path[depth].dirty = 1;
+
+  if (ins == 0)
+    extent_fix_index (path, depth);
+}
+
+/* Remove leaf entry I, which is not the first one, of PATH.  */
+static void
+extent_remove (struct extent_path *path, int depth, int i)
+{
+  struct ext2_extent_header *leaf = path[depth].header;
+
+  assert (i > 0);
+  memmove (EXTENT (leaf, i), EXTENT (leaf, i + 1),
+	   (leaf->eh_entries - i - 1) * sizeof (struct ext2_extent));
+  leaf->eh_entries--;
+  path[depth].dirty = 1;
+}
+
+/* Return a good disk block to allocate logical block BLOCK of NODE at,
+   PATH pointing to the leaf entry before it.  */
+static block_t
+extent_goal (struct node *node, struct extent_path *path, int depth,
+	     block_t block)
+{
+  struct ext2_inode_info *info = &diskfs_node_disknode (node)->info;
+  struct ext2_extent_header *leaf = path[depth].header;
+  struct ext2_extent *ext;
+
+  if (info->i_next_alloc_block == block && info->i_next_alloc_goal)
+    /* Sequential allocation, or blocks grabbed in advance.  */
+    return info->i_next_alloc_goal;
+  if (path[depth].pos >= 0)
+    {
+      ext = EXTENT (leaf, path[depth].pos);
+      return ext->ee_start + (block - ext->ee_block);
+    }
+  if (leaf->eh_entries > 0)
+    {
+      ext = EXTENT (leaf, 0);
+      if (ext->ee_start - sblock->s_first_data_block
+	  > ext->ee_block - block)
+	return ext->ee_start - (ext->ee_block - block);
+    }
+  return ((diskfs_node_disknode (node)->info.i_block_group
+	   * EXT2_BLOCKS_PER_GROUP (sblock))
+	  + sblock->s_first_data_block);
+}
+
+/* Allocate a disk block for BLOCK of NODE, which is not mapped, PATH
+   pointing to the leaf entry before it, and return it in *DISK_BLOCK.  */
+static error_t
+extent_alloc (struct node *node, struct extent_path *path, int *depth,
+	      block_t block, block_t *disk_block)
+{
+  struct ext2_extent_header *leaf = path[*depth].header;
+  int pos = path[*depth].pos;
+  struct ext2_extent *prev = pos >= 0 ? EXTENT (leaf, pos) : NULL;
+  struct ext2_extent *next
+    = pos + 1 < leaf->eh_entries ? EXTENT (leaf, pos + 1) : NULL;
+  block_t new_block;
+  error_t err;
+
+  new_block = ext2_alloc_block (node, extent_goal (node, path, *depth, block),
+				0);
+  if (! new_block)
+    return ENOSPC;
+
+  if (prev && ! extent_uninit (prev)
+      && prev->ee_block + prev->ee_len == block
+      && prev->ee_start + prev->ee_len == new_block
+      && prev->ee_len < EXT2_EXTENT_INIT_MAX_LEN)
+    /* Extend the extent before BLOCK, merging it with the one after if
+       that now follows it.  */
+    {
+      prev->ee_len++;
+      if (next && ! extent_uninit (next)
+	  && next->ee_block == block + 1 && next->ee_start == new_block + 1
+	  && prev->ee_len + next->ee_len <= EXT2_EXTENT_INIT_MAX_LEN)
+	{
+	  prev->ee_len += next->ee_len;
+	  extent_remove (path, *depth, pos + 1);
+	}
+      path[*depth].dirty = 1;
+    }
+  else if (next && ! extent_uninit (next)
+	   && next->ee_block == block + 1 && next->ee_start == new_block + 1
+	   && next->ee_len < EXT2_EXTENT_INIT_MAX_LEN)
+    /* Extend the extent after BLOCK backwards.  */
+    {
+      next->ee_block--;
+      next->ee_start--;
+      next->ee_len++;
+      path[*depth].dirty = 1;
+      if (pos + 1 == 0)
+	extent_fix_index (path, *depth);
+    }
+  else
+    {
+      struct ext2_extent new = { .ee_block = block, .ee_len = 1,
+				 .ee_start = new_block };
+
+      err = extent_make_room (node, path, depth, *depth, block, 1, 1);
+      if (err)
+	{
+	  ext2_free_blocks (new_block, 1);
+	  return err;
+	}
+      extent_insert_here (path, *depth, &new);
+    }
+
+  extent_account (node, 1);
+  *disk_block = new_block;
+  return 0;
+}
+
+/* Mark BLOCK of NODE, which lies in the uninitialized extent of PATH,
+   as initialized, and return its disk block in *DISK_BLOCK.  */
+static error_t
+extent_convert (struct node *node, struct extent_path *path, int *depth,
+		block_t block, block_t *disk_block)
+{
+  struct ext2_extent_header *leaf = path[*depth].header;
+  int pos = path[*depth].pos;
+  struct ext2_extent *ext = EXTENT (leaf, pos);
+  struct ext2_extent *prev = pos > 0 ? EXTENT (leaf, pos - 1) : NULL;
+  struct ext2_extent pieces[2];
+  block_t start = ext->ee_block, len = extent_len (ext);
+  int npieces = 0, i;
+  error_t err;
+
+  *disk_block = ext->ee_start + (block - start);
+
+  if (block == start && prev && ! extent_uninit (prev)
+      && prev->ee_block + prev->ee_len == block
+      && prev->ee_start + prev->ee_len == *disk_block
+      && prev->ee_len < EXT2_EXTENT_INIT_MAX_LEN)
+    /* Data is written sequentially into preallocated blocks; move the
+       first of them to the extent before.  */
+    {
+      prev->ee_len++;
+      if (len == 1)
+	extent_remove (path, *depth, pos);
+      else
+	{
+	  ext->ee_block++;
+	  ext->ee_start++;
+	  ext->ee_len--;
+	}
+      path[*depth].dirty = 1;
+      return 0;
+    }
+
+  /* Split the extent into the uninitialized blocks before BLOCK, BLOCK
+     itself, and the uninitialized blocks after it.  */
+  if (block > start)
+    {
+      pieces[npieces].ee_block = block;
+      pieces[npieces].ee_len = 1;
+      pieces[npieces].ee_start_hi = 0;
+      pieces[npieces].ee_start = *disk_block;
+      npieces++;
+    }
+  if (block + 1 < start + len)
+    {
+      pieces[npieces].ee_block = block + 1;
+      pieces[npieces].ee_len = (start + len - block - 1
+				+ EXT2_EXTENT_INIT_MAX_LEN);
+      pieces[npieces].ee_start_hi = 0;
+      pieces[npieces].ee_start = *disk_block + 1;
+      npieces++;
+    }
+
+  if (npieces > 0)
+    {
+      err = extent_make_room (node, path, depth, *depth,
+			      pieces[0].ee_block, npieces, 0);
+      if (err)
+	return err;
+      ext = EXTENT (path[*depth].header, path[*depth].pos);
+    }
+
+  if (block > start)
+    ext->ee_len = block - start + EXT2_EXTENT_INIT_MAX_LEN;
+  else
+    ext->ee_len = 1;
+  path[*depth].dirty = 1;
+
+  for (i = 0; i < npieces; i++)
+    extent_insert_here (path, *depth, &pieces[i]);
+
+  return 0;
+}
+
+error_t
+ext2_extent_getblk (struct node *node, block_t block, int create,
+		    block_t *disk_block)
+{
+  struct extent_path path[EXT2_EXTENT_MAX_DEPTH + 1];
+  struct ext2_extent *ext = NULL;
+  unsigned int gen = ext2_bmap_cache_gen (node);
+  int depth;
+  error_t err;
+
+  err = extent_find (node, block, path, &depth);
+  if (err)
+    return err;
+
+  if (path[depth].pos >= 0)
+    {
+      ext = EXTENT (path[depth].header, path[depth].pos);
+      if (block - ext->ee_block >= extent_len (ext))
+	ext = NULL;
+      else if (! extent_blocks_ok (node, ext->ee_start, extent_len (ext),
+				   ext->ee_start_hi))
+	{
+	  extent_path_release (node, path, depth);
+	  return EIO;
+	}
+    }
+
+  if (ext && ! extent_uninit (ext))
+    {
+      *disk_block = ext->ee_start + (block - ext->ee_block);
+      ext2_bmap_cache_add (node, gen, ext->ee_block, extent_len (ext),
+			   ext->ee_start);
+      err = 0;
+    }
+  else if (! create)
+    /* Uninitialized blocks read as zeros, just like holes.  */
+    {
+      block_t end = (ext ? ext->ee_block + extent_len (ext)
+		     : extent_next_start (path, depth));
+      ext2_bmap_cache_add (node, gen, block, end - block, 0);
+      err = EINVAL;
+    }
+  else
+    {
+      if (ext)
+	err = extent_convert (node, path, &depth, block, disk_block);
+      else
+	err = extent_alloc (node, path, &depth, block, disk_block);
+      if (! err)
+	{
+	  struct ext2_inode_info *info = &diskfs_node_disknode (node)->info;
+
+	  info->i_next_alloc_block = block;
+	  info->i_next_alloc_goal = *disk_block;
+	  node->dn_set_ctime = node->dn_set_mtime = 1;
+	  node->dn_stat_dirty = 1;
+	}
+    }
+
+  extent_path_release (node, path, depth);
+
+  if (! err && create
+      && (diskfs_synchronous || diskfs_node_disknode (node)->info.i_osync))
+    diskfs_node_update (node, 1);
+
+  return err;
+}
+
+/* Free the COUNT blocks of NODE starting at disk block START.  */
+static void
+extent_free_blocks (struct node *node, block_t start, block_t count)
+{
+  ext2_free_blocks (start, count);
+  extent_account (node, - (long) count);
+}
+
+/* Free the blocks mapped at or after logical block END by the extent
+   tree node HEADER of NODE, setting *DIRTY if HEADER changes.  Return
+   true if it has no entries left.  */
+static int
+extent_trunc_node (struct node *node, struct ext2_extent_header *header,
+		   block_t end, int *dirty)
+{
+  struct ext2_extent_header *child;
+  struct ext2_extent_idx *idx;
+  struct ext2_extent *ext;
+  block_t len, keep;
+  int child_dirty;
+
+  if (header->eh_depth == 0)
+    while (header->eh_entries > 0)
+      {
+	ext = EXTENT (header, header->eh_entries - 1);
+	len = extent_len (ext);
+	if (! extent_blocks_ok (node, ext->ee_start, len, ext->ee_start_hi))
+	  break;
+
+	if (ext->ee_block >= end)
+	  {
+	    extent_free_blocks (node, ext->ee_start, len);
+	    header->eh_entries--;
+	    *dirty = 1;
+	  }
+	else
+	  {
+	    if (ext->ee_block + len > end)
+	      {
+		keep = end - ext->ee_block;
+		extent_free_blocks (node, ext->ee_start + keep, len - keep);
+		ext->ee_len -= len - keep;
+		*dirty = 1;
+	      }
+	    break;
+	  }
+      }
+  else
+    /* The entries before one starting before END cannot map anything
+       at or after it.  */
+    while (header->eh_entries > 0)
+      {
+	idx = EXTENT_IDX (header, header->eh_entries - 1);
+	if (! extent_blocks_ok (node, idx->ei_leaf, 1, idx->ei_leaf_hi))
+	  break;
+
+	child = disk_cache_block_ref (idx->ei_leaf);
+	if (! extent_header_ok (node, child, idx->ei_leaf,
+				header->eh_depth - 1))
+	  {
+	    disk_cache_block_deref (child);
+	    break;
+	  }
+
+	child_dirty = 0;
+	if (extent_trunc_node (node, child, end, &child_dirty))
+	  {
+	    pager_flush_some (diskfs_disk_pager,
+			      bptr_index (child) << log2_block_size,
+			      block_size, 1);
+	    disk_cache_block_deref (child);
+	    extent_free_blocks (node, idx->ei_leaf, 1);
+	    header->eh_entries--;
+	    *dirty = 1;
+	  }
+	else
+	  {
+	    if (child_dirty)
+	      record_indir_poke (node, child);
+	    else
+	      disk_cache_block_deref (child);
+	    break;
+	  }
+      }
+
+  return header->eh_entries == 0;
+}
+
+void
+ext2_extent_truncate (struct node *node, block_t end)
+{
+  struct ext2_extent_header *root = extent_root (node);
+  int dirty = 0;
+
+  if (! extent_header_ok (node, root, 0, -1))
+    return;
+
+  if (extent_trunc_node (node, root, end, &dirty))
+    /* The tree is empty; make the root a leaf again.  */
+    root->eh_depth = 0;
+
+  if (dirty)
+    node->dn_stat_dirty = 1;
+}
+
+void
+ext2_extent_init (struct node *node)
+{
+  struct ext2_extent_header *root = extent_root (node);
+
+  memset (root, 0, sizeof *root);
+  root->eh_magic = EXT2_EXTENT_MAGIC;
+  root->eh_max = EXTENT_ROOT_MAX;
+  diskfs_node_disknode (node)->info.i_flags |= EXT2_EXTENTS_FL;
+}
@@ -63,7 +63,7 @@ ext2_discard_prealloc (struct node *node)
 /* Allocate a new block for the file NODE, as close to block GOAL as
    possible, and return it, or 0 if none could be had.  If ZERO is true, then
    zero the block (and add it to NODE's list of modified indirect blocks).  */
-static block_t
+block_t
 ext2_alloc_block (struct node *node, block_t goal, int zero)
 {
 #ifdef EXT2FS_DEBUG
@@ -86,17 +86,25 @@ ext2_alloc_block (struct node *node, block_t goal, int zero)
       ext2_debug ("preallocation miss (%lu/%lu)",
 		  alloc_hits, ++alloc_attempts);
       ext2_discard_prealloc (node);
-      result = ext2_new_block
-	(goal,
-	 S_ISREG (node->dn_stat.st_mode)
-	 ? (sblock->s_prealloc_blocks ?: EXT2_DEFAULT_PREALLOC_BLOCKS)
-	 : (S_ISDIR (node->dn_stat.st_mode)
-	    && EXT2_HAS_COMPAT_FEATURE(sblock,
-				       EXT2_FEATURE_COMPAT_DIR_PREALLOC))
-	 ? sblock->s_prealloc_dir_blocks
-	 : 0,
-	 &diskfs_node_disknode (node)->info.i_prealloc_count,
-	 &diskfs_node_disknode (node)->info.i_prealloc_block);
+      if (diskfs_node_disknode (node)->delalloc_reserved)
+	/* Writing back delayed blocks; use the space set aside for them.  */
+	{
+	  block_t count;
+	  result = ext2_new_blocks
+	    (goal, 1, &count, &diskfs_node_disknode (node)->delalloc_reserved);
+	}
+      else
+	result = ext2_new_block
+	  (goal,
+	   S_ISREG (node->dn_stat.st_mode)
+	   ? (sblock->s_prealloc_blocks ?: EXT2_DEFAULT_PREALLOC_BLOCKS)
+	   : (S_ISDIR (node->dn_stat.st_mode)
+	      && EXT2_HAS_COMPAT_FEATURE(sblock,
+					 EXT2_FEATURE_COMPAT_DIR_PREALLOC))
+	   ? sblock->s_prealloc_dir_blocks
+	   : 0,
+	   &diskfs_node_disknode (node)->info.i_prealloc_count,
+	   &diskfs_node_disknode (node)->info.i_prealloc_block);
     }
 #else
   result = ext2_new_block (goal, 0, 0);
@@ -237,38 +245,192 @@ block_getblk (struct node *node, block_t block, int nr, int create, int zero,
   return 0;
 }
 
-/* Returns in DISK_BLOCK the disk block corresponding to BLOCK in NODE.
-   If there is no such block yet, but CREATE is true, then it is created,
-   otherwise EINVAL is returned.  */
-error_t
-ext2_getblk (struct node *node, block_t block, int create, block_t *disk_block)
+/* Each node remembers the runs of blocks it last looked up, so that
+   most lookups of a file read sequentially do not need to walk its
+   indirect blocks or extent tree.  A cached run stays valid until the
+   file is truncated, since allocating blocks never moves those already
+   mapped; only cached holes are affected, and dropped, by allocations.
+   Lookups done without ALLOC_LOCK can race with allocations; so that
+   such a lookup does not remember a hole that has just been filled,
+   every invalidation bumps BMAP_CACHE_GEN, and runs found under an older
+   generation are not added.  */
+
+static unsigned long bmap_cache_hits, bmap_cache_misses;
+
+/* If BLOCK of NODE is in its block map cache, return its disk block, or 0
+   for a hole, in *DISK_BLOCK, and if COUNT is not NULL, how many blocks
+   from BLOCK on are in the same run in *COUNT, and return true.  */
+static int
+bmap_cache_lookup (struct node *node, block_t block, block_t *disk_block,
+		   block_t *count)
+{
+  struct disknode *dn = diskfs_node_disknode (node);
+  struct bmap_cache_entry *e;
+  int found = 0;
+
+  pthread_spin_lock (&dn->bmap_cache_lock);
+  for (e = dn->bmap_cache; e < dn->bmap_cache + BMAP_CACHE_SIZE; e++)
+    if (block - e->block < e->len)
+      {
+	*disk_block = e->start ? e->start + (block - e->block) : 0;
+	if (count)
+	  *count = e->len - (block - e->block);
+	found = 1;
+	break;
+      }
+  pthread_spin_unlock (&dn->bmap_cache_lock);
+
+  return found;
+}
+
+unsigned int
+ext2_bmap_cache_gen (struct node *node)
+{
+  return __atomic_load_n (&diskfs_node_disknode (node)->bmap_cache_gen,
+			  __ATOMIC_ACQUIRE);
+}
+
+void
+ext2_bmap_cache_add (struct node *node, unsigned int gen,
+		     block_t block, block_t len, block_t start)
+{
+  struct disknode *dn = diskfs_node_disknode (node);
+  struct bmap_cache_entry *e;
+
+  pthread_spin_lock (&dn->bmap_cache_lock);
+  if (dn->bmap_cache_gen == gen)
+    {
+      e = &dn->bmap_cache[dn->bmap_cache_next++ % BMAP_CACHE_SIZE];
+      e->block = block;
+      e->len = len;
+      e->start = start;
+    }
+  pthread_spin_unlock (&dn->bmap_cache_lock);
+}
+
+/* Forget the cached hole of NODE that BLOCK, now allocated, was in.  */
+static void
+bmap_cache_fill_hole (struct node *node, block_t block)
+{
+  struct disknode *dn = diskfs_node_disknode (node);
+  struct bmap_cache_entry *e;
+
+  pthread_spin_lock (&dn->bmap_cache_lock);
+  for (e = dn->bmap_cache; e < dn->bmap_cache + BMAP_CACHE_SIZE; e++)
+    if (e->start == 0 && block - e->block < e->len)
+      e->len = 0;
+  __atomic_add_fetch (&dn->bmap_cache_gen, 1, __ATOMIC_RELEASE);
+  pthread_spin_unlock (&dn->bmap_cache_lock);
+}
+
+void
+ext2_bmap_cache_flush (struct node *node)
+{
+  struct disknode *dn = diskfs_node_disknode (node);
+  int i;
+
+  pthread_spin_lock (&dn->bmap_cache_lock);
+  for (i = 0; i < BMAP_CACHE_SIZE; i++)
+    dn->bmap_cache[i].len = 0;
+  __atomic_add_fetch (&dn->bmap_cache_gen, 1, __ATOMIC_RELEASE);
+  pthread_spin_unlock (&dn->bmap_cache_lock);
+}
+
+void
+ext2_bmap_cache_get_stats (unsigned long *hits, unsigned long *misses)
+{
+  *hits = __atomic_load_n (&bmap_cache_hits, __ATOMIC_RELAXED);
+  *misses = __atomic_load_n (&bmap_cache_misses, __ATOMIC_RELAXED);
+}
+
+/* Look up BLOCK of NODE, which is mapped by indirect blocks, without
+   allocating anything, and add the run of blocks around it to the block
+   map cache of NODE: the neighbours pointed to by the same indirect
+   block that are contiguous on disk, or, for a hole, the neighbouring
+   null pointers.  */
+static error_t
+indir_lookup (struct node *node, block_t block, block_t *disk_block)
 {
-  error_t err;
-  block_t indir, b;
   unsigned long addr_per_block = EXT2_ADDR_PER_BLOCK (sblock);
+  unsigned int gen = ext2_bmap_cache_gen (node);
+  block_t *ptrs = diskfs_node_disknode (node)->info.i_data;
+  block_t *bh = NULL;
+  /* PTRS[NR] is one of SIZE pointers, each of which maps SPAN blocks,
+     the first of them mapping the blocks from FIRST on.  */
+  unsigned long long first, span;
+  int nr, size, lo, hi;
 
-  if (block > EXT2_NDIR_BLOCKS + addr_per_block +
-      addr_per_block * addr_per_block +
-      addr_per_block * addr_per_block * addr_per_block)
+  if (block < EXT2_NDIR_BLOCKS)
     {
-      ext2_warning ("block > big: %u", block);
-      return EIO;
+      first = 0;
+      span = 1;
+      nr = block;
+      size = EXT2_NDIR_BLOCKS;
+    }
+  else
+    {
+      first = EXT2_NDIR_BLOCKS;
+      span = addr_per_block;
+      nr = EXT2_IND_BLOCK;
+      while (block - first >= span)
+	{
+	  first += span;
+	  span *= addr_per_block;
+	  nr++;
+	}
+      /* The block is in the tree rooted at I_DATA[NR] alone.  */
+      ptrs += nr;
+      nr = 0;
+      size = 1;
     }
-  /*
-     * If this is a sequential block allocation, set the next_alloc_block
-     * to this block now so that all the indblock and data block
-     * allocations use the same goal zone
-   */
 
-  ext2_debug ("block = %u, next = %u, goal = %u", block,
-	      diskfs_node_disknode (node)->info.i_next_alloc_block,
-	      diskfs_node_disknode (node)->info.i_next_alloc_goal);
+  while (ptrs[nr] && span > 1)
+    {
+      block_t *child = disk_cache_block_ref (ptrs[nr]);
+
+      if (bh)
+	disk_cache_block_deref (bh);
+      bh = ptrs = child;
+      first += nr * span;
+      span /= addr_per_block;
+      nr = (block - first) / span;
+      size = addr_per_block;
+    }
 
-  if (block == diskfs_node_disknode (node)->info.i_next_alloc_block + 1)
+  *disk_block = ptrs[nr];
+  lo = nr;
+  hi = nr + 1;
+  if (*disk_block)
     {
-      diskfs_node_disknode (node)->info.i_next_alloc_block++;
-      diskfs_node_disknode (node)->info.i_next_alloc_goal++;
+      while (lo > 0 && ptrs[lo - 1] && ptrs[lo - 1] == ptrs[lo] - 1)
+	lo--;
+      while (hi < size && ptrs[hi] && ptrs[hi] == ptrs[hi - 1] + 1)
+	hi++;
     }
+  else
+    {
+      while (lo > 0 && ! ptrs[lo - 1])
+	lo--;
+      while (hi < size && ! ptrs[hi])
+	hi++;
+    }
+  ext2_bmap_cache_add (node, gen, first + lo * span, (hi - lo) * span,
+		       ptrs[lo]);
+
+  if (bh)
+    disk_cache_block_deref (bh);
+
+  return *disk_block ? 0 : EINVAL;
+}
+
+/* Like ext2_getblk, for NODE mapped by indirect blocks.  */
+static error_t
+indir_getblk (struct node *node, block_t block, int create,
+	      block_t *disk_block)
+{
+  error_t err;
+  block_t indir, b;
+  unsigned long addr_per_block = EXT2_ADDR_PER_BLOCK (sblock);
 
   b = block;
 
@@ -313,3 +475,81 @@ ext2_getblk (struct node *node, block_t block, int create, block_t *disk_block)
 
   return err;
 }
+
+/* Returns in DISK_BLOCK the disk block corresponding to BLOCK in NODE.
+   If there is no such block yet, but CREATE is true, then it is created,
+   otherwise EINVAL is returned.  */
+error_t
+ext2_getblk (struct node *node, block_t block, int create, block_t *disk_block)
+{
+  error_t err;
+  unsigned long addr_per_block = EXT2_ADDR_PER_BLOCK (sblock);
+
+  /*
+     * If this is a sequential block allocation, set the next_alloc_block
+     * to this block now so that all the indblock and data block
+     * allocations use the same goal zone
+   */
+
+  ext2_debug ("block = %u, next = %u, goal = %u", block,
+	      diskfs_node_disknode (node)->info.i_next_alloc_block,
+	      diskfs_node_disknode (node)->info.i_next_alloc_goal);
+
+  if (block == diskfs_node_disknode (node)->info.i_next_alloc_block + 1)
+    {
+      diskfs_node_disknode (node)->info.i_next_alloc_block++;
+      diskfs_node_disknode (node)->info.i_next_alloc_goal++;
+    }
+
+  if (bmap_cache_lookup (node, block, disk_block, NULL)
+      && (*disk_block || ! create))
+    {
+      __atomic_add_fetch (&bmap_cache_hits, 1, __ATOMIC_RELAXED);
+      return *disk_block ? 0 : EINVAL;
+    }
+  __atomic_add_fetch (&bmap_cache_misses, 1, __ATOMIC_RELAXED);
+
+  if (diskfs_node_disknode (node)->info.i_flags & EXT2_EXTENTS_FL)
+    err = ext2_extent_getblk (node, block, create, disk_block);
+  else if (block >= EXT2_NDIR_BLOCKS + addr_per_block +
+	   addr_per_block * addr_per_block +
+	   addr_per_block * addr_per_block * addr_per_block)
+    {
+      ext2_warning ("block > big: %u", block);
+      return EIO;
+    }
+  else if (! create)
+    return indir_lookup (node, block, disk_block);
+  else
+    err = indir_getblk (node, block, create, disk_block);
+
+  if (! err && create)
+    bmap_cache_fill_hole (node, block);
+
+  return err;
+}
+
+error_t
+ext2_getblk_run (struct node *node, block_t block, block_t *disk_block,
+		 block_t *count)
+{
+  error_t err;
+
+  if (bmap_cache_lookup (node, block, disk_block, count))
+    {
+      __atomic_add_fetch (&bmap_cache_hits, 1, __ATOMIC_RELAXED);
+      return 0;
+    }
+
+  err = ext2_getblk (node, block, 0, disk_block);
+  if (err == EINVAL)
+    {
+      *disk_block = 0;
+      err = 0;
+    }
+  if (! err && ! bmap_cache_lookup (node, block, disk_block, count))
+    /* The run was invalidated by a concurrent allocation.  */
+    *count = 1;
+
+  return err;
+}
@@ -0,0 +1,738 @@
+/* Hashed directory indexes
+
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+
+/* The index format and the hash functions are the ones of Linux
+   ("htree"), so that indexes built by either can be used by the
+   other, and checked by e2fsck.  See <ext2_fs.h> for the layout.  */
+
+#include "ext2fs.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#define DX_TEA_DELTA	0x9E3779B9
+
+/* The TEA block cipher, used as a hash function.  */
+static void
+dx_tea_transform (uint32_t buf[4], const uint32_t in[4])
+{
+  uint32_t sum = 0;
+  uint32_t b0 = buf[0], b1 = buf[1];
+  uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+  int n = 16;
+
+  do
+    {
+      sum += DX_TEA_DELTA;
+      b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+      b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    }
+  while (--n);
+
+  buf[0] += b0;
+  buf[1] += b1;
+}
+
+/* The basic MD4 functions: selection, majority and parity.  */
+#define DX_F(x, y, z)	((z) ^ ((x) & ((y) ^ (z))))
+#define DX_G(x, y, z)	(((x) & (y)) + (((x) ^ (y)) & (z)))
+#define DX_H(x, y, z)	((x) ^ (y) ^ (z))
+
+#define DX_ROUND(f, a, b, c, d, x, s)					      \
+  ((a) += f ((b), (c), (d)) + (x), (a) = ((a) << (s)) | ((a) >> (32 - (s))))
+#define DX_K1	0
+#define DX_K2	013240474631UL
+#define DX_K3	015666365641UL
+
+/* Half of the MD4 transformation, cut down to three rounds of eight
+   steps.  */
+static void
+dx_half_md4_transform (uint32_t buf[4], const uint32_t in[8])
+{
+  uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+  DX_ROUND (DX_F, a, b, c, d, in[0] + DX_K1, 3);
+  DX_ROUND (DX_F, d, a, b, c, in[1] + DX_K1, 7);
+  DX_ROUND (DX_F, c, d, a, b, in[2] + DX_K1, 11);
+  DX_ROUND (DX_F, b, c, d, a, in[3] + DX_K1, 19);
+  DX_ROUND (DX_F, a, b, c, d, in[4] + DX_K1, 3);
+  DX_ROUND (DX_F, d, a, b, c, in[5] + DX_K1, 7);
+  DX_ROUND (DX_F, c, d, a, b, in[6] + DX_K1, 11);
+  DX_ROUND (DX_F, b, c, d, a, in[7] + DX_K1, 19);
+
+  DX_ROUND (DX_G, a, b, c, d, in[1] + DX_K2, 3);
+  DX_ROUND (DX_G, d, a, b, c, in[3] + DX_K2, 5);
+  DX_ROUND (DX_G, c, d, a, b, in[5] + DX_K2, 9);
+  DX_ROUND (DX_G, b, c, d, a, in[7] + DX_K2, 13);
+  DX_ROUND (DX_G, a, b, c, d, in[0] + DX_K2, 3);
+  DX_ROUND (DX_G, d, a, b, c, in[2] + DX_K2, 5);
+  DX_ROUND (DX_G, c, d, a, b, in[4] + DX_K2, 9);
+  DX_ROUND (DX_G, b, c, d, a, in[6] + DX_K2, 13);
+
+  DX_ROUND (DX_H, a, b, c, d, in[3] + DX_K3, 3);
+  DX_ROUND (DX_H, d, a, b, c, in[7] + DX_K3, 9);
+  DX_ROUND (DX_H, c, d, a, b, in[2] + DX_K3, 11);
+  DX_ROUND (DX_H, b, c, d, a, in[6] + DX_K3, 15);
+  DX_ROUND (DX_H, a, b, c, d, in[1] + DX_K3, 3);
+  DX_ROUND (DX_H, d, a, b, c, in[5] + DX_K3, 9);
+  DX_ROUND (DX_H, c, d, a, b, in[0] + DX_K3, 11);
+  DX_ROUND (DX_H, b, c, d, a, in[4] + DX_K3, 15);
+
+  buf[0] += a;
+  buf[1] += b;
+  buf[2] += c;
+  buf[3] += d;
+}
+
+/* The hash function of the first indexes.  */
+static uint32_t
+dx_legacy_hash (const char *name, int len, int unsigned_chars)
+{
+  uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+  int c;
+
+  while (len--)
+    {
+      c = unsigned_chars ? (unsigned char) *name : (signed char) *name;
+      name++;
+      hash = hash1 + (hash0 ^ (c * 7152373));
+      if (hash & 0x80000000)
+	hash -= 0x7fffffff;
+      hash1 = hash0;
+      hash0 = hash;
+    }
+
+  return hash0 << 1;
+}
+
+/* Fill the NUM words of BUF with the first characters of the LEN
+   characters at MSG, padding it with a value depending on LEN.  */
+static void
+dx_str2hashbuf (const char *msg, int len, uint32_t *buf, int num,
+		int unsigned_chars)
+{
+  uint32_t pad, val;
+  int i, c;
+
+  pad = (uint32_t) len | ((uint32_t) len << 8);
+  pad |= pad << 16;
+
+  val = pad;
+  if (len > num * 4)
+    len = num * 4;
+  for (i = 0; i < len; i++)
+    {
+      c = unsigned_chars ? (unsigned char) msg[i] : (signed char) msg[i];
+      val = c + (val << 8);
+      if ((i % 4) == 3)
+	{
+	  *buf++ = val;
+	  val = pad;
+	  num--;
+	}
+    }
+  if (--num >= 0)
+    *buf++ = val;
+  while (--num >= 0)
+    *buf++ = pad;
+}
+
+uint32_t
+ext2_dirhash (const char *name, size_t namelen, int version)
+{
+  uint32_t buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+  uint32_t in[8];
+  uint32_t hash;
+  int len = namelen;
+  int unsigned_chars = 0;
+  int i;
+
+  for (i = 0; i < 4; i++)
+    if (sblock->s_hash_seed[i])
+      {
+	memcpy (buf, sblock->s_hash_seed, sizeof buf);
+	break;
+      }
+
+  switch (version)
+    {
+    case EXT2_DX_HASH_LEGACY_UNSIGNED:
+      unsigned_chars = 1;
+      /* Fall through.  */
+    case EXT2_DX_HASH_LEGACY:
+      hash = dx_legacy_hash (name, len, unsigned_chars);
+      break;
+
+    case EXT2_DX_HASH_HALF_MD4_UNSIGNED:
+      unsigned_chars = 1;
+      /* Fall through.  */
+    case EXT2_DX_HASH_HALF_MD4:
+      for (; len > 0; len -= 32, name += 32)
+	{
+	  dx_str2hashbuf (name, len, in, 8, unsigned_chars);
+	  dx_half_md4_transform (buf, in);
+	}
+      hash = buf[1];
+      break;
+
+    case EXT2_DX_HASH_TEA_UNSIGNED:
+      unsigned_chars = 1;
+      /* Fall through.  */
+    case EXT2_DX_HASH_TEA:
+      for (; len > 0; len -= 16, name += 16)
+	{
+	  dx_str2hashbuf (name, len, in, 4, unsigned_chars);
+	  dx_tea_transform (buf, in);
+	}
+      hash = buf[0];
+      break;
+
+    default:
+      assert (! "unknown directory hash version");
+      hash = 0;
+    }
+
+  /* The low bit is used in the index to mark hash collisions across
+     leaf blocks, and the largest value marks the end of the directory
+     for Linux' readdir.  */
+  hash &= ~1;
+  if (hash == 0x7fffffff << 1)
+    hash = (0x7fffffff - 1) << 1;
+  return hash;
+}
+
+int
+ext2_dir_is_indexed (struct node *dp)
+{
+  return ((diskfs_node_disknode (dp)->info.i_flags & EXT2_INDEX_FL)
+	  && EXT2_HAS_COMPAT_FEATURE (sblock, EXT2_FEATURE_COMPAT_DIR_INDEX));
+}
+
+static inline struct ext2_dx_countlimit *
+dx_countlimit (struct ext2_dx_entry *entries)
+{
+  return (struct ext2_dx_countlimit *) entries;
+}
+
+static inline block_t
+dx_block (struct ext2_dx_entry *entry)
+{
+  return entry->block & 0x0fffffff;
+}
+
+static inline unsigned int
+dx_root_limit (int info_length)
+{
+  return ((block_size - EXT2_DX_ROOT_INFO_OFFSET - info_length)
+	  / sizeof (struct ext2_dx_entry));
+}
+
+static inline unsigned int
+dx_node_limit (void)
+{
+  return (block_size - EXT2_DX_NODE_OFFSET) / sizeof (struct ext2_dx_entry);
+}
+
+/* Return the hash function to use for the index with root INFO.  */
+static int
+dx_hash_version (struct ext2_dx_root_info *info)
+{
+  int version = info->hash_version;
+
+  /* Linux uses the signedness of char of the machine that created the
+     file system, which it records in the superblock.  */
+  if (version <= EXT2_DX_HASH_TEA
+      && (sblock->s_flags & EXT2_FLAGS_UNSIGNED_HASH))
+    version += EXT2_DX_HASH_LEGACY_UNSIGNED;
+  return version;
+}
+
+/* Return the entries of the index block of directory DP mapped at BUF
+   that ENTRY points to, or NULL if they are corrupt.  */
+static struct ext2_dx_entry *
+dx_node (struct node *dp, vm_address_t buf, struct ext2_dx_entry *entry)
+{
+  block_t block = dx_block (entry);
+  struct ext2_dx_entry *entries;
+
+  if (block == 0 || block >= dp->dn_stat.st_size / block_size)
+    goto bad;
+
+  entries = (void *) (buf + block * block_size + EXT2_DX_NODE_OFFSET);
+  if (dx_countlimit (entries)->limit != dx_node_limit ()
+      || dx_countlimit (entries)->count == 0
+      || dx_countlimit (entries)->count > dx_node_limit ())
+    goto bad;
+
+  return entries;
+
+ bad:
+  ext2_warning ("bad directory index block: inode: %Ld block: %u",
+		dp->cache_id, block);
+  return NULL;
+}
+
+error_t
+ext2_dx_probe (struct node *dp, vm_address_t buf, const char *name,
+	       size_t namelen, struct ext2_dx_path *path, block_t *leaf)
+{
+  struct ext2_dx_root_info *info
+    = (void *) (buf + EXT2_DX_ROOT_INFO_OFFSET);
+  struct ext2_dx_entry *entries, *p, *q, *m;
+  unsigned int count;
+  int level;
+
+  path->levels = 0;
+
+  /* "." and ".." are in the first block.  */
+  if (name[0] == '.' && (namelen == 1 || (namelen == 2 && name[1] == '.')))
+    {
+      *leaf = 0;
+      return 0;
+    }
+
+  if (dp->dn_stat.st_size < 2 * block_size
+      || info->reserved_zero != 0
+      || info->hash_version > EXT2_DX_HASH_TEA
+      || info->info_length < sizeof *info
+      || info->info_length > block_size / 2
+      || info->indirect_levels > EXT2_DX_MAX_INDIRECT_LEVELS
+      || (info->unused_flags & 1))
+    {
+      ext2_warning ("bad directory index root: inode: %Ld", dp->cache_id);
+      return EIO;
+    }
+
+  path->version = dx_hash_version (info);
+  path->hash = ext2_dirhash (name, namelen, path->version);
+
+  entries = (void *) ((char *) info + info->info_length);
+  count = dx_countlimit (entries)->count;
+  if (dx_countlimit (entries)->limit != dx_root_limit (info->info_length)
+      || count == 0 || count > dx_root_limit (info->info_length))
+    {
+      ext2_warning ("bad directory index root: inode: %Ld", dp->cache_id);
+      return EIO;
+    }
+
+  for (level = 0; ; level++)
+    {
+      /* Find the last entry whose hash is not larger than the one of
+	 NAME.  The first entry stands for all hashes below the second
+	 one, so its hash is not stored.  */
+      count = dx_countlimit (entries)->count;
+      p = entries + 1;
+      q = entries + count - 1;
+      while (p <= q)
+	{
+	  m = p + (q - p) / 2;
+	  if (m->hash > path->hash)
+	    q = m - 1;
+	  else
+	    p = m + 1;
+	}
+
+      path->frames[level].entries = entries;
+      path->frames[level].at = p - 1;
+      path->levels = level + 1;
+
+      if (level == info->indirect_levels)
+	break;
+
+      entries = dx_node (dp, buf, p - 1);
+      if (! entries)
+	return EIO;
+    }
+
+  *leaf = dx_block (path->frames[level].at);
+  if (*leaf == 0 || *leaf >= dp->dn_stat.st_size / block_size)
+    {
+      ext2_warning ("bad directory index leaf: inode: %Ld block: %u",
+		    dp->cache_id, *leaf);
+      return EIO;
+    }
+
+  return 0;
+}
+
+int
+ext2_dx_next_leaf (struct node *dp, vm_address_t buf,
+		   struct ext2_dx_path *path, block_t *leaf)
+{
+  struct ext2_dx_frame *frame;
+  struct ext2_dx_entry *entries;
+  int level;
+
+  /* Find the deepest level with entries left.  */
+  for (level = path->levels - 1; level >= 0; level--)
+    {
+      frame = &path->frames[level];
+      if (frame->at + 1
+	  < frame->entries + dx_countlimit (frame->entries)->count)
+	break;
+    }
+  if (level < 0)
+    return 0;
+
+  /* Names with the same hash continue in the next block only if its
+     hash has the collision bit set.  */
+  if ((frame->at[1].hash & ~1) != path->hash)
+    return 0;
+  frame->at++;
+
+  /* Go down the first entries of the levels below.  */
+  for (; level < path->levels - 1; level++)
+    {
+      entries = dx_node (dp, buf, path->frames[level].at);
+      if (! entries)
+	return 0;
+      path->frames[level + 1].entries = entries;
+      path->frames[level + 1].at = entries;
+    }
+
+  *leaf = dx_block (path->frames[level].at);
+  return *leaf != 0 && *leaf < dp->dn_stat.st_size / block_size;
+}
+
+/* Append an empty block to directory DP, mapped at BUF, and return its
+   index in *BLOCK.  The mapping must extend beyond the end of DP.  */
+static error_t
+dx_append_block (struct node *dp, vm_address_t buf, struct protid *cred,
+		 block_t *block)
+{
+  off_t size = dp->dn_stat.st_size;
+  struct ext2_dir_entry_2 *entry;
+  error_t err;
+
+  while (size + block_size > dp->allocsize)
+    {
+      err = diskfs_grow (dp, size + block_size, cred);
+      if (err)
+	return err;
+    }
+
+  entry = (void *) (buf + size);
+  entry->inode = 0;
+  entry->rec_len = block_size;
+  entry->name_len = 0;
+  entry->file_type = 0;
+
+  dp->dn_stat.st_size = size + block_size;
+  dp->dn_set_ctime = 1;
+  *block = size / block_size;
+  return 0;
+}
+
+/* Insert an entry for BLOCK, whose hashes start at HASH, after the one
+   FRAME points to.  */
+static void
+dx_insert (struct ext2_dx_frame *frame, uint32_t hash, block_t block)
+{
+  struct ext2_dx_countlimit *countlimit = dx_countlimit (frame->entries);
+  struct ext2_dx_entry *new = frame->at + 1;
+
+  assert (countlimit->count < countlimit->limit);
+  memmove (new + 1, new,
+	   (frame->entries + countlimit->count - new) * sizeof *new);
+  new->hash = hash;
+  new->block = block;
+  countlimit->count++;
+}
+
+/* Return whether ENTRY, at OFFSET in a directory block, is sane.  */
+static int
+dx_entry_ok (struct ext2_dir_entry_2 *entry, size_t offset)
+{
+  return (entry->rec_len >= EXT2_DIR_REC_LEN (0)
+	  && entry->rec_len % EXT2_DIR_PAD == 0
+	  && offset + entry->rec_len <= block_size
+	  && EXT2_DIR_REC_LEN (entry->name_len) <= entry->rec_len);
+}
+
+/* Move the used entries of directory block BLOCK to its start.  */
+static void
+dx_pack (char *block)
+{
+  struct ext2_dir_entry_2 *entry, *last = NULL;
+  char *from, *to = block;
+  size_t rec_len, len;
+
+  for (from = block; from < block + block_size; from += rec_len)
+    {
+      entry = (void *) from;
+      rec_len = entry->rec_len;
+      if (entry->inode)
+	{
+	  len = EXT2_DIR_REC_LEN (entry->name_len);
+	  memmove (to, from, len);
+	  last = (void *) to;
+	  last->rec_len = len;
+	  to += len;
+	}
+    }
+
+  assert (last);
+  last->rec_len += block + block_size - to;
+}
+
+struct dx_map_entry
+{
+  uint32_t hash;
+  uint16_t offset;
+  uint16_t len;
+};
+
+static int
+dx_map_cmp (const void *a, const void *b)
+{
+  const struct dx_map_entry *x = a, *y = b;
+
+  if (x->hash != y->hash)
+    return x->hash < y->hash ? -1 : 1;
+  return x->offset - y->offset;
+}
+
+/* Move the entries with the larger hashes out of leaf block *LEAF of
+   the index of DP, mapped at BUF, into a new block, which is entered
+   into the index after the one the last frame of PATH points to.  Set
+   *LEAF to the block the name of PATH belongs to.  */
+static error_t
+dx_split_leaf (struct node *dp, vm_address_t buf, struct ext2_dx_path *path,
+	       block_t *leaf, struct protid *cred)
+{
+  char *old = (char *) buf + *leaf * block_size;
+  struct dx_map_entry map[block_size / EXT2_DIR_REC_LEN (1)];
+  struct ext2_dir_entry_2 *entry, *last;
+  size_t offset, len;
+  int count, split, i, continued;
+  uint32_t hash2;
+  block_t newblock;
+  char *new, *to;
+  error_t err;
+
+  count = 0;
+  for (offset = 0; offset < block_size; offset += entry->rec_len)
+    {
+      entry = (void *) (old + offset);
+      if (! dx_entry_ok (entry, offset))
+	{
+	  ext2_warning ("bad directory entry: inode: %Ld offset: %zu",
+			dp->cache_id, *leaf * block_size + offset);
+	  return EIO;
+	}
+      if (entry->inode)
+	{
+	  map[count].hash = ext2_dirhash (entry->name, entry->name_len,
+					  path->version);
+	  map[count].offset = offset;
+	  map[count].len = EXT2_DIR_REC_LEN (entry->name_len);
+	  count++;
+	}
+    }
+  if (count < 2)
+    return EIO;
+
+  qsort (map, count, sizeof *map, dx_map_cmp);
+
+  /* Split the block in the middle, size-wise.  */
+  len = 0;
+  for (i = count - 1; i > 0; i--)
+    {
+      if (len + map[i].len / 2 > block_size / 2)
+	break;
+      len += map[i].len;
+    }
+  split = i + 1;
+  if (split == count)
+    split--;
+  hash2 = map[split].hash;
+  continued = hash2 == map[split - 1].hash;
+
+  err = dx_append_block (dp, buf, cred, &newblock);
+  if (err)
+    return err;
+  new = (char *) buf + newblock * block_size;
+
+  to = new;
+  last = NULL;
+  for (i = split; i < count; i++)
+    {
+      entry = (void *) (old + map[i].offset);
+      memcpy (to, entry, map[i].len);
+      last = (void *) to;
+      last->rec_len = map[i].len;
+      to += map[i].len;
+      entry->inode = 0;
+    }
+  last->rec_len += new + block_size - to;
+  dx_pack (old);
+
+  dx_insert (&path->frames[path->levels - 1], hash2 + continued, newblock);
+  if (path->hash >= hash2)
+    *leaf = newblock;
+  return 0;
+}
+
+error_t
+ext2_dx_split (struct node *dp, vm_address_t buf, struct ext2_dx_path *path,
+	       block_t *leaf, struct protid *cred)
+{
+  struct ext2_dx_frame *frame = &path->frames[path->levels - 1];
+  struct ext2_dx_countlimit *countlimit = dx_countlimit (frame->entries);
+  struct ext2_dx_countlimit *rootcountlimit
+    = dx_countlimit (path->frames[0].entries);
+  struct ext2_dx_entry *entries2;
+  block_t block2;
+  error_t err;
+
+  assert (path->levels > 0);
+
+  if (countlimit->count == countlimit->limit)
+    /* There is no room in the index block for the new leaf.  */
+    {
+      if (path->levels > 1 && rootcountlimit->count == rootcountlimit->limit)
+	{
+	  ext2_warning ("directory index full: inode: %Ld", dp->cache_id);
+	  return ENOSPC;
+	}
+
+      err = dx_append_block (dp, buf, cred, &block2);
+      if (err)
+	return err;
+      entries2 = (void *) (buf + block2 * block_size + EXT2_DX_NODE_OFFSET);
+
+      if (path->levels > 1)
+	/* Move the upper half of the index block into the new one, and
+	   enter that into the root.  */
+	{
+	  unsigned int count1 = countlimit->count / 2;
+	  unsigned int count2 = countlimit->count - count1;
+	  uint32_t hash2 = frame->entries[count1].hash;
+
+	  memcpy (entries2, frame->entries + count1,
+		  count2 * sizeof *entries2);
+	  countlimit->count = count1;
+	  dx_countlimit (entries2)->limit = dx_node_limit ();
+	  dx_countlimit (entries2)->count = count2;
+
+	  dx_insert (&path->frames[0], hash2, block2);
+	  if (frame->at >= frame->entries + count1)
+	    {
+	      frame->at = entries2 + (frame->at - frame->entries - count1);
+	      frame->entries = entries2;
+	      path->frames[0].at++;
+	    }
+	}
+      else
+	/* Add a level to the index, by moving all the entries of the
+	   root into the new block.  */
+	{
+	  struct ext2_dx_root_info *info
+	    = (void *) (buf + EXT2_DX_ROOT_INFO_OFFSET);
+
+	  memcpy (entries2, frame->entries,
+		  countlimit->count * sizeof *entries2);
+	  dx_countlimit (entries2)->limit = dx_node_limit ();
+
+	  countlimit->count = 1;
+	  frame->entries[0].block = block2;
+	  info->indirect_levels = 1;
+
+	  path->frames[1].entries = entries2;
+	  path->frames[1].at = entries2 + (frame->at - frame->entries);
+	  frame->at = frame->entries;
+	  path->levels = 2;
+	}
+    }
+
+  return dx_split_leaf (dp, buf, path, leaf, cred);
+}
+
+error_t
+ext2_dx_make_indexed (struct node *dp, vm_address_t buf,
+		      const char *name, size_t namelen,
+		      struct ext2_dx_path *path, block_t *leaf,
+		      struct protid *cred)
+{
+  struct ext2_dir_entry_2 *dot = (void *) buf;
+  struct ext2_dir_entry_2 *dotdot = (void *) (buf + EXT2_DIR_REC_LEN (1));
+  struct ext2_dx_root_info *info = (void *) (buf + EXT2_DX_ROOT_INFO_OFFSET);
+  struct ext2_dx_entry *entries;
+  struct ext2_dir_entry_2 *entry;
+  size_t start, offset;
+  block_t block;
+  char *data;
+  error_t err;
+
+  /* The root of the index takes the place of the entries following
+     "." and "..", so these must be at the start of the block.  */
+  if (dp->dn_stat.st_size != block_size
+      || sblock->s_def_hash_version > EXT2_DX_HASH_TEA
+      || dot->rec_len != EXT2_DIR_REC_LEN (1)
+      || dot->name_len != 1 || dot->name[0] != '.'
+      || dotdot->name_len != 2 || dotdot->name[0] != '.'
+      || dotdot->name[1] != '.'
+      || dotdot->rec_len < EXT2_DIR_REC_LEN (2)
+      || dotdot->rec_len % EXT2_DIR_PAD != 0
+      || EXT2_DIR_REC_LEN (1) + dotdot->rec_len >= block_size)
+    return EINVAL;
+
+  start = EXT2_DIR_REC_LEN (1) + dotdot->rec_len;
+  for (offset = start; offset < block_size; offset += entry->rec_len)
+    {
+      entry = (void *) (buf + offset);
+      if (! dx_entry_ok (entry, offset))
+	return EINVAL;
+    }
+
+  /* Move the other entries into a new block.  */
+  err = dx_append_block (dp, buf, cred, &block);
+  if (err)
+    return err;
+  assert (block == 1);
+
+  data = (char *) buf + block_size;
+  memcpy (data, (char *) buf + start, block_size - start);
+  for (offset = 0; ; offset += entry->rec_len)
+    {
+      entry = (void *) (data + offset);
+      if (offset + entry->rec_len == block_size - start)
+	break;
+    }
+  entry->rec_len += start;
+
+  /* Turn the first block into the root of the index.  */
+  dotdot->rec_len = block_size - EXT2_DIR_REC_LEN (1);
+  memset (info, 0, sizeof *info);
+  info->hash_version = sblock->s_def_hash_version;
+  info->info_length = sizeof *info;
+  entries = (void *) (info + 1);
+  dx_countlimit (entries)->limit = dx_root_limit (sizeof *info);
+  dx_countlimit (entries)->count = 1;
+  entries[0].block = block;
+  diskfs_node_disknode (dp)->info.i_flags |= EXT2_INDEX_FL;
+
+  path->version = dx_hash_version (info);
+  path->hash = ext2_dirhash (name, namelen, path->version);
+  path->levels = 1;
+  path->frames[0].entries = entries;
+  path->frames[0].at = entries;
+
+  *leaf = block;
+  return dx_split_leaf (dp, buf, path, leaf, cred);
+}
@@ -17,6 +17,7 @@
    along with this program; if not, write to the Free Software
    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
 
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <error.h>
@@ -130,7 +131,11 @@ get_hypermetadata (void)
 			sblock->s_feature_ro_compat & ~EXT2_FEATURE_RO_COMPAT_SUPP);
 	  diskfs_readonly = 1;
 	}
-      if (sblock->s_inode_size != EXT2_GOOD_OLD_INODE_SIZE)
+      /* Only the first EXT2_GOOD_OLD_INODE_SIZE bytes of larger inodes
+	 are used.  */
+      if (sblock->s_inode_size < EXT2_GOOD_OLD_INODE_SIZE
+	  || sblock->s_inode_size > block_size
+	  || (sblock->s_inode_size & (sblock->s_inode_size - 1)))
 	ext2_panic ("inode size %d isn't supported", sblock->s_inode_size);
     }
 
@@ -157,6 +162,17 @@ get_hypermetadata (void)
 
   allocate_mod_map ();
 
+  /* The number of groups never changes while we run.  */
+  if (group_locks == NULL)
+    {
+      int i;
+
+      group_locks = malloc (groups_count * sizeof *group_locks);
+      assert (group_locks);
+      for (i = 0; i < groups_count; i++)
+	pthread_spin_init (&group_locks[i], PTHREAD_PROCESS_PRIVATE);
+    }
+
   /* A handy source of page-aligned zeros.  */
   if (zeroblock == 0)
     {
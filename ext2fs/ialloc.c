@@ -57,17 +57,15 @@ diskfs_free_node (struct node *np, mode_t old_mode)
   unsigned long bit;
   struct ext2_group_desc *gdp;
   ino_t inum = np->cache_id;
+  int freed = 1;
 
   assert (!diskfs_readonly);
 
   ext2_debug ("freeing inode %u", inum);
 
-  pthread_spin_lock (&global_lock);
-
   if (inum < EXT2_FIRST_INO (sblock) || inum > sblock->s_inodes_count)
     {
       ext2_error ("reserved inode or nonexistent inode: %Ld", inum);
-      pthread_spin_unlock (&global_lock);
       return;
     }
 
@@ -75,10 +73,16 @@ diskfs_free_node (struct node *np, mode_t old_mode)
   bit = (inum - 1) % sblock->s_inodes_per_group;
 
   gdp = group_desc (block_group);
+
+  pthread_spin_lock (&group_locks[block_group]);
+
   bh = disk_cache_block_ref (gdp->bg_inode_bitmap);
 
   if (!clear_bit (bit, bh))
-    ext2_warning ("bit already cleared for inode %Ld", inum);
+    {
+      ext2_warning ("bit already cleared for inode %Ld", inum);
+      freed = 0;
+    }
   else
     {
       disk_cache_block_ref_ptr (bh);
@@ -89,11 +93,13 @@ diskfs_free_node (struct node *np, mode_t old_mode)
 	gdp->bg_used_dirs_count--;
       disk_cache_block_ref_ptr (gdp);
       record_global_poke (gdp);
-
-      sblock->s_free_inodes_count++;
     }
 
   disk_cache_block_deref (bh);
+  pthread_spin_unlock (&group_locks[block_group]);
+
+  pthread_spin_lock (&global_lock);
+  sblock->s_free_inodes_count += freed;
   sblock_dirty = 1;
   pthread_spin_unlock (&global_lock);
   alloc_sync(0);
@@ -110,6 +116,10 @@ diskfs_free_node (struct node *np, mode_t old_mode)
  *
  * For other inodes, search forward from the parent directory\'s block
  * group to find a free inode.
+ *
+ * The group is chosen looking at the free counts without locks; only the
+ * chosen group is locked to allocate the inode, and if it has become full
+ * meanwhile, another is chosen.
  */
 ino_t
 ext2_alloc_inode (ino_t dir_inum, mode_t mode)
@@ -120,8 +130,6 @@ ext2_alloc_inode (ino_t dir_inum, mode_t mode)
   struct ext2_group_desc *gdp;
   struct ext2_group_desc *tmp;
 
-  pthread_spin_lock (&global_lock);
-
 repeat:
   assert (bh == NULL);
   gdp = NULL;
@@ -213,14 +221,19 @@ repeat:
     }
 
   if (!gdp)
+    return 0;
+
+  pthread_spin_lock (&group_locks[i]);
+
+  if (gdp->bg_free_inodes_count == 0)
     {
-      pthread_spin_unlock (&global_lock);
-      return 0;
+      /* Taken meanwhile.  */
+      pthread_spin_unlock (&group_locks[i]);
+      goto repeat;
     }
 
   bh = disk_cache_block_ref (gdp->bg_inode_bitmap);
-  if ((inum =
-       find_first_zero_bit ((unsigned long *) bh, sblock->s_inodes_per_group))
+  if ((inum = find_first_zero_bit (bh, sblock->s_inodes_per_group))
       < sblock->s_inodes_per_group)
     {
       if (set_bit (inum, bh))
@@ -228,22 +241,18 @@ repeat:
 	  ext2_warning ("bit already set for inode %llu", inum);
 	  disk_cache_block_deref (bh);
 	  bh = NULL;
+	  pthread_spin_unlock (&group_locks[i]);
 	  goto repeat;
 	}
-      record_global_poke (bh);
-      bh = NULL;
     }
   else
     {
       disk_cache_block_deref (bh);
       bh = NULL;
-      if (gdp->bg_free_inodes_count != 0)
-	{
-	  ext2_error ("free inodes count corrupted in group %d", i);
-	  inum = 0;
-	  goto sync_out;
-	}
-      goto repeat;
+      ext2_error ("free inodes count corrupted in group %d", i);
+      pthread_spin_unlock (&group_locks[i]);
+      inum = 0;
+      goto sync_out;
     }
 
   inum += i * sblock->s_inodes_per_group + 1;
@@ -251,29 +260,39 @@ repeat:
     {
       ext2_error ("reserved inode or inode > inodes count - "
 		  "block_group = %d,inode=%llu", i, inum);
+      clear_bit ((inum - 1) % sblock->s_inodes_per_group, bh);
+      disk_cache_block_deref (bh);
+      bh = NULL;
+      pthread_spin_unlock (&group_locks[i]);
       inum = 0;
       goto sync_out;
     }
 
+  record_global_poke (bh);
+  bh = NULL;
+
   gdp->bg_free_inodes_count--;
   if (S_ISDIR (mode))
     gdp->bg_used_dirs_count++;
   disk_cache_block_ref_ptr (gdp);
   record_global_poke (gdp);
 
+  pthread_spin_unlock (&group_locks[i]);
+
+  pthread_spin_lock (&global_lock);
   sblock->s_free_inodes_count--;
   sblock_dirty = 1;
+  pthread_spin_unlock (&global_lock);
 
  sync_out:
   assert (bh == NULL);
-  pthread_spin_unlock (&global_lock);
   alloc_sync (0);
 
   /* Make sure the coming read_node won't complain about bad
      fields.  */
   {
     struct ext2_inode *di = dino_ref (inum);
-    memset (di, 0, sizeof *di);
+    memset (di, 0, EXT2_INODE_SIZE (sblock));
     dino_deref (di);
   }
 
@@ -339,6 +358,12 @@ diskfs_alloc_node (struct node *dir, mode_t mode, struct node **node)
     ext2_mask_flags(mode,
 	       diskfs_node_disknode (dir)->info.i_flags & EXT2_FL_INHERITED);
 
+  /* Map the blocks of new files and directories by extents if the
+     filesystem has them, as Linux does.  */
+  if (EXT2_HAS_INCOMPAT_FEATURE (sblock, EXT2_FEATURE_INCOMPAT_EXTENTS)
+      && (S_ISREG (mode) || S_ISDIR (mode)))
+    ext2_extent_init (np);
+
   st->st_flags = 0;
 
   /*
@@ -367,8 +392,6 @@ ext2_count_free_inodes ()
   struct ext2_group_desc *gdp;
   int i;
 
-  pthread_spin_lock (&global_lock);
-
   desc_count = 0;
   bitmap_count = 0;
   gdp = NULL;
@@ -376,17 +399,18 @@ ext2_count_free_inodes ()
     {
       void *bh;
       gdp = group_desc (i);
+      pthread_spin_lock (&group_locks[i]);
       desc_count += gdp->bg_free_inodes_count;
       bh = disk_cache_block_ref (gdp->bg_inode_bitmap);
       x = count_free (bh, sblock->s_inodes_per_group / 8);
       disk_cache_block_deref (bh);
+      pthread_spin_unlock (&group_locks[i]);
       ext2_debug ("group %d: stored = %d, counted = %lu",
 		  i, gdp->bg_free_inodes_count, x);
       bitmap_count += x;
     }
   ext2_debug ("stored = %u, computed = %lu, %lu",
 	      sblock->s_free_inodes_count, desc_count, bitmap_count);
-  pthread_spin_unlock (&global_lock);
   return desc_count;
 #else
   return sblock->s_free_inodes_count;
@@ -402,8 +426,6 @@ ext2_check_inodes_bitmap ()
   struct ext2_group_desc *gdp;
   unsigned long desc_count, bitmap_count, x;
 
-  pthread_spin_lock (&global_lock);
-
   desc_count = 0;
   bitmap_count = 0;
   gdp = NULL;
@@ -411,6 +433,7 @@ ext2_check_inodes_bitmap ()
     {
       void *bh;
       gdp = group_desc (i);
+      pthread_spin_lock (&group_locks[i]);
       desc_count += gdp->bg_free_inodes_count;
       bh = disk_cache_block_ref (gdp->bg_inode_bitmap);
       x = count_free (bh, sblock->s_inodes_per_group / 8);
@@ -419,8 +442,10 @@ ext2_check_inodes_bitmap ()
 	ext2_error ("wrong free inodes count in group %d, "
 		    "stored = %d, counted = %lu",
 		    i, gdp->bg_free_inodes_count, x);
+      pthread_spin_unlock (&group_locks[i]);
       bitmap_count += x;
     }
+  pthread_spin_lock (&global_lock);
   if (sblock->s_free_inodes_count != bitmap_count)
     ext2_error ("wrong free inodes count in super block, "
 		"stored = %lu, counted = %lu",
@@ -59,6 +59,15 @@ diskfs_user_make_node (struct node **npp, struct lookup_context *ctx)
   dn->dirents = 0;
   dn->dir_idx = 0;
   dn->pager = 0;
+  dn->ra_next = 0;
+  dn->ra_window = 0;
+  pthread_spin_init (&dn->bmap_cache_lock, PTHREAD_PROCESS_PRIVATE);
+  memset (dn->bmap_cache, 0, sizeof dn->bmap_cache);
+  dn->bmap_cache_next = 0;
+  dn->bmap_cache_gen = 0;
+  hurd_ihash_init (&dn->delalloc_pages, HURD_IHASH_NO_LOCP);
+  dn->delalloc_blocks = 0;
+  dn->delalloc_reserved = 0;
   pthread_rwlock_init (&dn->alloc_lock, NULL);
   pokel_init (&dn->indir_pokel, diskfs_disk_pager, disk_cache);
 
@@ -75,6 +84,11 @@ diskfs_node_norefs (struct node *np)
     free (diskfs_node_disknode (np)->dirents);
   assert (!diskfs_node_disknode (np)->pager);
 
+  /* Pages still delayed were never written back; give their space
+     back.  */
+  delalloc_truncate (np, 0);
+  hurd_ihash_destroy (&diskfs_node_disknode (np)->delalloc_pages);
+
   /* Move any pending writes of indirect blocks.  */
   pokel_inherit (&global_pokel, &diskfs_node_disknode (np)->indir_pokel);
   pokel_finalize (&diskfs_node_disknode (np)->indir_pokel);
@@ -468,6 +482,7 @@ diskfs_node_reload (struct node *node)
   pokel_flush (&dn->indir_pokel);
   flush_node_pager (node);
   diskfs_user_read_node (node, NULL);
+  ext2_bmap_cache_flush (node);
 
   return 0;
 }
@@ -521,7 +536,7 @@ diskfs_set_statfs (struct statfs *st)
   st->f_type = FSTYPE_EXT2FS;
   st->f_bsize = block_size;
   st->f_blocks = sblock->s_blocks_count;
-  st->f_bfree = sblock->s_free_blocks_count;
+  st->f_bfree = sblock->s_free_blocks_count - ext2_count_reserved_blocks ();
   st->f_bavail = st->f_bfree - sblock->s_r_blocks_count;
   if (st->f_bfree < sblock->s_r_blocks_count)
     st->f_bavail = 0;
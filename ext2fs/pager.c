@@ -38,6 +38,9 @@ struct port_bucket *file_pager_bucket;
    worker threads can be inhibited and resumed.  */
 struct pager_requests *file_pager_requests;
 
+/* The number of worker threads started for the file pager.  */
+unsigned int file_pager_worker_count = PAGER_DEFAULT_WORKER_COUNT;
+
 pthread_spinlock_t node_to_page_lock = PTHREAD_SPINLOCK_INITIALIZER;
 
 
@@ -62,10 +65,22 @@ struct ext2fs_pager_stats
   unsigned long file_pagein_freed_bufs;	/* Discarded pages */
   unsigned long file_pagein_alloced_bufs; /* Allocated pages */
 
+  unsigned long file_readaheads; /* Pageins served by a clustered read */
+  unsigned long file_readahead_pages; /* Extra pages offered to the kernel */
+
   unsigned long file_pageouts;
+  unsigned long file_pageout_writes; /* Device writes done by file pageout */
+  unsigned long file_pageout_merged; /* Pages written along with the
+					previous page of the same pageout */
 
   unsigned long file_page_unlocks;
   unsigned long file_grows;
+
+  /* These are counted without taking LOCK.  */
+  unsigned long disk_cache_hits;
+  unsigned long disk_cache_misses;
+  unsigned long disk_cache_ghost_hits; /* Misses on recently evicted blocks */
+  unsigned long disk_cache_returns; /* Pages returned by the policy */
 };
 
 static struct ext2fs_pager_stats ext2s_pager_stats =
@@ -76,8 +91,14 @@ do { pthread_spin_lock (&ext2s_pager_stats.lock);			      \
      ext2s_pager_stats.field++;						      \
      pthread_spin_unlock (&ext2s_pager_stats.lock); } while (0)
 
+#define STAT_ATOMIC_ADD(field, n)					      \
+  __atomic_add_fetch (&ext2s_pager_stats.field, (n), __ATOMIC_RELAXED)
+#define STAT_ATOMIC_INC(field) STAT_ATOMIC_ADD (field, 1)
+
 #else /* !STATS */
 #define STAT_INC(field) /* nop */0
+#define STAT_ATOMIC_ADD(field, n) /* nop */0
+#define STAT_ATOMIC_INC(field) /* nop */0
 #endif /* STATS */
 
 static void
@@ -132,15 +153,18 @@ free_page_buf (void *buf)
 }
 
 /* Find the location on disk of page OFFSET in NODE.  Return the disk block
-   in BLOCK (if unallocated, then return 0).  If *LOCK is 0, then a reader
-   lock is acquired on NODE's ALLOC_LOCK before doing anything, and left
-   locked after the return -- even if an error is returned.  0 is returned
-   on success otherwise an error code.  */
+   in BLOCK (if unallocated, then return 0), and in COUNT how many blocks
+   from there on are known to follow contiguously on disk (or to be
+   unallocated as well), within NODE's allocsize.  If *LOCK is 0, then a
+   reader lock is acquired on NODE's ALLOC_LOCK before doing anything, and
+   left locked after the return -- even if an error is returned.  0 is
+   returned on success otherwise an error code.  */
 static error_t
 find_block (struct node *node, vm_offset_t offset,
-	    block_t *block, pthread_rwlock_t **lock)
+	    block_t *block, block_t *count, pthread_rwlock_t **lock)
 {
   error_t err;
+  block_t left;
 
   if (!*lock)
     {
@@ -151,17 +175,403 @@ find_block (struct node *node, vm_offset_t offset,
   if (offset + block_size > node->allocsize)
     return EIO;
 
-  err = ext2_getblk (node, offset >> log2_block_size, 0, block);
-  if (err == EINVAL)
-    /* Don't barf yet if the node is unallocated.  */
+  err = ext2_getblk_run (node, offset >> log2_block_size, block, count);
+  if (err)
+    return err;
+
+  left = (node->allocsize - offset) >> log2_block_size;
+  if (*count > left)
+    *count = left;
+
+  return 0;
+}
+
+/* Delayed allocation.  When a page of a regular file is made writable,
+   its unallocated blocks are not allocated but only counted as free
+   blocks set aside for the file, so that running out of space is still
+   reported to the writer.  The blocks are allocated when the page is
+   written back, together with the other delayed blocks written at the
+   same time, which ext2_new_blocks can then place contiguously.  Files
+   written by many writers at once thus don't end up interleaved on
+   disk, and the allocator is called once per run instead of once per
+   block.  */
+
+int file_pager_delalloc = 1;
+
+/* The free blocks set aside for the indirect blocks or extent tree nodes
+   that allocating the delayed blocks of a file may need.  */
+#define DELALLOC_META_BLOCKS	4
+
+/* Return the page of file offset OFFSET, as key for DELALLOC_PAGES.  */
+#define delalloc_key(offset)	((offset) / vm_page_size)
+
+/* Set aside the space for the blocks of NODE in MASK of the page at
+   OFFSET, and mark them as delayed.  */
+static error_t
+delalloc_add (struct node *node, vm_offset_t offset, uintptr_t mask)
+{
+  struct disknode *dn = diskfs_node_disknode (node);
+  uintptr_t old = (uintptr_t) hurd_ihash_find (&dn->delalloc_pages,
+					       delalloc_key (offset));
+  block_t count;
+  error_t err;
+
+  mask &= ~old;
+  if (mask == 0)
+    return 0;
+
+  count = __builtin_popcountl (mask);
+  err = ext2_reserve_blocks (&dn->delalloc_reserved,
+			     count + (dn->delalloc_blocks == 0
+				      ? DELALLOC_META_BLOCKS : 0));
+  if (err)
+    return err;
+  err = hurd_ihash_add (&dn->delalloc_pages, delalloc_key (offset),
+			(void *) (old | mask));
+  if (err)
+    {
+      ext2_release_blocks (&dn->delalloc_reserved,
+			   count + (dn->delalloc_blocks == 0
+				    ? DELALLOC_META_BLOCKS : 0));
+      return err;
+    }
+  dn->delalloc_blocks += count;
+  return 0;
+}
+
+/* Account for COUNT delayed blocks of NODE that are gone, and return
+   what was set aside for them, leaving the allowance for indirect blocks
+   as long as there are delayed blocks.  Some of the space may have been
+   used already to allocate them.  */
+static void
+delalloc_done (struct node *node, block_t count)
+{
+  struct disknode *dn = diskfs_node_disknode (node);
+  block_t want;
+
+  dn->delalloc_blocks -= count;
+  want = (dn->delalloc_blocks
+	  ? dn->delalloc_blocks + DELALLOC_META_BLOCKS : 0);
+  if (dn->delalloc_reserved > want)
+    ext2_release_blocks (&dn->delalloc_reserved,
+			 dn->delalloc_reserved - want);
+  else if (dn->delalloc_reserved < want)
+    /* More indirect blocks were needed than set aside.  If the space
+       can't be had any more, writing back the other blocks may fail
+       on a full disk.  */
+    ext2_reserve_blocks (&dn->delalloc_reserved,
+			 want - dn->delalloc_reserved);
+}
+
+/* Mark the unallocated blocks of NODE from BLOCK on, up to the end of the
+   page at OFFSET or to block END, as delayed.  */
+static error_t
+delalloc_page (struct node *node, vm_offset_t offset, block_t block,
+	       block_t end)
+{
+  block_t first = offset >> log2_block_size;
+  block_t page_end = first + (vm_page_size >> log2_block_size);
+  uintptr_t mask = 0;
+  error_t err;
+
+  if (end > page_end)
+    end = page_end;
+  for (; block < end; block++)
+    {
+      block_t disk_block;
+
+      err = ext2_getblk (node, block, 0, &disk_block);
+      if (err == EINVAL)
+	mask |= 1UL << (block - first);
+      else if (err)
+	return err;
+    }
+
+  return delalloc_add (node, offset, mask);
+}
+
+/* Allocate the delayed blocks of NODE in the LENGTH bytes from OFFSET.
+   NODE's ALLOC_LOCK must be held for writing.  */
+static error_t
+delalloc_allocate (struct node *node, vm_offset_t offset, vm_size_t length)
+{
+  struct disknode *dn = diskfs_node_disknode (node);
+  struct ext2_inode_info *info = &dn->info;
+  vm_offset_t page, end = offset + length;
+  block_t run = 0, count = 0, done = 0;
+  error_t err = 0;
+
+  /* Allocate the COUNT blocks from RUN with as few searches of the
+     bitmaps as possible.  The blocks are handed to ext2_alloc_block
+     through the preallocation window of NODE.  */
+  error_t allocate_run (void)
+    {
+      while (count > 0)
+	{
+	  block_t goal, start, got, i, disk_block;
+
+	  if (run == 0 || ext2_getblk (node, run - 1, 0, &goal))
+	    goal = (info->i_block_group * EXT2_BLOCKS_PER_GROUP (sblock)
+		    + sblock->s_first_data_block);
+	  else
+	    goal++;
+
+	  start = ext2_new_blocks (goal, count, &got,
+				   &dn->delalloc_reserved);
+	  if (! start)
+	    return ENOSPC;
+
+	  ext2_discard_prealloc (node);
+	  info->i_prealloc_block = start;
+	  info->i_prealloc_count = got;
+	  info->i_next_alloc_block = run;
+	  info->i_next_alloc_goal = start;
+
+	  for (i = 0; i < got; i++)
+	    {
+	      err = ext2_getblk (node, run, 1, &disk_block);
+	      if (err)
+		return err;
+	      run++;
+	      count--;
+	      done++;
+	    }
+	}
+      return 0;
+    }
+
+  err = diskfs_catch_exception ();
+  if (err)
+    goto out;
+
+  for (page = offset; page < end && ! err; page += vm_page_size)
     {
-      *block = 0;
-      err = 0;
+      block_t first = page >> log2_block_size;
+      uintptr_t mask = (uintptr_t) hurd_ihash_find (&dn->delalloc_pages,
+						    delalloc_key (page));
+      int i;
+
+      if (mask == 0)
+	continue;
+
+      for (i = 0; mask >> i; i++)
+	if (mask & (1UL << i))
+	  {
+	    if (count > 0 && run + count != first + i)
+	      err = allocate_run ();
+	    if (err)
+	      break;
+	    if (count == 0)
+	      run = first + i;
+	    count++;
+	  }
     }
+  if (! err)
+    err = allocate_run ();
+
+  diskfs_end_catch_exception ();
+
+ out:
+  /* Forget the pages whose blocks are allocated now.  Blocks that could
+     not be allocated stay delayed.  */
+  for (page = offset; page < end; page += vm_page_size)
+    {
+      block_t first = page >> log2_block_size;
+      uintptr_t mask = (uintptr_t) hurd_ihash_find (&dn->delalloc_pages,
+						    delalloc_key (page));
+      int i;
+
+      if (mask == 0)
+	continue;
+
+      for (i = 0; mask >> i; i++)
+	if ((mask & (1UL << i)) && first + i < run)
+	  mask &= ~(1UL << i);
+      if (mask)
+	hurd_ihash_add (&dn->delalloc_pages, delalloc_key (page),
+			(void *) mask);
+      else
+	hurd_ihash_remove (&dn->delalloc_pages, delalloc_key (page));
+    }
+  delalloc_done (node, done);
 
   return err;
 }
+
+void
+delalloc_truncate (struct node *node, block_t end)
+{
+  struct disknode *dn = diskfs_node_disknode (node);
+  hurd_ihash_key_t *gone;
+  size_t n = 0, i;
+  block_t count = 0;
+
+  if (dn->delalloc_blocks == 0)
+    return;
+
+  if (end == 0)
+    {
+      /* Everything goes.  */
+      hurd_ihash_destroy (&dn->delalloc_pages);
+      hurd_ihash_init (&dn->delalloc_pages, HURD_IHASH_NO_LOCP);
+      delalloc_done (node, dn->delalloc_blocks);
+      return;
+    }
+
+  /* Entries can't be removed while iterating.  */
+  gone = malloc (dn->delalloc_pages.nr_items * sizeof *gone);
+
+  HURD_IHASH_ITERATE_ITEMS (&dn->delalloc_pages, item)
+    {
+      block_t first = (item->key * vm_page_size) >> log2_block_size;
+      uintptr_t mask = (uintptr_t) item->value;
+      uintptr_t cut = 0;
+      int i;
+
+      for (i = 0; mask >> i; i++)
+	if (first + i >= end)
+	  cut |= mask & (1UL << i);
+      if (cut == 0 || (cut == mask && ! gone))
+	/* Without memory, the page stays until the node goes away.  */
+	continue;
+
+      count += __builtin_popcountl (cut);
+      if (cut == mask)
+	gone[n++] = item->key;
+      else
+	item->value = (void *) (mask & ~cut);
+    }
+  for (i = 0; i < n; i++)
+    hurd_ihash_remove (&dn->delalloc_pages, gone[i]);
+  free (gone);
+
+  delalloc_done (node, count);
+}
+
 
+/* The read-ahead window starts at FILE_READAHEAD_MIN pages once a node
+   is paged in sequentially, doubles with every further sequential
+   fault up to FILE_READAHEAD_MAX pages, and collapses on random access.  */
+#define FILE_READAHEAD_MIN	4
+#define FILE_READAHEAD_MAX	32
+
+/* Return true if the kernel might have a copy of page OFFSET of
+   PAGER.  */
+static int
+page_incore (struct pager *pager, vm_offset_t offset)
+{
+  int incore;
+
+  /* XXX: Use libpager internals.  */
+  pthread_mutex_lock (&pager->interlock);
+  incore = (offset / vm_page_size < pager->pagemapsize
+	    && (pager->pagemap[offset / vm_page_size] & PM_INCORE));
+  pthread_mutex_unlock (&pager->interlock);
+
+  return incore;
+}
+
+/* Update the read-ahead state of NODE for a fault at PAGE, and if the
+   access looks sequential, read the pages from PAGE on that are backed
+   by one contiguous run of blocks with a single store_read.  Return the
+   first page in BUF and offer the others to the kernel.  If no cluster
+   of at least two pages can be read, return an error, and the caller
+   has to read the page the usual way.  */
+static error_t
+file_pager_read_cluster (struct node *node, vm_offset_t page, void **buf)
+{
+  struct disknode *dn = diskfs_node_disknode (node);
+  pthread_rwlock_t *lock = NULL;
+  block_t start = 0, count = 0;
+  unsigned int npages, i;
+  vm_offset_t offset, end, limit;
+  struct pager *pager;
+  void *data = NULL;
+  size_t len = 0;
+  error_t err;
+
+  if (page == dn->ra_next)
+    dn->ra_window = (dn->ra_window == 0 ? FILE_READAHEAD_MIN
+		     : dn->ra_window < FILE_READAHEAD_MAX / 2
+		     ? dn->ra_window * 2 : FILE_READAHEAD_MAX);
+  else
+    dn->ra_window = 0;
+  dn->ra_next = page + vm_page_size;
+
+  if (dn->ra_window < 2)
+    return EAGAIN;
+
+  /* Count the whole pages that are allocated contiguously on disk, a run
+     of blocks at a time.  */
+  limit = page + (vm_size_t) dn->ra_window * vm_page_size;
+  if (limit > trunc_page (node->allocsize))
+    limit = page < node->allocsize ? trunc_page (node->allocsize) : page;
+  for (end = page; end < limit; end += (vm_offset_t) count << log2_block_size)
+    {
+      block_t block;
+
+      err = find_block (node, end, &block, &count, &lock);
+      if (err || block == 0)
+	break;
+      if (end == page)
+	start = block;
+      else if (block != start + ((end - page) >> log2_block_size))
+	break;
+    }
+  if (end > limit)
+    end = limit;
+  npages = (end - page) / vm_page_size;
+
+  if (npages < 2)
+    {
+      if (lock)
+	pthread_rwlock_unlock (lock);
+      return EAGAIN;
+    }
+
+  STAT_INC (file_pagein_reads);
+  err = store_read (store, (store_offset_t) start
+		    << log2_dev_blocks_per_fs_block,
+		    npages * vm_page_size, &data, &len);
+  pthread_rwlock_unlock (lock);
+  if (! err && len != npages * vm_page_size)
+    {
+      munmap (data, len);
+      err = EIO;
+    }
+  if (err)
+    return err;
+
+  *buf = data;
+  dn->ra_next = page + npages * vm_page_size;
+  STAT_INC (file_readaheads);
+
+  pthread_spin_lock (&node_to_page_lock);
+  pager = dn->pager;
+  if (pager)
+    ports_port_ref (pager);
+  pthread_spin_unlock (&node_to_page_lock);
+
+  if (pager)
+    {
+      for (i = 1; i < npages; i++)
+	{
+	  offset = page + i * vm_page_size;
+	  if (page_incore (pager, offset))
+	    continue;
+	  pager_offer_page (pager, 0, 0, offset,
+			    (vm_address_t) data + i * vm_page_size);
+	  STAT_INC (file_readahead_pages);
+	}
+      ports_port_deref (pager);
+    }
+
+  /* The kernel copied the pages it took.  */
+  munmap (data + vm_page_size, (npages - 1) * vm_page_size);
+
+  return 0;
+}
+
 /* Read one page for the pager backing NODE at offset PAGE, into BUF.  This
    may need to read several filesystem blocks to satisfy one page, and tries
    to consolidate the i/o if possible.  */
@@ -233,6 +643,9 @@ file_pager_read_page (struct node *node, vm_offset_t page,
 
   *writelock = 0;
 
+  if (file_pager_read_cluster (node, page, buf) == 0)
+    return 0;
+
   if (page >= node->allocsize)
     {
       err = EIO;
@@ -246,11 +659,15 @@ file_pager_read_page (struct node *node, vm_offset_t page,
 
   while (left > 0)
     {
-      block_t block;
+      block_t block, count;
+      size_t amount;
 
-      err = find_block (node, page, &block, &lock);
+      err = find_block (node, page, &block, &count, &lock);
       if (err)
 	break;
+      if (count > left >> log2_block_size)
+	count = left >> log2_block_size;
+      amount = count << log2_block_size;
 
       if (block != pending_blocks + num_pending_blocks)
 	{
@@ -272,14 +689,14 @@ file_pager_read_page (struct node *node, vm_offset_t page,
 		break;
 	      STAT_INC (file_pagein_alloced_bufs);
 	    }
-	  memset (*buf + offs, 0, block_size);
-	  offs += block_size;
+	  memset (*buf + offs, 0, amount);
+	  offs += amount;
 	}
       else
-	num_pending_blocks++;
+	num_pending_blocks += count;
 
-      page += block_size;
-      left -= block_size;
+      page += amount;
+      left -= amount;
     }
 
   if (!err && num_pending_blocks > 0)
@@ -294,6 +711,10 @@ file_pager_read_page (struct node *node, vm_offset_t page,
   return err;
 }
 
+/* The largest number of pages file_pager_write_pages writes with a
+   single store_write, set by --write-cluster.  */
+unsigned int file_pager_write_cluster = FILE_WRITE_CLUSTER;
+
 struct pending_blocks
 {
   /* The block number of the first of the blocks.  */
@@ -304,6 +725,9 @@ struct pending_blocks
   void *buf;
   /* And an offset into BUF.  */
   int offs;
+  /* If not NULL, the error of a failed write is stored here for each
+     page of BUF it covers, and later blocks are still written.  */
+  error_t *errors;
 };
 
 /* Write the any pending blocks in PB.  */
@@ -319,7 +743,12 @@ pending_blocks_write (struct pending_blocks *pb)
 
       ext2_debug ("writing block %u[%ld]", pb->block, pb->num);
 
-      if (pb->offs > 0)
+      STAT_INC (file_pageout_writes);
+
+      if (pb->offs % vm_page_size == 0)
+	err = store_write (store, dev_block, pb->buf + pb->offs, length,
+			   &amount);
+      else if (length <= vm_page_size)
 	/* Put what we're going to write into a page-aligned buffer.  */
 	{
 	  void *page_buf = get_page_buf ();
@@ -328,11 +757,32 @@ pending_blocks_write (struct pending_blocks *pb)
 	  free_page_buf (page_buf);
 	}
       else
-	err = store_write (store, dev_block, pb->buf, length, &amount);
+	{
+	  void *bounce = mmap (0, length, PROT_READ|PROT_WRITE,
+			       MAP_ANON, 0, 0);
+	  if (bounce == MAP_FAILED)
+	    err = ENOMEM;
+	  else
+	    {
+	      memcpy (bounce, pb->buf + pb->offs, length);
+	      err = store_write (store, dev_block, bounce, length, &amount);
+	      munmap (bounce, length);
+	    }
+	}
+      if (!err && amount != length)
+	err = EIO;
+
+      if (err && pb->errors)
+	{
+	  int page;
+	  for (page = pb->offs / vm_page_size;
+	       page <= (pb->offs + length - 1) / vm_page_size;
+	       page++)
+	    pb->errors[page] = err;
+	  err = 0;
+	}
       if (err)
 	return err;
-      else if (amount != length)
-	return EIO;
 
       pb->offs += length;
       pb->num = 0;
@@ -348,6 +798,7 @@ pending_blocks_init (struct pending_blocks *pb, void *buf)
   pb->block = 0;
   pb->num = 0;
   pb->offs = 0;
+  pb->errors = NULL;
 }
 
 /* Skip writing the next block in PB's buffer (writing out any previous
@@ -360,10 +811,10 @@ pending_blocks_skip (struct pending_blocks *pb)
   return err;
 }
 
-/* Add the disk block BLOCK to the list of destination disk blocks pending in
-   PB.  */
+/* Add the COUNT disk blocks from BLOCK on to the list of destination disk
+   blocks pending in PB.  */
 static error_t
-pending_blocks_add (struct pending_blocks *pb, block_t block)
+pending_blocks_add (struct pending_blocks *pb, block_t block, block_t count)
 {
   if (block != pb->block + pb->num)
     {
@@ -372,7 +823,7 @@ pending_blocks_add (struct pending_blocks *pb, block_t block)
 	return err;
       pb->block = block;
     }
-  pb->num++;
+  pb->num += count;
   return 0;
 }
 
@@ -382,10 +833,10 @@ pending_blocks_add (struct pending_blocks *pb, block_t block)
 static error_t
 file_pager_write_page (struct node *node, vm_offset_t offset, void *buf)
 {
-  error_t err = 0;
+  error_t err = 0, alloc_err = 0;
   struct pending_blocks pb;
   pthread_rwlock_t *lock = &diskfs_node_disknode (node)->alloc_lock;
-  block_t block;
+  block_t block, count;
   int left = vm_page_size;
 
   pending_blocks_init (&pb, buf);
@@ -395,6 +846,14 @@ file_pager_write_page (struct node *node, vm_offset_t offset, void *buf)
      diskfs_grow and diskfs_truncate.  */
   pthread_rwlock_rdlock (&diskfs_node_disknode (node)->alloc_lock);
 
+  if (diskfs_node_disknode (node)->delalloc_blocks > 0)
+    {
+      /* Allocating needs the lock for writing.  */
+      pthread_rwlock_unlock (lock);
+      pthread_rwlock_wrlock (lock);
+      alloc_err = delalloc_allocate (node, offset, vm_page_size);
+    }
+
   if (offset >= node->allocsize)
     left = 0;
   else if (offset + left > node->allocsize)
@@ -406,13 +865,20 @@ file_pager_write_page (struct node *node, vm_offset_t offset, void *buf)
 
   while (left > 0)
     {
-      err = find_block (node, offset, &block, &lock);
+      err = find_block (node, offset, &block, &count, &lock);
       if (err)
 	break;
-      assert (block);
-      pending_blocks_add (&pb, block);
-      offset += block_size;
-      left -= block_size;
+      if (! block)
+	{
+	  /* A delayed block that could not be allocated.  */
+	  err = alloc_err ?: ENOSPC;
+	  break;
+	}
+      if (count > left >> log2_block_size)
+	count = left >> log2_block_size;
+      pending_blocks_add (&pb, block, count);
+      offset += count << log2_block_size;
+      left -= count << log2_block_size;
     }
 
   if (!err)
@@ -422,6 +888,94 @@ file_pager_write_page (struct node *node, vm_offset_t offset, void *buf)
 
   return err;
 }
+
+/* Write the LENGTH bytes of pages in BUF for the pager backing NODE, at
+   OFFSET, storing the result for each page in ERRORS.  Blocks that are
+   contiguous on disk are written together even if they belong to
+   different pages, up to file_pager_write_cluster pages at once.  */
+static void
+file_pager_write_pages (struct node *node, vm_offset_t offset, void *buf,
+			vm_size_t length, error_t *errors)
+{
+  struct pending_blocks pb;
+  pthread_rwlock_t *lock = &diskfs_node_disknode (node)->alloc_lock;
+  int npages = length / vm_page_size, i;
+  off_t max_blocks;
+  error_t alloc_err = 0;
+
+  max_blocks = ((off_t) file_pager_write_cluster * vm_page_size)
+    >> log2_block_size;
+
+  pending_blocks_init (&pb, buf);
+  pb.errors = errors;
+
+  /* See file_pager_write_page.  */
+  pthread_rwlock_rdlock (lock);
+
+  if (diskfs_node_disknode (node)->delalloc_blocks > 0)
+    {
+      pthread_rwlock_unlock (lock);
+      pthread_rwlock_wrlock (lock);
+      alloc_err = delalloc_allocate (node, offset, length);
+    }
+
+  for (i = 0; i < npages; i++, offset += vm_page_size)
+    {
+      error_t err = 0;
+      int left = vm_page_size;
+      vm_offset_t page = offset;
+      block_t block, count;
+
+      errors[i] = 0;
+      STAT_INC (file_pageouts);
+
+      if (offset >= node->allocsize)
+	left = 0;
+      else if (offset + left > node->allocsize)
+	left = node->allocsize - offset;
+
+      /* Blocks of the previous page can only be continued if nothing
+	 was skipped in BUF since.  */
+      if (pb.num > 0 && pb.offs + (pb.num << log2_block_size)
+	  != i * vm_page_size)
+	pending_blocks_write (&pb);
+      if (pb.num == 0)
+	pb.offs = i * vm_page_size;
+
+      while (left > 0)
+	{
+	  int continued = page == offset && pb.num > 0;
+
+	  err = find_block (node, page, &block, &count, &lock);
+	  if (err)
+	    break;
+	  if (! block)
+	    {
+	      err = alloc_err ?: ENOSPC;
+	      break;
+	    }
+	  if (count > left >> log2_block_size)
+	    count = left >> log2_block_size;
+	  if (pb.num >= max_blocks
+	      || (pb.num > 0 && block != pb.block + pb.num))
+	    pending_blocks_write (&pb);
+	  if (count > max_blocks - pb.num)
+	    count = max_blocks - pb.num;
+	  pending_blocks_add (&pb, block, count);
+	  if (continued && pb.num > count)
+	    STAT_INC (file_pageout_merged);
+	  page += count << log2_block_size;
+	  left -= count << log2_block_size;
+	}
+
+      if (err)
+	errors[i] = err;
+    }
+
+  pending_blocks_write (&pb);
+
+  pthread_rwlock_unlock (lock);
+}
 
 static error_t
 disk_pager_read_page (vm_offset_t page, void **buf, int *writelock)
@@ -431,17 +985,19 @@ disk_pager_read_page (vm_offset_t page, void **buf, int *writelock)
   store_offset_t offset = page, dev_end = store->size;
   int index = offset >> log2_block_size;
 
-  pthread_mutex_lock (&disk_cache_lock);
-  offset = ((store_offset_t) disk_cache_info[index].block << log2_block_size)
+  offset = ((store_offset_t) __atomic_load_n (&disk_cache_info[index].block,
+					      __ATOMIC_ACQUIRE)
+	    << log2_block_size)
     + offset % block_size;
-  disk_cache_info[index].flags |= DC_INCORE;
-  disk_cache_info[index].flags &=~ DC_UNTOUCHED;
 #ifdef DEBUG_DISK_CACHE
   disk_cache_info[index].last_read = disk_cache_info[index].block;
   disk_cache_info[index].last_read_xor
     = disk_cache_info[index].block ^ DISK_CACHE_LAST_READ_XOR;
 #endif
-  pthread_mutex_unlock (&disk_cache_lock);
+  __atomic_or_fetch (&disk_cache_info[index].state, DC_INCORE,
+		     __ATOMIC_RELAXED);
+  __atomic_and_fetch (&disk_cache_info[index].state, ~DC_UNTOUCHED,
+		      __ATOMIC_RELEASE);
 
   ext2_debug ("(%lld)", offset >> log2_block_size);
 
@@ -509,7 +1065,7 @@ disk_pager_write_page (vm_offset_t page, void *buf)
 	     paging interface.  XXXX */
 	  if (test_bit (block, modified_global_blocks))
 	    /* This block may have been modified, so write it out.  */
-	    err = pending_blocks_add (&pb, block);
+	    err = pending_blocks_add (&pb, block, 1);
 	  else
 	    /* Otherwise just skip it.  */
 	    err = pending_blocks_skip (&pb);
@@ -539,12 +1095,10 @@ disk_pager_notify_evict (vm_offset_t page)
 
   ext2_debug ("(block %lu)", index);
 
-  pthread_mutex_lock (&disk_cache_lock);
-  disk_cache_info[index].flags &= ~DC_INCORE;
-  if (disk_cache_info[index].ref_count == 0 &&
-      !(disk_cache_info[index].flags & DC_DONT_REUSE))
+  uint32_t state = __atomic_and_fetch (&disk_cache_info[index].state,
+				       ~DC_INCORE, __ATOMIC_ACQ_REL);
+  if ((state & DC_REF_MASK) == 0 && !(state & DC_DONT_REUSE))
     disk_cache_info_free_push (&disk_cache_info[index]);
-  pthread_mutex_unlock (&disk_cache_lock);
 }
 
 /* Satisfy a pager read request for either the disk pager or file pager
@@ -572,6 +1126,20 @@ pager_write_page (struct user_pager_info *pager, vm_offset_t page,
     return file_pager_write_page (pager->node, page, (void *)buf);
 }
 
+/* Satisfy a pager write request of several pages for the file pager
+   PAGER, writing LENGTH bytes at offset OFFSET from BUF.  The disk pager
+   has its pages scattered over the disk, so it writes them one by one.  */
+static error_t
+ext2_pager_write_pages (struct user_pager_info *pager, vm_offset_t offset,
+			vm_address_t buf, vm_size_t length, error_t *errors)
+{
+  if (pager->type == DISK)
+    return EOPNOTSUPP;
+
+  file_pager_write_pages (pager->node, offset, (void *)buf, length, errors);
+  return 0;
+}
+
 void
 pager_notify_evict (struct user_pager_info *pager, vm_offset_t page)
 {
@@ -605,14 +1173,19 @@ pager_unlock_page (struct user_pager_info *pager, vm_offset_t page)
 	  block_t block = page >> log2_block_size;
 	  int left = (partial_page ? node->allocsize - page : vm_page_size);
 
-	  while (left > 0)
-	    {
-	      block_t disk_block;
-	      err = ext2_getblk (node, block++, 1, &disk_block);
-	      if (err)
-		break;
-	      left -= block_size;
-	    }
+	  if (file_pager_delalloc && S_ISREG (node->dn_stat.st_mode))
+	    /* Only set the space aside; see delalloc_add.  */
+	    err = delalloc_page (node, page, block,
+				 block + (left >> log2_block_size));
+	  else
+	    while (left > 0)
+	      {
+		block_t disk_block;
+		err = ext2_getblk (node, block++, 1, &disk_block);
+		if (err)
+		  break;
+		left -= block_size;
+	      }
 	}
       diskfs_end_catch_exception ();
 
@@ -707,11 +1280,20 @@ diskfs_grow (struct node *node, off_t size, struct protid *cred)
 			  end_block);
 
 	      err = diskfs_catch_exception ();
-	      while (!err && end_block < writable_end)
+	      if (!err && file_pager_delalloc
+		  && S_ISREG (node->dn_stat.st_mode))
 		{
-		  block_t disk_block;
-		  err = ext2_getblk (node, end_block++, 1, &disk_block);
+		  err = delalloc_page (node, trunc_page (old_size), end_block,
+				       writable_end);
+		  if (! err)
+		    end_block = writable_end;
 		}
+	      else
+		while (!err && end_block < writable_end)
+		  {
+		    block_t disk_block;
+		    err = ext2_getblk (node, end_block++, 1, &disk_block);
+		  }
 	      diskfs_end_catch_exception ();
 
 	      if (! err)
@@ -850,27 +1432,77 @@ void *disk_cache;
 
 /* DISK_CACHE size in bytes and blocks.  */
 store_offset_t disk_cache_size;
-int disk_cache_blocks;
+int disk_cache_blocks = DISK_CACHE_BLOCKS;
+int disk_cache_active_blocks;
 
 /* block num --> pointer to in-memory block */
-hurd_ihash_t disk_cache_bptr;
+struct hurd_cihash disk_cache_bptr;
 /* Cached blocks' info.  */
 struct disk_cache_info *disk_cache_info;
-/* Lock for these structures.  */
+/* Lock for changing these structures.  */
 pthread_mutex_t disk_cache_lock;
-/* Fired when a re-association is done.  */
-pthread_cond_t disk_cache_reassociation;
+
+/* Threads finding a block in the process of being re-associated wait
+   for it on the condition of the stripe of its entry.  */
+#define DISK_CACHE_STRIPES	64
+
+static struct
+{
+  pthread_mutex_t lock;
+  /* Fired when a re-association in this stripe is done.  */
+  pthread_cond_t reassociation;
+} disk_cache_stripes[DISK_CACHE_STRIPES];
 
 /* Linked list of potentially unused blocks. */
 static struct disk_cache_info *disk_cache_info_free;
 static pthread_mutex_t disk_cache_info_free_lock;
 
-/* Get a reusable entry.  Must be called with disk_cache_lock
-   held.  */
+/* The disk cache is managed with CLOCK with Adaptive Replacement.
+   Mapped entries are either recent, if they have not been referenced
+   since they were mapped, or frequent (DC_FREQUENT).  When the cache
+   runs out of free entries, a clock hand sweeps over the entries
+   nobody holds a reference to.  Entries with DC_REFERENCED get a second
+   chance, and recent ones become frequent.  Other entries are returned
+   to the kernel, from the recent ones if there are at least
+   DISK_CACHE_TARGET of them, and from the frequent ones otherwise.
+
+   The block numbers of the blocks that lost their entry are remembered
+   in two ghost lists, one for each kind.  A miss on a block in the
+   recent ghost list means that recent blocks were evicted too early,
+   so DISK_CACHE_TARGET grows; a miss in the frequent ghost list makes
+   it shrink.  Such blocks are mapped as frequent ones.  Thus a scan
+   over many blocks only cycles through the recent entries and leaves
+   frequently used blocks like group descriptors and inode tables in
+   the cache.
+
+   All of this is protected by disk_cache_lock.  */
+static int disk_cache_recent;
+static int disk_cache_frequent;
+static int disk_cache_target;
+static int disk_cache_hand;
+
+/* The ghost lists.  DISK_CACHE_GHOSTS maps block numbers to their
+   position in the DISK_CACHE_GHOST_RING FIFO, shifted left by one, plus
+   one if the block was frequent.  */
+static struct hurd_ihash disk_cache_ghosts
+  = HURD_IHASH_INITIALIZER (HURD_IHASH_NO_LOCP);
+static block_t *disk_cache_ghost_ring;
+static int disk_cache_ghost_head;
+static int disk_cache_ghost_len;
+static int disk_cache_ghost_recent;
+static int disk_cache_ghost_frequent;
+
+/* The largest number of pages returned at once by
+   disk_cache_return_unused.  */
+#define DISK_CACHE_RETURN_MAX	256
+
+/* Get a reusable entry and mark it as being re-associated by setting
+   DC_UNTOUCHED.  Must be called with disk_cache_lock held.  */
 static struct disk_cache_info *
 disk_cache_info_free_pop (void)
 {
   struct disk_cache_info *p;
+  uint32_t state;
 
   do
     {
@@ -882,9 +1514,23 @@ disk_cache_info_free_pop (void)
 	  p->next = NULL;
 	}
       pthread_mutex_unlock (&disk_cache_info_free_lock);
+
+      if (p == NULL)
+	break;
+      if (p - disk_cache_info >= disk_cache_active_blocks)
+	continue;
+
+      /* Only claim P if nobody took a reference in the meantime.  */
+      state = __atomic_load_n (&p->state, __ATOMIC_RELAXED);
+      while (! (state & DC_DONT_REUSE || state & DC_REF_MASK))
+	if (__atomic_compare_exchange_n (&p->state, &state,
+					 state | DC_UNTOUCHED, 0,
+					 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	  return p;
     }
-  while (p && (p->flags & DC_DONT_REUSE || p->ref_count > 0));
-  return p;
+  while (1);
+
+  return NULL;
 }
 
 /* Add P to the list of potentially re-usable entries.  */
@@ -900,6 +1546,279 @@ disk_cache_info_free_push (struct disk_cache_info *p)
   pthread_mutex_unlock (&disk_cache_info_free_lock);
 }
 
+/* Forget the oldest block of the ghost lists.  */
+static void
+disk_cache_ghost_expire (void)
+{
+  int pos = disk_cache_ghost_head;
+  block_t block = disk_cache_ghost_ring[pos];
+  uintptr_t ghost;
+
+  disk_cache_ghost_head = (pos + 1) % disk_cache_blocks;
+  disk_cache_ghost_len--;
+
+  /* The block might have been mapped and evicted again since.  */
+  ghost = (uintptr_t) hurd_ihash_find (&disk_cache_ghosts, block);
+  if (ghost && (int) (ghost >> 1) - 1 == pos)
+    {
+      hurd_ihash_remove (&disk_cache_ghosts, block);
+      if (ghost & 1)
+	disk_cache_ghost_frequent--;
+      else
+	disk_cache_ghost_recent--;
+    }
+}
+
+/* Remember that BLOCK lost its entry in the cache.  FREQUENT tells
+   which ghost list it goes to.  */
+static void
+disk_cache_ghost_add (block_t block, int frequent)
+{
+  int pos;
+
+  while (disk_cache_ghost_len > 0
+	 && (disk_cache_ghost_len == disk_cache_blocks
+	     || (disk_cache_ghost_recent + disk_cache_ghost_frequent
+		 >= disk_cache_active_blocks)))
+    disk_cache_ghost_expire ();
+
+  pos = (disk_cache_ghost_head + disk_cache_ghost_len) % disk_cache_blocks;
+  disk_cache_ghost_ring[pos] = block;
+  disk_cache_ghost_len++;
+
+  if (hurd_ihash_add (&disk_cache_ghosts, block,
+		      (void *) ((((uintptr_t) pos + 1) << 1) | !!frequent)))
+    /* Not remembering it is fine.  */
+    return;
+
+  if (frequent)
+    disk_cache_ghost_frequent++;
+  else
+    disk_cache_ghost_recent++;
+}
+
+/* BLOCK is about to be mapped.  If it is in a ghost list, remove it,
+   adapt the target size of the recent entries, and return true.  */
+static int
+disk_cache_ghost_hit (block_t block)
+{
+  uintptr_t ghost = (uintptr_t) hurd_ihash_find (&disk_cache_ghosts, block);
+  int delta;
+
+  if (! ghost)
+    return 0;
+
+  STAT_ATOMIC_INC (disk_cache_ghost_hits);
+
+  if (ghost & 1)
+    {
+      delta = (disk_cache_ghost_frequent >= disk_cache_ghost_recent ? 1
+	       : disk_cache_ghost_recent / disk_cache_ghost_frequent);
+      disk_cache_target = (disk_cache_target > delta
+			   ? disk_cache_target - delta : 0);
+      disk_cache_ghost_frequent--;
+    }
+  else
+    {
+      delta = (disk_cache_ghost_recent >= disk_cache_ghost_frequent ? 1
+	       : disk_cache_ghost_frequent / disk_cache_ghost_recent);
+      disk_cache_target = (disk_cache_target + delta
+			   < disk_cache_active_blocks
+			   ? disk_cache_target + delta
+			   : disk_cache_active_blocks);
+      disk_cache_ghost_recent--;
+    }
+
+  hurd_ihash_remove (&disk_cache_ghosts, block);
+  return 1;
+}
+
+/* Return whether an entry in STATE could be returned to the kernel.  */
+static inline int
+disk_cache_returnable (uint32_t state)
+{
+  return ((state & DC_INCORE)
+	  && ! (state & (DC_UNTOUCHED | DC_FIXED))
+	  && ! (state & DC_REF_MASK));
+}
+
+/* Store in VICTIMS the indices of up to MAX entries outside of the
+   active part of the cache that can be returned to the kernel, and
+   return their number.  Must be called with disk_cache_lock held.  */
+static int
+disk_cache_choose_inactive (int *victims, int max)
+{
+  int n = 0;
+
+  for (int index = disk_cache_active_blocks;
+       index < disk_cache_blocks && n < max;
+       index++)
+    if (disk_cache_returnable (__atomic_load_n (&disk_cache_info[index].state,
+						__ATOMIC_RELAXED)))
+      victims[n++] = index;
+
+  return n;
+}
+
+/* Store in VICTIMS the indices of up to MAX entries chosen by the
+   replacement policy, and return their number.  Must be called with
+   disk_cache_lock held.  */
+static int
+disk_cache_choose_victims (int *victims, int max)
+{
+  int n = disk_cache_choose_inactive (victims, max);
+  int recent = disk_cache_recent;
+  int target = disk_cache_target ?: 1;
+
+  for (int scanned = 0;
+       n < max && scanned < 2 * disk_cache_active_blocks;
+       scanned++)
+    {
+      int index = disk_cache_hand;
+      struct disk_cache_info *info = &disk_cache_info[index];
+      uint32_t state = __atomic_load_n (&info->state, __ATOMIC_RELAXED);
+
+      disk_cache_hand = (index + 1) % disk_cache_active_blocks;
+
+      if (! disk_cache_returnable (state))
+	continue;
+
+      if (state & DC_REFERENCED)
+	/* Give it a second chance.  */
+	{
+	  __atomic_and_fetch (&info->state, ~DC_REFERENCED, __ATOMIC_RELAXED);
+	  if (! (state & DC_FREQUENT))
+	    {
+	      __atomic_or_fetch (&info->state, DC_FREQUENT, __ATOMIC_RELAXED);
+	      disk_cache_recent--;
+	      disk_cache_frequent++;
+	      recent--;
+	    }
+	  continue;
+	}
+
+      /* In the first round, stick to the kind of entries the policy
+	 wants to evict.  */
+      if (scanned < disk_cache_active_blocks
+	  && (state & DC_FREQUENT ? recent >= target : recent < target))
+	continue;
+
+      victims[n++] = index;
+      if (! (state & DC_FREQUENT))
+	recent--;
+    }
+
+  return n;
+}
+
+/* Return the N pages of the disk cache in VICTIMS to the kernel.  */
+static void
+disk_cache_return (int *victims, int n)
+{
+  int i, j;
+
+  for (i = 0; i < n; i = j)
+    {
+      /* Return runs of consecutive pages at once.  */
+      for (j = i + 1; j < n && victims[j] == victims[j - 1] + 1; j++)
+	;
+      ext2_debug ("return %d[%d]", victims[i], j - i);
+      pager_return_some (diskfs_disk_pager, victims[i] * vm_page_size,
+			 (j - i) * vm_page_size, 1);
+    }
+}
+
+error_t
+disk_cache_resize (int blocks)
+{
+  int victims[DISK_CACHE_RETURN_MAX];
+  int old, n;
+
+  if (blocks < DISK_CACHE_MIN_BLOCKS || blocks > disk_cache_blocks)
+    return EINVAL;
+
+  pthread_mutex_lock (&disk_cache_lock);
+  old = disk_cache_active_blocks;
+  disk_cache_active_blocks = blocks;
+  if (disk_cache_target > blocks)
+    disk_cache_target = blocks;
+  if (disk_cache_hand >= blocks)
+    disk_cache_hand = 0;
+
+  /* Entries that become usable again may be free.  */
+  for (int index = old; index < blocks; index++)
+    {
+      uint32_t state = __atomic_load_n (&disk_cache_info[index].state,
+					__ATOMIC_RELAXED);
+      if (! (state & DC_REF_MASK) && ! (state & DC_DONT_REUSE))
+	disk_cache_info_free_push (&disk_cache_info[index]);
+    }
+  pthread_mutex_unlock (&disk_cache_lock);
+
+  /* Give back the memory of the entries no longer used.  Entries that
+     are still referenced are given back the next time the cache runs
+     out of free entries.  */
+  if (blocks < old)
+    do
+      {
+	pthread_mutex_lock (&disk_cache_lock);
+	n = disk_cache_choose_inactive (victims, DISK_CACHE_RETURN_MAX);
+	pthread_mutex_unlock (&disk_cache_lock);
+	disk_cache_return (victims, n);
+      }
+    while (n == DISK_CACHE_RETURN_MAX);
+
+  return 0;
+}
+
+void
+disk_cache_get_stats (struct disk_cache_stats *stats)
+{
+  memset (stats, 0, sizeof *stats);
+  pthread_mutex_lock (&disk_cache_lock);
+  stats->recent = disk_cache_recent;
+  stats->frequent = disk_cache_frequent;
+  stats->target = disk_cache_target;
+  pthread_mutex_unlock (&disk_cache_lock);
+#ifdef STATS
+  stats->hits = __atomic_load_n (&ext2s_pager_stats.disk_cache_hits,
+				 __ATOMIC_RELAXED);
+  stats->misses = __atomic_load_n (&ext2s_pager_stats.disk_cache_misses,
+				   __ATOMIC_RELAXED);
+  stats->ghost_hits
+    = __atomic_load_n (&ext2s_pager_stats.disk_cache_ghost_hits,
+		       __ATOMIC_RELAXED);
+  stats->returns = __atomic_load_n (&ext2s_pager_stats.disk_cache_returns,
+				    __ATOMIC_RELAXED);
+#endif
+}
+
+/* Wait until the re-association of entry INDEX is done.  */
+static void
+disk_cache_wait_reassociation (int index)
+{
+  int stripe = index % DISK_CACHE_STRIPES;
+
+  pthread_mutex_lock (&disk_cache_stripes[stripe].lock);
+  while (__atomic_load_n (&disk_cache_info[index].state, __ATOMIC_ACQUIRE)
+	 & DC_UNTOUCHED)
+    pthread_cond_wait (&disk_cache_stripes[stripe].reassociation,
+		       &disk_cache_stripes[stripe].lock);
+  pthread_mutex_unlock (&disk_cache_stripes[stripe].lock);
+}
+
+/* Wake up the threads waiting for the re-association of entry INDEX,
+   which must not have DC_UNTOUCHED set any more.  */
+static void
+disk_cache_reassociation_done (int index)
+{
+  int stripe = index % DISK_CACHE_STRIPES;
+
+  pthread_mutex_lock (&disk_cache_stripes[stripe].lock);
+  pthread_cond_broadcast (&disk_cache_stripes[stripe].reassociation);
+  pthread_mutex_unlock (&disk_cache_stripes[stripe].lock);
+}
+
 /* Finish mapping initialization. */
 static void
 disk_cache_init (void)
@@ -909,12 +1828,22 @@ disk_cache_init (void)
 		block_size, vm_page_size);
 
   pthread_mutex_init (&disk_cache_lock, NULL);
-  pthread_cond_init (&disk_cache_reassociation, NULL);
   pthread_mutex_init (&disk_cache_info_free_lock, NULL);
+  for (int i = 0; i < DISK_CACHE_STRIPES; i++)
+    {
+      pthread_mutex_init (&disk_cache_stripes[i].lock, NULL);
+      pthread_cond_init (&disk_cache_stripes[i].reassociation, NULL);
+    }
 
-  /* Allocate space for block num -> in-memory pointer mapping.  */
-  if (hurd_ihash_create (&disk_cache_bptr, HURD_IHASH_NO_LOCP))
-    ext2_panic ("Can't allocate memory for disk_pager_bptr");
+  /* Initialize the block num -> in-memory pointer mapping.  */
+  hurd_cihash_init (&disk_cache_bptr, HURD_IHASH_NO_LOCP);
+
+  if (disk_cache_active_blocks == 0)
+    disk_cache_active_blocks = disk_cache_blocks;
+  disk_cache_ghost_ring = malloc ((sizeof *disk_cache_ghost_ring)
+				  * disk_cache_blocks);
+  if (!disk_cache_ghost_ring)
+    ext2_panic ("Cannot allocate space for disk cache ghost list");
 
   /* Allocate space for disk cache blocks' info.  */
   disk_cache_info = malloc ((sizeof *disk_cache_info) * disk_cache_blocks);
@@ -927,8 +1856,7 @@ disk_cache_init (void)
   for (int i = disk_cache_blocks - 1; i >= 0; i--)
     {
       disk_cache_info[i].block = DC_NO_BLOCK;
-      disk_cache_info[i].flags = 0;
-      disk_cache_info[i].ref_count = 0;
+      disk_cache_info[i].state = 0;
       disk_cache_info[i].next = NULL;
       disk_cache_info_free_push (&disk_cache_info[i]);
 #ifdef DEBUG_DISK_CACHE
@@ -949,59 +1877,44 @@ disk_cache_init (void)
     {
       disk_cache_block_ref (i);
       assert (disk_cache_info[i-fixed_first].block == i);
-      disk_cache_info[i-fixed_first].flags |= DC_FIXED;
+      __atomic_or_fetch (&disk_cache_info[i-fixed_first].state, DC_FIXED,
+			 __ATOMIC_RELAXED);
+      /* Fixed blocks are not subject to the replacement policy.  */
+      disk_cache_recent--;
     }
 }
 
 static void
 disk_cache_return_unused (void)
 {
-  int index;
-
   /* XXX: Touch all pages.  It seems that sometimes GNU Mach "forgets"
      to notify us about evicted pages.  Disk cache must be
-     unlocked.  */
-  for (vm_offset_t i = 0; i < disk_cache_size; i += vm_page_size)
-    *(volatile char *)(disk_cache + i);
+     unlocked.  Do not fault in the part of the cache that is not
+     used.  */
+  for (int i = 0; i < disk_cache_active_blocks; i++)
+    *(volatile char *)(disk_cache + i * vm_page_size);
 
   /* Release some references to cached blocks.  */
   pokel_sync (&global_pokel, 1);
 
   /* Return unused pages that are in core.  */
-  int pending_begin = -1, pending_end = -1;
-  pthread_mutex_lock (&disk_cache_lock);
-  for (index = 0; index < disk_cache_blocks; index++)
-    if (! (disk_cache_info[index].flags & (DC_DONT_REUSE & ~DC_INCORE))
-	&& ! disk_cache_info[index].ref_count)
-      {
-	ext2_debug ("return %u -> %d",
-		    disk_cache_info[index].block, index);
-	if (index != pending_end)
-	  {
-	    /* Return previous region, if there is such, ... */
-	    if (pending_end >= 0)
-	      {
-		pthread_mutex_unlock (&disk_cache_lock);
-		pager_return_some (diskfs_disk_pager,
-				   pending_begin * vm_page_size,
-				   (pending_end - pending_begin)
-				   * vm_page_size, 1);
-		pthread_mutex_lock (&disk_cache_lock);
-	      }
-	    /* ... and start new region.  */
-	    pending_begin = index;
-	  }
-	pending_end = index + 1;
-      }
+  int victims[DISK_CACHE_RETURN_MAX];
+  int n;
 
+  /* Only return a small part of the cache at once, so that the
+     policy decides what stays in it.  */
+  pthread_mutex_lock (&disk_cache_lock);
+  n = disk_cache_active_blocks / 16 + 1;
+  if (n > DISK_CACHE_RETURN_MAX)
+    n = DISK_CACHE_RETURN_MAX;
+  n = disk_cache_choose_victims (victims, n);
   pthread_mutex_unlock (&disk_cache_lock);
 
-  /* Return last region, if there is such.   */
-  if (pending_end >= 0)
-    pager_return_some (diskfs_disk_pager,
-		       pending_begin * vm_page_size,
-		       (pending_end - pending_begin) * vm_page_size,
-		       1);
+  if (n > 0)
+    {
+      STAT_ATOMIC_ADD (disk_cache_returns, n);
+      disk_cache_return (victims, n);
+    }
   else
     {
       ext2_debug ("ext2fs: disk cache is starving\n");
@@ -1018,48 +1931,66 @@ disk_cache_block_ref (block_t block)
   struct disk_cache_info *info;
   int index;
   void *bptr;
-  hurd_ihash_locp_t slot;
+  uint32_t state;
 
   assert (block < store->size >> log2_block_size);
 
   ext2_debug ("(%u)", block);
 
 retry_ref:
-  pthread_mutex_lock (&disk_cache_lock);
-
-  bptr = hurd_ihash_locp_find (disk_cache_bptr, block, &slot);
+  bptr = hurd_cihash_find (&disk_cache_bptr, block);
   if (bptr)
     /* Already mapped.  */
     {
       index = bptr_index (bptr);
+      info = &disk_cache_info[index];
 
-      /* In process of re-associating?  */
-      if (disk_cache_info[index].flags & DC_UNTOUCHED)
+      state = __atomic_load_n (&info->state, __ATOMIC_RELAXED);
+      do
 	{
-	  /* Wait re-association to finish.  */
-	  pthread_cond_wait (&disk_cache_reassociation, &disk_cache_lock);
-	  pthread_mutex_unlock (&disk_cache_lock);
+	  /* In process of re-associating?  */
+	  if (state & DC_UNTOUCHED)
+	    {
+	      /* Wait re-association to finish.  */
+	      disk_cache_wait_reassociation (index);
 
 #if 0
-	  printf ("Re-association -- wait finished.\n");
+	      printf ("Re-association -- wait finished.\n");
 #endif
 
+	      goto retry_ref;
+	    }
+
+	  assert ((state & DC_REF_MASK) != DC_REF_MASK);
+	}
+      /* Just increment reference.  */
+      while (! __atomic_compare_exchange_n (&info->state, &state,
+					    (state + 1) | DC_REFERENCED,
+					    0, __ATOMIC_ACQUIRE,
+					    __ATOMIC_RELAXED));
+
+      /* The entry might have been re-associated after the lookup but
+	 before we got our reference.  */
+      if (__atomic_load_n (&info->block, __ATOMIC_RELAXED) != block)
+	{
+	  disk_cache_block_deref (bptr);
 	  goto retry_ref;
 	}
 
-      /* Just increment reference and return.  */
-      assert (disk_cache_info[index].ref_count + 1
-	      > disk_cache_info[index].ref_count);
-      disk_cache_info[index].ref_count++;
+      ext2_debug ("cached %u -> %d (state = %#x, ptr = %p)",
+		  block, index, state + 1, bptr);
+      STAT_ATOMIC_INC (disk_cache_hits);
 
-      ext2_debug ("cached %u -> %d (ref_count = %hu, flags = %#hx, ptr = %p)",
-		  disk_cache_info[index].block, index,
-		  disk_cache_info[index].ref_count,
-		  disk_cache_info[index].flags, bptr);
+      return bptr;
+    }
 
-      pthread_mutex_unlock (&disk_cache_lock);
+  pthread_mutex_lock (&disk_cache_lock);
 
-      return bptr;
+  /* Has someone mapped the block while we did not hold the lock?  */
+  if (hurd_cihash_find (&disk_cache_bptr, block))
+    {
+      pthread_mutex_unlock (&disk_cache_lock);
+      goto retry_ref;
     }
 
   /* Search for a block that is not in core and is not referenced.  */
@@ -1070,7 +2001,7 @@ retry_ref:
     /* No place is found.  Try to release some blocks and try
        again.  */
     {
-      ext2_debug ("flush %u -> %d", disk_cache_info[index].block, index);
+      ext2_debug ("flush %u", block);
 
       pthread_mutex_unlock (&disk_cache_lock);
 
@@ -1086,58 +2017,40 @@ retry_ref:
   bptr = (char *)disk_cache + (index << log2_block_size);
   ext2_debug ("map %u -> %d (%p)", block, index, bptr);
 
-  /* This pager_return_some is used only to set PM_FORCEREAD for the
-     page.  DC_UNTOUCHED is set so that we catch if someone has
-     referenced the block while we didn't hold disk_cache_lock.  */
-  disk_cache_info[index].flags |= DC_UNTOUCHED;
-
-#if 0 /* XXX: Let's see if this is needed at all.  */
+  /* DC_UNTOUCHED has been set by disk_cache_info_free_pop, so that we
+     catch if the page has not been read when we touch it below.  Until
+     it is cleared, nobody else can take a reference to the entry.  */
 
-  pthread_mutex_unlock (&disk_cache_lock);
-  pager_return_some (diskfs_disk_pager, bptr - disk_cache, vm_page_size, 1);
-  pthread_mutex_lock (&disk_cache_lock);
+  /* Re-associate.  */
+  STAT_ATOMIC_INC (disk_cache_misses);
+  state = __atomic_load_n (&info->state, __ATOMIC_RELAXED);
+  assert (! (state & DC_DONT_REUSE & ~DC_UNTOUCHED));
+  assert (! (state & DC_REF_MASK));
 
-  /* Has someone used our bptr?  Has someone mapped requested block
-     while we have unlocked disk_cache_lock?  If so, environment has
-     changed and we have to restart operation.  */
-  if ((! (disk_cache_info[index].flags & DC_UNTOUCHED))
-      || hurd_ihash_find (disk_cache_bptr, block))
+  /* New association.  */
+  if (hurd_cihash_add (&disk_cache_bptr, block, bptr))
+    ext2_panic ("Couldn't hurd_cihash_add new disk block");
+  if (info->block != DC_NO_BLOCK)
+    /* Remove old association.  */
     {
-      pthread_mutex_unlock (&disk_cache_lock);
-      goto retry_ref;
+      hurd_cihash_remove (&disk_cache_bptr, info->block);
+      if (state & DC_FREQUENT)
+	disk_cache_frequent--;
+      else
+	disk_cache_recent--;
+      disk_cache_ghost_add (info->block, state & DC_FREQUENT);
     }
-
-#elif 0
-
-  /* XXX: Use libpager internals.  */
-
-  pthread_mutex_lock (&diskfs_disk_pager->interlock);
-  int page = (bptr - disk_cache) / vm_page_size;
-  assert (page >= 0);
-  int is_incore = (page < diskfs_disk_pager->pagemapsize
-		   && (diskfs_disk_pager->pagemap[page] & PM_INCORE));
-  pthread_mutex_unlock (&diskfs_disk_pager->interlock);
-  if (is_incore)
+  __atomic_and_fetch (&info->state, ~(DC_REFERENCED | DC_FREQUENT),
+		      __ATOMIC_RELAXED);
+  if (disk_cache_ghost_hit (block))
     {
-      pthread_mutex_unlock (&disk_cache_lock);
-      printf ("INCORE\n");
-      goto retry_ref;
+      __atomic_or_fetch (&info->state, DC_FREQUENT, __ATOMIC_RELAXED);
+      disk_cache_frequent++;
     }
-
-#endif
-
-  /* Re-associate.  */
-
-  /* New association.  */
-  if (hurd_ihash_locp_add (disk_cache_bptr, slot, block, bptr))
-    ext2_panic ("Couldn't hurd_ihash_locp_add new disk block");
-  if (disk_cache_info[index].block != DC_NO_BLOCK)
-    /* Remove old association.  */
-    hurd_ihash_remove (disk_cache_bptr, disk_cache_info[index].block);
-  assert (! (disk_cache_info[index].flags & DC_DONT_REUSE & ~DC_UNTOUCHED));
-  disk_cache_info[index].block = block;
-  assert (! disk_cache_info[index].ref_count);
-  disk_cache_info[index].ref_count = 1;
+  else
+    disk_cache_recent++;
+  __atomic_store_n (&info->block, block, __ATOMIC_RELEASE);
+  __atomic_add_fetch (&info->state, 1, __ATOMIC_RELEASE);
 
   /* All data structures are set up.  */
   pthread_mutex_unlock (&disk_cache_lock);
@@ -1146,16 +2059,21 @@ retry_ref:
   *(volatile char *) bptr;
 
   /* Check if it's actually read.  */
-  pthread_mutex_lock (&disk_cache_lock);
-  if (disk_cache_info[index].flags & DC_UNTOUCHED)
+  if (__atomic_load_n (&info->state, __ATOMIC_ACQUIRE) & DC_UNTOUCHED)
     /* It's not read.  */
     {
       /* Remove newly created association.  */
-      hurd_ihash_remove (disk_cache_bptr, block);
-      disk_cache_info[index].block = DC_NO_BLOCK;
-      disk_cache_info[index].flags &=~ DC_UNTOUCHED;
-      disk_cache_info[index].ref_count = 0;
+      pthread_mutex_lock (&disk_cache_lock);
+      hurd_cihash_remove (&disk_cache_bptr, block);
+      __atomic_store_n (&info->block, DC_NO_BLOCK, __ATOMIC_RELAXED);
+      if (__atomic_fetch_and (&info->state, ~DC_FREQUENT, __ATOMIC_RELAXED)
+	  & DC_FREQUENT)
+	disk_cache_frequent--;
+      else
+	disk_cache_recent--;
+      __atomic_sub_fetch (&info->state, DC_UNTOUCHED + 1, __ATOMIC_RELEASE);
       pthread_mutex_unlock (&disk_cache_lock);
+      disk_cache_reassociation_done (index);
 
       /* Prepare next time association of this page to succeed.  */
       pager_flush_some (diskfs_disk_pager, bptr - disk_cache,
@@ -1169,9 +2087,7 @@ retry_ref:
     }
 
   /* Re-association was successful.  */
-  pthread_cond_broadcast (&disk_cache_reassociation);
-
-  pthread_mutex_unlock (&disk_cache_lock);
+  disk_cache_reassociation_done (index);
 
   ext2_debug ("(%u) = %p", block, bptr);
   return bptr;
@@ -1181,41 +2097,33 @@ void
 disk_cache_block_ref_ptr (void *ptr)
 {
   int index;
+  uint32_t state;
 
-  pthread_mutex_lock (&disk_cache_lock);
   index = bptr_index (ptr);
-  assert (disk_cache_info[index].ref_count >= 1);
-  assert (disk_cache_info[index].ref_count + 1
-	  > disk_cache_info[index].ref_count);
-  disk_cache_info[index].ref_count++;
-  assert (! (disk_cache_info[index].flags & DC_UNTOUCHED));
-  ext2_debug ("(%p) (ref_count = %hu, flags = %#hx)",
-	      ptr,
-	      disk_cache_info[index].ref_count,
-	      disk_cache_info[index].flags);
-  pthread_mutex_unlock (&disk_cache_lock);
+  state = __atomic_fetch_add (&disk_cache_info[index].state, 1,
+			      __ATOMIC_RELAXED);
+  assert ((state & DC_REF_MASK) >= 1);
+  assert ((state & DC_REF_MASK) != DC_REF_MASK);
+  assert (! (state & DC_UNTOUCHED));
+  ext2_debug ("(%p) (state = %#x)", ptr, state + 1);
 }
 
 void
 disk_cache_block_deref (void *ptr)
 {
   int index;
+  uint32_t state;
 
   assert (disk_cache <= ptr && ptr <= disk_cache + disk_cache_size);
 
-  pthread_mutex_lock (&disk_cache_lock);
   index = bptr_index (ptr);
-  ext2_debug ("(%p) (ref_count = %hu, flags = %#hx)",
-	      ptr,
-	      disk_cache_info[index].ref_count - 1,
-	      disk_cache_info[index].flags);
-  assert (! (disk_cache_info[index].flags & DC_UNTOUCHED));
-  assert (disk_cache_info[index].ref_count >= 1);
-  disk_cache_info[index].ref_count--;
-  if (disk_cache_info[index].ref_count == 0 &&
-      !(disk_cache_info[index].flags & DC_DONT_REUSE))
+  state = __atomic_sub_fetch (&disk_cache_info[index].state, 1,
+			      __ATOMIC_RELEASE);
+  ext2_debug ("(%p) (state = %#x)", ptr, state);
+  assert (! (state & DC_UNTOUCHED));
+  assert ((state & DC_REF_MASK) != DC_REF_MASK);
+  if ((state & DC_REF_MASK) == 0 && !(state & DC_DONT_REUSE))
     disk_cache_info_free_push (&disk_cache_info[index]);
-  pthread_mutex_unlock (&disk_cache_lock);
 }
 
 /* Not used.  */
@@ -1225,17 +2133,16 @@ disk_cache_block_is_ref (block_t block)
   int ref;
   void *ptr;
 
-  pthread_mutex_lock (&disk_cache_lock);
-  ptr = hurd_ihash_find (disk_cache_bptr, block);
+  ptr = hurd_cihash_find (&disk_cache_bptr, block);
   if (ptr == NULL)
     ref = 0;
   else				/* XXX: Should check for DC_UNTOUCHED too.  */
-    ref = disk_cache_info[bptr_index (ptr)].ref_count;
-  pthread_mutex_unlock (&disk_cache_lock);
+    ref = __atomic_load_n (&disk_cache_info[bptr_index (ptr)].state,
+			   __ATOMIC_RELAXED) & DC_REF_MASK;
 
   return ref;
 }
-
+
 /* Create the disk pager, and the file pager.  */
 void
 create_disk_pager (void)
@@ -1249,7 +2156,6 @@ create_disk_pager (void)
   upi->type = DISK;
   disk_pager_bucket = ports_create_bucket ();
   get_hypermetadata ();
-  disk_cache_blocks = DISK_CACHE_BLOCKS;
   disk_cache_size = disk_cache_blocks << log2_block_size;
   diskfs_start_disk_pager (upi, disk_pager_bucket, MAY_CACHE, 1,
 			   disk_cache_size, &disk_cache);
@@ -1257,9 +2163,11 @@ create_disk_pager (void)
 
   /* The file pager.  */
   file_pager_bucket = ports_create_bucket ();
+  pager_write_pages_hook = ext2_pager_write_pages;
 
   /* Start libpagers worker threads.  */
-  err = pager_start_workers (file_pager_bucket, &file_pager_requests);
+  err = pager_start_workers_n (file_pager_bucket, file_pager_worker_count,
+			       &file_pager_requests);
   if (err)
     ext2_panic ("can't create libpager worker threads: %s", strerror (err));
 }
@@ -0,0 +1,80 @@
+/* Just enough of ext2fs.h to build htree.c on the build machine.
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+typedef int error_t;
+typedef uint32_t block_t;
+typedef unsigned long vm_address_t;
+
+typedef uint8_t __u8;
+typedef int8_t __s8;
+typedef uint16_t __u16;
+typedef int16_t __s16;
+typedef uint32_t __u32;
+typedef int32_t __s32;
+
+/* ext2_fs.h defines ioctls not used here.  */
+#define _IOR(type, nr, size) 0
+#define _IOW(type, nr, size) 0
+
+#include "../ext2_fs.h"
+#include "../ext2_fs_i.h"
+
+struct protid;
+
+struct disknode
+{
+  struct ext2_inode_info info;
+};
+
+/* The fields of struct node that htree.c uses.  */
+struct node
+{
+  struct
+  {
+    off_t st_size;
+  } dn_stat;
+  off_t allocsize;
+  long long cache_id;		/* ino_t is 64 bits on the Hurd.  */
+  int dn_set_ctime;
+  struct disknode dn;
+};
+
+#define diskfs_node_disknode(np) (&(np)->dn)
+
+extern unsigned int block_size;
+extern struct ext2_super_block *sblock;
+
+/* The directory is mapped in a buffer large enough for any growth.  */
+static inline error_t
+diskfs_grow (struct node *np, off_t size, struct protid *cred)
+{
+  np->allocsize = size;
+  return 0;
+}
+
+#define ext2_warning(fmt, args...) \
+  fprintf (stderr, "warning: " fmt "\n" , ##args)
+
+/* The declarations of htree.c, taken from ext2fs.h.  */
+#include "htree-decl.h"
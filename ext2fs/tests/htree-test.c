@@ -0,0 +1,420 @@
+/* Test of the hashed directory indexes of htree.c
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+
+/* Build a directory in memory the way dir.c does, adding COUNT names
+   through the index of htree.c: the first block fills up and is made
+   indexed, leaves are split and a level is added to the index.  A
+   third of the names are then removed and added again, and the
+   directory is moved to another parent by rewriting its "..".  Every
+   name is looked up through the index after each step.  The names and
+   the blocks of the directory are then written out for htree-test.sh
+   to put in the ext2 image they were built for, and check there.  */
+
+#include "host.h"
+
+#include <error.h>
+#include <stdlib.h>
+#include <string.h>
+
+unsigned int block_size;
+static struct ext2_super_block super;
+struct ext2_super_block *sblock = &super;
+
+/* The directory, mapped at BUF of BUFSIZE bytes.  */
+static struct node dirnode;
+static struct node *dp = &dirnode;
+static char *buf;
+static size_t bufsize;
+
+/* What the index has been through.  */
+static int made_indexed, splits, levels_added;
+
+/* Return the entry of block BLOCK of the directory, if any, that holds
+   NAME of length NAMELEN.  Set *PREV to the entry before it, or to
+   NULL if it is the first of the block.  */
+static struct ext2_dir_entry_2 *
+scan_block (block_t block, const char *name, size_t namelen,
+	    struct ext2_dir_entry_2 **prev)
+{
+  char *blockaddr = buf + block * block_size;
+  struct ext2_dir_entry_2 *entry, *last = NULL;
+  size_t offset;
+
+  for (offset = 0; offset < block_size; offset += entry->rec_len)
+    {
+      entry = (void *) (blockaddr + offset);
+      if (entry->rec_len < EXT2_DIR_REC_LEN (1)
+	  || offset + entry->rec_len > block_size)
+	error (1, 0, "bad directory entry in block %u at %zu",
+	       block, offset);
+      if (entry->inode && entry->name_len == namelen
+	  && !memcmp (entry->name, name, namelen))
+	{
+	  *prev = last;
+	  return entry;
+	}
+      last = entry;
+    }
+  return NULL;
+}
+
+/* Add NAME of length NAMELEN, for inode INUM, to block BLOCK of the
+   directory, compressing the block if needed.  Return false if there
+   is no room for it.  */
+static int
+add_to_block (block_t block, const char *name, size_t namelen, ino_t inum)
+{
+  char *blockaddr = buf + block * block_size;
+  char copy[block_size];
+  struct ext2_dir_entry_2 *entry, *new = NULL;
+  size_t needed = EXT2_DIR_REC_LEN (namelen);
+  size_t offset, used, room = 0;
+
+  for (offset = 0; offset < block_size; offset += entry->rec_len)
+    {
+      entry = (void *) (blockaddr + offset);
+      used = entry->inode ? EXT2_DIR_REC_LEN (entry->name_len) : 0;
+      if (entry->rec_len - used >= needed)
+	{
+	  if (used)
+	    {
+	      new = (void *) entry + used;
+	      new->rec_len = entry->rec_len - used;
+	      entry->rec_len = used;
+	    }
+	  else
+	    new = entry;
+	  break;
+	}
+      room += entry->rec_len - used;
+    }
+
+  if (! new)
+    {
+      if (room < needed)
+	return 0;
+
+      /* Move the entries together to put the free space at the end.  */
+      used = 0;
+      for (offset = 0; offset < block_size; offset += entry->rec_len)
+	{
+	  entry = (void *) (blockaddr + offset);
+	  if (entry->inode)
+	    {
+	      struct ext2_dir_entry_2 *moved = (void *) (copy + used);
+	      memcpy (moved, entry, EXT2_DIR_REC_LEN (entry->name_len));
+	      moved->rec_len = EXT2_DIR_REC_LEN (entry->name_len);
+	      used += moved->rec_len;
+	    }
+	}
+      memcpy (blockaddr, copy, used);
+      new = (void *) (blockaddr + used);
+      new->rec_len = block_size - used;
+    }
+
+  new->inode = inum;
+  new->name_len = namelen;
+  new->file_type = (EXT2_HAS_INCOMPAT_FEATURE (sblock,
+					       EXT2_FEATURE_INCOMPAT_FILETYPE)
+		    ? EXT2_FT_REG_FILE : 0);
+  memcpy (new->name, name, namelen);
+  return 1;
+}
+
+/* Look up NAME in the directory as dir.c does, through the index if
+   there is one.  Return its entry, if any, and set *PREV as for
+   scan_block.  For a name that is not there, set *LEAF and PATH to the
+   last leaf block it can go in.  Set *INDEXED to whether the index is
+   kept up to date by changing the entry there, as dirscanindex does.  */
+static struct ext2_dir_entry_2 *
+lookup (const char *name, struct ext2_dir_entry_2 **prev,
+	struct ext2_dx_path *path, block_t *leaf, int *indexed)
+{
+  size_t namelen = strlen (name);
+  struct ext2_dir_entry_2 *entry;
+  block_t block;
+
+  if (ext2_dir_is_indexed (dp))
+    {
+      if (ext2_dx_probe (dp, (vm_address_t) buf, name, namelen, path, leaf))
+	error (1, 0, "the index is corrupt");
+      do
+	entry = scan_block (*leaf, name, namelen, prev);
+      while (! entry
+	     && ext2_dx_next_leaf (dp, (vm_address_t) buf, path, leaf));
+      *indexed = path->levels > 0 || entry;
+      return entry;
+    }
+
+  *indexed = 0;
+  for (block = 0; block < dp->dn_stat.st_size / block_size; block++)
+    if ((entry = scan_block (block, name, namelen, prev)))
+      return entry;
+  return NULL;
+}
+
+/* Return the inode NAME is for, or 0 if it is not in the directory.  */
+static ino_t
+find (const char *name)
+{
+  struct ext2_dir_entry_2 *entry, *prev;
+  struct ext2_dx_path path;
+  block_t leaf;
+  int indexed;
+
+  entry = lookup (name, &prev, &path, &leaf, &indexed);
+  return entry ? entry->inode : 0;
+}
+
+/* Add NAME, for inode INUM, to the directory.  */
+static void
+add (const char *name, ino_t inum)
+{
+  size_t namelen = strlen (name);
+  struct ext2_dir_entry_2 *prev;
+  struct ext2_dx_path path;
+  block_t leaf;
+  int indexed, levels;
+  error_t err;
+
+  if (lookup (name, &prev, &path, &leaf, &indexed))
+    error (1, 0, "%s is already there", name);
+
+  if (ext2_dir_is_indexed (dp))
+    {
+      /* Use the first leaf the name can be in with room for it, or
+	 split the last one, as dir.c does.  */
+      if (ext2_dx_probe (dp, (vm_address_t) buf, name, namelen,
+			 &path, &leaf))
+	error (1, 0, "the index is corrupt");
+      do
+	if (add_to_block (leaf, name, namelen, inum))
+	  return;
+      while (ext2_dx_next_leaf (dp, (vm_address_t) buf, &path, &leaf));
+
+      if (dp->dn_stat.st_size + 2 * block_size > bufsize)
+	error (1, 0, "the directory is too large");
+      levels = path.levels;
+      err = ext2_dx_split (dp, (vm_address_t) buf, &path, &leaf, NULL);
+      if (err)
+	error (1, err, "cannot split leaf block %u for %s", leaf, name);
+      splits++;
+      if (path.levels > levels)
+	levels_added++;
+    }
+  else
+    {
+      if (add_to_block (0, name, namelen, inum))
+	return;
+      err = ext2_dx_make_indexed (dp, (vm_address_t) buf, name, namelen,
+				  &path, &leaf, NULL);
+      if (err)
+	error (1, err, "cannot index the directory for %s", name);
+      made_indexed++;
+    }
+
+  if (! add_to_block (leaf, name, namelen, inum))
+    error (1, 0, "no room for %s in leaf block %u", name, leaf);
+}
+
+/* Remove NAME from the directory.  */
+static void
+remove_name (const char *name)
+{
+  struct ext2_dir_entry_2 *entry, *prev;
+  struct ext2_dx_path path;
+  block_t leaf;
+  int indexed;
+
+  entry = lookup (name, &prev, &path, &leaf, &indexed);
+  if (! entry)
+    error (1, 0, "%s is missing", name);
+  if (! indexed)
+    error (1, 0, "%s was not found through the index", name);
+
+  if (prev)
+    prev->rec_len += entry->rec_len;
+  else
+    entry->inode = 0;
+}
+
+/* Point ".." of the directory to PARENT, as renaming it does.  */
+static void
+set_parent (ino_t parent)
+{
+  struct ext2_dir_entry_2 *entry, *prev;
+  struct ext2_dx_path path;
+  block_t leaf;
+  int indexed;
+
+  entry = lookup ("..", &prev, &path, &leaf, &indexed);
+  if (! entry)
+    error (1, 0, ".. is missing");
+  entry->inode = parent;
+  if (! indexed)
+    diskfs_node_disknode (dp)->info.i_flags &= ~EXT2_INDEX_FL;
+}
+
+/* Fill in the first block of the directory, for inode SELF in PARENT.  */
+static void
+init_dir (ino_t self, ino_t parent)
+{
+  struct ext2_dir_entry_2 *entry = (void *) buf;
+  int filetype = EXT2_HAS_INCOMPAT_FEATURE (sblock,
+					    EXT2_FEATURE_INCOMPAT_FILETYPE);
+
+  entry->inode = self;
+  entry->rec_len = EXT2_DIR_REC_LEN (1);
+  entry->name_len = 1;
+  entry->file_type = filetype ? EXT2_FT_DIR : 0;
+  memcpy (entry->name, ".", 1);
+
+  entry = (void *) buf + EXT2_DIR_REC_LEN (1);
+  entry->inode = parent;
+  entry->rec_len = block_size - EXT2_DIR_REC_LEN (1);
+  entry->name_len = 2;
+  entry->file_type = filetype ? EXT2_FT_DIR : 0;
+  memcpy (entry->name, "..", 2);
+
+  dp->dn_stat.st_size = dp->allocsize = block_size;
+}
+
+/* Set NAME to the Nth name, of a random length that is sometimes
+   long.  The same names are made on every run.  */
+static void
+make_name (char *name, long n)
+{
+  static uint32_t state = 2463534242U;
+  int len, i;
+
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  len = state % 50 == 0 ? 100 + state % 140 : state % 40;
+
+  i = sprintf (name, "f%ld", n);
+  while (len-- > 0)
+    {
+      state ^= state << 13;
+      state ^= state >> 17;
+      state ^= state << 5;
+      name[i++] = 'a' + state % 26;
+    }
+  name[i] = '\0';
+}
+
+/* Check that all COUNT names of NAMES are found for inode INUM.  */
+static void
+check (char (*names)[EXT2_NAME_LEN + 1], long count, ino_t inum,
+       const char *when)
+{
+  long i;
+
+  for (i = 0; i < count; i++)
+    if (find (names[i]) != inum)
+      error (1, 0, "%s: %s is not found", when, names[i]);
+  if (find ("absent") || find ("f0absent"))
+    error (1, 0, "%s: an absent name is found", when);
+}
+
+int
+main (int argc, char **argv)
+{
+  char (*names)[EXT2_NAME_LEN + 1];
+  ino_t self, parent, new_parent, inum;
+  long count, i;
+  FILE *f;
+
+  if (argc != 9)
+    error (1, 0, "Usage: %s IMAGE DIR PARENT NEW-PARENT FILE COUNT "
+	   "NAMES-OUT DIR-OUT", argv[0]);
+
+  /* The hash function and its seed are the ones of the image, whose
+     superblock is at its usual place.  */
+  f = fopen (argv[1], "r");
+  if (! f)
+    error (1, errno, "%s", argv[1]);
+  if (fseek (f, EXT2_MIN_BLOCK_SIZE, SEEK_SET)
+      || fread (&super, sizeof super, 1, f) != 1)
+    error (1, 0, "%s: cannot read the superblock", argv[1]);
+  fclose (f);
+  if (super.s_magic != EXT2_SUPER_MAGIC
+      || ! EXT2_HAS_COMPAT_FEATURE (sblock, EXT2_FEATURE_COMPAT_DIR_INDEX))
+    error (1, 0, "%s: not an ext2 file system with dir_index", argv[1]);
+  block_size = EXT2_MIN_BLOCK_SIZE << super.s_log_block_size;
+
+  self = atol (argv[2]);
+  parent = atol (argv[3]);
+  new_parent = atol (argv[4]);
+  inum = atol (argv[5]);
+  count = atol (argv[6]);
+
+  /* Leaves are at least half full, and the index needs few blocks.  */
+  bufsize = 2 * count * EXT2_DIR_REC_LEN (EXT2_NAME_LEN) + 8 * block_size;
+  buf = calloc (1, bufsize);
+  names = calloc (count, sizeof *names);
+  if (! buf || ! names)
+    error (1, errno, "cannot allocate the directory");
+
+  init_dir (self, parent);
+  for (i = 0; i < count; i++)
+    {
+      make_name (names[i], i);
+      add (names[i], inum);
+    }
+  check (names, count, inum, "after adding");
+
+  for (i = 0; i < count; i += 3)
+    remove_name (names[i]);
+  for (i = 0; i < count; i++)
+    if (find (names[i]) != (i % 3 ? inum : 0))
+      error (1, 0, "after removing: %s is wrong", names[i]);
+  for (i = 0; i < count; i += 3)
+    add (names[i], inum);
+  check (names, count, inum, "after adding again");
+
+  set_parent (new_parent);
+  if (! ext2_dir_is_indexed (dp))
+    error (1, 0, "moving the directory dropped its index");
+  if (find ("..") != new_parent)
+    error (1, 0, "after moving: .. is wrong");
+  check (names, count, inum, "after moving");
+
+  if (made_indexed != 1 || splits == 0 || levels_added != 1)
+    error (1, 0, "not every case was tried: indexed %d, splits %d, "
+	   "levels added %d; try more names", made_indexed, splits,
+	   levels_added);
+
+  printf ("%ld names in %ld blocks, %d splits\n", count,
+	  (long) (dp->dn_stat.st_size / block_size), splits);
+
+  f = fopen (argv[7], "w");
+  if (! f)
+    error (1, errno, "%s", argv[7]);
+  for (i = 0; i < count; i++)
+    fprintf (f, "%s\n", names[i]);
+  if (fclose (f))
+    error (1, errno, "%s", argv[7]);
+
+  f = fopen (argv[8], "w");
+  if (! f)
+    error (1, errno, "%s", argv[8]);
+  if (fwrite (buf, dp->dn_stat.st_size, 1, f) != 1 || fclose (f))
+    error (1, errno, "%s", argv[8]);
+
+  return 0;
+}
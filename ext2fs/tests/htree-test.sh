@@ -0,0 +1,114 @@
+#!/bin/sh
+# Check the directory index built by htree-test with e2fsprogs.
+#
+#   Copyright (C) 2026 Free Software Foundation, Inc.
+#
+#   This program is free software; you can redistribute it and/or
+#   modify it under the terms of the GNU General Public License as
+#   published by the Free Software Foundation; either version 2, or (at
+#   your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful, but
+#   WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+#   General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+# Make an image with the directory a/d and an empty directory b, have
+# htree-test build d with enough hard links to the file x for its
+# index to grow a level, and move it to b, and put the blocks it built in place of those of d.  Then b/d must
+# pass e2fsck, which checks the index, still be indexed, and hold
+# exactly the names added.  Every block size and hash function is
+# tried.
+
+set -e
+
+img=htree-test.img
+tmp=${TMPDIR:-/tmp}/htree-test.$$
+trap 'rm -rf $tmp' 0
+mkdir $tmp
+
+PATH=$PATH:/sbin:/usr/sbin
+
+run ()
+{
+  debugfs -w -R "$1" $img > /dev/null 2>&1
+}
+
+inode ()
+{
+  debugfs -R "stat $1" $img 2> /dev/null \
+    | sed -n 's/^Inode: *\([0-9]*\).*/\1/p'
+}
+
+fail ()
+{
+  echo "htree-test: $*" >&2
+  exit 1
+}
+
+for bs in 1024 2048 4096; do
+  # About as many names as it takes for the index to grow a level.
+  count=$((bs * bs / 300))
+  for hash in legacy half_md4 tea; do
+    echo "block size $bs, hash $hash"
+    rm -f $img
+    mke2fs -q -F -t ext2 -b $bs -O dir_index -N 64 $img 32M > /dev/null
+    run "ssv def_hash_version $hash"
+    echo x > $tmp/x
+    run "write $tmp/x x"
+    run "mkdir a"
+    run "mkdir b"
+    run "mkdir a/d"
+
+    ./htree-test $img $(inode a/d) $(inode a) $(inode b) $(inode x) \
+      $count $tmp/names $tmp/dir
+
+    # Give d as many blocks as the directory built, and copy them in.
+    blocks=$(($(wc -c < $tmp/dir) / bs))
+    i=1
+    while [ $i -lt $blocks ]; do
+      echo "expand_dir a/d"
+      i=$((i + 1))
+    done > $tmp/cmds
+    debugfs -w -f $tmp/cmds $img > /dev/null 2>&1
+    i=0
+    while [ $i -lt $blocks ]; do
+      echo "bmap a/d $i"
+      i=$((i + 1))
+    done > $tmp/cmds
+    debugfs -f $tmp/cmds $img 2> /dev/null | grep -v '^debugfs' > $tmp/blocks
+    [ $(wc -l < $tmp/blocks) -eq $blocks ] || fail "cannot give d $blocks blocks"
+    i=0
+    while read block; do
+      dd if=$tmp/dir of=$img bs=$bs skip=$i seek=$block count=1 \
+	 conv=notrunc 2> /dev/null
+      i=$((i + 1))
+    done < $tmp/blocks
+    run "sif a/d flags 0x1000"
+    run "sif x links_count $((count + 1))"
+
+    # Move d to b, as htree-test did with its "..".
+    run "link a/d b/d"
+    run "unlink a/d"
+    run "sif a links_count 2"
+    run "sif b links_count 3"
+
+    e2fsck -fn $img > $tmp/fsck 2>&1 || { cat $tmp/fsck; fail "e2fsck failed"; }
+
+    debugfs -R "stat b/d" $img 2> /dev/null | grep -q 'Flags: 0x1000' \
+      || fail "b/d is not indexed"
+    debugfs -R "ls -p b/d" $img 2> /dev/null \
+      | awk -F/ 'NF > 5 && $2 != 0 { print $2 " " $6 }' | sort > $tmp/list
+    { echo "$(inode b) .."
+      echo "$(inode b/d) ."
+      sed "s/^/$(inode x) /" $tmp/names; } | sort > $tmp/expected
+    cmp -s $tmp/list $tmp/expected || fail "b/d does not hold the names added"
+  done
+done
+
+rm -f $img
+echo "htree-test: all passed"
@@ -338,19 +338,28 @@ diskfs_truncate (struct node *node, off_t length)
       block_t *bptrs = diskfs_node_disknode (node)->info.i_data;
       struct free_block_run fbr;
 
-      free_block_run_init (&fbr, node);
+      if (diskfs_node_disknode (node)->info.i_flags & EXT2_EXTENTS_FL)
+	ext2_extent_truncate (node, end);
+      else
+	{
+	  free_block_run_init (&fbr, node);
 
-      trunc_direct (node, end, &fbr);
+	  trunc_direct (node, end, &fbr);
 
-      offs = EXT2_NDIR_BLOCKS;
-      trunc_single_indirect (node, end, bptrs + EXT2_IND_BLOCK, offs, &fbr);
-      offs += addr_per_block;
-      trunc_double_indirect (node, end, bptrs + EXT2_DIND_BLOCK, offs, &fbr);
-      offs += addr_per_block * addr_per_block;
-      trunc_triple_indirect (node, end, bptrs + EXT2_TIND_BLOCK, offs, &fbr);
+	  offs = EXT2_NDIR_BLOCKS;
+	  trunc_single_indirect (node, end, bptrs + EXT2_IND_BLOCK, offs,
+				 &fbr);
+	  offs += addr_per_block;
+	  trunc_double_indirect (node, end, bptrs + EXT2_DIND_BLOCK, offs,
+				 &fbr);
+	  offs += addr_per_block * addr_per_block;
+	  trunc_triple_indirect (node, end, bptrs + EXT2_TIND_BLOCK, offs,
+				 &fbr);
 
-      free_block_run_finish (&fbr);
+	  free_block_run_finish (&fbr);
+	}
 
+      delalloc_truncate (node, end);
       node->allocsize = round_block (length);
 
       /* Set our last_page_partially_writable to a pessimistic state -- it
@@ -361,6 +370,9 @@ diskfs_truncate (struct node *node, off_t length)
       diskfs_end_catch_exception ();
     }
 
+  /* Even if freeing failed half-way, the cached runs may be stale.  */
+  ext2_bmap_cache_flush (node);
+
   node->dn_set_mtime = 1;
   node->dn_set_ctime = 1;
   node->dn_stat_dirty = 1;
@@ -64,6 +64,7 @@ diskfs_clear_directory (struct node *dp,
   pdp->dn_stat.st_nlink--;
   pdp->dn_set_ctime = 1;
 
+  _diskfs_drop_map_windows (dp);
   diskfs_truncate (dp, 0);
 
   return err;
@@ -126,6 +126,9 @@ struct node
   loff_t allocsize;
 
   ino64_t cache_id;
+
+  /* Mappings of the file kept by _diskfs_rdwr_internal.  */
+  struct _diskfs_map_window *map_windows;
 };
 
 struct diskfs_control
@@ -168,6 +168,7 @@ diskfs_S_file_set_translator (struct protid *cred,
 		  np->dn_stat.st_rdev = makedev (major, minor);
 		}
 
+	      _diskfs_drop_map_windows (np);
 	      diskfs_truncate (np, 0);
 	      if (newmode == S_IFLNK)
 		{
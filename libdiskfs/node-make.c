@@ -38,6 +38,7 @@ init_node (struct node *np, struct disknode *dn)
   np->dirmod_tick = 0;
   np->filemod_reqs = 0;
   np->filemod_tick = 0;
+  np->map_windows = NULL;
 
   fshelp_transbox_init (&np->transbox, &np->lock, np);
   iohelp_initialize_conch (&np->conch, &np->lock);
@@ -49,6 +49,7 @@ diskfs_nrele (struct node *np)
 	     routine, which might result in further recursive calls to
 	     the ref-counting system.  This is not a problem, as we
 	     hold a weak reference ourselves. */
+	  _diskfs_drop_map_windows (np);
 	  diskfs_try_dropping_softrefs (np);
 	}
     }
@@ -86,6 +86,13 @@ typedef struct bootinfo *bootinfo_t;
 error_t _diskfs_rdwr_internal (struct node *np, char *data, off_t offset,
 			       size_t *amt, int dir, int notime);
 
+/* Drop the file mappings _diskfs_rdwr_internal keeps for locked node NP,
+   before it is truncated or to let it go away.  */
+void _diskfs_drop_map_windows (struct node *np);
+
+/* Drop the file mappings of all nodes.  */
+void _diskfs_drop_all_map_windows (void);
+
 /* Called when we have a real user environment (complete with proc
    and auth ports). */
 void _diskfs_init_completed (void);
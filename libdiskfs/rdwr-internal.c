@@ -19,6 +19,307 @@
 #include <string.h>
 #include <fcntl.h>
 #include <hurd/pager.h>
+#include <hurd/sigpreempt.h>
+#include <setjmp.h>
+
+/* Reads and writes of at most this many bytes are done through windows
+   mapping the file's memory object that are kept across calls, so that
+   a sequence of small reads or writes doesn't map and unmap the file
+   each time.  Larger ones are left to pager_memcpy, which may use
+   vm_copy for them.  Windows are aligned to their size.  */
+#define MAP_WINDOW_SIZE		(32 * vm_page_size)
+
+/* How many windows a node may have, and how many all nodes together may
+   have.  A window keeps its memory object, and thus the node, from going
+   away.  Mapped windows don't use memory themselves, but the least
+   recently used ones are dropped to bound the address space used.  */
+#define MAP_WINDOWS_PER_NODE	4
+#define MAP_WINDOWS_MAX		64
+
+struct _diskfs_map_window
+{
+  struct node *np;
+  struct _diskfs_map_window *next;	/* In NP's list.  */
+  struct _diskfs_map_window *lru_next, *lru_prev;
+  vm_address_t addr;
+  vm_offset_t offset;
+  vm_prot_t prot;
+  int busy;			/* Being copied from or to.  */
+};
+
+/* Protects the lists of windows of all nodes, the LRU list and the BUSY
+   flags.  Windows are only used with their node locked, but may be
+   dropped by the users of other nodes, unless they are busy.  */
+static pthread_mutex_t map_windows_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* All windows, most recently used first.  */
+static struct _diskfs_map_window *map_windows_lru, *map_windows_lru_tail;
+static int map_windows_count;
+
+/* Remove W from its node's list and the LRU list.  MAP_WINDOWS_LOCK must
+   be held.  */
+static void
+window_unlink (struct _diskfs_map_window *w)
+{
+  struct _diskfs_map_window **wp;
+
+  for (wp = &w->np->map_windows; *wp != w; wp = &(*wp)->next)
+    assert (*wp);
+  *wp = w->next;
+
+  if (w->lru_prev)
+    w->lru_prev->lru_next = w->lru_next;
+  else
+    map_windows_lru = w->lru_next;
+  if (w->lru_next)
+    w->lru_next->lru_prev = w->lru_prev;
+  else
+    map_windows_lru_tail = w->lru_prev;
+
+  map_windows_count--;
+}
+
+/* Put W at the head of the LRU list.  MAP_WINDOWS_LOCK must be held.  */
+static void
+window_link (struct _diskfs_map_window *w)
+{
+  w->next = w->np->map_windows;
+  w->np->map_windows = w;
+
+  w->lru_prev = NULL;
+  w->lru_next = map_windows_lru;
+  if (map_windows_lru)
+    map_windows_lru->lru_prev = w;
+  else
+    map_windows_lru_tail = w;
+  map_windows_lru = w;
+
+  map_windows_count++;
+}
+
+/* Unmap and free the windows in the list linked through NEXT at W.  */
+static void
+windows_free (struct _diskfs_map_window *w)
+{
+  while (w)
+    {
+      struct _diskfs_map_window *next = w->next;
+      vm_deallocate (mach_task_self (), w->addr, MAP_WINDOW_SIZE);
+      free (w);
+      w = next;
+    }
+}
+
+/* Return a window of locked node NP at OFFSET (a multiple of
+   MAP_WINDOW_SIZE) allowing PROT, marked busy, or set *ERR.  */
+static struct _diskfs_map_window *
+window_get (struct node *np, vm_offset_t offset, vm_prot_t prot,
+	    error_t *err)
+{
+  struct _diskfs_map_window *w, *victims = NULL, *oldest = NULL;
+  memory_object_t memobj;
+  int n = 0;
+
+  pthread_mutex_lock (&map_windows_lock);
+
+  for (w = np->map_windows; w; w = w->next)
+    {
+      assert (! w->busy);
+      if (w->offset == offset && (w->prot & prot) == prot)
+	break;
+      n++;
+    }
+
+  if (w)
+    {
+      /* Move it to the head of the LRU list.  */
+      window_unlink (w);
+      window_link (w);
+      w->busy = 1;
+      pthread_mutex_unlock (&map_windows_lock);
+      return w;
+    }
+
+  /* Make room for a new one.  */
+  if (n >= MAP_WINDOWS_PER_NODE)
+    for (w = map_windows_lru_tail; w; w = w->lru_prev)
+      if (w->np == np)
+	{
+	  oldest = w;
+	  break;
+	}
+  if (oldest == NULL && map_windows_count >= MAP_WINDOWS_MAX)
+    for (w = map_windows_lru_tail; w; w = w->lru_prev)
+      if (! w->busy)
+	{
+	  oldest = w;
+	  break;
+	}
+  if (oldest)
+    {
+      window_unlink (oldest);
+      oldest->next = victims;
+      victims = oldest;
+    }
+
+  /* A window at OFFSET without PROT is replaced.  */
+  for (w = np->map_windows; w; w = w->next)
+    if (w->offset == offset)
+      {
+	window_unlink (w);
+	w->next = victims;
+	victims = w;
+	break;
+      }
+
+  pthread_mutex_unlock (&map_windows_lock);
+
+  windows_free (victims);
+
+  w = malloc (sizeof *w);
+  if (! w)
+    {
+      *err = ENOMEM;
+      return NULL;
+    }
+
+  memobj = diskfs_get_filemap (np, prot);
+  if (memobj == MACH_PORT_NULL)
+    {
+      *err = errno;
+      free (w);
+      return NULL;
+    }
+
+  w->addr = 0;
+  *err = vm_map (mach_task_self (), &w->addr, MAP_WINDOW_SIZE, 0, 1,
+		 memobj, offset, 0, prot, prot, VM_INHERIT_NONE);
+  mach_port_deallocate (mach_task_self (), memobj);
+  if (*err)
+    {
+      free (w);
+      return NULL;
+    }
+
+  w->np = np;
+  w->offset = offset;
+  w->prot = prot;
+  w->busy = 1;
+
+  pthread_mutex_lock (&map_windows_lock);
+  window_link (w);
+  pthread_mutex_unlock (&map_windows_lock);
+
+  return w;
+}
+
+/* Copy *AMT bytes between DATA and the file of locked node NP at OFFSET
+   through its windows, like pager_memcpy.  */
+static error_t
+window_memcpy (struct node *np, vm_offset_t offset, char *data, size_t *amt,
+	       vm_prot_t prot)
+{
+  struct _diskfs_map_window *w = NULL;
+  vm_offset_t start;
+  size_t n = *amt, len = 0;
+  error_t err = 0;
+  jmp_buf buf;
+
+  error_t copy (struct hurd_signal_preemptor *preemptor)
+    {
+      if (prot == VM_PROT_READ)
+	memcpy (data, (void *) w->addr + (offset - w->offset), len);
+      else
+	memcpy ((void *) w->addr + (offset - w->offset), data, len);
+      return 0;
+    }
+
+  void fault (int signo, long int sigcode, struct sigcontext *scp)
+    {
+      assert (scp->sc_error == EKERN_MEMORY_ERROR);
+      err = pager_get_error (diskfs_get_filemap_pager_struct (np),
+			     sigcode - w->addr + w->offset);
+      n -= sigcode - (w->addr + (offset - w->offset));
+      longjmp (buf, 1);
+    }
+
+  while (n > 0)
+    {
+      start = offset - offset % MAP_WINDOW_SIZE;
+      w = window_get (np, start, prot, &err);
+      if (! w)
+	break;
+
+      len = start + MAP_WINDOW_SIZE - offset;
+      if (len > n)
+	len = n;
+
+      if (setjmp (buf) == 0)
+	hurd_catch_signal (sigmask (SIGSEGV) | sigmask (SIGBUS),
+			   w->addr, w->addr + MAP_WINDOW_SIZE,
+			   &copy, (sighandler_t) &fault);
+
+      if (err)
+	{
+	  /* Don't keep a window that faulted.  */
+	  pthread_mutex_lock (&map_windows_lock);
+	  window_unlink (w);
+	  pthread_mutex_unlock (&map_windows_lock);
+	  w->next = NULL;
+	  windows_free (w);
+	  break;
+	}
+
+      w->busy = 0;
+      offset += len;
+      data += len;
+      n -= len;
+    }
+
+  *amt -= n;
+  return err;
+}
+
+/* Drop the windows of locked node NP.  */
+void
+_diskfs_drop_map_windows (struct node *np)
+{
+  struct _diskfs_map_window *w, *victims = NULL;
+
+  if (np->map_windows == NULL)
+    return;
+
+  pthread_mutex_lock (&map_windows_lock);
+  while ((w = np->map_windows))
+    {
+      assert (! w->busy);
+      window_unlink (w);
+      w->next = victims;
+      victims = w;
+    }
+  pthread_mutex_unlock (&map_windows_lock);
+
+  windows_free (victims);
+}
+
+/* Drop the windows of all nodes.  No read or write may be in progress.  */
+void
+_diskfs_drop_all_map_windows (void)
+{
+  struct _diskfs_map_window *w, *victims = NULL;
+
+  pthread_mutex_lock (&map_windows_lock);
+  while ((w = map_windows_lru))
+    {
+      assert (! w->busy);
+      window_unlink (w);
+      w->next = victims;
+      victims = w;
+    }
+  pthread_mutex_unlock (&map_windows_lock);
+
+  windows_free (victims);
+}
 
 /* Actually read or write a file.  The file size must already permit
    the requested access.  NP is the file to read/write.  DATA is a buffer
@@ -53,18 +354,23 @@ _diskfs_rdwr_internal (struct node *np,
 	np->dn_set_atime = 1;
     }
 
-  memobj = diskfs_get_filemap (np, prot);
-
-  if (memobj == MACH_PORT_NULL)
-    return errno;
-
   /* pager_memcpy inherently uses vm_offset_t, which may be smaller than off_t.  */
   if (sizeof(off_t) > sizeof(vm_offset_t) &&
       offset + *amt > ((off_t) 1) << (sizeof(vm_offset_t) * 8))
     err = EFBIG;
+  else if (*amt <= MAP_WINDOW_SIZE)
+    err = window_memcpy (np, offset, data, amt, prot);
   else
-    err = pager_memcpy (diskfs_get_filemap_pager_struct (np), memobj,
-		      offset, data, amt, prot);
+    {
+      memobj = diskfs_get_filemap (np, prot);
+      if (memobj == MACH_PORT_NULL)
+	return errno;
+
+      err = pager_memcpy (diskfs_get_filemap_pager_struct (np), memobj,
+			  offset, data, amt, prot);
+
+      mach_port_deallocate (mach_task_self (), memobj);
+    }
 
   if (!diskfs_check_readonly () && !notime)
     {
@@ -74,6 +380,5 @@ _diskfs_rdwr_internal (struct node *np,
 	np->dn_set_atime = 1;
     }
 
-  mach_port_deallocate (mach_task_self (), memobj);
   return err;
 }
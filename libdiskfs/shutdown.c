@@ -74,6 +74,9 @@ diskfs_shutdown (int flags)
       return err;
     }
 
+  /* Our own mappings of files don't count as users.  */
+  _diskfs_drop_all_map_windows ();
+
   /* Write everything out and set "clean" state.  Even if we don't in fact
      shut down now, this has the nice effect that a disk that has not been
      written for a long time will not need checking after a crash.  */
@@ -67,6 +67,39 @@ struct hurd_slab
   union hurd_bufctl *free_list;
 };
 
+/* A magazine holds up to SPACE->magazine_size constructed objects
+   which are allocated as far as the slab layer is concerned.  */
+struct hurd_slab_magazine
+{
+  struct hurd_slab_magazine *next;
+
+  /* The number of objects in OBJS.  */
+  size_t rounds;
+
+  void *objs[];
+};
+
+/* The per-thread cache of a slab space using the magazine layer.
+   Only the owning thread touches it, except for the statistics, which
+   hurd_slab_get_stats reads, and when the slab space is destroyed.  */
+struct hurd_slab_cache
+{
+  struct hurd_slab_space *space;
+
+  /* In the list of caches of SPACE.  */
+  struct hurd_slab_cache *next;
+  struct hurd_slab_cache **prevp;
+
+  /* The magazine objects are taken from and put into, and the one
+     used before.  Both are always present.  */
+  struct hurd_slab_magazine *loaded;
+  struct hurd_slab_magazine *previous;
+
+  unsigned long allocs;
+  unsigned long deallocs;
+};
+
+
 /* Allocate a buffer in *PTR of size SIZE which must be a power of 2
    and self aligned (i.e. aligned on a SIZE byte boundary) for slab
    space SPACE.  Return 0 on success, an error code on failure.  */
@@ -384,6 +417,10 @@ hurd_slab_create (size_t size, size_t alignment,
 }
 
 
+static void flush_magazines (hurd_slab_space_t space);
+static void cache_release (hurd_slab_space_t space,
+			   struct hurd_slab_cache *cache);
+
 /* Destroy all objects and the slab space SPACE.  Returns EBUSY if
    there are still allocated objects in the slab.  */
 error_t
@@ -391,6 +428,10 @@ hurd_slab_destroy (hurd_slab_space_t space)
 {
   error_t err;
 
+  /* Objects cached in magazines are not outstanding allocations.  */
+  if (space->magazine_size)
+    flush_magazines (space);
+
   /* The caller wants to destroy the slab.  It can not be destroyed if
      there are any outstanding memory allocations.  */
   pthread_mutex_lock (&space->lock);
@@ -411,6 +452,16 @@ hurd_slab_destroy (hurd_slab_space_t space)
 
   /* FIXME: Remove slab space from pager's reap functionality.  */
 
+  if (space->magazine_size)
+    {
+      /* Deleting the key makes sure that exiting threads do not touch
+	 their caches anymore, so we can free them.  */
+      pthread_key_delete (space->cache_key);
+      while (space->caches)
+	cache_release (space, space->caches);
+      pthread_mutex_destroy (&space->depot_lock);
+    }
+
   return 0;
 }
 
@@ -429,9 +480,9 @@ hurd_slab_free (hurd_slab_space_t space)
 }
 
 
-/* Allocate a new object from the slab space SPACE.  */
-error_t
-hurd_slab_alloc (hurd_slab_space_t space, void **buffer)
+/* Allocate a new object from the slabs of the slab space SPACE.  */
+static error_t
+slab_alloc (hurd_slab_space_t space, void **buffer)
 {
   error_t err;
   union hurd_bufctl *bufctl;
@@ -477,6 +528,7 @@ hurd_slab_alloc (hurd_slab_space_t space, void **buffer)
       space->first_free = new_first;
     }
   *buffer = ((void *) bufctl) - (space->size - sizeof *bufctl);
+  space->slab_allocs++;
   pthread_mutex_unlock (&space->lock);
   return 0;
 }
@@ -492,17 +544,14 @@ put_on_slab_list (struct hurd_slab *slab, union hurd_bufctl *bufctl)
 }
 
 
-/* Deallocate the object BUFFER from the slab space SPACE.  */
-void
-hurd_slab_dealloc (hurd_slab_space_t space, void *buffer)
+/* Return the object BUFFER to its slab in the slab space SPACE.
+   SPACE must be locked.  */
+static void
+slab_dealloc_locked (hurd_slab_space_t space, void *buffer)
 {
   struct hurd_slab *slab;
   union hurd_bufctl *bufctl;
 
-  assert (space->initialized);
-
-  pthread_mutex_lock (&space->lock);
-
   bufctl = (buffer + (space->size - sizeof *bufctl));
   put_on_slab_list (slab = bufctl->slab, bufctl);
 
@@ -514,5 +563,362 @@ hurd_slab_dealloc (hurd_slab_space_t space, void *buffer)
       || slab->refcount < space->first_free->refcount)
     space->first_free = slab;
 
+  space->slab_deallocs++;
+}
+
+
+/* Return all objects in MAGAZINE to their slabs in the slab space
+   SPACE.  */
+static void
+magazine_empty (hurd_slab_space_t space, struct hurd_slab_magazine *magazine)
+{
+  size_t i;
+
+  if (magazine->rounds > 0)
+    {
+      pthread_mutex_lock (&space->lock);
+      for (i = 0; i < magazine->rounds; i++)
+	slab_dealloc_locked (space, magazine->objs[i]);
+      pthread_mutex_unlock (&space->lock);
+      magazine->rounds = 0;
+    }
+}
+
+
+/* Like magazine_empty, but also free MAGAZINE.  */
+static void
+magazine_release (hurd_slab_space_t space,
+		  struct hurd_slab_magazine *magazine)
+{
+  magazine_empty (space, magazine);
+  free (magazine);
+}
+
+
+/* Allocate an empty magazine for the slab space SPACE.  */
+static struct hurd_slab_magazine *
+magazine_alloc (hurd_slab_space_t space)
+{
+  struct hurd_slab_magazine *magazine;
+
+  magazine = malloc (sizeof *magazine
+		     + space->magazine_size * sizeof magazine->objs[0]);
+  if (magazine)
+    {
+      magazine->next = NULL;
+      magazine->rounds = 0;
+    }
+  return magazine;
+}
+
+
+/* Release the per-thread cache CACHE of the slab space SPACE.
+   DEPOT_LOCK must be held.  */
+static void
+cache_release (hurd_slab_space_t space, struct hurd_slab_cache *cache)
+{
+  *cache->prevp = cache->next;
+  if (cache->next)
+    cache->next->prevp = cache->prevp;
+
+  space->magazine_allocs += cache->allocs;
+  space->magazine_deallocs += cache->deallocs;
+
+  magazine_release (space, cache->loaded);
+  magazine_release (space, cache->previous);
+  free (cache);
+}
+
+
+/* The destructor of the per-thread cache key, called when a thread
+   exits.  */
+static void
+cache_destructor (void *arg)
+{
+  struct hurd_slab_cache *cache = arg;
+  hurd_slab_space_t space = cache->space;
+
+  pthread_mutex_lock (&space->depot_lock);
+  cache_release (space, cache);
+  pthread_mutex_unlock (&space->depot_lock);
+}
+
+
+/* Return the cache of the calling thread for the slab space SPACE,
+   creating it if necessary.  Return NULL if it could not be
+   created.  */
+static struct hurd_slab_cache *
+get_cache (hurd_slab_space_t space)
+{
+  struct hurd_slab_cache *cache;
+
+  cache = pthread_getspecific (space->cache_key);
+  if (cache)
+    return cache;
+
+  cache = calloc (1, sizeof *cache);
+  if (cache == NULL)
+    return NULL;
+  cache->space = space;
+  cache->loaded = magazine_alloc (space);
+  cache->previous = magazine_alloc (space);
+  if (cache->loaded == NULL || cache->previous == NULL
+      || pthread_setspecific (space->cache_key, cache))
+    {
+      free (cache->loaded);
+      free (cache->previous);
+      free (cache);
+      return NULL;
+    }
+
+  pthread_mutex_lock (&space->depot_lock);
+  cache->next = space->caches;
+  if (cache->next)
+    cache->next->prevp = &cache->next;
+  cache->prevp = &space->caches;
+  space->caches = cache;
+  pthread_mutex_unlock (&space->depot_lock);
+
+  return cache;
+}
+
+
+/* Return the objects in the depot of the slab space SPACE to the slab
+   layer and free its magazines.  DEPOT_LOCK must be held.  */
+static void
+flush_depot (hurd_slab_space_t space)
+{
+  struct hurd_slab_magazine *magazine, *next;
+
+  for (magazine = space->depot_full; magazine; magazine = next)
+    {
+      next = magazine->next;
+      magazine_release (space, magazine);
+    }
+  for (magazine = space->depot_empty; magazine; magazine = next)
+    {
+      next = magazine->next;
+      magazine_release (space, magazine);
+    }
+  space->depot_full = space->depot_empty = NULL;
+  space->depot_nr_full = space->depot_nr_empty = 0;
+}
+
+
+/* Return the objects in all magazines of the slab space SPACE to the
+   slab layer.  No other thread may use SPACE.  The per-thread caches
+   themselves stay in place, as their threads may still use SPACE if
+   it turns out to be busy.  */
+static void
+flush_magazines (hurd_slab_space_t space)
+{
+  struct hurd_slab_cache *cache;
+
+  pthread_mutex_lock (&space->depot_lock);
+
+  for (cache = space->caches; cache; cache = cache->next)
+    {
+      magazine_empty (space, cache->loaded);
+      magazine_empty (space, cache->previous);
+    }
+  flush_depot (space);
+
+  pthread_mutex_unlock (&space->depot_lock);
+}
+
+
+/* Enable the magazine layer for the slab space SPACE.  */
+error_t
+hurd_slab_enable_magazines (hurd_slab_space_t space, size_t magazine_size)
+{
+  error_t err;
+
+  assert (! space->initialized || !"called after allocation");
+
+  err = pthread_mutex_init (&space->depot_lock, NULL);
+  if (err)
+    return err;
+
+  err = pthread_key_create (&space->cache_key, cache_destructor);
+  if (err)
+    {
+      pthread_mutex_destroy (&space->depot_lock);
+      return err;
+    }
+
+  space->magazine_size = magazine_size ?: HURD_SLAB_MAGAZINE_SIZE;
+  return 0;
+}
+
+
+/* Return the objects in the depot of SPACE to the slab layer and
+   release the unused slabs.  */
+error_t
+hurd_slab_reap (hurd_slab_space_t space)
+{
+  error_t err;
+
+  if (space->magazine_size)
+    {
+      pthread_mutex_lock (&space->depot_lock);
+      flush_depot (space);
+      pthread_mutex_unlock (&space->depot_lock);
+    }
+
+  pthread_mutex_lock (&space->lock);
+  err = reap (space);
+  pthread_mutex_unlock (&space->lock);
+  return err;
+}
+
+
+/* Store the allocation statistics of SPACE in STATS.  */
+void
+hurd_slab_get_stats (hurd_slab_space_t space, struct hurd_slab_stats *stats)
+{
+  struct hurd_slab_cache *cache;
+
+  memset (stats, 0, sizeof *stats);
+
+  if (space->magazine_size)
+    {
+      pthread_mutex_lock (&space->depot_lock);
+      stats->magazine_allocs = space->magazine_allocs;
+      stats->magazine_deallocs = space->magazine_deallocs;
+      for (cache = space->caches; cache; cache = cache->next)
+	{
+	  stats->magazine_allocs
+	    += __atomic_load_n (&cache->allocs, __ATOMIC_RELAXED);
+	  stats->magazine_deallocs
+	    += __atomic_load_n (&cache->deallocs, __ATOMIC_RELAXED);
+	}
+      stats->depot_exchanges = space->depot_exchanges;
+      stats->depot_full = space->depot_nr_full;
+      stats->depot_empty = space->depot_nr_empty;
+      pthread_mutex_unlock (&space->depot_lock);
+    }
+
+  pthread_mutex_lock (&space->lock);
+  stats->slab_allocs = space->slab_allocs;
+  stats->slab_deallocs = space->slab_deallocs;
+  pthread_mutex_unlock (&space->lock);
+}
+
+
+/* Allocate a new object from the slab space SPACE.  */
+error_t
+hurd_slab_alloc (hurd_slab_space_t space, void **buffer)
+{
+  struct hurd_slab_cache *cache;
+  struct hurd_slab_magazine *magazine;
+
+  if (! space->magazine_size || (cache = get_cache (space)) == NULL)
+    return slab_alloc (space, buffer);
+
+  if (cache->loaded->rounds == 0)
+    {
+      if (cache->previous->rounds > 0)
+	{
+	  magazine = cache->loaded;
+	  cache->loaded = cache->previous;
+	  cache->previous = magazine;
+	}
+      else
+	{
+	  /* Both magazines are empty.  Trade the previous one for a
+	     full one from the depot.  */
+	  pthread_mutex_lock (&space->depot_lock);
+	  magazine = space->depot_full;
+	  if (magazine)
+	    {
+	      space->depot_full = magazine->next;
+	      space->depot_nr_full--;
+	      cache->previous->next = space->depot_empty;
+	      space->depot_empty = cache->previous;
+	      space->depot_nr_empty++;
+	      space->depot_exchanges++;
+	    }
+	  pthread_mutex_unlock (&space->depot_lock);
+
+	  if (magazine == NULL)
+	    return slab_alloc (space, buffer);
+
+	  cache->previous = cache->loaded;
+	  cache->loaded = magazine;
+	}
+    }
+
+  *buffer = cache->loaded->objs[--cache->loaded->rounds];
+  __atomic_store_n (&cache->allocs, cache->allocs + 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+
+/* Deallocate the object BUFFER from the slab space SPACE.  */
+void
+hurd_slab_dealloc (hurd_slab_space_t space, void *buffer)
+{
+  struct hurd_slab_cache *cache;
+  struct hurd_slab_magazine *magazine;
+
+  assert (space->initialized);
+
+  if (space->magazine_size && (cache = get_cache (space)) != NULL)
+    {
+      if (cache->loaded->rounds == space->magazine_size)
+	{
+	  if (cache->previous->rounds < space->magazine_size)
+	    {
+	      magazine = cache->loaded;
+	      cache->loaded = cache->previous;
+	      cache->previous = magazine;
+	    }
+	  else
+	    {
+	      /* Both magazines are full.  Trade the previous one for an
+		 empty one from the depot, unless the depot holds enough
+		 full magazines already.  */
+	      magazine = NULL;
+	      pthread_mutex_lock (&space->depot_lock);
+	      if (space->depot_nr_full < HURD_SLAB_DEPOT_SIZE)
+		{
+		  magazine = space->depot_empty;
+		  if (magazine)
+		    {
+		      space->depot_empty = magazine->next;
+		      space->depot_nr_empty--;
+		    }
+		  else
+		    magazine = magazine_alloc (space);
+		  if (magazine)
+		    {
+		      cache->previous->next = space->depot_full;
+		      space->depot_full = cache->previous;
+		      space->depot_nr_full++;
+		      space->depot_exchanges++;
+		    }
+		}
+	      pthread_mutex_unlock (&space->depot_lock);
+
+	      if (magazine == NULL)
+		{
+		  /* Return the objects of the previous magazine to the
+		     slab layer and use it again.  */
+		  magazine_empty (space, cache->previous);
+		  magazine = cache->previous;
+		}
+	      cache->previous = cache->loaded;
+	      cache->loaded = magazine;
+	    }
+	}
+
+      cache->loaded->objs[cache->loaded->rounds++] = buffer;
+      __atomic_store_n (&cache->deallocs, cache->deallocs + 1,
+			__ATOMIC_RELAXED);
+      return;
+    }
+
+  pthread_mutex_lock (&space->lock);
+  slab_dealloc_locked (space, buffer);
   pthread_mutex_unlock (&space->lock);
 }
@@ -111,6 +111,67 @@ struct hurd_slab_space
   /* The size of one object.  Should include possible alignment as
      well as the size of the bufctl structure.  */
   size_t size;
+
+  /* Allocation statistics of the slab layer, protected by LOCK.  */
+  unsigned long slab_allocs;
+  unsigned long slab_deallocs;
+
+  /* The magazine layer (see hurd_slab_enable_magazines).  The number
+     of objects a magazine holds, or zero if the layer is disabled.  */
+  size_t magazine_size;
+
+  /* The key of the per-thread caches.  */
+  pthread_key_t cache_key;
+
+  /* Protects the depot, the list of per-thread caches and the
+     statistics of exited threads.  Taken before LOCK if both are
+     needed.  */
+  pthread_mutex_t depot_lock;
+
+  /* The depot: full and empty magazines not loaded by any thread.  */
+  struct hurd_slab_magazine *depot_full;
+  struct hurd_slab_magazine *depot_empty;
+  size_t depot_nr_full;
+  size_t depot_nr_empty;
+
+  /* All per-thread caches of this slab space.  */
+  struct hurd_slab_cache *caches;
+
+  /* Statistics of the magazine layer of threads that exited, and of
+     exchanges with the depot.  Protected by DEPOT_LOCK.  */
+  unsigned long magazine_allocs;
+  unsigned long magazine_deallocs;
+  unsigned long depot_exchanges;
+};
+
+/* The default number of objects in a magazine.  */
+#define HURD_SLAB_MAGAZINE_SIZE	32
+
+/* The number of full magazines the depot keeps at most.  Beyond that,
+   the objects of a full magazine a thread gives up go back to the slab
+   layer, so that memory freed by one thread can be reclaimed.  */
+#define HURD_SLAB_DEPOT_SIZE	16
+
+/* Statistics of a slab space, see hurd_slab_get_stats.  */
+struct hurd_slab_stats
+{
+  /* Allocations and deallocations served from a per-thread magazine
+     without taking any shared lock.  */
+  unsigned long magazine_allocs;
+  unsigned long magazine_deallocs;
+
+  /* Allocations and deallocations that had to go to the slab layer,
+     serialized by the lock of the slab space.  */
+  unsigned long slab_allocs;
+  unsigned long slab_deallocs;
+
+  /* The number of magazines exchanged between a per-thread cache and
+     the depot.  */
+  unsigned long depot_exchanges;
+
+  /* The number of full and empty magazines in the depot.  */
+  size_t depot_full;
+  size_t depot_empty;
 };
 
 
@@ -178,6 +239,32 @@ error_t hurd_slab_alloc (hurd_slab_space_t space, void **buffer);
 /* Deallocate the object BUFFER from the slab space SPACE.  */
 void hurd_slab_dealloc (hurd_slab_space_t space, void *buffer);
 
+/* Enable the magazine layer for the slab space SPACE.  Must be called
+   before the first allocation from SPACE.
+
+   Every thread then keeps two magazines of up to MAGAZINE_SIZE
+   constructed objects (HURD_SLAB_MAGAZINE_SIZE if zero), from which
+   allocations are served and to which deallocations go without taking
+   any lock.  Only when both magazines of a thread are empty (on
+   allocation) or full (on deallocation), the thread exchanges a
+   magazine with the depot of SPACE, and only if the depot cannot
+   help, the slab layer is used.  Objects in magazines are not
+   available to other threads until the magazine is exchanged, and
+   they keep their slabs from being released until the thread exits,
+   the depot is drained by hurd_slab_reap or SPACE is destroyed.  */
+error_t hurd_slab_enable_magazines (hurd_slab_space_t space,
+				    size_t magazine_size);
+
+/* Return the objects in the depot of SPACE to the slab layer and
+   release the memory of all slabs that have no allocated objects.  */
+error_t hurd_slab_reap (hurd_slab_space_t space);
+
+/* Store the allocation statistics of SPACE in STATS.  The counters of
+   running threads are read without synchronization, so the result is
+   only a snapshot.  */
+void hurd_slab_get_stats (hurd_slab_space_t space,
+			  struct hurd_slab_stats *stats);
+
 /* Create a more strongly typed slab interface a la a C++ template.
 
    NAME is the name of the new slab class.  NAME is used to synthesize
@@ -0,0 +1,594 @@
+/* cihash.c - Concurrent integer-keyed hash table functions.
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This file is part of the GNU Hurd.
+
+   The GNU Hurd is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   The GNU Hurd is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with the GNU Hurd; see the file COPYING.  If not, write to
+   the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "ihash.h"
+
+/* Lookups do not lock the table, so every member of an item that a
+   lookup may read is accessed with these.  Writers always hold the
+   lock of the segment, so they may read the items directly.  */
+#define load_relaxed(p)		__atomic_load_n ((p), __ATOMIC_RELAXED)
+#define store_relaxed(p, v)	__atomic_store_n ((p), (v), __ATOMIC_RELAXED)
+
+/* This function is used to hash the key.  */
+static inline hurd_ihash_key_t
+hash (hurd_cihash_t ht, hurd_ihash_key_t k)
+{
+  return ht->fct_hash ? ht->fct_hash ((const void *) k) : k;
+}
+
+/* This function is used to compare the key.  Returns true if A is
+   equal to B.  */
+static inline int
+compare (hurd_cihash_t ht, hurd_ihash_key_t a, hurd_ihash_key_t b)
+{
+  return
+    ht->fct_cmp ? (a && ht->fct_cmp ((const void *) a, (const void *) b))
+		: a == b;
+}
+
+/* Return the segment of HT responsible for the hash value H.  The
+   index into the array of the segment is taken from the low bits of
+   H, so the segment is selected by the high bits of a multiplicative
+   hash to keep both independent even for sequential integer keys.  */
+static inline struct _hurd_cihash_segment *
+segment (hurd_cihash_t ht, hurd_ihash_key_t h)
+{
+  uint32_t mix = (uint32_t) h * 2654435761U;
+  return &ht->segments[mix >> (32 - __builtin_ctz (HURD_CIHASH_SEGMENTS))];
+}
+
+/* Return the load of a segment of size SIZE holding N slots in binary
+   percent, see hurd_ihash_get_load.  */
+static inline size_t
+load (size_t n, size_t size)
+{
+  int d = __builtin_ctzl (size) - 7;
+  return d >= 0 ? n >> d : n << -d;
+}
+
+/* Store the location pointer LOCP in VALUE, if HT uses them.  */
+static inline void
+set_locp (hurd_cihash_t ht, hurd_ihash_value_t value, hurd_ihash_locp_t locp)
+{
+  if (ht->locp_offset != HURD_IHASH_NO_LOCP)
+    __atomic_store_n ((hurd_ihash_locp_t *) ((char *) value
+					     + ht->locp_offset),
+		      locp, __ATOMIC_RELEASE);
+}
+
+
+/* Grace periods.
+
+   A lookup accounts itself in one of the reader counters for the
+   duration of the lookup.  To make sure that no lookup uses an old
+   array anymore, a writer advances the epoch, so that new lookups use
+   the other set of counters, and waits until the counters of the
+   previous epoch drain.  */
+
+/* Return the reader counter slot of the calling thread.  */
+static inline unsigned int
+reader_slot (void)
+{
+  uintptr_t self = (uintptr_t) pthread_self ();
+  return (self ^ (self >> 7)) & (HURD_CIHASH_READER_SLOTS - 1);
+}
+
+/* Enter a lookup in HT.  Returns the counter which must be passed to
+   read_unlock.  */
+static inline unsigned int *
+read_lock (hurd_cihash_t ht)
+{
+  unsigned int slot = reader_slot ();
+  unsigned int epoch;
+  unsigned int *count;
+
+  for (;;)
+    {
+      epoch = __atomic_load_n (&ht->epoch, __ATOMIC_SEQ_CST);
+      count = &ht->readers[epoch & 1][slot].count;
+      __atomic_add_fetch (count, 1, __ATOMIC_SEQ_CST);
+
+      /* If a grace period started before we got accounted, it might
+	 have missed us.  Use the new set of counters instead.  */
+      if (__atomic_load_n (&ht->epoch, __ATOMIC_SEQ_CST) == epoch)
+	return count;
+
+      __atomic_sub_fetch (count, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/* Leave a lookup.  */
+static inline void
+read_unlock (unsigned int *count)
+{
+  __atomic_sub_fetch (count, 1, __ATOMIC_RELEASE);
+}
+
+/* Wait until all lookups in HT that were in progress when this
+   function was called have finished.  */
+void
+hurd_cihash_synchronize (hurd_cihash_t ht)
+{
+  unsigned int old;
+  unsigned int i;
+
+  pthread_mutex_lock (&ht->epoch_lock);
+  old = __atomic_fetch_add (&ht->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+  for (i = 0; i < HURD_CIHASH_READER_SLOTS; i++)
+    while (__atomic_load_n (&ht->readers[old][i].count, __ATOMIC_ACQUIRE))
+      sched_yield ();
+  pthread_mutex_unlock (&ht->epoch_lock);
+}
+
+
+/* Segment sequence counters.  */
+
+static inline unsigned int
+read_seqbegin (struct _hurd_cihash_segment *seg)
+{
+  unsigned int seq;
+
+  while ((seq = __atomic_load_n (&seg->seq, __ATOMIC_ACQUIRE)) & 1)
+    ;
+  return seq;
+}
+
+static inline int
+read_seqretry (struct _hurd_cihash_segment *seg, unsigned int seq)
+{
+  __atomic_thread_fence (__ATOMIC_ACQUIRE);
+  return load_relaxed (&seg->seq) != seq;
+}
+
+/* SEG must be locked.  */
+static inline void
+write_seqbegin (struct _hurd_cihash_segment *seg)
+{
+  store_relaxed (&seg->seq, seg->seq + 1);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+}
+
+/* SEG must be locked.  */
+static inline void
+write_seqend (struct _hurd_cihash_segment *seg)
+{
+  __atomic_store_n (&seg->seq, seg->seq + 1, __ATOMIC_RELEASE);
+}
+
+
+/* Given a hash table HT, an array ARRAY of one of its segments, and a
+   key KEY with the hash value H, find the index in ARRAY of that key.
+   If the key is not present, the index of a free slot is returned,
+   or ARRAY->size if there is none.  The segment must be locked.  */
+static size_t
+find_index (hurd_cihash_t ht, struct _hurd_cihash_array *array,
+	    hurd_ihash_key_t h, hurd_ihash_key_t key)
+{
+  size_t mask = array->size - 1;
+  size_t idx = h & mask;
+  size_t up_idx = idx;
+  size_t first_deleted = array->size;
+
+  do
+    {
+      hurd_ihash_value_t value = array->items[up_idx].value;
+
+      if (value == _HURD_IHASH_EMPTY)
+	return first_deleted < array->size ? first_deleted : up_idx;
+      if (value == _HURD_IHASH_DELETED)
+	{
+	  if (first_deleted == array->size)
+	    first_deleted = up_idx;
+	}
+      else if (compare (ht, array->items[up_idx].key, key))
+	return up_idx;
+      up_idx = (up_idx + 1) & mask;
+    }
+  while (up_idx != idx);
+
+  return first_deleted;
+}
+
+/* Like find_index, but for lookups that do not hold the lock.  Return
+   the value stored under KEY, or NULL.  */
+static hurd_ihash_value_t
+array_find (hurd_cihash_t ht, struct _hurd_cihash_array *array,
+	    hurd_ihash_key_t h, hurd_ihash_key_t key)
+{
+  size_t mask = array->size - 1;
+  size_t idx = h & mask;
+  size_t up_idx = idx;
+
+  do
+    {
+      hurd_ihash_value_t value = load_relaxed (&array->items[up_idx].value);
+
+      if (value == _HURD_IHASH_EMPTY)
+	return NULL;
+      if (value != _HURD_IHASH_DELETED
+	  && compare (ht, load_relaxed (&array->items[up_idx].key), key))
+	return value;
+      up_idx = (up_idx + 1) & mask;
+    }
+  while (up_idx != idx);
+
+  return NULL;
+}
+
+/* Allocate a new array of SIZE slots for SEG and move all items of
+   SEG into it.  The new array is not published, so lookups continue
+   to use the old one.  Return NULL on allocation failure.  SEG must
+   be locked.  */
+static struct _hurd_cihash_array *
+rehash (hurd_cihash_t ht, struct _hurd_cihash_segment *seg, size_t size)
+{
+  struct _hurd_cihash_array *old = seg->array;
+  struct _hurd_cihash_array *new;
+  size_t i;
+
+  /* calloc() will initialize all values to _HURD_IHASH_EMPTY
+     implicitly.  */
+  new = calloc (1, sizeof *new + size * sizeof (struct _hurd_ihash_item));
+  if (new == NULL)
+    return NULL;
+  new->size = size;
+
+  if (old)
+    for (i = 0; i < old->size; i++)
+      if (hurd_ihash_value_valid (old->items[i].value))
+	{
+	  hurd_ihash_key_t key = old->items[i].key;
+	  size_t idx = find_index (ht, new, hash (ht, key), key);
+
+	  assert (idx < new->size);
+	  new->items[idx] = old->items[i];
+	  set_locp (ht, new->items[idx].value, &new->items[idx].value);
+	}
+
+  return new;
+}
+
+
+/* Construction and destruction of hash tables.  */
+
+/* Initialize the concurrent hash table at address HT.  */
+void
+hurd_cihash_init (hurd_cihash_t ht, intptr_t locp_offs)
+{
+  unsigned int i;
+
+  for (i = 0; i < HURD_CIHASH_SEGMENTS; i++)
+    {
+      struct _hurd_cihash_segment *seg = &ht->segments[i];
+
+      pthread_mutex_init (&seg->lock, NULL);
+      seg->seq = 0;
+      seg->array = NULL;
+      seg->nr_items = 0;
+      seg->nr_free = 0;
+    }
+
+  for (i = 0; i < HURD_CIHASH_READER_SLOTS; i++)
+    {
+      ht->readers[0][i].count = 0;
+      ht->readers[1][i].count = 0;
+    }
+  ht->epoch = 0;
+  pthread_mutex_init (&ht->epoch_lock, NULL);
+
+  ht->locp_offset = locp_offs;
+  ht->max_load = HURD_IHASH_MAX_LOAD_DEFAULT;
+  ht->cleanup = 0;
+  ht->cleanup_data = NULL;
+  ht->fct_hash = NULL;
+  ht->fct_cmp = NULL;
+}
+
+
+/* Destroy the concurrent hash table at address HT.  */
+void
+hurd_cihash_destroy (hurd_cihash_t ht)
+{
+  unsigned int i;
+  size_t j;
+
+  for (i = 0; i < HURD_CIHASH_SEGMENTS; i++)
+    {
+      struct _hurd_cihash_segment *seg = &ht->segments[i];
+
+      if (seg->array)
+	{
+	  if (ht->cleanup)
+	    for (j = 0; j < seg->array->size; j++)
+	      if (hurd_ihash_value_valid (seg->array->items[j].value))
+		(*ht->cleanup) (seg->array->items[j].value,
+				ht->cleanup_data);
+	  free (seg->array);
+	  seg->array = NULL;
+	}
+      seg->nr_items = 0;
+      seg->nr_free = 0;
+      pthread_mutex_destroy (&seg->lock);
+    }
+
+  pthread_mutex_destroy (&ht->epoch_lock);
+}
+
+
+/* Set the cleanup function for the hash table HT to CLEANUP.  */
+void
+hurd_cihash_set_cleanup (hurd_cihash_t ht, hurd_ihash_cleanup_t cleanup,
+			 void *cleanup_data)
+{
+  ht->cleanup = cleanup;
+  ht->cleanup_data = cleanup_data;
+}
+
+
+/* Use the generalized key interface.  Must be called before any item
+   is inserted into the table.  */
+void
+hurd_cihash_set_gki (hurd_cihash_t ht,
+		     hurd_ihash_fct_hash_t fct_hash,
+		     hurd_ihash_fct_cmp_t fct_cmp)
+{
+  assert (hurd_cihash_count (ht) == 0 || !"called after insertion");
+  assert (fct_hash);
+  assert (fct_cmp);
+  ht->fct_hash = fct_hash;
+  ht->fct_cmp = fct_cmp;
+}
+
+
+/* Set the maximum load factor of every segment in binary percent.  */
+void
+hurd_cihash_set_max_load (hurd_cihash_t ht, unsigned int max_load)
+{
+  ht->max_load = max_load;
+}
+
+
+/* Add ITEM to the hash table HT under the key KEY.  If there already
+   is an item under this key, call the cleanup function (if any) for
+   it before overriding the value.  If a memory allocation error
+   occurs, ENOMEM is returned, otherwise 0.  */
+error_t
+hurd_cihash_add (hurd_cihash_t ht, hurd_ihash_key_t key,
+		 hurd_ihash_value_t item)
+{
+  hurd_ihash_key_t h = hash (ht, key);
+  struct _hurd_cihash_segment *seg = segment (ht, h);
+  struct _hurd_cihash_array *array;
+  struct _hurd_cihash_array *retired = NULL;
+  hurd_ihash_value_t replaced = NULL;
+  size_t idx;
+
+  pthread_mutex_lock (&seg->lock);
+
+  array = seg->array;
+  if (array == NULL
+      || load (array->size - seg->nr_free, array->size) > ht->max_load)
+    {
+      /* If the load exceeds the configured maximal load, then the
+	 segment is too small, and we have to increase it.  Otherwise
+	 we merely rehash it to get rid of the tombstones.  This is
+	 done while lookups continue to use the old array.  */
+      size_t size = HURD_IHASH_MIN_SIZE;
+      struct _hurd_cihash_array *new;
+
+      if (array)
+	size = (load (seg->nr_items, array->size) > ht->max_load
+		? array->size << 1 : array->size);
+
+      new = rehash (ht, seg, size);
+      if (new)
+	{
+	  retired = array;
+	  array = new;
+	}
+      else if (array == NULL)
+	{
+	  pthread_mutex_unlock (&seg->lock);
+	  return ENOMEM;
+	}
+      /* Otherwise, we prefer performance degradation over failure,
+	 and add the item to the old array if there is room.  */
+    }
+
+  idx = find_index (ht, array, h, key);
+  if (idx == array->size)
+    {
+      /* The old array is full, and we could not grow it.  */
+      assert (array == seg->array);
+      pthread_mutex_unlock (&seg->lock);
+      return ENOMEM;
+    }
+
+  write_seqbegin (seg);
+
+  if (array != seg->array)
+    {
+      __atomic_store_n (&seg->array, array, __ATOMIC_RELEASE);
+      store_relaxed (&seg->nr_free, array->size - seg->nr_items);
+    }
+
+  if (hurd_ihash_value_valid (array->items[idx].value))
+    replaced = array->items[idx].value;
+  else
+    {
+      store_relaxed (&seg->nr_items, seg->nr_items + 1);
+      if (array->items[idx].value == _HURD_IHASH_EMPTY)
+	{
+	  assert (seg->nr_free > 0);
+	  store_relaxed (&seg->nr_free, seg->nr_free - 1);
+	}
+    }
+  store_relaxed (&array->items[idx].key, key);
+  store_relaxed (&array->items[idx].value, item);
+
+  write_seqend (seg);
+
+  set_locp (ht, item, &array->items[idx].value);
+
+  pthread_mutex_unlock (&seg->lock);
+
+  if (replaced && ht->cleanup)
+    (*ht->cleanup) (replaced, ht->cleanup_data);
+
+  if (retired)
+    {
+      hurd_cihash_synchronize (ht);
+      free (retired);
+    }
+
+  return 0;
+}
+
+
+/* Find and return the item in the hash table HT with key KEY, or NULL
+   if it doesn't exist.  */
+hurd_ihash_value_t
+hurd_cihash_find (hurd_cihash_t ht, hurd_ihash_key_t key)
+{
+  hurd_ihash_key_t h = hash (ht, key);
+  struct _hurd_cihash_segment *seg = segment (ht, h);
+  hurd_ihash_value_t value;
+  unsigned int *count;
+  unsigned int seq;
+
+  count = read_lock (ht);
+  do
+    {
+      struct _hurd_cihash_array *array;
+
+      seq = read_seqbegin (seg);
+      array = __atomic_load_n (&seg->array, __ATOMIC_ACQUIRE);
+      value = array ? array_find (ht, array, h, key) : NULL;
+    }
+  while (read_seqretry (seg, seq));
+  read_unlock (count);
+
+  return value;
+}
+
+
+/* Remove the item at index IDX of the array of SEG, and return its
+   value.  SEG must be locked.  */
+static hurd_ihash_value_t
+segment_remove (struct _hurd_cihash_segment *seg, size_t idx)
+{
+  struct _hurd_ihash_item *item = &seg->array->items[idx];
+  hurd_ihash_value_t value = item->value;
+
+  write_seqbegin (seg);
+  store_relaxed (&item->value, _HURD_IHASH_DELETED);
+  store_relaxed (&item->key, 0);
+  store_relaxed (&seg->nr_items, seg->nr_items - 1);
+  write_seqend (seg);
+
+  return value;
+}
+
+
+/* Remove the entry with the key KEY from the hash table HT.  If such
+   an entry was found and removed, 1 is returned, otherwise 0.  */
+int
+hurd_cihash_remove (hurd_cihash_t ht, hurd_ihash_key_t key)
+{
+  hurd_ihash_key_t h = hash (ht, key);
+  struct _hurd_cihash_segment *seg = segment (ht, h);
+  hurd_ihash_value_t value = NULL;
+
+  pthread_mutex_lock (&seg->lock);
+  if (seg->array)
+    {
+      size_t idx = find_index (ht, seg->array, h, key);
+
+      if (idx < seg->array->size
+	  && hurd_ihash_value_valid (seg->array->items[idx].value))
+	value = segment_remove (seg, idx);
+    }
+  pthread_mutex_unlock (&seg->lock);
+
+  if (value && ht->cleanup)
+    (*ht->cleanup) (value, ht->cleanup_data);
+
+  return value != NULL;
+}
+
+
+/* Remove VALUE from the hash table HT using the location pointer
+   stored in it.  */
+void
+hurd_cihash_locp_remove (hurd_cihash_t ht, hurd_ihash_value_t value)
+{
+  hurd_ihash_locp_t *locpp;
+  struct _hurd_cihash_segment *seg;
+  struct _hurd_ihash_item *item;
+  hurd_ihash_key_t key;
+  unsigned int *count;
+
+  assert (ht->locp_offset != HURD_IHASH_NO_LOCP);
+  locpp = (hurd_ihash_locp_t *) ((char *) value + ht->locp_offset);
+
+  /* The key of VALUE tells us the segment to lock.  The array the
+     location pointer points into can be replaced and freed by a
+     concurrent insertion until we hold that lock, so we read it like
+     a lookup would.  The key itself does not change as long as VALUE
+     is in the table.  */
+  count = read_lock (ht);
+  item = (struct _hurd_ihash_item *) __atomic_load_n (locpp,
+						      __ATOMIC_ACQUIRE);
+  key = load_relaxed (&item->key);
+  read_unlock (count);
+
+  seg = segment (ht, hash (ht, key));
+  pthread_mutex_lock (&seg->lock);
+  item = (struct _hurd_ihash_item *) *locpp;
+  assert (item->value == value);
+  segment_remove (seg, item - seg->array->items);
+  pthread_mutex_unlock (&seg->lock);
+
+  if (ht->cleanup)
+    (*ht->cleanup) (value, ht->cleanup_data);
+}
+
+
+/* Return the number of items in HT.  */
+size_t
+hurd_cihash_count (hurd_cihash_t ht)
+{
+  size_t n = 0;
+  unsigned int i;
+
+  for (i = 0; i < HURD_CIHASH_SEGMENTS; i++)
+    n += load_relaxed (&ht->segments[i].nr_items);
+  return n;
+}
@@ -27,8 +27,12 @@
 
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
 #include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "ihash.h"
 
@@ -67,11 +71,115 @@ index_valid (hurd_ihash_t ht, unsigned int idx, hurd_ihash_key_t key)
 }
 
 
-/* Given a hash table HT, and a key KEY, find the index in the table
-   of that key.  You must subsequently check with index_valid() if the
-   returned index is valid.  */
+/* The control byte layout.  A control byte is either CTRL_EMPTY,
+   CTRL_DELETED, or, for a slot in use, seven bits of the hash value of
+   its key.  */
+#define CTRL_EMPTY	((uint8_t) 0x80)
+#define CTRL_DELETED	((uint8_t) 0xfe)
+
+/* Return the control byte for a key with the hash value H.  The slot
+   index is taken from the low bits of H, so the control byte is taken
+   from the high bits of a multiplicative hash of H, which also works
+   for integer keys that are used as their own hash value.  */
+static inline uint8_t
+ctrl_hash (hurd_ihash_key_t h)
+{
+  return ((uint32_t) h * 2654435761U) >> 25;
+}
+
+/* Set the control byte of the slot IDX of the hash table HT to C.  */
+static inline void
+set_ctrl (hurd_ihash_t ht, unsigned int idx, uint8_t c)
+{
+  ht->ctrl[idx] = c;
+  if (idx < HURD_IHASH_CTRL_GROUP)
+    ht->ctrl[ht->size + idx] = c;
+}
+
+/* Allocate a control byte array for a table with SIZE slots, all of
+   them empty.  */
+static uint8_t *
+alloc_ctrl (size_t size)
+{
+  uint8_t *ctrl = malloc (size + HURD_IHASH_CTRL_GROUP);
+  if (ctrl)
+    memset (ctrl, CTRL_EMPTY, size + HURD_IHASH_CTRL_GROUP);
+  return ctrl;
+}
+
+/* Return a bit mask of the control bytes in the group starting at G
+   that are equal to C.  Bit I corresponds to G[I].  */
+static inline unsigned int
+group_match (const uint8_t *g, uint8_t c)
+{
+#ifdef __SSE2__
+  __m128i group = _mm_loadu_si128 ((const __m128i *) g);
+  return _mm_movemask_epi8 (_mm_cmpeq_epi8 (group, _mm_set1_epi8 (c)));
+#else
+  unsigned int mask = 0;
+  unsigned int i;
+
+  for (i = 0; i < HURD_IHASH_CTRL_GROUP; i++)
+    mask |= (unsigned int) (g[i] == c) << i;
+  return mask;
+#endif
+}
+
+/* Like find_index, but for tables using the control byte layout.
+   This probes the same slots in the same order, but a group at a
+   time, and only compares the keys of slots with a matching control
+   byte.  */
 static inline int
-find_index (hurd_ihash_t ht, hurd_ihash_key_t key)
+find_index_ctrl (hurd_ihash_t ht, hurd_ihash_key_t key, hurd_ihash_key_t h)
+{
+  unsigned int mask = ht->size - 1;
+  unsigned int pos = h & mask;
+  uint8_t c = ctrl_hash (h);
+  int first_deleted = -1;
+  size_t n;
+
+  for (n = 0; n < ht->size; n += HURD_IHASH_CTRL_GROUP)
+    {
+      const uint8_t *g = &ht->ctrl[pos];
+      unsigned int match = group_match (g, c);
+      unsigned int empty;
+      unsigned int deleted;
+
+      while (match)
+	{
+	  unsigned int idx = (pos + __builtin_ctz (match)) & mask;
+	  if (compare (ht, ht->items[idx].key, key))
+	    return idx;
+	  match &= match - 1;
+	}
+
+      empty = group_match (g, CTRL_EMPTY);
+      if (first_deleted < 0)
+	{
+	  deleted = group_match (g, CTRL_DELETED);
+	  if (empty)
+	    /* Only tombstones before the first empty slot count.  */
+	    deleted &= (1U << __builtin_ctz (empty)) - 1;
+	  if (deleted)
+	    first_deleted = (pos + __builtin_ctz (deleted)) & mask;
+	}
+
+      if (empty)
+	return (first_deleted >= 0
+		? first_deleted : (pos + __builtin_ctz (empty)) & mask);
+
+      pos = (pos + HURD_IHASH_CTRL_GROUP) & mask;
+    }
+
+  return first_deleted >= 0 ? first_deleted : 0;
+}
+
+
+/* Given a hash table HT, and a key KEY with the hash value H, find the
+   index in the table of that key.  You must subsequently check with
+   index_valid() if the returned index is valid.  */
+static inline int
+find_index_hashed (hurd_ihash_t ht, hurd_ihash_key_t key, hurd_ihash_key_t h)
 {
   unsigned int idx;
   unsigned int up_idx;
@@ -79,7 +187,10 @@ find_index (hurd_ihash_t ht, hurd_ihash_key_t key)
   int first_deleted_set = 0;
   unsigned int mask = ht->size - 1;
 
-  idx = hash (ht, key) & mask;
+  if (ht->ctrl)
+    return find_index_ctrl (ht, key, h);
+
+  idx = h & mask;
 
   up_idx = idx;
   do
@@ -103,6 +214,44 @@ find_index (hurd_ihash_t ht, hurd_ihash_key_t key)
 }
 
 
+/* Given a hash table HT, and a key KEY, find the index in the table
+   of that key.  You must subsequently check with index_valid() if the
+   returned index is valid.  */
+static inline int
+find_index (hurd_ihash_t ht, hurd_ihash_key_t key)
+{
+  return find_index_hashed (ht, key, hash (ht, key));
+}
+
+
+/* Find the index of the key KEY in the old array of the hash table HT
+   while an incremental rehash is in progress.  Return the index, or
+   -1 if the key is not in the old array.  */
+static inline int
+find_old_index (hurd_ihash_t ht, hurd_ihash_key_t key)
+{
+  unsigned int idx;
+  unsigned int up_idx;
+  unsigned int mask = ht->old_size - 1;
+
+  idx = hash (ht, key) & mask;
+
+  up_idx = idx;
+  do
+    {
+      if (ht->old_items[up_idx].value == _HURD_IHASH_EMPTY)
+        return -1;
+      if (ht->old_items[up_idx].value != _HURD_IHASH_DELETED
+          && compare (ht, ht->old_items[up_idx].key, key))
+	return up_idx;
+      up_idx = (up_idx + 1) & mask;
+    }
+  while (up_idx != idx);
+
+  return -1;
+}
+
+
 /* Remove the entry pointed to by the location pointer LOCP from the
    hashtable HT.  LOCP is the location pointer of which the address
    was provided to hurd_ihash_add().  */
@@ -112,6 +261,10 @@ locp_remove (hurd_ihash_t ht, hurd_ihash_locp_t locp)
   struct _hurd_ihash_item *item = (struct _hurd_ihash_item *) locp;
   if (ht->cleanup)
     (*ht->cleanup) (item->value, ht->cleanup_data);
+  /* Items in the old array of an incremental rehash have no control
+     bytes.  */
+  if (ht->ctrl && item >= ht->items && item < &ht->items[ht->size])
+    set_ctrl (ht, item - ht->items, CTRL_DELETED);
   item->value = _HURD_IHASH_DELETED;
   item->key = 0;
   ht->nr_items--;
@@ -132,6 +285,12 @@ hurd_ihash_init (hurd_ihash_t ht, intptr_t locp_offs)
   ht->fct_hash = NULL;
   ht->fct_cmp = NULL;
   ht->nr_free = 0;
+  ht->incremental = 0;
+  ht->old_items = NULL;
+  ht->old_size = 0;
+  ht->old_pos = 0;
+  ht->ctrl = NULL;
+  ht->use_ctrl = 0;
 }
 
 
@@ -152,6 +311,8 @@ hurd_ihash_destroy (hurd_ihash_t ht)
 
   if (ht->size > 0)
     free (ht->items);
+  free (ht->old_items);
+  free (ht->ctrl);
 }
 
 
@@ -226,6 +387,24 @@ hurd_ihash_set_max_load (hurd_ihash_t ht, unsigned int max_load)
   ht->max_load = max_load;
 }
 
+
+/* Enable or disable the control byte layout for the hash table HT.
+   Must be called before any item is inserted into the table.  */
+void
+hurd_ihash_set_ctrl (hurd_ihash_t ht, int use_ctrl)
+{
+  assert (ht->size == 0 || !"called after insertion");
+  ht->use_ctrl = use_ctrl;
+}
+
+
+/* Enable or disable incremental rehashing for the hash table HT.  */
+void
+hurd_ihash_set_incremental (hurd_ihash_t ht, int incremental)
+{
+  ht->incremental = incremental;
+}
+
 
 /* Helper function for hurd_ihash_add.  Return 1 if the item was
    added, and 0 if it could not be added because no empty slot was
@@ -237,8 +416,9 @@ static inline int
 add_one (hurd_ihash_t ht, hurd_ihash_key_t key, hurd_ihash_value_t value)
 {
   unsigned int idx;
+  hurd_ihash_key_t h = hash (ht, key);
 
-  idx = find_index (ht, key);
+  idx = find_index_hashed (ht, key, h);
 
   /* Remove the old entry for this key if necessary.  */
   if (index_valid (ht, idx, key))
@@ -254,6 +434,8 @@ add_one (hurd_ihash_t ht, hurd_ihash_key_t key, hurd_ihash_value_t value)
         }
       ht->items[idx].value = value;
       ht->items[idx].key = key;
+      if (ht->ctrl)
+	set_ctrl (ht, idx, ctrl_hash (h));
 
       if (ht->locp_offset != HURD_IHASH_NO_LOCP)
 	*((hurd_ihash_locp_t *) (((char *) value) + ht->locp_offset))
@@ -266,6 +448,39 @@ add_one (hurd_ihash_t ht, hurd_ihash_key_t key, hurd_ihash_value_t value)
 }
 
 
+/* Move up to COUNT slots of the old array of the hash table HT to the
+   current one.  If this empties the old array, the incremental rehash
+   is finished and the old array is freed.  */
+static void
+rehash_step (hurd_ihash_t ht, size_t count)
+{
+  int was_added;
+
+  while (count-- > 0 && ht->old_pos < ht->old_size)
+    {
+      struct _hurd_ihash_item *item = &ht->old_items[ht->old_pos++];
+
+      if (hurd_ihash_value_valid (item->value))
+	{
+	  /* The item stays in the table, add_one counts it again.  */
+	  ht->nr_items--;
+	  was_added = add_one (ht, item->key, item->value);
+	  assert (was_added);
+	  item->value = _HURD_IHASH_DELETED;
+	  item->key = 0;
+	}
+    }
+
+  if (ht->old_pos == ht->old_size)
+    {
+      free (ht->old_items);
+      ht->old_items = NULL;
+      ht->old_size = 0;
+      ht->old_pos = 0;
+    }
+}
+
+
 /* Add VALUE to the hash table HT under the key KEY at LOCP.  If there
    already is an item under this key, call the cleanup function (if
    any) for it before overriding the value.  This function is faster
@@ -295,6 +510,8 @@ hurd_ihash_locp_add (hurd_ihash_t ht, hurd_ihash_locp_t locp,
   if (! hurd_ihash_value_valid (item->value))
     {
       item->key = key;
+      if (ht->ctrl && item >= ht->items && item < &ht->items[ht->size])
+	set_ctrl (ht, item - ht->items, ctrl_hash (hash (ht, key)));
       ht->nr_items += 1;
       if (item->value == _HURD_IHASH_EMPTY)
         {
@@ -315,6 +532,10 @@ hurd_ihash_locp_add (hurd_ihash_t ht, hurd_ihash_locp_t locp,
     *((hurd_ihash_locp_t *) (((char *) value) + ht->locp_offset))
       = locp;
 
+  /* Only now that LOCP has been used, we may move items around.  */
+  if (ht->old_items)
+    rehash_step (ht, HURD_IHASH_REHASH_STEP);
+
   return 0;
 }
 
@@ -326,11 +547,34 @@ hurd_ihash_locp_add (hurd_ihash_t ht, hurd_ihash_locp_t locp,
 error_t
 hurd_ihash_add (hurd_ihash_t ht, hurd_ihash_key_t key, hurd_ihash_value_t item)
 {
-  struct hurd_ihash old_ht = *ht;
+  struct hurd_ihash old_ht;
   int was_added;
   int fatal = 0;	/* bail out on allocation errors */
   unsigned int i;
+  int idx;
 
+  if (ht->old_items)
+    {
+      /* An incremental rehash is in progress.  Move some more items
+	 out of the old array, or all of them if the new array is
+	 already full enough.  */
+      rehash_step (ht, (hurd_ihash_get_effective_load (ht) > ht->max_load
+			? ht->old_size : HURD_IHASH_REHASH_STEP));
+
+      if (ht->old_items)
+	{
+	  idx = find_old_index (ht, key);
+	  if (idx >= 0)
+	    locp_remove (ht, &ht->old_items[idx].value);
+
+	  if (add_one (ht, key, item))
+	    return 0;
+
+	  rehash_step (ht, ht->old_size);
+	}
+    }
+
+  old_ht = *ht;
   if (ht->size)
     {
       /* Only fill the hash table up to its maximum load factor.  */
@@ -342,16 +586,33 @@ hurd_ihash_add (hurd_ihash_t ht, hurd_ihash_key_t key, hurd_ihash_value_t item)
 
   /* If the load exceeds the configured maximal load, then the hash
      table is too small, and we have to increase it.  Otherwise we
-     merely rehash the table to get rid of the tombstones.  */
-  ht->nr_items = 0;
+     merely rehash the table to get rid of the tombstones.  This
+     requires that the live items plus the ones added while an
+     incremental rehash is in progress fit into the new array, which
+     may not be the case for a maximal load close to 128b%.  */
+  if (! ht->incremental)
+    ht->nr_items = 0;
   if (ht->size == 0)
       ht->size = HURD_IHASH_MIN_SIZE;
-  else if (hurd_ihash_get_load (&old_ht) > ht->max_load)
+  else if (hurd_ihash_get_load (&old_ht) > ht->max_load
+	   || (old_ht.nr_items
+	       + (ht->incremental ? old_ht.size / HURD_IHASH_REHASH_STEP : 0)
+	       >= old_ht.size))
       ht->size <<= 1;
   ht->nr_free = ht->size;
 
   /* calloc() will initialize all values to _HURD_IHASH_EMPTY implicitly.  */
   ht->items = calloc (ht->size, sizeof (struct _hurd_ihash_item));
+  ht->ctrl = NULL;
+  if (ht->items && ht->use_ctrl)
+    {
+      ht->ctrl = alloc_ctrl (ht->size);
+      if (ht->ctrl == NULL)
+	{
+	  free (ht->items);
+	  ht->items = NULL;
+	}
+    }
 
   if (ht->items == NULL)
     {
@@ -367,6 +628,26 @@ hurd_ihash_add (hurd_ihash_t ht, hurd_ihash_key_t key, hurd_ihash_value_t item)
       goto add_one;
     }
 
+  if (ht->incremental && old_ht.size > 0)
+    {
+      /* Leave the old entries where they are for now, and move them
+	 over a few at a time.  */
+      ht->old_items = old_ht.items;
+      ht->old_size = old_ht.size;
+      ht->old_pos = 0;
+      free (old_ht.ctrl);
+
+      idx = find_old_index (ht, key);
+      if (idx >= 0)
+	locp_remove (ht, &ht->old_items[idx].value);
+
+      rehash_step (ht, HURD_IHASH_REHASH_STEP);
+
+      was_added = add_one (ht, key, item);
+      assert (was_added);
+      return 0;
+    }
+
   /* We have to rehash the old entries.  */
   for (i = 0; i < old_ht.size; i++)
     if (!index_empty (&old_ht, i))
@@ -381,6 +662,7 @@ hurd_ihash_add (hurd_ihash_t ht, hurd_ihash_key_t key, hurd_ihash_value_t item)
 
   if (old_ht.size > 0)
     free (old_ht.items);
+  free (old_ht.ctrl);
 
   return 0;
 }
@@ -396,7 +678,17 @@ hurd_ihash_find (hurd_ihash_t ht, hurd_ihash_key_t key)
   else
     {
       int idx = find_index (ht, key);
-      return index_valid (ht, idx, key) ? ht->items[idx].value : NULL;
+      if (index_valid (ht, idx, key))
+	return ht->items[idx].value;
+
+      if (ht->old_items)
+	{
+	  idx = find_old_index (ht, key);
+	  if (idx >= 0)
+	    return ht->old_items[idx].value;
+	}
+
+      return NULL;
     }
 }
 
@@ -428,7 +720,20 @@ hurd_ihash_locp_find (hurd_ihash_t ht,
 
   idx = find_index (ht, key);
   *slot = &ht->items[idx].value;
-  return index_valid (ht, idx, key) ? ht->items[idx].value : NULL;
+  if (index_valid (ht, idx, key))
+    return ht->items[idx].value;
+
+  if (ht->old_items)
+    {
+      int old_idx = find_old_index (ht, key);
+      if (old_idx >= 0)
+	{
+	  *slot = &ht->old_items[old_idx].value;
+	  return ht->old_items[old_idx].value;
+	}
+    }
+
+  return NULL;
 }
 
 
@@ -446,6 +751,16 @@ hurd_ihash_remove (hurd_ihash_t ht, hurd_ihash_key_t key)
 	  locp_remove (ht, &ht->items[idx].value);
 	  return 1;
 	}
+
+      if (ht->old_items)
+	{
+	  idx = find_old_index (ht, key);
+	  if (idx >= 0)
+	    {
+	      locp_remove (ht, &ht->old_items[idx].value);
+	      return 1;
+	    }
+	}
     }
 
   return 0;
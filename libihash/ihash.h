@@ -27,6 +27,7 @@
 #include <limits.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <pthread.h>
 
 
 /* The type of the values corresponding to the keys.  Must be a
@@ -116,6 +117,28 @@ struct hurd_ihash
 
   /* Number of free slots.  */
   size_t nr_free;
+
+  /* If true, the table is grown incrementally, see
+     hurd_ihash_set_incremental.  */
+  int incremental;
+
+  /* While an incremental rehash is in progress, the array the items
+     are being moved out of, its length, and the index of the next
+     slot to move.  OLD_ITEMS is NULL otherwise.  NR_ITEMS counts the
+     items in both arrays.  */
+  _hurd_ihash_item_t old_items;
+  size_t old_size;
+  size_t old_pos;
+
+  /* If the control byte layout is used (see hurd_ihash_set_ctrl), an
+     array of SIZE + HURD_IHASH_CTRL_GROUP bytes describing the slots
+     of ITEMS, and NULL otherwise.  The first HURD_IHASH_CTRL_GROUP
+     bytes are repeated at the end, so that a group of bytes can be
+     loaded from any position without wrapping around.  */
+  uint8_t *ctrl;
+
+  /* True if ITEMS is accompanied by a CTRL array.  */
+  int use_ctrl;
 };
 typedef struct hurd_ihash *hurd_ihash_t;
 
@@ -130,6 +153,16 @@ typedef struct hurd_ihash *hurd_ihash_t;
    96b% is equivalent to 75%, 128b% to 100%.  */
 #define HURD_IHASH_MAX_LOAD_DEFAULT 96
 
+/* The number of slots of the old array that are moved to the new one
+   on every insertion while an incremental rehash is in progress.  With
+   the default maximum load factor, this ensures that the old array is
+   empty long before the new one fills up.  */
+#define HURD_IHASH_REHASH_STEP	8
+
+/* The number of control bytes that are examined at once when probing
+   a hash table using the control byte layout.  */
+#define HURD_IHASH_CTRL_GROUP	16
+
 /* The LOCP_OFFS to use if no location pointer is available.  */
 #define HURD_IHASH_NO_LOCP	INTPTR_MIN
 
@@ -204,6 +237,39 @@ void hurd_ihash_set_gki (hurd_ihash_t ht,
    added to the hash table.  */
 void hurd_ihash_set_max_load (hurd_ihash_t ht, unsigned int max_load);
 
+/* Enable (if USE_CTRL is true) or disable the control byte layout for
+   the hash table HT.  Must be called before any item is inserted into
+   the table.
+
+   In this layout, the table keeps a separate array with one byte per
+   slot, which is either a marker for an empty or a deleted slot, or 7
+   bits of the hash value of the key stored in the slot.  Lookups
+   compare HURD_IHASH_CTRL_GROUP of these bytes at once (using SSE2 if
+   available), and only look at the keys of slots whose byte matches.
+   This saves most of the key comparisons, which is especially
+   worthwhile with the generalized key interface, and touches far less
+   memory for long probe sequences.  Therefore, higher maximum load
+   factors (e.g. 112b%, i.e. 87.5%) are practical with this layout.
+
+   The items themselves are stored exactly as before, so location
+   pointers and the iteration macros keep working.  */
+void hurd_ihash_set_ctrl (hurd_ihash_t ht, int use_ctrl);
+
+/* Enable (if INCREMENTAL is true) or disable incremental rehashing
+   for the hash table HT.  Normally, the insertion that makes the hash
+   table exceed its maximum load factor moves all items to a new,
+   larger array at once, which makes that one insertion as expensive
+   as all previous ones together.  In incremental mode, that insertion
+   only allocates the new array, and every insertion moves at most
+   HURD_IHASH_REHASH_STEP slots of the old array to the new one, until
+   the old array is empty and freed.  Lookups and removals consult both
+   arrays in the meantime.  This bounds the worst-case cost of an
+   insertion at the price of keeping both arrays around for a while.
+
+   Lookups never move items, so tables that are searched concurrently
+   under a read lock can use this mode as well.  */
+void hurd_ihash_set_incremental (hurd_ihash_t ht, int incremental);
+
 
 /* Get the current load factor of HT in binary percent, where 128b%
    corresponds to 100%.  The reason we do this is that it is so
@@ -302,6 +368,22 @@ hurd_ihash_value_t hurd_ihash_locp_find (hurd_ihash_t ht,
    value of the current element is available in the variable VALUE
    (which is declared for you and local to the block).  */
 
+/* Return the slot following ITEM in the hash table HT for the
+   iteration macros below, or NULL if ITEM is the last one.  While an
+   incremental rehash is in progress, the slots of the old array follow
+   those of the new one.  Slots of the old array which were already
+   moved are marked as deleted.  */
+static inline _hurd_ihash_item_t
+_hurd_ihash_iterate_next (hurd_ihash_t ht, _hurd_ihash_item_t item)
+{
+  item++;
+  if (item == &ht->items[ht->size])
+    return ht->old_items ? &ht->old_items[0] : 0;
+  if (ht->old_items && item == &ht->old_items[ht->old_size])
+    return 0;
+  return item;
+}
+
 /* The implementation of this macro is peculiar.  We want the macro to
    execute a block following its invocation, so we can only prepend
    code.  This excludes creating an outer block.  However, we must
@@ -325,13 +407,11 @@ hurd_ihash_value_t hurd_ihash_locp_find (hurd_ihash_t ht,
 #define HURD_IHASH_ITERATE(ht, val)					\
   for (hurd_ihash_value_t val,						\
          *_hurd_ihash_valuep = (ht)->size ? &(ht)->items[0].value : 0;	\
-       (ht)->size							\
-	 && (size_t) ((_hurd_ihash_item_t) _hurd_ihash_valuep		\
-		      - &(ht)->items[0])				\
-            < (ht)->size						\
+       _hurd_ihash_valuep						\
          && (val = *_hurd_ihash_valuep, 1);				\
        _hurd_ihash_valuep = (hurd_ihash_value_t *)			\
-	 (((_hurd_ihash_item_t) _hurd_ihash_valuep) + 1))		\
+	 _hurd_ihash_iterate_next ((ht),				\
+				   (_hurd_ihash_item_t) _hurd_ihash_valuep)) \
     if (val != _HURD_IHASH_EMPTY && val != _HURD_IHASH_DELETED)
 
 /* Iterate over all elements in the hash table making both the key and
@@ -346,8 +426,8 @@ hurd_ihash_value_t hurd_ihash_locp_find (hurd_ihash_t ht,
    ITEM->value.  */
 #define HURD_IHASH_ITERATE_ITEMS(ht, item)                              \
   for (_hurd_ihash_item_t item = (ht)->size? &(ht)->items[0]: 0;	\
-       (ht)->size && item - &(ht)->items[0] < (ht)->size;               \
-       item++)                                                          \
+       item;								\
+       item = _hurd_ihash_iterate_next ((ht), item))			\
     if (item->value != _HURD_IHASH_EMPTY &&                             \
         item->value != _HURD_IHASH_DELETED)
 
@@ -361,6 +441,160 @@ int hurd_ihash_remove (hurd_ihash_t ht, hurd_ihash_key_t key);
    hurd_ihash_remove().  */
 void hurd_ihash_locp_remove (hurd_ihash_t ht, hurd_ihash_locp_t locp);
 
+/* Concurrent hash tables.
+
+   A struct hurd_cihash maps keys to values just like a struct
+   hurd_ihash, but it does its own locking and is meant for tables
+   that are looked up much more often than they are modified, and from
+   many threads at once, such as the port hash table of libports.
+
+   Lookups never take a lock.  Instead, the table is split into
+   HURD_CIHASH_SEGMENTS independent segments, each with its own writer
+   lock and sequence counter.  A lookup reads the sequence counter of
+   its segment, probes the segment, and retries if a writer modified
+   the segment in the meantime.  As writers on different segments do
+   not contend, insertions and removals scale as well.
+
+   Each segment grows on its own, so growing the table only ever
+   rehashes a fraction of the items, and lookups continue on the old
+   array while the new one is being built.  Old arrays are only freed
+   once every lookup that might still use them has finished.  */
+
+/* The number of segments of a concurrent hash table.  Must be a power
+   of two.  */
+#define HURD_CIHASH_SEGMENTS	16
+
+/* The number of reader counters used to detect when an old array of a
+   concurrent hash table is no longer used.  Must be a power of two.  */
+#define HURD_CIHASH_READER_SLOTS	16
+
+/* The assumed size of a cache line.  Frequently written members of a
+   concurrent hash table are aligned to it to avoid false sharing.  */
+#define _HURD_CIHASH_CACHELINE	64
+
+struct _hurd_cihash_array
+{
+  /* The length of the array ITEMS.  Always a power of two.  */
+  size_t size;
+
+  /* The (key, value) pairs.  */
+  struct _hurd_ihash_item items[];
+};
+
+struct _hurd_cihash_segment
+{
+  /* Serializes all writers of this segment.  */
+  pthread_mutex_t lock;
+
+  /* The sequence counter.  It is odd while a writer modifies this
+     segment.  */
+  unsigned int seq;
+
+  /* The current array of this segment, or NULL if nothing was ever
+     added to it.  */
+  struct _hurd_cihash_array *array;
+
+  /* The number of hashed elements and the number of free slots.  */
+  size_t nr_items;
+  size_t nr_free;
+} __attribute__ ((aligned (_HURD_CIHASH_CACHELINE)));
+
+struct _hurd_cihash_readers
+{
+  unsigned int count;
+} __attribute__ ((aligned (_HURD_CIHASH_CACHELINE)));
+
+struct hurd_cihash
+{
+  struct _hurd_cihash_segment segments[HURD_CIHASH_SEGMENTS];
+
+  /* The number of lookups in progress, for both halves of the current
+     grace period, spread over several cache lines.  */
+  struct _hurd_cihash_readers readers[2][HURD_CIHASH_READER_SLOTS];
+
+  /* The grace period counter.  Readers account themselves in
+     READERS[EPOCH & 1].  */
+  unsigned int epoch;
+
+  /* Serializes waiting for grace periods.  */
+  pthread_mutex_t epoch_lock;
+
+  /* The same as in struct hurd_ihash.  */
+  intptr_t locp_offset;
+  unsigned int max_load;
+  hurd_ihash_cleanup_t cleanup;
+  void *cleanup_data;
+  hurd_ihash_fct_hash_t fct_hash;
+  hurd_ihash_fct_cmp_t fct_cmp;
+};
+typedef struct hurd_cihash *hurd_cihash_t;
+
+/* Initialize the concurrent hash table at address HT.  LOCP_OFFS has
+   the same meaning as for hurd_ihash_init.  */
+void hurd_cihash_init (hurd_cihash_t ht, intptr_t locp_offs);
+
+/* Destroy the concurrent hash table at address HT.  This first
+   removes all elements which are still in the hash table, and calls
+   the cleanup function for them (if any).  No other thread may use HT
+   at this point.  */
+void hurd_cihash_destroy (hurd_cihash_t ht);
+
+/* Set the cleanup function of HT.  Must be called before HT is used
+   by more than one thread.  */
+void hurd_cihash_set_cleanup (hurd_cihash_t ht, hurd_ihash_cleanup_t cleanup,
+			      void *cleanup_data);
+
+/* Use the generalized key interface.  Must be called before any item
+   is inserted into the table.  As lookups do not lock the table,
+   FCT_CMP may be called with keys of items that are being removed
+   concurrently, see hurd_cihash_synchronize.  */
+void hurd_cihash_set_gki (hurd_cihash_t ht,
+			  hurd_ihash_fct_hash_t fct_hash,
+			  hurd_ihash_fct_cmp_t fct_cmp);
+
+/* Set the maximum load factor of every segment of HT in binary
+   percent, see hurd_ihash_set_max_load.  */
+void hurd_cihash_set_max_load (hurd_cihash_t ht, unsigned int max_load);
+
+/* Add ITEM to the hash table HT under the key KEY.  If there already
+   is an item under this key, call the cleanup function (if any) for
+   it before overriding the value.  If a memory allocation error
+   occurs, ENOMEM is returned, otherwise 0.  */
+error_t hurd_cihash_add (hurd_cihash_t ht, hurd_ihash_key_t key,
+			 hurd_ihash_value_t item);
+
+/* Find and return the item in the hash table HT with key KEY, or NULL
+   if it doesn't exist.  This does not take any lock, so the item may
+   be removed from HT as soon as it is returned.  Callers that need
+   the item to stay alive must make sure that removed items are not
+   released before hurd_cihash_synchronize returns, or must get a
+   reference in a way that fails for items being released.  */
+hurd_ihash_value_t hurd_cihash_find (hurd_cihash_t ht, hurd_ihash_key_t key);
+
+/* Remove the entry with the key KEY from the hash table HT.  If such
+   an entry was found and removed, 1 is returned, otherwise 0.  */
+int hurd_cihash_remove (hurd_cihash_t ht, hurd_ihash_key_t key);
+
+/* Remove VALUE, which must be in the hash table HT, using the
+   location pointer stored in it.  HT must have been initialized with
+   a LOCP_OFFS other than HURD_IHASH_NO_LOCP.  This is faster than
+   hurd_cihash_remove, as it does not search for the item.
+
+   Unlike hurd_ihash_locp_remove, this takes the value and not the
+   location pointer itself, because the location pointer may change
+   under the feet of the caller while another thread grows the table.
+   It is read from VALUE while the segment is locked.  */
+void hurd_cihash_locp_remove (hurd_cihash_t ht, hurd_ihash_value_t value);
+
+/* Wait until all lookups in HT that were in progress when this
+   function was called have finished.  After that, no lookup can
+   return or compare an item that was removed before the call.  */
+void hurd_cihash_synchronize (hurd_cihash_t ht);
+
+/* Return the number of items in HT.  The result is only a snapshot if
+   other threads modify HT concurrently.  */
+size_t hurd_cihash_count (hurd_cihash_t ht);
+
 /* We provide a general purpose hash function.  This function can be
    used with the generalized key interface to use arbitrary data as
    keys using this library.  */
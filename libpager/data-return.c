@@ -21,6 +21,12 @@
 #include <string.h>
 #include <assert.h>
 
+error_t (*pager_write_pages_hook) (struct user_pager_info *pager,
+				   vm_offset_t offset,
+				   vm_address_t buf,
+				   vm_size_t length,
+				   error_t *errors);
+
 /* Worker function used by _pager_S_memory_object_data_return
    and _pager_S_memory_object_data_initialize.  All args are
    as for _pager_S_memory_object_data_return; the additional
@@ -158,14 +164,16 @@ _pager_do_write_request (struct pager *p,
   /* Let someone else in. */
   pthread_mutex_unlock (&p->interlock);
 
-  /* This is inefficient; we should send all the pages to the device at once
-     but until the pager library interface is changed, this will have to do. */
-
-  for (i = 0; i < npages; i++)
-    if (!(omitdata & (1 << i)))
-      pagerrs[i] = pager_write_page (p->upi,
-				     offset + (vm_page_size * i),
-				     data + (vm_page_size * i));
+  /* Send all the pages to the device at once if the user can do that,
+     otherwise write them one by one.  */
+  if (npages == 1 || omitdata || pager_write_pages_hook == NULL
+      || (*pager_write_pages_hook) (p->upi, offset, data, length,
+				    pagerrs) == EOPNOTSUPP)
+    for (i = 0; i < npages; i++)
+      if (!(omitdata & (1 << i)))
+	pagerrs[i] = pager_write_page (p->upi,
+				       offset + (vm_page_size * i),
+				       data + (vm_page_size * i));
 
   /* Acquire the right to meddle with the pagemap */
   pthread_mutex_lock (&p->interlock);
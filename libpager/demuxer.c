@@ -20,6 +20,7 @@
 #include <mach/mig_errors.h>
 #include <pthread.h>
 #include <string.h>
+#include <time.h>
 
 #include "priv.h"
 #include "memory_object_S.h"
@@ -39,17 +40,34 @@
   unique identifier representing O.  If another thread now dequeues a
   second request to O, it enqueues it to the first workers queue.
 
-  At least one worker thread is necessary.
+  The number of workers is chosen when the pool is started.  At least
+  one worker thread is necessary.
 */
-#define WORKER_COUNT 1
 
 /* An request contains the message received from the port set.  */
 struct request
 {
   struct item item;
   mig_routine_t routine;
+  unsigned long long queued;	/* when it was queued, in nanoseconds */
+  int pooled;			/* whether it is from the request pool */
 };
 
+/* Messages are copied from the receive buffer into request buffers.
+   To keep malloc off the path of the receiving thread, every pool
+   owns REQUEST_POOL_SIZE preallocated buffers with room for
+   REQUEST_MSG_SIZE bytes of message.  That is plenty for any
+   memory_object or notification message, as they carry page data
+   out-of-line.  Larger messages, and messages arriving while all
+   buffers are in use, are copied to the heap.
+
+   The buffers not in use are kept on a stack.  It is popped only by
+   the receiving thread and pushed by the workers, so it can be a
+   lock-free stack without suffering from the ABA problem.  */
+#define REQUEST_POOL_SIZE	64
+#define REQUEST_MSG_SIZE	256
+#define REQUEST_SLOT_SIZE	(sizeof (struct request) + REQUEST_MSG_SIZE)
+
 /* A struct request object is immediately followed by the received
    message.  */
 static inline mach_msg_header_t *
@@ -82,9 +100,78 @@ struct pager_requests
   pthread_cond_t wakeup;
   pthread_cond_t inhibit_wakeup;
   pthread_mutex_t lock;
-  struct worker workers[WORKER_COUNT];
+
+  /* The request pool.  */
+  char *pool;
+  struct item *pool_free;
+
+  /* Statistics, protected by LOCK.  */
+  struct pager_request_stats stats;
+
+  unsigned int worker_count;
+  struct worker workers[];
 };
 
+static inline unsigned long long
+now (void)
+{
+  struct timespec ts;
+  if (clock_gettime (CLOCK_MONOTONIC, &ts))
+    return 0;
+  return (unsigned long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Get a request buffer with room for a message of SIZE bytes.  Must
+   only be called by the receiving thread.  */
+static struct request *
+request_alloc (struct pager_requests *requests, mach_msg_size_t size)
+{
+  struct request *r;
+
+  if (size <= REQUEST_MSG_SIZE)
+    {
+      struct item *head = __atomic_load_n (&requests->pool_free,
+					   __ATOMIC_ACQUIRE);
+      while (head != NULL
+	     && ! __atomic_compare_exchange_n (&requests->pool_free, &head,
+					       head->next, 0,
+					       __ATOMIC_ACQUIRE,
+					       __ATOMIC_ACQUIRE))
+	;
+      if (head != NULL)
+	{
+	  r = (struct request *) head;
+	  r->pooled = 1;
+	  return r;
+	}
+    }
+
+  r = malloc (sizeof *r + size);
+  if (r != NULL)
+    r->pooled = 0;
+  return r;
+}
+
+/* Release the request buffer R.  */
+static void
+request_free (struct pager_requests *requests, struct request *r)
+{
+  if (r == NULL)
+    return;
+
+  if (! r->pooled)
+    {
+      free (r);
+      return;
+    }
+
+  r->item.next = __atomic_load_n (&requests->pool_free, __ATOMIC_RELAXED);
+  while (! __atomic_compare_exchange_n (&requests->pool_free, &r->item.next,
+					&r->item, 0,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+}
+
 /* Demultiplex a single message directed at a pager port; INP is the
    message received; fill OUTP with the reply.  */
 static int
@@ -103,7 +190,7 @@ pager_demuxer (struct pager_requests *requests,
   mach_msg_size_t padded_size = (inp->msgh_size + MASK) & ~MASK;
 #undef MASK
 
-  struct request *r = malloc (sizeof *r + padded_size);
+  struct request *r = request_alloc (requests, padded_size);
   if (r == NULL)
     {
       err = ENOMEM;
@@ -112,11 +199,19 @@ pager_demuxer (struct pager_requests *requests,
 
   r->routine = routine;
   memcpy (request_inp (r), inp, inp->msgh_size);
+  r->queued = now ();
 
   pthread_mutex_lock (&requests->lock);
 
   queue_enqueue (requests->queue_in, &r->item);
 
+  requests->stats.requests += 1;
+  if (! r->pooled)
+    requests->stats.heap_requests += 1;
+  requests->stats.queue_depth += 1;
+  if (requests->stats.queue_depth > requests->stats.max_queue_depth)
+    requests->stats.max_queue_depth = requests->stats.queue_depth;
+
   /* Awake worker, but only if not inhibited.  */
   if (requests->asleep > 0 && requests->queue_in == requests->queue_out)
       pthread_cond_signal (&requests->wakeup);
@@ -177,7 +272,7 @@ worker_func (void *arg)
       mach_msg_return_t mr;
 
       /* Free previous message.  */
-      free (r);
+      request_free (requests, r);
 
       pthread_mutex_lock (&requests->lock);
 
@@ -196,13 +291,13 @@ worker_func (void *arg)
       while ((r = queue_dequeue (requests->queue_out)) == NULL)
 	{
 	  requests->asleep += 1;
-	  if (requests->asleep == WORKER_COUNT)
+	  if (requests->asleep == requests->worker_count)
 	    pthread_cond_broadcast (&requests->inhibit_wakeup);
 	  pthread_cond_wait (&requests->wakeup, &requests->lock);
 	  requests->asleep -= 1;
 	}
 
-      for (i = 0; i < WORKER_COUNT; i++)
+      for (i = 0; i < requests->worker_count; i++)
 	if (requests->workers[i].tag
 	    == (unsigned long) request_inp (r)->msgh_local_port)
 	  {
@@ -216,6 +311,15 @@ worker_func (void *arg)
       self->tag = (unsigned long) request_inp (r)->msgh_local_port;
 
     got_one:
+      requests->stats.queue_depth -= 1;
+      if (r->queued)
+	{
+	  unsigned long long wait = now () - r->queued;
+	  requests->stats.wait_time += wait;
+	  if (wait > requests->stats.max_wait_time)
+	    requests->stats.max_wait_time = wait;
+	}
+
       pthread_mutex_unlock (&requests->lock);
 
       mig_reply_setup (request_inp (r), (mach_msg_header_t *) &reply_msg);
@@ -305,10 +409,12 @@ service_paging_requests (void *arg)
   return NULL;
 }
 
-/* Start the worker threads libpager uses to service requests.  */
+/* Start WORKER_COUNT worker threads libpager uses to service
+   requests.  */
 error_t
-pager_start_workers (struct port_bucket *pager_bucket,
-		     struct pager_requests **out_requests)
+pager_start_workers_n (struct port_bucket *pager_bucket,
+		       unsigned int worker_count,
+		       struct pager_requests **out_requests)
 {
   error_t err;
   int i;
@@ -317,7 +423,14 @@ pager_start_workers (struct port_bucket *pager_bucket,
 
   assert (out_requests != NULL);
 
-  requests = malloc (sizeof *requests);
+  if (worker_count == 0)
+    {
+      err = EINVAL;
+      goto done;
+    }
+
+  requests = malloc (sizeof *requests
+		     + worker_count * sizeof requests->workers[0]);
   if (requests == NULL)
     {
       err = ENOMEM;
@@ -326,6 +439,23 @@ pager_start_workers (struct port_bucket *pager_bucket,
 
   requests->bucket = pager_bucket;
   requests->asleep = 0;
+  requests->worker_count = worker_count;
+  memset (&requests->stats, 0, sizeof requests->stats);
+
+  requests->pool = malloc (REQUEST_POOL_SIZE * REQUEST_SLOT_SIZE);
+  if (requests->pool == NULL)
+    {
+      err = ENOMEM;
+      goto done;
+    }
+  requests->pool_free = NULL;
+  for (i = REQUEST_POOL_SIZE - 1; i >= 0; i--)
+    {
+      struct item *item =
+	(struct item *) (requests->pool + i * REQUEST_SLOT_SIZE);
+      item->next = requests->pool_free;
+      requests->pool_free = item;
+    }
 
   requests->queue_in = malloc (sizeof *requests->queue_in);
   if (requests->queue_in == NULL)
@@ -341,18 +471,23 @@ pager_start_workers (struct port_bucket *pager_bucket,
   pthread_cond_init (&requests->inhibit_wakeup, NULL);
   pthread_mutex_init (&requests->lock, NULL);
 
+  /* Workers look at each other's tags and queues to delegate requests,
+     so all of them must be set up before any thread starts.  */
+  for (i = 0; i < worker_count; i++)
+    {
+      requests->workers[i].requests = requests;
+      requests->workers[i].tag = 0;
+      queue_init (&requests->workers[i].queue);
+    }
+
   /* Make a thread to service paging requests.  */
   err = pthread_create (&t, NULL, service_paging_requests, requests);
   if (err)
     goto done;
   pthread_detach (t);
 
-  for (i = 0; i < WORKER_COUNT; i++)
+  for (i = 0; i < worker_count; i++)
     {
-      requests->workers[i].requests = requests;
-      requests->workers[i].tag = 0;
-      queue_init (&requests->workers[i].queue);
-
       err = pthread_create (&t, NULL, &worker_func, &requests->workers[i]);
       if (err)
 	goto done;
@@ -368,6 +503,15 @@ done:
   return err;
 }
 
+/* Start the worker threads libpager uses to service requests.  */
+error_t
+pager_start_workers (struct port_bucket *pager_bucket,
+		     struct pager_requests **out_requests)
+{
+  return pager_start_workers_n (pager_bucket, PAGER_DEFAULT_WORKER_COUNT,
+				out_requests);
+}
+
 error_t
 pager_inhibit_workers (struct pager_requests *requests)
 {
@@ -395,7 +539,8 @@ pager_inhibit_workers (struct pager_requests *requests)
      Check that the queue is empty, since it's possible that a request
      came in, was queued and a worker was signalled but the lock was
      acquired here before the worker woke up.  */
-  while (requests->asleep < WORKER_COUNT || !queue_empty(requests->queue_out))
+  while (requests->asleep < requests->worker_count
+	 || !queue_empty(requests->queue_out))
     pthread_cond_wait (&requests->inhibit_wakeup, &requests->lock);
 
 done_locked:
@@ -410,7 +555,7 @@ pager_resume_workers (struct pager_requests *requests)
 
   /* Check the workers are inhibited.  */
   assert (requests->queue_out != requests->queue_in);
-  assert (requests->asleep == WORKER_COUNT);
+  assert (requests->asleep == requests->worker_count);
   assert (queue_empty(requests->queue_out));
 
   /* The queue has been drained and will no longer be used.  */
@@ -423,3 +568,12 @@ pager_resume_workers (struct pager_requests *requests)
 
   pthread_mutex_unlock (&requests->lock);
 }
+
+void
+pager_get_request_stats (struct pager_requests *requests,
+			 struct pager_request_stats *stats)
+{
+  pthread_mutex_lock (&requests->lock);
+  *stats = requests->stats;
+  pthread_mutex_unlock (&requests->lock);
+}
@@ -34,6 +34,20 @@ error_t
 pager_start_workers (struct port_bucket *pager_bucket,
 		     struct pager_requests **requests);
 
+/* The number of worker threads started by pager_start_workers.  */
+#define PAGER_DEFAULT_WORKER_COUNT	1
+
+/* Like pager_start_workers, but start WORKER_COUNT worker threads,
+   which must be at least one.  Requests to different memory objects
+   are handled by up to WORKER_COUNT threads in parallel.  Requests to
+   the same memory object are still handled one at a time, in the order
+   they were received, so the callbacks of the user only have to cope
+   with concurrent calls for different pagers.  */
+error_t
+pager_start_workers_n (struct port_bucket *pager_bucket,
+		       unsigned int worker_count,
+		       struct pager_requests **requests);
+
 /* Inhibit the worker threads libpager uses to service requests,
    blocking until all requests sent before this function is called have
    finished.
@@ -52,6 +66,30 @@ pager_inhibit_workers (struct pager_requests *requests);
 void
 pager_resume_workers (struct pager_requests *requests);
 
+/* Statistics about the requests handled by a worker pool.  */
+struct pager_request_stats
+{
+  /* Number of requests received, and how many of them did not fit in a
+     preallocated request buffer and were copied to the heap.  */
+  unsigned long long requests;
+  unsigned long long heap_requests;
+
+  /* Number of requests waiting for a worker right now, and the
+     largest number seen so far.  */
+  unsigned int queue_depth;
+  unsigned int max_queue_depth;
+
+  /* Time in nanoseconds requests spent queued until a worker picked
+     them up, in total and at most.  */
+  unsigned long long wait_time;
+  unsigned long long max_wait_time;
+};
+
+/* Store the statistics of the worker pool REQUESTS in STATS.  */
+void
+pager_get_request_stats (struct pager_requests *requests,
+			 struct pager_request_stats *stats);
+
 /* Create a new pager.  The pager will have a port created for it
    (using libports, in BUCKET) and will be immediately ready
    to receive requests.  U_PAGER will be provided to later calls to
@@ -199,6 +237,19 @@ pager_write_page (struct user_pager_info *pager,
 		  vm_offset_t page,
 		  vm_address_t buf);
 
+/* If this function is nonzero, it is called when the kernel returns
+   several contiguous pages at once, so that the user can write them
+   with fewer, larger i/o operations.  For pager PAGER, synchronously
+   write LENGTH bytes (a multiple of the page size) from BUF to offset
+   OFFSET, and store the result for each page in ERRORS.  BUF must not
+   be deallocated.  If it returns EOPNOTSUPP, pager_write_page is called
+   for each page instead.  */
+extern error_t (*pager_write_pages_hook) (struct user_pager_info *pager,
+					  vm_offset_t offset,
+					  vm_address_t buf,
+					  vm_size_t length,
+					  error_t *errors);
+
 /* The user must define this function.  A page should be made writable. */
 error_t
 pager_unlock_page (struct user_pager_info *pager,
@@ -0,0 +1,603 @@
+/* Random-access decompressing store backend for gzip images
+
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This file is part of the GNU Hurd.
+
+   The GNU Hurd is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   The GNU Hurd is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111, USA. */
+
+/* Unlike the gunzip store, which decompresses the whole image when it is
+   opened, this store decompresses only what is read.  As decompression
+   proceeds it records access points -- the state of the decompressor at
+   deflate block boundaries roughly every GZINDEX_SPAN bytes of output --
+   from which later reads can resume.  Decompressed data is kept in a small
+   LRU cache of GZINDEX_CHUNK sized chunks, and the decompressor is left
+   where it stopped, so sequential reads don't restart at all.  The size of
+   the image is taken from the gzip trailer, so images of 4 GiB or more, and
+   images of several concatenated gzip members, must use the gunzip store
+   instead.  */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <zlib.h>
+
+#include "store.h"
+
+/* Uncompressed bytes between access points.  */
+#define GZINDEX_SPAN	(1024 * 1024)
+/* The unit of caching.  */
+#define GZINDEX_CHUNK	(64 * 1024)
+/* Number of chunks cached.  */
+#define GZINDEX_CACHE	32
+/* Bytes of compressed input read at a time.  */
+#define GZINDEX_INPUT	(64 * 1024)
+/* The size of a deflate window.  */
+#define GZINDEX_WINDOW	32768
+
+/* A place from which decompression can start.  */
+struct gzindex_point
+{
+  store_offset_t out;		/* Offset in the uncompressed data.  */
+  store_offset_t in;		/* Offset of the next compressed byte.  */
+  int bits;			/* Bits of the byte before IN not used yet.  */
+  unsigned char *window;	/* Malloced; the preceding output.  */
+  unsigned window_len;
+};
+
+/* A decompressed chunk.  */
+struct gzindex_chunk
+{
+  store_offset_t chunk;		/* Index of the chunk, or -1 if none.  */
+  size_t len;			/* Less than GZINDEX_CHUNK only at the end.  */
+  unsigned long used;		/* Time of last use.  */
+  void *data;			/* Malloced.  */
+};
+
+struct gzindex
+{
+  pthread_mutex_t lock;
+
+  /* Access points, sorted by OUT.  POINTS[0] is the start of the gzip
+     stream, and has no window.  */
+  struct gzindex_point *points;
+  size_t num_points, alloced_points;
+
+  struct gzindex_chunk cache[GZINDEX_CACHE];
+  unsigned long clock;
+
+  /* The decompressor, which has produced everything before OUT.  Output
+     goes into CUR, which holds the chunk containing OUT; if CUR_WHOLE is
+     false, CUR is missing the start of that chunk.  */
+  z_stream strm;
+  int live;			/* STRM has been set up.  */
+  int eof;			/* STRM has reached the end of the stream.  */
+  store_offset_t out;
+  void *cur;			/* Malloced.  */
+  int cur_whole;
+
+  /* Compressed input; IN is the address in the source of the next byte
+     after those in INPUT.  */
+  unsigned char *input;		/* Malloced.  */
+  size_t input_size;
+  store_offset_t in;
+};
+
+static void
+gzindex_free (struct gzindex *gz)
+{
+  size_t i;
+
+  for (i = 0; i < gz->num_points; i++)
+    free (gz->points[i].window);
+  free (gz->points);
+  for (i = 0; i < GZINDEX_CACHE; i++)
+    free (gz->cache[i].data);
+  free (gz->cur);
+  free (gz->input);
+  inflateEnd (&gz->strm);
+  pthread_mutex_destroy (&gz->lock);
+  free (gz);
+}
+
+/* Return a new index for the gzip image in SOURCE in GZ.  */
+static error_t
+gzindex_alloc (struct store *source, struct gzindex **gz)
+{
+  struct gzindex *new = calloc (1, sizeof *new);
+  size_t i;
+
+  if (! new)
+    return ENOMEM;
+
+  if (inflateInit2 (&new->strm, 32 + MAX_WBITS) != Z_OK)
+    {
+      free (new);
+      return ENOMEM;
+    }
+  pthread_mutex_init (&new->lock, NULL);
+
+  /* Read whole blocks of SOURCE.  */
+  new->input_size = ((GZINDEX_INPUT + source->block_size - 1)
+		     / source->block_size * source->block_size);
+  new->input = malloc (new->input_size);
+  new->cur = malloc (GZINDEX_CHUNK);
+  new->alloced_points = 16;
+  new->points = malloc (new->alloced_points * sizeof *new->points);
+  if (!new->input || !new->cur || !new->points)
+    {
+      gzindex_free (new);
+      return ENOMEM;
+    }
+
+  for (i = 0; i < GZINDEX_CACHE; i++)
+    new->cache[i].chunk = -1;
+
+  new->points[0].out = 0;
+  new->points[0].in = 0;
+  new->points[0].bits = 0;
+  new->points[0].window = 0;
+  new->points[0].window_len = 0;
+  new->num_points = 1;
+
+  *gz = new;
+  return 0;
+}
+
+/* Refill GZ's input buffer from SOURCE.  */
+static error_t
+gzindex_fill (struct gzindex *gz, struct store *source)
+{
+  size_t bsize = source->block_size;
+  store_offset_t addr = gz->in / bsize;
+  size_t skip = gz->in - addr * bsize;
+  size_t amount = gz->input_size;
+  void *buf = gz->input;
+  size_t len = gz->input_size;
+  error_t err;
+
+  if (addr * bsize >= source->size)
+    return EIO;			/* Truncated image.  */
+  if (amount > source->size - addr * bsize)
+    amount = source->size - addr * bsize;
+
+  err = store_read (source, addr, amount, &buf, &len);
+  if (err)
+    return err;
+  if (buf != gz->input)
+    {
+      size_t buf_len = len;
+      if (len > gz->input_size)
+	len = gz->input_size;
+      memcpy (gz->input, buf, len);
+      munmap (buf, buf_len);
+    }
+  if (len <= skip)
+    return EIO;
+
+  gz->strm.next_in = gz->input + skip;
+  gz->strm.avail_in = len - skip;
+  gz->in += len - skip;
+  return 0;
+}
+
+/* Return the cache entry holding chunk CHUNK in GZ, or 0.  */
+static struct gzindex_chunk *
+gzindex_lookup (struct gzindex *gz, store_offset_t chunk)
+{
+  size_t i;
+
+  for (i = 0; i < GZINDEX_CACHE; i++)
+    if (gz->cache[i].chunk == chunk)
+      {
+	gz->cache[i].used = ++gz->clock;
+	return &gz->cache[i];
+      }
+  return 0;
+}
+
+/* GZ->cur holds all LEN bytes of chunk CHUNK; move it into the cache.  */
+static void
+gzindex_cache_cur (struct gzindex *gz, store_offset_t chunk, size_t len)
+{
+  struct gzindex_chunk *victim = &gz->cache[0];
+  void *data;
+  size_t i;
+
+  for (i = 1; i < GZINDEX_CACHE && victim->data; i++)
+    if (! gz->cache[i].data || gz->cache[i].used < victim->used)
+      victim = &gz->cache[i];
+
+  if (! victim->data)
+    {
+      /* Give GZ->cur a fresh buffer, rather than the victim's.  */
+      data = malloc (GZINDEX_CHUNK);
+      if (! data)
+	return;			/* Just don't cache it.  */
+    }
+  else
+    data = victim->data;
+
+  victim->data = gz->cur;
+  victim->chunk = chunk;
+  victim->len = len;
+  victim->used = ++gz->clock;
+  gz->cur = data;
+}
+
+/* Record the current state of GZ's decompressor as an access point.  */
+static void
+gzindex_add_point (struct gzindex *gz)
+{
+  struct gzindex_point *point;
+
+  if (gz->num_points == gz->alloced_points)
+    {
+      size_t alloced = gz->alloced_points * 2;
+      struct gzindex_point *points =
+	realloc (gz->points, alloced * sizeof *points);
+      if (! points)
+	return;			/* The index is just sparser.  */
+      gz->points = points;
+      gz->alloced_points = alloced;
+    }
+
+  point = &gz->points[gz->num_points];
+  point->window = malloc (GZINDEX_WINDOW);
+  if (! point->window)
+    return;
+  point->window_len = GZINDEX_WINDOW;
+  if (inflateGetDictionary (&gz->strm, point->window, &point->window_len)
+      != Z_OK)
+    {
+      free (point->window);
+      return;
+    }
+  point->out = gz->out;
+  point->in = gz->in - gz->strm.avail_in;
+  point->bits = gz->strm.data_type & 7;
+  gz->num_points++;
+}
+
+/* Set up GZ's decompressor to start at POINT.  */
+static error_t
+gzindex_restart (struct gzindex *gz, struct store *source,
+		 struct gzindex_point *point)
+{
+  error_t err;
+
+  gz->live = 0;
+  gz->eof = 0;
+  gz->strm.avail_in = 0;
+
+  if (point->out == 0)
+    /* The very start, with the gzip header.  */
+    {
+      if (inflateReset2 (&gz->strm, 32 + MAX_WBITS) != Z_OK)
+	return EIO;
+      gz->in = 0;
+    }
+  else
+    /* The middle of the raw deflate data.  */
+    {
+      if (inflateReset2 (&gz->strm, -MAX_WBITS) != Z_OK)
+	return EIO;
+      gz->in = point->in - (point->bits ? 1 : 0);
+      if (point->bits)
+	{
+	  int byte;
+
+	  err = gzindex_fill (gz, source);
+	  if (err)
+	    return err;
+	  byte = *gz->strm.next_in++;
+	  gz->strm.avail_in--;
+	  inflatePrime (&gz->strm, point->bits, byte >> (8 - point->bits));
+	}
+      if (inflateSetDictionary (&gz->strm, point->window, point->window_len)
+	  != Z_OK)
+	return EIO;
+    }
+
+  gz->out = point->out;
+  gz->cur_whole = 0;
+  gz->live = 1;
+  return 0;
+}
+
+/* Run GZ's decompressor until it has produced everything before UNTIL, or
+   reached the end of the stream, caching whole chunks and recording access
+   points as it goes.  */
+static error_t
+gzindex_inflate (struct gzindex *gz, struct store *source,
+		 store_offset_t until)
+{
+  while (gz->out < until && ! gz->eof)
+    {
+      size_t ofs = gz->out % GZINDEX_CHUNK, produced;
+      int ret;
+
+      if (ofs == 0)
+	gz->cur_whole = 1;
+
+      if (gz->strm.avail_in == 0)
+	{
+	  error_t err = gzindex_fill (gz, source);
+	  if (err)
+	    {
+	      gz->live = 0;
+	      return err;
+	    }
+	}
+
+      gz->strm.next_out = gz->cur + ofs;
+      gz->strm.avail_out = GZINDEX_CHUNK - ofs;
+      ret = inflate (&gz->strm, Z_BLOCK);
+      if (ret != Z_OK && ret != Z_STREAM_END)
+	{
+	  gz->live = 0;
+	  return EIO;
+	}
+
+      produced = GZINDEX_CHUNK - ofs - gz->strm.avail_out;
+      gz->out += produced;
+
+      if (ret == Z_STREAM_END)
+	gz->eof = 1;
+
+      if (gz->cur_whole && gz->out > 0
+	  && (gz->eof || (produced > 0 && gz->out % GZINDEX_CHUNK == 0)))
+	gzindex_cache_cur (gz, (gz->out - 1) / GZINDEX_CHUNK,
+			   gz->out - (gz->out - 1) / GZINDEX_CHUNK
+			   * GZINDEX_CHUNK);
+
+      if (! gz->eof
+	  && (gz->strm.data_type & 128) && ! (gz->strm.data_type & 64)
+	  && gz->out >= gz->points[gz->num_points - 1].out + GZINDEX_SPAN)
+	/* At the end of a deflate block, and far enough from the last access
+	   point to add another.  */
+	gzindex_add_point (gz);
+    }
+
+  return 0;
+}
+
+/* Return the cache entry for chunk CHUNK of STORE, decompressing it if
+   necessary, or 0 if it lies beyond the end of the data.  */
+static error_t
+gzindex_get (struct store *store, store_offset_t chunk,
+	     struct gzindex_chunk **entry)
+{
+  struct gzindex *gz = store->hook;
+  struct store *source = store->children[0];
+  store_offset_t start = chunk * GZINDEX_CHUNK;
+  size_t lo = 0, hi = gz->num_points;
+  error_t err;
+
+  *entry = gzindex_lookup (gz, chunk);
+  if (*entry)
+    return 0;
+
+  /* Find the last access point at or before START.  */
+  while (hi - lo > 1)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (gz->points[mid].out <= start)
+	lo = mid;
+      else
+	hi = mid;
+    }
+
+  if (! gz->live || gz->out > start || gz->out < gz->points[lo].out)
+    /* Resuming where the decompressor stopped would take longer.  */
+    {
+      err = gzindex_restart (gz, source, &gz->points[lo]);
+      if (err)
+	return err;
+    }
+
+  err = gzindex_inflate (gz, source, start + GZINDEX_CHUNK);
+  if (err)
+    return err;
+
+  *entry = gzindex_lookup (gz, chunk);
+  return 0;
+}
+
+static error_t
+gzindex_read (struct store *store,
+	      store_offset_t addr, size_t index, size_t amount,
+	      void **buf, size_t *len)
+{
+  struct gzindex *gz = store->hook;
+  void *data = *buf;
+  size_t done = 0;
+  error_t err = 0;
+
+  if (addr >= store->size)
+    amount = 0;
+  else if (amount > store->size - addr)
+    amount = store->size - addr;
+
+  if (*len < amount)
+    {
+      data = mmap (0, amount, PROT_READ|PROT_WRITE, MAP_ANON, 0, 0);
+      if (data == MAP_FAILED)
+	return errno;
+    }
+
+  pthread_mutex_lock (&gz->lock);
+  while (done < amount)
+    {
+      store_offset_t pos = addr + done;
+      size_t ofs = pos % GZINDEX_CHUNK, n;
+      struct gzindex_chunk *entry;
+
+      err = gzindex_get (store, pos / GZINDEX_CHUNK, &entry);
+      if (err)
+	break;
+      if (! entry || entry->len <= ofs)
+	break;			/* The data ended early.  */
+
+      n = entry->len - ofs;
+      if (n > amount - done)
+	n = amount - done;
+      memcpy (data + done, entry->data + ofs, n);
+      done += n;
+    }
+  pthread_mutex_unlock (&gz->lock);
+
+  if (err && done == 0)
+    {
+      if (data != *buf)
+	munmap (data, amount);
+      return err;
+    }
+
+  *buf = data;
+  *len = done;
+  return 0;
+}
+
+static error_t
+gzindex_write (struct store *store,
+	       store_offset_t addr, size_t index, const void *buf, size_t len,
+	       size_t *amount)
+{
+  return EROFS;
+}
+
+static error_t
+gzindex_set_size (struct store *store, size_t newsize)
+{
+  return EOPNOTSUPP;
+}
+
+static void
+gzindex_cleanup (struct store *store)
+{
+  if (store->hook)
+    gzindex_free (store->hook);
+}
+
+/* A clone gets its own index, as it gets its own copy of the source.  */
+static error_t
+gzindex_clone (const struct store *from, struct store *to)
+{
+  return gzindex_alloc (to->children[0], (struct gzindex **) &to->hook);
+}
+
+/* Return a new store in STORE which reads the uncompressed contents of the
+   gzip image in the store FROM, decompressing only what is needed; FROM is
+   consumed.  */
+error_t
+store_gzindex_create (struct store *from, int flags, struct store **store)
+{
+  unsigned char trailer[4], *p;
+  size_t bsize = from->block_size;
+  store_offset_t addr;
+  struct store_run run;
+  struct gzindex *gz;
+  void *buf;
+  size_t len;
+  error_t err;
+
+  if (from->size < 18)
+    return EINVAL;		/* Too small to be a gzip file.  */
+
+  /* The last four bytes of a gzip file are its uncompressed size.  */
+  addr = (from->size - 4) / bsize;
+  buf = 0;
+  len = 0;
+  err = store_read (from, addr, from->size - addr * bsize, &buf, &len);
+  if (err)
+    return err;
+  if (len != from->size - addr * bsize)
+    err = EIO;
+  else
+    {
+      p = buf + (from->size - 4 - addr * bsize);
+      memcpy (trailer, p, 4);
+    }
+  munmap (buf, len);
+  if (err)
+    return err;
+
+  run.start = 0;
+  run.length = ((store_offset_t) trailer[0]
+		| ((store_offset_t) trailer[1] << 8)
+		| ((store_offset_t) trailer[2] << 16)
+		| ((store_offset_t) trailer[3] << 24));
+
+  err = gzindex_alloc (from, &gz);
+  if (err)
+    return err;
+
+  err = _store_create (&store_gzindex_class, MACH_PORT_NULL,
+		       flags | STORE_HARD_READONLY, 1,
+		       &run, 1, 0, store);
+  if (err)
+    {
+      gzindex_free (gz);
+      return err;
+    }
+  (*store)->hook = gz;
+
+  err = store_set_children (*store, &from, 1);
+  if (err)
+    {
+      /* Don't let store_free free FROM; our caller still owns it.  */
+      store_free (*store);
+      return err;
+    }
+
+  return 0;
+}
+
+/* Open the gzindex store NAME -- which consists of another store-class
+   name, a ':', and a name for that store class to open -- and return the
+   corresponding store in STORE.  CLASSES is used to select classes
+   specified by the type name; if it is 0, STORE_STD_CLASSES is used.  */
+error_t
+store_gzindex_open (const char *name, int flags,
+		    const struct store_class *const *classes,
+		    struct store **store)
+{
+  struct store *from;
+  error_t err =
+    store_typed_open (name, flags | STORE_HARD_READONLY, classes, &from);
+
+  if (! err)
+    {
+      err = store_gzindex_create (from, flags, store);
+      if (err)
+	store_free (from);
+    }
+
+  return err;
+}
+
+const struct store_class store_gzindex_class =
+{
+  -1, "gzindex",
+  open: store_gzindex_open,
+  read: gzindex_read,
+  write: gzindex_write,
+  set_size: gzindex_set_size,
+  cleanup: gzindex_cleanup,
+  clone: gzindex_clone,
+};
+STORE_STD_CLASS (gzindex);
@@ -43,6 +43,7 @@ _store_create (const struct store_class *class,
 	  new->port = port;
 	  new->runs = 0;
 	  new->num_runs = 0;
+	  new->run_index = 0;
 	  new->wrap_src = 0;
 	  new->wrap_dst = 0;
 	  new->flags = flags;
@@ -95,6 +96,8 @@ store_free (struct store *store)
     free (store->name);
   if (store->runs)
     free (store->runs);
+  if (store->run_index)
+    free (store->run_index);
 
   free (store);
 }
@@ -29,6 +29,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <pthread.h>
 
 
 // Avoid dragging in the resolver when linking statically.
@@ -83,187 +84,321 @@ struct nbd_reply
 #define ntohll htonll
 
 
-static inline error_t
-read_reply (struct store *store, uint64_t handle)
-{
-  struct nbd_reply reply;
-  char *buf = (void *) &reply;
-  mach_msg_type_number_t cc = sizeof reply;
-  error_t err = io_read (store->port, &buf, &cc, -1, cc);
-  if (err)
-    return err;
-  if (buf != (void *) &reply)
-    {
-      memcpy (&reply, buf, sizeof reply);
-      munmap (buf, cc);
-    }
-  if (cc != sizeof reply)
-    return EIO;
-  if (reply.magic != NBD_REPLY_MAGIC)
-    return EIO;
-  if (reply.handle != handle)
-    return EIO;
-  if (reply.error != 0)
-    return EIO;
-  return 0;
-}
+/* Requests are tagged with unique handles, so that many of them can be
+   outstanding on the connection at once.  A thread waiting for a reply
+   which finds no other thread reading replies becomes the receiver: it
+   reads replies off the connection and hands each one to the request with
+   the matching handle, until its own request is done.  */
 
-static error_t
-nbd_write (struct store *store,
-	   store_offset_t addr, size_t index, const void *buf, size_t len,
-	   size_t *amount)
+/* The maximum number of requests each read or write keeps outstanding.  */
+int store_nbd_queue_depth = 16;
+
+/* A request which has been sent, and its reply.  */
+struct nbd_pending
 {
-  struct nbd_request req =
-  {
-    magic: NBD_REQUEST_MAGIC,
-    type: htonl (1),		/* WRITE */
-  };
+  uint64_t handle;
+  char *buf;			/* Where the data of a read goes.  */
+  size_t len;			/* Amount of data in the reply.  */
+  size_t size;			/* Amount of data transferred.  */
   error_t err;
-  mach_msg_type_number_t cc;
+  int done;
+  struct nbd_pending *next;
+};
 
-  addr <<= store->log2_block_size;
-  *amount = 0;
+/* Connection state, shared by clones of a store.  */
+struct nbd_conn
+{
+  pthread_mutex_t lock;
+  pthread_cond_t wakeup;	/* Broadcast when requests complete.  */
+  pthread_mutex_t send_lock;	/* Keeps requests from being interleaved.  */
+  uint64_t next_handle;
+  struct nbd_pending *pending;	/* Sent, but not yet replied to.  */
+  int receiving;		/* Some thread is reading replies.  */
+  error_t err;			/* Once set, every request fails.  */
+  unsigned int refs;
+};
 
-  do
+/* Send exactly LEN bytes from BUF on STORE's connection.  */
+static error_t
+nbd_send_data (struct store *store, const char *buf, size_t len)
+{
+  while (len > 0)
     {
-      size_t chunk = len < NBD_IO_MAX ? len : NBD_IO_MAX, nwrote;
-      req.from = htonll (addr);
-      req.len = htonl (chunk);
-
-      err = io_write (store->port, (char *) &req, sizeof req, -1, &cc);
+      mach_msg_type_number_t cc;
+      error_t err = io_write (store->port, (char *) buf, len, -1, &cc);
       if (err)
 	return err;
-      if (cc != sizeof req)
+      if (cc == 0)
 	return EIO;
+      buf += cc;
+      len -= cc;
+    }
+  return 0;
+}
 
-      nwrote = 0;
-      do
-	{
-	  err = io_write (store->port, (char *) buf, chunk - nwrote, -1, &cc);
-	  if (err)
-	    return err;
-	  buf += cc;
-	  nwrote += cc;
-	} while (nwrote < chunk);
-
-      err = read_reply (store, req.handle);
+/* Read exactly LEN bytes from STORE's connection into BUF.  */
+static error_t
+nbd_recv_data (struct store *store, char *buf, size_t len)
+{
+  while (len > 0)
+    {
+      char *data = buf;
+      mach_msg_type_number_t cc = len;
+      error_t err = io_read (store->port, &data, &cc, -1, len);
       if (err)
 	return err;
+      if (cc == 0)
+	return EIO;		/* The server hung up on us.  */
+      if (data != buf)
+	{
+	  memcpy (buf, data, cc);
+	  munmap (data, cc);
+	}
+      buf += cc;
+      len -= cc;
+    }
+  return 0;
+}
 
-      addr += chunk;
-      *amount += chunk;
-      len -= chunk;
-    } while (len > 0);
+/* Fail every request outstanding on CONN with ERR, and all future ones.
+   CONN->lock must be held.  */
+static void
+nbd_fail (struct nbd_conn *conn, error_t err)
+{
+  struct nbd_pending *p;
 
-  return 0;
+  if (! conn->err)
+    conn->err = err;
+  for (p = conn->pending; p; p = p->next)
+    {
+      p->err = err;
+      p->done = 1;
+    }
+  conn->pending = 0;
+  pthread_cond_broadcast (&conn->wakeup);
 }
 
+/* Send a request of type TYPE for SIZE bytes at FROM (in bytes) on STORE's
+   connection, and register P to receive its reply.  For a write, the data
+   is taken from BUF; for a read, it will be put there.  */
 static error_t
-nbd_read (struct store *store,
-	  store_offset_t addr, size_t index, size_t amount,
-	  void **buf, size_t *len)
+nbd_submit (struct store *store, struct nbd_pending *p, int type,
+	    uint64_t from, char *buf, size_t size)
 {
+  struct nbd_conn *conn = store->hook;
   struct nbd_request req =
   {
     magic: NBD_REQUEST_MAGIC,
-    type: htonl (0),		/* READ */
+    type: htonl (type),
+    from: htonll (from),
+    len: htonl (size),
   };
   error_t err;
-  size_t ofs, chunk;
-  char *databuf, *piecebuf;
-  size_t databuflen, piecelen;
-
-  /* Send a request for the largest possible piece of remaining data and
-     read the first piece of its reply into PIECEBUF, PIECELEN.  The amount
-     requested can be found in CHUNK.  */
-  inline error_t request_chunk (char **buf, size_t *len)
-    {
-      mach_msg_type_number_t cc;
-
-      chunk = (amount - ofs) < NBD_IO_MAX ? (amount - ofs) : NBD_IO_MAX;
-
-      req.from = htonll (addr);
-      req.len = htonl (chunk);
 
-      /* Advance ADDR immediately, so it always points past what we've
-	 already requested.  */
-      addr += chunk;
+  p->buf = buf;
+  p->len = type == 0 ? size : 0;
+  p->size = size;
+  p->err = 0;
+  p->done = 0;
 
-      return (io_write (store->port, (char *) &req, sizeof req, -1, &cc) ?
-	      : cc != sizeof req ? EIO
-	      : read_reply (store, req.handle) ?
-	      : io_read (store->port, buf, len, (off_t) -1, chunk));
+  /* Register P before sending, as the reply might come back right away.  */
+  pthread_mutex_lock (&conn->lock);
+  err = conn->err;
+  if (! err)
+    {
+      p->handle = req.handle = conn->next_handle++;
+      p->next = conn->pending;
+      conn->pending = p;
     }
+  pthread_mutex_unlock (&conn->lock);
+  if (err)
+    return err;
 
-  addr <<= store->log2_block_size;
+  pthread_mutex_lock (&conn->send_lock);
+  err = nbd_send_data (store, (char *) &req, sizeof req);
+  if (!err && type == 1)
+    err = nbd_send_data (store, buf, size);
+  pthread_mutex_unlock (&conn->send_lock);
 
-  /* Read the first piece, which can go directly into the caller's buffer.  */
-  databuf = *buf;
-  piecelen = databuflen = *len;
-  err = request_chunk (&databuf, &piecelen);
   if (err)
-    return err;
-  if (databuflen >= amount)
+    /* The server may have seen part of the request, so the connection is
+       now useless.  */
     {
-      /* That got it all.  We're done.  */
-      *buf = databuf;
-      *len = piecelen;
-      return 0;
+      pthread_mutex_lock (&conn->lock);
+      nbd_fail (conn, err);
+      pthread_mutex_unlock (&conn->lock);
     }
 
-  /* We haven't read the entire amount yet.  */
-  ofs = 0;
-  do
+  return err;
+}
+
+/* Wait for the reply to the request P, reading replies off STORE's
+   connection for whoever they belong to if no one else is.  */
+static error_t
+nbd_wait (struct store *store, struct nbd_pending *p)
+{
+  struct nbd_conn *conn = store->hook;
+  error_t err;
+
+  pthread_mutex_lock (&conn->lock);
+  while (! p->done)
     {
-      /* Account for what we just read.  */
-      ofs += piecelen;
-      chunk -= piecelen;
-      if (ofs == amount)
+      if (conn->receiving)
 	{
-	  /* That got it all.  We're done.  */
-	  *buf = databuf;
-	  *len = ofs;
-	  return 0;
+	  pthread_cond_wait (&conn->wakeup, &conn->lock);
+	  continue;
 	}
 
-      /* Now we'll read another piece of the data, hopefully
-	 into the latter part of the existing buffer.  */
-      piecebuf = databuf + ofs;
-      piecelen = databuflen - ofs;
+      conn->receiving = 1;
+      while (! p->done)
+	{
+	  struct nbd_reply reply;
+	  struct nbd_pending **qp, *q;
 
-      if (chunk > 0)
-	/* We haven't finishing reading the last chunk we requested.  */
-	err = io_read (store->port, &piecebuf, &piecelen,
-		       (off_t) -1, chunk);
-      else
-	/* Request the next chunk from the server.  */
-	err = request_chunk (&piecebuf, &piecelen);
+	  pthread_mutex_unlock (&conn->lock);
+	  err = nbd_recv_data (store, (char *) &reply, sizeof reply);
+	  pthread_mutex_lock (&conn->lock);
 
-      if (!err && piecebuf != databuf + ofs)
-	{
-	  /* Now we have two discontiguous pieces of the buffer.  */
-	  size_t newbuflen = round_page (databuflen + piecelen);
-	  char *newbuf = mmap (0, newbuflen,
-			       PROT_READ|PROT_WRITE, MAP_ANON, 0, 0);
-	  if (newbuf == MAP_FAILED)
+	  if (!err && reply.magic != NBD_REPLY_MAGIC)
+	    err = EIO;
+	  if (err)
+	    {
+	      nbd_fail (conn, err);
+	      break;
+	    }
+
+	  for (qp = &conn->pending; *qp; qp = &(*qp)->next)
+	    if ((*qp)->handle == reply.handle)
+	      break;
+	  q = *qp;
+	  if (! q)
+	    /* A reply to something we never asked for.  */
 	    {
-	      err = errno;
+	      nbd_fail (conn, EIO);
 	      break;
 	    }
-	  memcpy (newbuf, databuf, ofs);
-	  memcpy (newbuf + ofs, piecebuf, piecelen);
-	  if (databuf != *buf)
-	    munmap (databuf, databuflen);
-	  databuf = newbuf;
-	  databuflen = newbuflen;
+	  *qp = q->next;
+
+	  if (reply.error == 0 && q->len > 0)
+	    /* The data follows the reply.  Q is no longer on the list, so
+	       nobody else will touch it.  */
+	    {
+	      pthread_mutex_unlock (&conn->lock);
+	      err = nbd_recv_data (store, q->buf, q->len);
+	      pthread_mutex_lock (&conn->lock);
+	      if (err)
+		{
+		  q->err = err;
+		  q->done = 1;
+		  nbd_fail (conn, err);
+		  break;
+		}
+	    }
+
+	  q->err = reply.error ? EIO : 0;
+	  q->done = 1;
+	  pthread_cond_broadcast (&conn->wakeup);
 	}
-    } while (! err);
+      conn->receiving = 0;
+
+      /* Let someone else take over reading replies.  */
+      pthread_cond_broadcast (&conn->wakeup);
+    }
+  err = p->err;
+  pthread_mutex_unlock (&conn->lock);
 
-  if (databuf != *buf)
-    munmap (databuf, databuflen);
   return err;
 }
 
+/* Transfer LEN bytes at FROM (in bytes) between STORE and BUF in chunks of
+   at most NBD_IO_MAX, keeping up to store_nbd_queue_depth of them
+   outstanding.  Returns the amount transferred before the first failure in
+   AMOUNT.  */
+static error_t
+nbd_transfer (struct store *store, int type, uint64_t from,
+	      char *buf, size_t len, size_t *amount)
+{
+  unsigned int depth =
+    store_nbd_queue_depth > 0 ? store_nbd_queue_depth : 1;
+  struct nbd_pending window[depth];
+  unsigned int head = 0, tail = 0;
+  size_t sent = 0;
+  error_t err = 0;
+
+  *amount = 0;
+
+  for (;;)
+    {
+      if (!err && sent < len && head - tail < depth)
+	{
+	  size_t chunk = len - sent < NBD_IO_MAX ? len - sent : NBD_IO_MAX;
+	  err = nbd_submit (store, &window[head % depth], type,
+			    from + sent, buf + sent, chunk);
+	  if (! err)
+	    {
+	      head++;
+	      sent += chunk;
+	    }
+	}
+      else if (head != tail)
+	/* Wait for the oldest request.  We wait for all of them even after an
+	   error, as WINDOW is on our stack.  */
+	{
+	  struct nbd_pending *p = &window[tail++ % depth];
+	  error_t werr = nbd_wait (store, p);
+	  if (! err)
+	    {
+	      err = werr;
+	      if (! err)
+		*amount += p->size;
+	    }
+	}
+      else
+	break;
+    }
+
+  return *amount > 0 ? 0 : err;
+}
+
+static error_t
+nbd_write (struct store *store,
+	   store_offset_t addr, size_t index, const void *buf, size_t len,
+	   size_t *amount)
+{
+  return nbd_transfer (store, 1, addr << store->log2_block_size,
+		       (char *) buf, len, amount);
+}
+
+static error_t
+nbd_read (struct store *store,
+	  store_offset_t addr, size_t index, size_t amount,
+	  void **buf, size_t *len)
+{
+  char *data = *buf;
+  size_t got;
+  error_t err;
+
+  if (*len < amount)
+    {
+      data = mmap (0, amount, PROT_READ|PROT_WRITE, MAP_ANON, 0, 0);
+      if (data == MAP_FAILED)
+	return errno;
+    }
+
+  err = nbd_transfer (store, 0, addr << store->log2_block_size,
+		      data, amount, &got);
+  if (err)
+    {
+      if (data != *buf)
+	munmap (data, amount);
+      return err;
+    }
+
+  *buf = data;
+  *len = got;
+  return 0;
+}
+
 static error_t
 nbd_set_size (struct store *store, size_t newsize)
 {
@@ -468,10 +603,45 @@ nbd_clear_flags (struct store *store, int flags)
 	       &store->port, &store->block_size, &store->size)
     : ENOENT;
   if (! err)
-    store->flags &= ~STORE_INACTIVE;
+    {
+      struct nbd_conn *conn = store->hook;
+
+      /* A fresh connection has no history.  */
+      pthread_mutex_lock (&conn->lock);
+      conn->err = 0;
+      pthread_mutex_unlock (&conn->lock);
+
+      store->flags &= ~STORE_INACTIVE;
+    }
   return err;
 }
 
+static void
+nbd_cleanup (struct store *store)
+{
+  struct nbd_conn *conn = store->hook;
+
+  if (conn && __atomic_sub_fetch (&conn->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+      pthread_mutex_destroy (&conn->lock);
+      pthread_cond_destroy (&conn->wakeup);
+      pthread_mutex_destroy (&conn->send_lock);
+      free (conn);
+    }
+}
+
+/* Clones share their original's socket, so they must share its
+   connection state too.  */
+static error_t
+nbd_clone (const struct store *from, struct store *to)
+{
+  struct nbd_conn *conn = from->hook;
+
+  __atomic_add_fetch (&conn->refs, 1, __ATOMIC_RELAXED);
+  to->hook = conn;
+  return 0;
+}
+
 const struct store_class store_nbd_class =
 {
   STORAGE_NETWORK, "nbd",
@@ -484,6 +654,7 @@ const struct store_class store_nbd_class =
   encode: store_std_leaf_encode,
   decode: nbd_decode,
   set_flags: nbd_set_flags, clear_flags: nbd_clear_flags,
+  cleanup: nbd_cleanup, clone: nbd_clone,
 };
 STORE_STD_CLASS (nbd);
 
@@ -494,8 +665,28 @@ _store_nbd_create (mach_port_t port, int flags, size_t block_size,
 		   const struct store_run *runs, size_t num_runs,
 		   struct store **store)
 {
-  return _store_create (&store_nbd_class,
-			port, flags, block_size, runs, num_runs, 0, store);
+  error_t err;
+  struct nbd_conn *conn = malloc (sizeof *conn);
+
+  if (! conn)
+    return ENOMEM;
+
+  pthread_mutex_init (&conn->lock, NULL);
+  pthread_cond_init (&conn->wakeup, NULL);
+  pthread_mutex_init (&conn->send_lock, NULL);
+  conn->next_handle = 0;
+  conn->pending = 0;
+  conn->receiving = 0;
+  conn->err = 0;
+  conn->refs = 1;
+
+  err = _store_create (&store_nbd_class,
+		       port, flags, block_size, runs, num_runs, 0, store);
+  if (err)
+    free (conn);
+  else
+    (*store)->hook = conn;
+  return err;
 }
 
 /* Open a new store backed by the named nbd server.  */
@@ -18,11 +18,48 @@
    with this program; if not, write to the Free Software Foundation, Inc.,
    59 Temple Place - Suite 330, Boston, MA 02111, USA. */
 
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 
 #include "store.h"
 
+/* Run lists longer than this are searched using STORE->run_index.  */
+#define RUN_INDEX_MIN_RUNS 8
+
+/* Return STORE's run index, building it if necessary, or 0 if there isn't
+   enough memory to do so.  Concurrent callers may both build an index; only
+   the first one to finish gets installed.  */
+static store_offset_t *
+store_run_index (struct store *store)
+{
+  store_offset_t *index = __atomic_load_n (&store->run_index,
+					   __ATOMIC_ACQUIRE);
+  store_offset_t *expected = 0;
+  size_t i;
+
+  if (index)
+    return index;
+
+  index = malloc ((store->num_runs + 1) * sizeof *index);
+  if (! index)
+    return 0;
+
+  index[0] = 0;
+  for (i = 0; i < store->num_runs; i++)
+    index[i + 1] = index[i] + store->runs[i].length;
+
+  if (! __atomic_compare_exchange_n (&store->run_index, &expected, index, 0,
+				     __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+    {
+      free (index);
+      index = expected;
+    }
+
+  return index;
+}
+
 /* Returns in RUN the tail of STORE's run list, who's first run contains
    ADDR, and is not a hole, and in RUNS_END a pointer pointing at the end of
    the run list.  Returns the offset within it at which ADDR occurs.  Also
@@ -34,6 +71,7 @@ store_find_first_run (struct store *store, store_offset_t addr,
 {
   struct store_run *tail = store->runs, *tail_end = tail + store->num_runs;
   store_offset_t wrap_src = store->wrap_src;
+  store_offset_t *run_index;
 
   if (addr >= wrap_src && addr < store->end)
     /* Locate the correct position within a repeating pattern of runs.  */
@@ -44,9 +82,33 @@ store_find_first_run (struct store *store, store_offset_t addr,
   else
     *base = 0;
 
-  /* XXX: this isn't going to be very efficient if RUNS is very complex...
-     But it should do dandy if it's short.  For long run lists, we could do a
-     binary search or something.  */
+  if (store->num_runs > RUN_INDEX_MIN_RUNS
+      && (run_index = store_run_index (store)))
+    /* Find the last run starting at or before ADDR.  Zero-length runs are
+       skipped since the search prefers the highest such run.  */
+    {
+      size_t lo = 0, hi = store->num_runs;
+
+      if (addr >= run_index[hi])
+	return -1;
+
+      /* RUN_INDEX[LO] <= ADDR < RUN_INDEX[HI] */
+      while (hi - lo > 1)
+	{
+	  size_t mid = lo + (hi - lo) / 2;
+	  if (run_index[mid] <= addr)
+	    lo = mid;
+	  else
+	    hi = mid;
+	}
+
+      *run = tail + lo;
+      *runs_end = tail_end;
+      *index = lo;
+      return addr - run_index[lo];
+    }
+
+  /* Short run lists are just walked.  */
   while (tail < tail_end)
     {
       store_offset_t run_blocks = tail->length;
@@ -89,6 +151,197 @@ store_next_run (struct store *store, struct store_run *runs_end,
     return 1;
 }
 
+/* Stores whose runs each belong to a different child (interleaved and
+   concatenated stores) can have a request that spans several runs split
+   into segments, with one thread per child transferring that child's
+   segments, so that the children all work at once.  */
+
+/* Part of a request lying within a single run.  */
+struct store_segment
+{
+  store_offset_t addr;		/* Address to pass to the class method.  */
+  size_t index;			/* Index of the run containing ADDR.  */
+  void *buf;			/* Where the data goes to or comes from.  */
+  size_t len;			/* Bytes requested.  */
+  size_t amount;		/* Bytes actually transferred.  */
+  error_t err;
+};
+
+/* The segments of a request that use run INDEX.  */
+struct store_fanout
+{
+  struct store *store;
+  struct store_segment *segs;
+  size_t num_segs;
+  size_t index;
+  int write;
+  pthread_t thread;
+  int threaded;			/* True if THREAD should be joined.  */
+};
+
+/* Return true if requests to STORE should be fanned out.  */
+static inline int
+store_fans_out (struct store *store)
+{
+  return store->num_children > 1 && store->num_runs == store->num_children;
+}
+
+/* Return a malloced array of the segments of the LEN bytes at BUF which
+   begin ADDR blocks into RUN, with RUNS_END, BASE and INDEX as returned by
+   store_find_first_run, and the number of them in NUM_SEGS.  Segments stop
+   at the first hole.  Returns 0 if there isn't enough memory.  */
+static struct store_segment *
+store_segments (struct store *store, store_offset_t addr,
+		struct store_run *run, struct store_run *runs_end,
+		store_offset_t base, size_t index,
+		void *buf, size_t len, size_t *num_segs)
+{
+  int block_shift = store->log2_block_size;
+  struct store_segment *segs = 0;
+  size_t alloced = 0, num = 0;
+
+  do
+    {
+      size_t seg_len;
+
+      if (num == alloced)
+	{
+	  struct store_segment *new;
+	  alloced = alloced ? alloced * 2 : store->num_runs * 2;
+	  new = realloc (segs, alloced * sizeof *segs);
+	  if (! new)
+	    {
+	      free (segs);
+	      return 0;
+	    }
+	  segs = new;
+	}
+
+      if ((len >> block_shift) <= run->length - addr)
+	seg_len = len;
+      else
+	seg_len = (run->length - addr) << block_shift;
+
+      segs[num].addr = base + run->start + addr;
+      segs[num].index = index;
+      segs[num].buf = buf;
+      segs[num].len = seg_len;
+      segs[num].amount = 0;
+      segs[num].err = 0;
+      num++;
+
+      buf += seg_len;
+      len -= seg_len;
+      addr = 0;
+    }
+  while (len > 0
+	 && store_next_run (store, runs_end, &run, &base, &index)
+	 && run->start >= 0);	/* Stop at holes.  */
+
+  *num_segs = num;
+  return segs;
+}
+
+/* Transfer those segments in F that use F->index, in order, stopping at the
+   first one which fails or comes up short.  */
+static void *
+store_fanout_worker (void *arg)
+{
+  struct store_fanout *f = arg;
+  struct store *store = f->store;
+  size_t i;
+
+  for (i = 0; i < f->num_segs; i++)
+    {
+      struct store_segment *seg = &f->segs[i];
+
+      if (seg->index != f->index)
+	continue;
+
+      if (f->write)
+	seg->err = (*store->class->write) (store, seg->addr, seg->index,
+					   seg->buf, seg->len, &seg->amount);
+      else
+	{
+	  void *buf = seg->buf;
+	  size_t len = seg->len;
+
+	  seg->err = (*store->class->read) (store, seg->addr, seg->index,
+					    seg->len, &buf, &len);
+	  if (! seg->err)
+	    {
+	      seg->amount = len < seg->len ? len : seg->len;
+	      if (buf != seg->buf)
+		/* The child didn't use our buffer; copy it there.  */
+		{
+		  memcpy (seg->buf, buf, seg->amount);
+		  munmap (buf, len);
+		}
+	    }
+	}
+
+      if (seg->err || seg->amount < seg->len)
+	break;
+    }
+
+  return 0;
+}
+
+/* Transfer SEGS (NUM_SEGS of them) to or from STORE (depending on WRITE),
+   with each child's segments done in parallel with the others.  Returns in
+   AMOUNT the number of bytes transferred before the first segment that
+   failed or came up short, and the error from the first segment, if any.  */
+static error_t
+store_fanout (struct store *store, struct store_segment *segs,
+	      size_t num_segs, int write, size_t *amount)
+{
+  size_t num_runs = store->num_runs;
+  struct store_fanout fanouts[num_runs];
+  char used[num_runs];
+  size_t i, num_fanouts = 0;
+
+  memset (used, 0, num_runs);
+  for (i = 0; i < num_segs; i++)
+    used[segs[i].index] = 1;
+
+  for (i = 0; i < num_runs; i++)
+    if (used[i])
+      {
+	struct store_fanout *f = &fanouts[num_fanouts++];
+	f->store = store;
+	f->segs = segs;
+	f->num_segs = num_segs;
+	f->index = i;
+	f->write = write;
+	f->threaded = 0;
+      }
+
+  /* The first child's segments are done by this thread.  If a thread can't
+     be created, do that child's segments here as well.  */
+  for (i = 1; i < num_fanouts; i++)
+    fanouts[i].threaded =
+      pthread_create (&fanouts[i].thread, NULL, store_fanout_worker,
+		      &fanouts[i]) == 0;
+
+  for (i = 0; i < num_fanouts; i++)
+    if (! fanouts[i].threaded)
+      store_fanout_worker (&fanouts[i]);
+
+  for (i = 1; i < num_fanouts; i++)
+    if (fanouts[i].threaded)
+      pthread_join (fanouts[i].thread, NULL);
+
+  *amount = 0;
+  for (i = 0; i < num_segs; i++)
+    {
+      *amount += segs[i].amount;
+      if (segs[i].err || segs[i].amount < segs[i].len)
+	break;
+    }
+
+  return segs[0].err;
+}
+
 /* Write LEN bytes from BUF to STORE at ADDR.  Returns the amount written
    in AMOUNT.  ADDR is in BLOCKS (as defined by STORE->block_size).  */
 error_t
@@ -96,9 +349,10 @@ store_write (struct store *store,
 	     store_offset_t addr, const void *buf, size_t len, size_t *amount)
 {
   error_t err;
-  size_t index;
+  size_t index, num_segs;
   store_offset_t base;
   struct store_run *run, *runs_end;
+  struct store_segment *segs;
   int block_shift = store->log2_block_size;
   store_write_meth_t write = store->class->write;
 
@@ -117,6 +371,16 @@ store_write (struct store *store,
   else if ((len >> block_shift) <= run->length - addr)
     /* The first run has it all... */
     err = (*write)(store, base + run->start + addr, index, buf, len, amount);
+  else if (store_fans_out (store)
+	   && (segs = store_segments (store, addr, run, runs_end, base, index,
+				      (void *) buf, len, &num_segs)))
+    /* Write to all the children at once.  */
+    {
+      err = store_fanout (store, segs, num_segs, 1, amount);
+      free (segs);
+      if (*amount > 0)
+	err = 0;		/* Return a short write instead of an error.  */
+    }
   else
     /* ARGH, we've got to split up the write ... */
     {
@@ -199,6 +463,8 @@ store_read (struct store *store,
     {
       error_t err;
       int all;
+      struct store_segment *segs;
+      size_t num_segs;
       /* WHOLE_BUF and WHOLE_BUF_LEN will point to a buff that's large enough
 	 to hold the entire request.  This is initially whatever the user
 	 passed in, but we'll change it as necessary.  */
@@ -245,20 +511,33 @@ store_read (struct store *store,
 
       buf_end = whole_buf;
 
-      err = seg_read (base + run->start + addr,
-		      (run->length - addr) << block_shift, &all);
-      while (!err && all && amount > 0
-	     && store_next_run (store, runs_end, &run, &base, &index))
+      if (store_fans_out (store)
+	  && (segs = store_segments (store, addr, run, runs_end, base, index,
+				     whole_buf, amount, &num_segs)))
+	/* Read from all the children at once.  */
 	{
-	  if (run->start < 0)
-	    /* A hole!  Can't read here.  Must stop.  */
-	    break;
-	  else
-	    err = seg_read (base + run->start,
-			    (amount >> block_shift) <= run->length
-			    ? amount /* This run has the rest.  */
-			    : (run->length << block_shift), /* Whole run.  */
-			    &all);
+	  size_t got;
+	  err = store_fanout (store, segs, num_segs, 0, &got);
+	  free (segs);
+	  buf_end += got;
+	}
+      else
+	{
+	  err = seg_read (base + run->start + addr,
+			  (run->length - addr) << block_shift, &all);
+	  while (!err && all && amount > 0
+		 && store_next_run (store, runs_end, &run, &base, &index))
+	    {
+	      if (run->start < 0)
+		/* A hole!  Can't read here.  Must stop.  */
+		break;
+	      else
+		err = seg_read (base + run->start,
+				(amount >> block_shift) <= run->length
+				? amount /* This run has the rest.  */
+				: (run->length << block_shift), /* Whole run.  */
+				&all);
+	    }
 	}
 
       /* The actual amount read.  */
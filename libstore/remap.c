@@ -332,6 +332,8 @@ store_remap (struct store *source,
 	  /* Don't use store_set_runs -- we've already allocated the
 	     storage. */
 	  free (source->runs);
+	  free (source->run_index);
+	  source->run_index = 0;
 	  source->runs = xruns;
 	  source->num_runs = num_xruns;
 	  source->flags &= ~STORE_ENFORCED;
@@ -38,6 +38,11 @@ store_set_runs (struct store *store,
 
   if (store->runs)
     free (store->runs);
+  if (store->run_index)
+    {
+      free (store->run_index);
+      store->run_index = 0;
+    }
 
   memcpy (copy, runs, size);
   store->runs = copy;
@@ -100,6 +100,13 @@ struct store
   size_t num_children;
 
   void *hook;			/* Type specific noise.  */
+
+  /* If non-zero, RUN_INDEX[I] is the sum of the lengths of RUNS[0] through
+     RUNS[I - 1], for I from 0 to NUM_RUNS; it lets I/O find the run
+     containing an address by binary search.  Built lazily for long run
+     lists, and discarded whenever RUNS changes.  Last, so that the fields
+     before it keep their offsets.  */
+  store_offset_t *run_index;	/* Malloced */
 };
 
 /* Store flags.  These are in addition to the STORAGE_ flags defined in
@@ -409,6 +416,10 @@ error_t store_memobj_create (memory_object_t memobj, int flags,
    and then uses _store_nbd_create with the open socket port.  */
 error_t store_nbd_open (const char *name, int flags, struct store **store);
 
+/* The maximum number of requests a single read or write on an nbd store
+   keeps outstanding on the connection at once.  */
+extern int store_nbd_queue_depth;
+
 /* Create a store that works by talking to an nbd server on an existing
    socket port.  */
 error_t _store_nbd_create (mach_port_t port, int flags, size_t block_size,
@@ -486,6 +497,21 @@ error_t store_gunzip_open (const char *name, int flags,
 			   const struct store_class *const *classes,
 			   struct store **store);
 
+/* Return a new read-only store in STORE which reads the uncompressed contents
+   of the gzip image in the store FROM, decompressing only the parts that are
+   read, and keeping an index of the image to make seeking fast; FROM is
+   consumed.  */
+error_t store_gzindex_create (struct store *from, int flags,
+			      struct store **store);
+
+/* Open the gzindex NAME -- which consists of another store-class name, a
+   ':', and a name for that store class to open -- and return the
+   corresponding store in STORE.  CLASSES is as if passed to
+   store_find_class, which see.  */
+error_t store_gzindex_open (const char *name, int flags,
+			    const struct store_class *const *classes,
+			    struct store **store);
+
 /* Return a new store in STORE which contains a snapshot of the uncompressed
    contents of the store FROM; FROM is consumed.  BLOCK_SIZE is the desired
    block size of the result.  */
@@ -624,6 +650,7 @@ extern const struct store_class store_remap_class;
 extern const struct store_class store_query_class;
 extern const struct store_class store_copy_class;
 extern const struct store_class store_gunzip_class;
+extern const struct store_class store_gzindex_class;
 extern const struct store_class store_bunzip2_class;
 extern const struct store_class store_typed_open_class;
 extern const struct store_class store_url_open_class;
@@ -84,6 +84,16 @@ lookup_fhandle (struct fhandle *handle, struct node **npp)
   nn->dtrans = NOT_POSSIBLE;
   nn->dead_dir = 0;
   nn->dead_name = 0;
+  nn->reads = 0;
+  nn->reads_cred = 0;
+  nn->read_next = 0;
+  nn->writes = 0;
+  nn->nwrites = 0;
+  nn->write_next = 0;
+  nn->write_err = 0;
+  nn->wb_next = 0;
+  nn->wb_listed = 0;
+  nn->data_epoch = 0;
   
   hurd_ihash_add (&nodehash, (hurd_ihash_key_t) &nn->handle, np);
   netfs_nref_light (np);
@@ -120,6 +130,8 @@ forked_node_delete (void *arg)
 void
 netfs_node_norefs (struct node *np)
 {
+  drop_reads (np);
+
   if (np->nn->dead_dir)
     {
       struct fnd *args;
@@ -0,0 +1,342 @@
+/* File data caching for the NFS client
+
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This file is part of the GNU Hurd.
+
+   The GNU Hurd is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   The GNU Hurd is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111, USA. */
+
+/* Blocks of file data returned by READ are kept here, keyed by file
+   handle and offset, so that reading the same data again needn't go to
+   the server.  Each file's blocks are tagged with the file's current
+   epoch (see struct netnode); when the server's modification or change
+   time for the file differs from the one the epoch was started at, a new
+   epoch is started and all the old blocks are ignored.  Writes by this
+   client patch the cached blocks and carry the epoch over to the new
+   times.  Attributes are checked with the server when a file is opened
+   (see netfs_check_open_permissions) and whenever the cached ones are
+   older than cache_timeout, which gives close-to-open consistency.  */
+
+#include "nfs.h"
+#include <string.h>
+#include <cacheq.h>
+
+/* Size and alignment of the cached blocks */
+#define DATA_BLOCK 4096
+
+/* Number of hash chains */
+#define DATA_HASH_SIZE 1024
+
+/* Cache entry */
+struct data_block
+{
+  struct cacheq_hdr hdr;
+
+  /* Chain of blocks with the same hash value.  PREVP is null if the block
+     is unused.  */
+  struct data_block *next, **prevp;
+
+  /* The file handle of the file this comes from, and the file's epoch
+     when it was read.  */
+  char fh[NFS3_FHSIZE];
+  size_t fh_len;
+  unsigned long epoch;
+
+  /* Where this is in the file, a multiple of DATA_BLOCK, and how much
+     data there is.  LEN is only less than DATA_BLOCK if the block ends at
+     the end of the file.  */
+  off_t offset;
+  size_t len;
+
+  char data[DATA_BLOCK];
+};
+
+/* The blocks, in LRU order */
+static struct cacheq data_cache = { sizeof (struct data_block) };
+
+static struct data_block *data_hash[DATA_HASH_SIZE];
+
+/* Epochs are never reused, so that blocks from an old epoch of a file
+   can't be mistaken for current ones, even by a new node for it.  */
+static unsigned long last_epoch;
+
+static pthread_mutex_t data_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline int
+data_hash_fn (struct fhandle *fh, off_t offset)
+{
+  unsigned int h = offset / DATA_BLOCK;
+  size_t i;
+
+  for (i = 0; i < fh->size; i++)
+    h = h * 31 + (unsigned char) fh->data[i];
+  return h % DATA_HASH_SIZE;
+}
+
+static void
+unlink_block (struct data_block *b)
+{
+  if (b->prevp)
+    {
+      *b->prevp = b->next;
+      if (b->next)
+	b->next->prevp = b->prevp;
+      b->prevp = 0;
+    }
+}
+
+/* How many blocks the cache is using; see size_cache.  */
+static int data_cache_length;
+
+/* Make the cache use as many blocks as DATA_CACHE_SIZE says, which may
+   have been changed by fsysopts, dropping everything if it changes.
+   Return true if there is any cache at all.  DATA_CACHE_LOCK must be
+   held.  */
+static int
+size_cache (void)
+{
+  int length = 0;
+
+  if (data_cache_size > 0)
+    length = data_cache_size / (DATA_BLOCK / 1024);
+
+  if (length != data_cache_length)
+    {
+      struct data_block *b;
+
+      for (b = data_cache.mru; b; b = b->hdr.next)
+	unlink_block (b);
+
+      /* A cacheq can't be shrunk to nothing, so turning the cache off
+	 just stops using it.  */
+      if (length > 0 && length != data_cache.length
+	  && cacheq_set_length (&data_cache, length))
+	length = 0;
+      data_cache_length = length;
+    }
+
+  return data_cache_length > 0;
+}
+
+/* Return the block of NP's data at OFFSET if it is cached and current.
+   DATA_CACHE_LOCK must be held.  */
+static struct data_block *
+find_block (struct node *np, off_t offset)
+{
+  struct fhandle *fh = &np->nn->handle;
+  struct data_block *b;
+
+  for (b = data_hash[data_hash_fn (fh, offset)]; b; b = b->next)
+    if (b->offset == offset
+	&& b->epoch == np->nn->data_epoch
+	&& b->fh_len == fh->size
+	&& memcmp (b->fh, fh->data, fh->size) == 0)
+      return b;
+
+  return 0;
+}
+
+/* Start a new epoch for NP, forgetting all its cached data.  */
+void
+data_cache_purge (struct node *np)
+{
+  pthread_mutex_lock (&data_cache_lock);
+  np->nn->data_epoch = ++last_epoch;
+  np->nn->data_mtime = np->nn_stat.st_mtim;
+  np->nn->data_ctime = np->nn_stat.st_ctim;
+  pthread_mutex_unlock (&data_cache_lock);
+}
+
+/* Forget NP's cached data if its attributes say it has been changed since
+   the data was read.  */
+void
+data_cache_check (struct node *np)
+{
+  struct netnode *nn = np->nn;
+
+  if (nn->data_epoch == 0
+      || nn->data_mtime.tv_sec != np->nn_stat.st_mtim.tv_sec
+      || nn->data_mtime.tv_nsec != np->nn_stat.st_mtim.tv_nsec
+      || nn->data_ctime.tv_sec != np->nn_stat.st_ctim.tv_sec
+      || nn->data_ctime.tv_nsec != np->nn_stat.st_ctim.tv_nsec)
+    data_cache_purge (np);
+}
+
+/* NP's attributes have just been changed by a write of ours, whose data
+   has been given to data_cache_write.  MTIME and CTIME are the times NP
+   had just before the write.  If they are those the cached data is valid
+   for, keep it; otherwise someone else changed NP too, so forget it.  */
+void
+data_cache_written (struct node *np, const struct timespec *mtime,
+		    const struct timespec *ctime)
+{
+  struct netnode *nn = np->nn;
+
+  if (nn->data_mtime.tv_sec != mtime->tv_sec
+      || nn->data_mtime.tv_nsec != mtime->tv_nsec
+      || nn->data_ctime.tv_sec != ctime->tv_sec
+      || nn->data_ctime.tv_nsec != ctime->tv_nsec)
+    {
+      data_cache_purge (np);
+      return;
+    }
+
+  nn->data_mtime = np->nn_stat.st_mtim;
+  nn->data_ctime = np->nn_stat.st_ctim;
+}
+
+/* Copy as much of the LEN bytes of NP at OFFSET as is cached into DATA,
+   stopping at the first block that isn't.  Return how much was copied,
+   and set *EOF if that reached the end of the file.  The caller should
+   call data_cache_check first.  */
+size_t
+data_cache_read (struct node *np, off_t offset, size_t len, char *data,
+		 int *eof)
+{
+  size_t done = 0;
+
+  *eof = 0;
+  if (len == 0 || np->nn->data_epoch == 0)
+    return 0;
+
+  pthread_mutex_lock (&data_cache_lock);
+  if (size_cache ())
+    while (done < len)
+      {
+	off_t pos = offset + done;
+	size_t skip = pos % DATA_BLOCK, n;
+	struct data_block *b = find_block (np, pos - skip);
+
+	if (! b)
+	  break;
+
+	if (b->len < DATA_BLOCK
+	    && b->offset + b->len != np->nn_stat.st_size)
+	  /* This block was at the end of the file, but the file has grown
+	     since.  */
+	  break;
+
+	if (skip >= b->len)
+	  n = 0;
+	else
+	  {
+	    n = b->len - skip;
+	    if (n > len - done)
+	      n = len - done;
+	    memcpy (data + done, b->data + skip, n);
+	    done += n;
+	  }
+	cacheq_make_mru (&data_cache, b);
+
+	if (b->len < DATA_BLOCK && skip + n >= b->len)
+	  {
+	    *eof = 1;
+	    break;
+	  }
+      }
+  pthread_mutex_unlock (&data_cache_lock);
+
+  return done;
+}
+
+/* Enter the LEN bytes of NP at OFFSET in DATA, just returned by a READ,
+   in the cache.  If EOF, they run up to the end of the file.  Only whole
+   blocks, and the last block of the file, are kept.  The caller should
+   call data_cache_check first.  */
+void
+data_cache_fill (struct node *np, off_t offset, char *data, size_t len,
+		 int eof)
+{
+  struct fhandle *fh = &np->nn->handle;
+  off_t end = offset + len;
+  off_t pos;
+
+  if (np->nn->data_epoch == 0)
+    return;
+
+  pthread_mutex_lock (&data_cache_lock);
+  if (size_cache ())
+    for (pos = (offset + DATA_BLOCK - 1) / DATA_BLOCK * DATA_BLOCK;
+	 pos < end;
+	 pos += DATA_BLOCK)
+      {
+	size_t n = end - pos > DATA_BLOCK ? DATA_BLOCK : end - pos;
+	struct data_block *b;
+	int h;
+
+	if (n < DATA_BLOCK && ! eof)
+	  break;
+
+	b = find_block (np, pos);
+	if (! b)
+	  {
+	    /* Reuse the least recently used block.  */
+	    b = data_cache.lru;
+	    unlink_block (b);
+	    memcpy (b->fh, fh->data, fh->size);
+	    b->fh_len = fh->size;
+	    b->epoch = np->nn->data_epoch;
+	    b->offset = pos;
+	    h = data_hash_fn (fh, pos);
+	    b->next = data_hash[h];
+	    if (b->next)
+	      b->next->prevp = &b->next;
+	    b->prevp = &data_hash[h];
+	    data_hash[h] = b;
+	  }
+	memcpy (b->data, data + (pos - offset), n);
+	b->len = n;
+	cacheq_make_mru (&data_cache, b);
+      }
+  pthread_mutex_unlock (&data_cache_lock);
+}
+
+/* The LEN bytes in DATA are being written to NP at OFFSET; bring the
+   cached blocks they overlap up to date.  */
+void
+data_cache_write (struct node *np, off_t offset, char *data, size_t len)
+{
+  off_t end = offset + len;
+  off_t pos;
+
+  if (np->nn->data_epoch == 0 || len == 0)
+    return;
+
+  pthread_mutex_lock (&data_cache_lock);
+  if (data_cache_length > 0)
+    for (pos = offset - offset % DATA_BLOCK; pos < end; pos += DATA_BLOCK)
+      {
+	struct data_block *b = find_block (np, pos);
+	off_t from, to;
+
+	if (! b)
+	  continue;
+
+	from = offset > pos ? offset : pos;
+	to = end < pos + DATA_BLOCK ? end : pos + DATA_BLOCK;
+	if (from > pos + b->len)
+	  {
+	    /* This would leave a gap in the block; just drop it.  */
+	    unlink_block (b);
+	    cacheq_make_lru (&data_cache, b);
+	    continue;
+	  }
+
+	memcpy (b->data + (from - pos), data + (from - offset), to - from);
+	if (to - pos > b->len)
+	  b->len = to - pos;
+      }
+  pthread_mutex_unlock (&data_cache_lock);
+}
@@ -52,12 +52,24 @@ extern char *localhost ();
 /* Default number of seconds to timeout cache negative dir hits. */
 #define DEFAULT_NAME_CACHE_NEG_TIMEOUT 3
 
+/* Default number of dir cache entries. */
+#define DEFAULT_NAME_CACHE_SIZE 4096
+
 /* Default maximum number of bytes to read at once. */
 #define DEFAULT_READ_SIZE     8192
 
 /* Default maximum number of bytes to write at once. */
 #define DEFAULT_WRITE_SIZE    8192
 
+/* Default number of READ or WRITE RPCs outstanding at once. */
+#define DEFAULT_RPC_WINDOW    8
+
+/* Default number of chunks to read ahead of sequential reads. */
+#define DEFAULT_READ_AHEAD    4
+
+/* Default number of kilobytes of file data to cache. */
+#define DEFAULT_DATA_CACHE_SIZE 8192
+
 
 /* Number of seconds to timeout cached stat information. */
 int stat_timeout = DEFAULT_STAT_TIMEOUT;
@@ -71,6 +83,9 @@ int name_cache_timeout = DEFAULT_NAME_CACHE_TIMEOUT;
 /* Number of seconds to timeout cached negative dir hits. */
 int name_cache_neg_timeout = DEFAULT_NAME_CACHE_NEG_TIMEOUT;
 
+/* Number of dir cache entries to keep. */
+int name_cache_size = DEFAULT_NAME_CACHE_SIZE;
+
 /* Number of seconds to wait for first retransmission of an RPC. */
 int initial_transmit_timeout = 1;
 
@@ -88,6 +103,18 @@ int read_size = DEFAULT_READ_SIZE;
 
 /* Maximum number of bytes to write at once. */
 int write_size = DEFAULT_WRITE_SIZE;
+
+/* Number of READ or WRITE RPCs a single read or write keeps outstanding. */
+int rpc_window = DEFAULT_RPC_WINDOW;
+
+/* Number of read_size chunks to read ahead of sequential reads. */
+int read_ahead = DEFAULT_READ_AHEAD;
+
+/* Number of kilobytes of file data to cache. */
+int data_cache_size = DEFAULT_DATA_CACHE_SIZE;
+
+/* True iff sequential writes may return before the server answers. */
+int write_behind = 1;
 
 #define OPT_SOFT	's'
 #define OPT_HARD	'h'
@@ -107,6 +134,15 @@ int write_size = DEFAULT_WRITE_SIZE;
 #define OPT_PMAP_PORT	-13
 #define OPT_NCACHE_TO	-14
 #define OPT_NCACHE_NEG_TO -15
+#define OPT_RPC_WINDOW	-16
+#define OPT_READ_AHEAD	-17
+#define OPT_TCP		-18
+#define OPT_UDP		-19
+#define OPT_DATA_CACHE	-20
+#define OPT_WB		-21
+#define OPT_NO_WB	-22
+#define OPT_NCACHE_SIZE	-23
+#define OPT_NCACHE_STATS -24
 
 /* Return a string corresponding to the printed rep of DEFAULT_what */
 #define ___D(what) #what
@@ -132,6 +168,25 @@ static const struct argp_option common_options[] =
   {"write-size",	    OPT_WSIZE,	   "BYTES", 0,
      "Max packet size for writes (default " _D(WRITE_SIZE)")"},
   {"wsize",0,0,OPTION_ALIAS},
+  {"rpc-window",	    OPT_RPC_WINDOW, "RPCS", 0,
+     "Max reads or writes outstanding at once for one request"
+     " (default " _D(RPC_WINDOW) ")"},
+  {"read-ahead",	    OPT_READ_AHEAD, "CHUNKS", 0,
+     "Number of read-size chunks to read ahead of sequential reads"
+     " (default " _D(READ_AHEAD) ")"},
+  {"data-cache-size",	    OPT_DATA_CACHE, "KBYTES", 0,
+     "Amount of file data to cache, 0 for none"
+     " (default " _D(DATA_CACHE_SIZE) ")"},
+  {"write-behind",	    OPT_WB, 0, 0,
+     "Let sequential writes return before the server has answered"
+     " (default)"},
+  {"no-write-behind",	    OPT_NO_WB, 0, 0,
+     "Make every write wait for the server"},
+  {"name-cache-size",	    OPT_NCACHE_SIZE, "ENTRIES", 0,
+     "Number of directory cache entries, 0 for none (default "
+     _D(NAME_CACHE_SIZE) ")"},
+  {"name-cache-stats",	    OPT_NCACHE_STATS, "POS,NEG,MISS", OPTION_HIDDEN,
+     "Directory cache hits and misses so far (ignored when given)"},
 
   {0,0,0,0,"Timeouts:",3},
   {"stat-timeout",	    OPT_STAT_TO,   "SEC", 0,
@@ -166,6 +221,11 @@ parse_common_opt (int key, char *arg, struct argp_state *state)
 
     case OPT_RSIZE: read_size = atoi (arg); break;
     case OPT_WSIZE: write_size = atoi (arg); break;
+    case OPT_RPC_WINDOW: rpc_window = atoi (arg); break;
+    case OPT_READ_AHEAD: read_ahead = atoi (arg); break;
+    case OPT_DATA_CACHE: data_cache_size = atoi (arg); break;
+    case OPT_WB: write_behind = 1; break;
+    case OPT_NO_WB: write_behind = 0; break;
 
     case OPT_STAT_TO: stat_timeout = atoi (arg); break;
     case OPT_CACHE_TO: cache_timeout = atoi (arg); break;
@@ -173,6 +233,8 @@ parse_common_opt (int key, char *arg, struct argp_state *state)
     case OPT_MAX_TR_TO: max_transmit_timeout = atoi (arg); break;
     case OPT_NCACHE_TO: name_cache_timeout = atoi (arg); break;
     case OPT_NCACHE_NEG_TO: name_cache_neg_timeout = atoi (arg); break;
+    case OPT_NCACHE_SIZE: name_cache_size = atoi (arg); break;
+    case OPT_NCACHE_STATS: break; /* Only reported, never set.  */
 
     default:
       return ARGP_ERR_UNKNOWN;
@@ -197,6 +259,12 @@ static const struct argp_option startup_options[] = {
 
   {"pmap-port",             OPT_PMAP_PORT,  "SVC|PORT"},
 
+  {"tcp",		    OPT_TCP, 0, 0,
+     "Talk to the nfs server over TCP if it supports that,"
+     " otherwise over UDP (default)"},
+  {"udp",		    OPT_UDP, 0, 0,
+     "Talk to the nfs server over UDP only"},
+
   {"hold", OPT_HOLD, 0, OPTION_HIDDEN}, /*  */
   { 0 }
 };
@@ -243,6 +311,12 @@ netfs_append_args (char **argz, size_t *argz_len)
 
   FOPT ("--read-size=%d", read_size);
   FOPT ("--write-size=%d", write_size);
+  FOPT ("--rpc-window=%d", rpc_window);
+  FOPT ("--read-ahead=%d", read_ahead);
+  FOPT ("--data-cache-size=%d", data_cache_size);
+  if (! err)
+    err = argz_add (argz, argz_len,
+		    write_behind ? "--write-behind" : "--no-write-behind");
 
   FOPT ("--stat-timeout=%d", stat_timeout);
   FOPT ("--cache-timeout=%d", cache_timeout);
@@ -250,6 +324,16 @@ netfs_append_args (char **argz, size_t *argz_len)
   FOPT ("--max-transmit-timeout=%d", max_transmit_timeout);
   FOPT ("--name-cache-timeout=%d", name_cache_timeout);
   FOPT ("--name-cache-neg-timeout=%d", name_cache_neg_timeout);
+  FOPT ("--name-cache-size=%d", name_cache_size);
+  if (! err)
+    {
+      long pos_hits, neg_hits, misses;
+
+      get_lookup_cache_stats (&pos_hits, &neg_hits, &misses);
+      snprintf (buf, sizeof buf, "--name-cache-stats=%ld,%ld,%ld",
+		pos_hits, neg_hits, misses);
+      err = argz_add (argz, argz_len, buf);
+    }
 
   if (! err)
     err = netfs_append_std_options (argz, argz_len);
@@ -337,6 +421,13 @@ parse_startup_opt (int key, char *arg, struct argp_state *state)
       nfs_port = atoi (arg);
       break;
 
+    case OPT_TCP:
+      nfs_use_tcp = 1;
+      break;
+    case OPT_UDP:
+      nfs_use_tcp = 0;
+      break;
+
     case ARGP_KEY_ARG:
       if (state->arg_num == 0)
 	remote_fs = arg;
@@ -374,8 +465,6 @@ main (int argc, char **argv)
   struct argp argp =
     { startup_options, parse_startup_opt, args_doc, doc, argp_children };
   mach_port_t bootstrap;
-  struct sockaddr_in addr;
-  int ret;
 
   argp_parse (&argp, argc, argv, 0, 0, 0);
     
@@ -383,25 +472,9 @@ main (int argc, char **argv)
   netfs_init ();
   
   main_udp_socket = socket (PF_INET, SOCK_DGRAM, 0);
-  addr.sin_family = AF_INET;
-  addr.sin_addr.s_addr = INADDR_ANY;
-  addr.sin_port = htons (IPPORT_RESERVED);
-  do
-    {
-      addr.sin_port = htons (ntohs (addr.sin_port) - 1);
-      ret = bind (main_udp_socket, (struct sockaddr *)&addr, 
-		  sizeof (struct sockaddr_in));
-      if (ret == -1 && errno == EACCES)
-	{
-	  /* We aren't allowed privileged ports; no matter;
-	     let the server deny us later if it wants. */
-	  ret = 0;
-	  break;
-	}
-    }
-  while ((ret == -1) && (errno == EADDRINUSE));
-  if (ret == -1)
-    error (1, errno, "binding main udp socket");
+  err = bind_reserved_port (main_udp_socket);
+  if (err)
+    error (1, err, "binding main udp socket");
 
   err = maptime_map (0, 0, &mapped_time);
   if (err)
@@ -416,6 +489,14 @@ main (int argc, char **argv)
       perror ("pthread_create");
     }
   err = pthread_create (&thread, NULL, rpc_receive_thread, NULL);
+  if (!err)
+    pthread_detach (thread);
+  else
+    {
+      errno = err;
+      perror ("pthread_create");
+    }
+  err = pthread_create (&thread, NULL, write_behind_thread, NULL);
   if (!err)
     pthread_detach (thread);
   else
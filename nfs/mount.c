@@ -65,6 +65,9 @@ short nfs_port = NFS_PORT;
 /* True iff NFS_PORT should be used even if portmapper present. */
 int nfs_port_override = 0;
 
+/* True iff NFS RPCs should go over TCP when the server supports it. */
+int nfs_use_tcp = 1;
+
 /* Host name and port number we actually decided to use.  */
 const char *mounted_hostname;
 uint16_t mounted_nfs_port;	/* host order */
@@ -101,7 +104,7 @@ mount_root (char *name, char *host)
   struct hostent *h;
   int *p;
   void *rpcbuf;
-  int port;
+  int port, tcp_port;
   error_t err;
   struct node *np;
   short pmapport;
@@ -219,7 +222,7 @@ mount_root (char *name, char *host)
   pthread_mutex_unlock (&np->lock);
 
   if (nfs_port_override)
-    port = nfs_port;
+    port = tcp_port = nfs_port;
   else
     {
       /* Send another PMAPPROC_GETPORT request to lookup the nfs server. */
@@ -255,6 +258,29 @@ mount_root (char *name, char *host)
 	  goto error_with_rpcbuf;
 	}
       free (rpcbuf);
+
+      /* And where it listens for TCP connections, if it does.  */
+      tcp_port = 0;
+      if (nfs_use_tcp)
+	{
+	  p = pmap_initialize_rpc (PMAPPROC_GETPORT, &rpcbuf);
+	  if (! p)
+	    {
+	      error (0, errno, "rpc");
+	      goto error_with_rpcbuf;
+	    }
+	  *(p++) = htonl (NFS_PROGRAM);
+	  *(p++) = htonl (NFS_VERSION);
+	  *(p++) = htonl (IPPROTO_TCP);
+	  *(p++) = htonl (0);
+	  err = conduct_rpc (&rpcbuf, &p);
+	  if (!err)
+	    {
+	      tcp_port = ntohl (*p);
+	      p++;
+	    }
+	  free (rpcbuf);
+	}
     }
 
   addr.sin_port = htons (port);
@@ -265,6 +291,15 @@ mount_root (char *name, char *host)
       return 0;
     }
 
+  if (nfs_use_tcp && tcp_port)
+    {
+      /* Use TCP if we can connect; UDP is all set up if we can't.  */
+      addr.sin_port = htons (tcp_port);
+      err = start_tcp_rpc (&addr);
+      if (err)
+	error (0, err, "nfs over tcp, using udp");
+    }
+
   mounted_hostname = host;
   mounted_nfs_port = port;
 
@@ -1,6 +1,6 @@
 /* Directory name lookup caching
 
-   Copyright (C) 1996, 1997 Free Software Foundation, Inc.
+   Copyright (C) 1996, 1997, 2026 Free Software Foundation, Inc.
    Written by Thomas Bushnell, n/BSG, & Miles Bader.
 
    This file is part of the GNU Hurd.
@@ -21,88 +21,165 @@
 
 #include "nfs.h"
 #include <string.h>
-#include <cacheq.h>
 
-
-/* Maximum number of names to cache at any given time */
-#define MAXCACHE 200
+/* The cache is a hash table keyed by directory file handle and name,
+   so that looking a name up takes constant time however large the cache
+   is.  Entries are also kept on two LRU lists, one for positive and one
+   for negative entries.  At most NAME_CACHE_SIZE entries are kept, of
+   which at most a quarter may be negative, so that a burst of failing
+   lookups (say, a search along a path) can't push out the names that
+   exist; and negative entries age by their own timeout.  */
 
-/* Maximum length of file name we bother caching */
-#define CACHE_NAME_LEN 100
+/* The key of a cache entry.  */
+struct lookup_key
+{
+  const char *dir;
+  size_t dir_len;
+  const char *name;
+  size_t name_len;
+};
 
 /* Cache entry */
 struct lookup_cache
 {
-  struct cacheq_hdr hdr;
+  /* Where this is in the hash table, and its neighbours on its LRU
+     list, MRU first.  */
+  hurd_ihash_locp_t slot;
+  struct lookup_cache *next, *prev;
 
-  /* File handles and lengths for cache entries.  0 for NODE_CACHE_LEN
-     means a  */
-  char dir_cache_fh[NFS3_FHSIZE];
-  size_t dir_cache_len;
+  /* Points at DIR_FH and NAME below.  */
+  struct lookup_key key;
 
   /* Zero means a `negative' entry -- recording that there's
      definitely no node with this name.  */
   struct node *np;
 
-  /* Name of the node NODE_CACHE_ID in the directory DIR_CACHE_ID.  Entries
-     with names too long to fit in this buffer aren't cached at all.  */
-  char name[CACHE_NAME_LEN];
-
-  /* Strlen of NAME.  If this is zero, it's an unused entry. */
-  size_t name_len;
-
   /* Time that this cache entry was created.  */
   time_t cache_stamp;
 
-  /* XXX */
-  int stati;
+  char dir_fh[NFS3_FHSIZE];
+
+  /* Name of the node NP in the directory DIR_FH, nul-terminated.  */
+  char name[0];
 };
 
-/* The contents of the cache in no particular order */
-static struct cacheq lookup_cache = { sizeof (struct lookup_cache) };
+/* An LRU list of entries.  */
+struct lookup_list
+{
+  struct lookup_cache *mru, *lru;
+  int length;
+};
+
+static hurd_ihash_key_t
+lookup_key_hash (const void *data)
+{
+  const struct lookup_key *key = data;
+  return (hurd_ihash_key_t)
+    hurd_ihash_hash32 (key->name, key->name_len,
+		       hurd_ihash_hash32 (key->dir, key->dir_len, 0));
+}
+
+static int
+lookup_key_compare (const void *key1, const void *key2)
+{
+  const struct lookup_key *k1 = key1, *k2 = key2;
+
+  return (k1->name_len == k2->name_len
+	  && k1->dir_len == k2->dir_len
+	  && memcmp (k1->name, k2->name, k1->name_len) == 0
+	  && memcmp (k1->dir, k2->dir, k1->dir_len) == 0);
+}
+
+/* All the entries, by key.  */
+static struct hurd_ihash lookup_hash =
+  HURD_IHASH_INITIALIZER_GKI (offsetof (struct lookup_cache, slot),
+			      NULL, NULL, lookup_key_hash, lookup_key_compare);
 
-static pthread_spinlock_t cache_lock = PTHREAD_SPINLOCK_INITIALIZER;
+/* The positive and negative entries.  */
+static struct lookup_list pos_entries, neg_entries;
 
-/* Buffer to hold statistics */
-static struct stats
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Statistics, reported by fsysopts.  */
+static struct
 {
   long pos_hits;
   long neg_hits;
   long miss;
-  long fetch_errors;
 } statistics;
 
-#define PARTIAL_THRESH 100
-#define NPARTIALS (MAXCACHE / PARTIAL_THRESH)
-struct stats partial_stats [NPARTIALS];
 
-
+static void
+list_unlink (struct lookup_list *l, struct lookup_cache *c)
+{
+  if (c->prev)
+    c->prev->next = c->next;
+  else
+    l->mru = c->next;
+  if (c->next)
+    c->next->prev = c->prev;
+  else
+    l->lru = c->prev;
+  l->length--;
+}
+
+static void
+list_push (struct lookup_list *l, struct lookup_cache *c)
+{
+  c->prev = 0;
+  c->next = l->mru;
+  if (c->next)
+    c->next->prev = c;
+  else
+    l->lru = c;
+  l->mru = c;
+  l->length++;
+}
+
+/* Remove C from the cache and free it.  CACHE_LOCK must be held.  */
+static void
+drop_entry (struct lookup_cache *c)
+{
+  hurd_ihash_locp_remove (&lookup_hash, c->slot);
+  if (c->np)
+    {
+      list_unlink (&pos_entries, c);
+      netfs_nrele (c->np);
+    }
+  else
+    list_unlink (&neg_entries, c);
+  free (c);
+}
+
+/* Evict least recently used entries until there is room for one more,
+   negative if NEG, going by the current NAME_CACHE_SIZE (which fsysopts
+   may have changed).  Return false if the cache is turned off.
+   CACHE_LOCK must be held.  */
+static int
+make_room (int neg)
+{
+  int size = name_cache_size > 0 ? name_cache_size : 0;
+  int neg_size = size > 0 ? size / 4 ?: 1 : 0;
+
+  while (neg_entries.length > 0 && neg_entries.length >= neg_size + !neg)
+    drop_entry (neg_entries.lru);
+  while (pos_entries.length + neg_entries.length > 0
+	 && pos_entries.length + neg_entries.length >= size)
+    drop_entry (pos_entries.lru ?: neg_entries.lru);
+
+  return size > 0;
+}
+
 /* If there's an entry for NAME, of length NAME_LEN, in directory DIR in the
    cache, return its entry, otherwise 0.  CACHE_LOCK must be held.  */
 static struct lookup_cache *
 find_cache (char *dir, size_t len, const char *name, size_t name_len)
 {
-  struct lookup_cache *c;
-  int i;
-
-  /* Search the list.  All unused entries are contiguous at the end of the
-     list, so we can stop searching when we see the first one.  */
-  for (i = 0, c = lookup_cache.mru; 
-       c && c->name_len; 
-       c = c->hdr.next, i++)
-    if (c->name_len == name_len
-	&& c->dir_cache_len == len
-	&& c->name[0] == name[0] 
-	&& memcmp (c->dir_cache_fh, dir, len) == 0
-	&& strcmp (c->name, name) == 0)
-      {
-	c->stati = i / PARTIAL_THRESH;
-	return c;
-      }
-  
-  return 0;
+  struct lookup_key key = { dir, len, name, name_len };
+
+  return hurd_ihash_find (&lookup_hash, (hurd_ihash_key_t) &key);
 }
-
+
 /* Node NP has just been found in DIR with NAME.  If NP is null, this
    name has been confirmed as absent in the directory.  DIR is the
    fhandle of the directory and LEN is its length.  */
@@ -111,66 +188,65 @@ enter_lookup_cache (char *dir, size_t len, struct node *np, char *name)
 {
   struct lookup_cache *c;
   size_t name_len = strlen (name);
-  
-  if (name_len > CACHE_NAME_LEN - 1)
-    return;
 
-  pthread_spin_lock (&cache_lock);
+  pthread_mutex_lock (&cache_lock);
 
-  if (lookup_cache.length == 0)
-    /* There should always be an lru_cache; this being zero means that the
-       cache hasn't been initialized yet.  Do so.  */
-    cacheq_set_length (&lookup_cache, MAXCACHE);
+  /* Replace any old entry for NAME in DIR.  */
+  c = find_cache (dir, len, name, name_len);
+  if (c)
+    drop_entry (c);
 
-  /* See if there's an old entry for NAME in DIR.  If not, replace the least
-     recently used entry.  */
-  c = find_cache (dir, len, name, name_len) ?: lookup_cache.lru;
+  if (! make_room (np == 0))
+    {
+      pthread_mutex_unlock (&cache_lock);
+      return;
+    }
 
-  /* Fill C with the new entry.  */
-  memcpy (c->dir_cache_fh, dir, len);
-  c->dir_cache_len = len;
-  if (c->np)
-    netfs_nrele (c->np);
+  c = malloc (sizeof *c + name_len + 1);
+  if (! c)
+    {
+      pthread_mutex_unlock (&cache_lock);
+      return;
+    }
+
+  memcpy (c->dir_fh, dir, len);
+  memcpy (c->name, name, name_len + 1);
+  c->key.dir = c->dir_fh;
+  c->key.dir_len = len;
+  c->key.name = c->name;
+  c->key.name_len = name_len;
   c->np = np;
-  if (c->np)
-    netfs_nref (c->np);
-  strcpy (c->name, name);
-  c->name_len = name_len;
   c->cache_stamp = mapped_time->seconds;
 
-  /* Now C becomes the MRU entry!  */
-  cacheq_make_mru (&lookup_cache, c);
+  if (hurd_ihash_add (&lookup_hash, (hurd_ihash_key_t) &c->key, c))
+    {
+      free (c);
+      pthread_mutex_unlock (&cache_lock);
+      return;
+    }
 
-  pthread_spin_unlock (&cache_lock);
+  if (np)
+    {
+      netfs_nref (np);
+      list_push (&pos_entries, c);
+    }
+  else
+    list_push (&neg_entries, c);
+
+  pthread_mutex_unlock (&cache_lock);
 }
-
+
 /* Purge all references in the cache to NAME within directory DIR. */
 void
 purge_lookup_cache (struct node *dp, char *name, size_t namelen)
 {
-  struct lookup_cache *c, *next;
-  
-  pthread_spin_lock (&cache_lock);
-  for (c = lookup_cache.mru; c; c = next)
-    {
-      /* Save C->hdr.next, since we may move C from this position. */
-      next = c->hdr.next;
-
-      if (c->name_len == namelen
-	  && c->dir_cache_len == dp->nn->handle.size
-	  && memcmp (c->dir_cache_fh, dp->nn->handle.data,
-	             c->dir_cache_len) == 0
-	  && strcmp (c->name, name) == 0)
-	{
-	  if (c->np)
-	    netfs_nrele (c->np);
-	  c->name_len = 0;
-	  c->np = 0;
-	  cacheq_make_lru (&lookup_cache, c); /* Use C as the next free
-						 entry. */
-	}
-    }
-  pthread_spin_unlock (&cache_lock);
+  struct lookup_cache *c;
+
+  pthread_mutex_lock (&cache_lock);
+  c = find_cache (dp->nn->handle.data, dp->nn->handle.size, name, namelen);
+  if (c)
+    drop_entry (c);
+  pthread_mutex_unlock (&cache_lock);
 }
 
 /* Purge all references in the cache to node NP. */
@@ -178,66 +254,30 @@ void
 purge_lookup_cache_node (struct node *np)
 {
   struct lookup_cache *c, *next;
-  
-  pthread_spin_lock (&cache_lock);
-  for (c = lookup_cache.mru; c; c = next)
+
+  pthread_mutex_lock (&cache_lock);
+  for (c = pos_entries.mru; c; c = next)
     {
-      next = c->hdr.next;
-      
+      next = c->next;
       if (c->np == np)
-	{
-	  netfs_nrele (c->np);
-	  c->name_len = 0;
-	  c->np = 0;
-	  cacheq_make_lru (&lookup_cache, c);
-	}
+	drop_entry (c);
     }
-  pthread_spin_unlock (&cache_lock);
+  pthread_mutex_unlock (&cache_lock);
 }
 
-
-
-/* Register a negative hit for an entry in the Nth stat class */
+/* Return the numbers of positive hits, negative hits and misses so far
+   in *POS_HITS, *NEG_HITS and *MISSES.  */
 void
-register_neg_hit (int n)
+get_lookup_cache_stats (long *pos_hits, long *neg_hits, long *misses)
 {
-  int i;
-
-  statistics.neg_hits++;
-
-  for (i = 0; i < n; i++)
-    partial_stats[i].miss++;
-  for (; i < NPARTIALS; i++)
-    partial_stats[i].neg_hits++;
+  pthread_mutex_lock (&cache_lock);
+  *pos_hits = statistics.pos_hits;
+  *neg_hits = statistics.neg_hits;
+  *misses = statistics.miss;
+  pthread_mutex_unlock (&cache_lock);
 }
 
-/* Register a positive hit for an entry in the Nth stat class */
-void
-register_pos_hit (int n)
-{
-  int i;
-
-  statistics.pos_hits++;
-
-  for (i = 0; i < n; i++)
-    partial_stats[i].miss++;
-  for (; i < NPARTIALS; i++)
-    partial_stats[i].pos_hits++;
-}
-  
-/* Register a miss */
-void
-register_miss ()
-{
-  int i;
-  
-  statistics.miss++;
-  for (i = 0; i < NPARTIALS; i++)
-    partial_stats[i].miss++;
-}
 
-
-
 /* Scan the cache looking for NAME inside DIR.  If we know nothing
    about the entry, then return 0.  If the entry is confirmed to not
    exist, then return -1.  Otherwise, return NP for the entry, with
@@ -248,58 +288,50 @@ struct node *
 check_lookup_cache (struct node *dir, char *name)
 {
   struct lookup_cache *c;
-  
-  pthread_spin_lock (&cache_lock);
+
+  pthread_mutex_lock (&cache_lock);
 
   c = find_cache (dir->nn->handle.data, dir->nn->handle.size,
 		  name, strlen (name));
   if (c)
     {
       int timeout = c->np
-	? name_cache_timeout 
+	? name_cache_timeout
 	: name_cache_neg_timeout;
 
       /* Make sure the entry is still usable; if not, zap it now. */
       if (mapped_time->seconds - c->cache_stamp >= timeout)
-	{
-	  register_neg_hit (c->stati);
-	  if (c->np)
-	    netfs_nrele (c->np);
-	  c->name_len = 0;
-	  c->np = 0;
-	  cacheq_make_lru (&lookup_cache, c);
-	  pthread_spin_unlock (&cache_lock);
-	  return 0;
-	}
-
-      cacheq_make_mru (&lookup_cache, c); /* Record C as recently used.  */
-
-      if (c->np == 0)
+	drop_entry (c);
+      else if (c->np == 0)
 	/* A negative cache entry.  */
 	{
-	  register_neg_hit (c->stati);
-	  pthread_spin_unlock (&cache_lock);
+	  list_unlink (&neg_entries, c);
+	  list_push (&neg_entries, c);
+	  statistics.neg_hits++;
+	  pthread_mutex_unlock (&cache_lock);
 	  pthread_mutex_unlock (&dir->lock);
 	  return (struct node *)-1;
 	}
-      else 
+      else
 	{
 	  struct node *np;
-	  
+
+	  list_unlink (&pos_entries, c);
+	  list_push (&pos_entries, c);
 	  np = c->np;
 	  netfs_nref (np);
-	  register_pos_hit (c->stati);
-	  pthread_spin_unlock (&cache_lock);
-	  
+	  statistics.pos_hits++;
+	  pthread_mutex_unlock (&cache_lock);
+
 	  pthread_mutex_unlock (&dir->lock);
 	  pthread_mutex_lock (&np->lock);
 
 	  return np;
 	}
     }
-  
-  register_miss ();
-  pthread_spin_unlock (&cache_lock);
+
+  statistics.miss++;
+  pthread_mutex_unlock (&cache_lock);
 
   return 0;
 }
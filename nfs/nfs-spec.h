@@ -102,6 +102,7 @@ enum createmode
 
 #define NFS_PROGRAM ((u_long)100003)
 #define NFS_VERSION ((u_long)2)
+#define NFS3_VERSION ((u_long)3)
 
 #define NFS_PROTOCOL_FUNC(proc,vers) \
 	(vers == 2 ? NFS2PROC_ ## proc : NFS3PROC_ ## proc)
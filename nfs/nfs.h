@@ -23,6 +23,7 @@
 #include <stdint.h>
 #include <pthread.h>
 #include <sys/mman.h>
+#include <netinet/in.h>
 #include "nfs-spec.h"
 #include <hurd/ihash.h>
 #include <hurd/netfs.h>
@@ -71,6 +72,33 @@ struct netnode
 
   struct user_pager_info *fileinfo;
 
+  /* READ RPCs for this file which are outstanding or whose data hasn't
+     been used yet, in order of offset, and the user they were sent for;
+     see ops.c.  READ_NEXT is where the last read ended, so that a read
+     starting there is sequential.  */
+  struct read_chunk *reads;
+  struct iouser *reads_cred;
+  off_t read_next;
+
+  /* WRITE RPCs for this file which are outstanding, oldest first, and how
+     many there are; see ops.c.  WRITE_NEXT is where the last write ended,
+     so that a write starting there is sequential and can return before
+     the server has answered.  WRITE_ERR is an error from such a write, to
+     be returned by the next write or sync.  WB_NEXT links the nodes
+     with writes left outstanding, which is the case if WB_LISTED.  */
+  struct write_chunk *writes;
+  unsigned int nwrites;
+  off_t write_next;
+  error_t write_err;
+  struct node *wb_next;
+  int wb_listed;
+
+  /* The epoch of this file's cached data, or zero if there is none yet,
+     and the modification and change times it is valid for; see
+     data-cache.c.  */
+  unsigned long data_epoch;
+  struct timespec data_mtime, data_ctime;
+
   /* If this node has been renamed by "deletion" then
      this is the directory and the name in that directory
      which is holding the node */
@@ -101,6 +129,9 @@ extern int name_cache_timeout;
 /* How long to keep around negative dir cache entries */
 extern int name_cache_neg_timeout;
 
+/* How many dir cache entries to keep */
+extern int name_cache_size;
+
 /* How long to wait for replies before re-sending RPC's. */
 extern int initial_transmit_timeout;
 extern int max_transmit_timeout;
@@ -117,6 +148,18 @@ extern int read_size;
 /* Maximum amout to write at once */
 extern int write_size;
 
+/* How many READ or WRITE RPCs a single read or write keeps outstanding */
+extern int rpc_window;
+
+/* How many read_size chunks to read ahead of sequential reads */
+extern int read_ahead;
+
+/* How many kilobytes of file data to cache */
+extern int data_cache_size;
+
+/* Whether sequential writes may return before the server has answered */
+extern int write_behind;
+
 /* Service name for portmapper */
 extern char *pmap_service_name;
 
@@ -152,6 +195,10 @@ extern short nfs_port;
    portmapper. */
 extern int nfs_port_override;
 
+/* If this is nonzero, talk to the NFS server over TCP if it can,
+   falling back to UDP otherwise. */
+extern int nfs_use_tcp;
+
 /* Which NFS protocol version we are using */
 extern int protocol_version;
 
@@ -185,21 +232,40 @@ extern uint16_t mounted_nfs_port; /* host order */
 
 /* ops.c */
 int *register_fresh_stat (struct node *, int *);
+void drop_reads (struct node *);
+void flush_writes (struct node *);
+void flush_write_behind (void);
+void *write_behind_thread (void *);
 
 /* rpc.c */
 int *initialize_rpc (int, int, int, size_t, void **, uid_t, gid_t, gid_t);
 error_t conduct_rpc (void **, int **);
+error_t start_rpc (void **, int **);
+error_t finish_rpc (void **, int **);
+void abandon_rpc (void *);
 void *timeout_service_thread (void *);
 void *rpc_receive_thread (void *);
+error_t bind_reserved_port (int);
+error_t start_tcp_rpc (const struct sockaddr_in *);
 
 /* cache.c */
 void lookup_fhandle (struct fhandle *, struct node **);
 int *recache_handle (int *, struct node *);
 
+/* data-cache.c */
+void data_cache_purge (struct node *);
+void data_cache_check (struct node *);
+void data_cache_written (struct node *, const struct timespec *,
+			 const struct timespec *);
+size_t data_cache_read (struct node *, off_t, size_t, char *, int *);
+void data_cache_fill (struct node *, off_t, char *, size_t, int);
+void data_cache_write (struct node *, off_t, char *, size_t);
+
 /* name-cache.c */
 void enter_lookup_cache (char *, size_t, struct node *, char *);
 void purge_lookup_cache (struct node *, char *, size_t);
 struct node *check_lookup_cache (struct node *, char *);
 void purge_lookup_cache_node (struct node *);
+void get_lookup_cache_stats (long *, long *, long *);
 
 #endif /* NFS_NFS_H */
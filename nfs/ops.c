@@ -103,29 +103,33 @@ process_returned_stat (struct node *np, int *p, int mod)
 }
 
 
-/* Handle returned wcc information for various calls.  In protocol
-   version 2, this is just register_fresh_stat.  In version 3, it does
-   the wcc_data interpretation too.  If this follows an operation that
-   we expect has modified the attributes, MOD should be set.
-   (This unpacks the wcc_data XDR type.)  */
-int *
-process_wcc_stat (struct node *np, int *p, int mod)
+/* Like process_wcc_stat, but in protocol version 3 also return in
+   *PRE_MTIME and *PRE_CTIME the modification and change times NP had
+   before the operation, and set *PRE_EXIST to whether the server gave
+   them.  In version 2, there are none and these are left alone.  */
+static int *
+process_wcc_stat_pre (struct node *np, int *p, int mod,
+		      struct timespec *pre_mtime, struct timespec *pre_ctime,
+		      int *pre_exist)
 {
   if (protocol_version == 2)
     return register_fresh_stat (np, p);
   else
     {
-      int attrs_exist;
-
       /* First the pre_op_attr */
-      attrs_exist = ntohl (*p);
+      *pre_exist = ntohl (*p);
       p++;
-      if (attrs_exist)
+      if (*pre_exist)
 	{
-	  /* Just skip them for now */
-	  p += 2 * sizeof (int); /* size */
-	  p += 2 * sizeof (int); /* mtime */
-	  p += 2 * sizeof (int); /* atime */
+	  p += 2; /* size */
+	  pre_mtime->tv_sec = ntohl (*p);
+	  p++;
+	  pre_mtime->tv_nsec = ntohl (*p);
+	  p++;
+	  pre_ctime->tv_sec = ntohl (*p);
+	  p++;
+	  pre_ctime->tv_nsec = ntohl (*p);
+	  p++;
 	}
 
       /* Now the post_op_attr */
@@ -133,6 +137,21 @@ process_wcc_stat (struct node *np, int *p, int mod)
     }
 }
 
+/* Handle returned wcc information for various calls.  In protocol
+   version 2, this is just register_fresh_stat.  In version 3, it does
+   the wcc_data interpretation too.  If this follows an operation that
+   we expect has modified the attributes, MOD should be set.
+   (This unpacks the wcc_data XDR type.)  */
+int *
+process_wcc_stat (struct node *np, int *p, int mod)
+{
+  struct timespec pre_mtime, pre_ctime;
+  int pre_exist;
+
+  return process_wcc_stat_pre (np, p, mod, &pre_mtime, &pre_ctime,
+			       &pre_exist);
+}
+
 
 /* Implement the netfs_validate_stat callback as described in
    <hurd/netfs.h>.  */
@@ -143,6 +162,9 @@ netfs_validate_stat (struct node *np, struct iouser *cred)
   void *rpcbuf;
   error_t err;
 
+  /* Writes still outstanding will change the size and times.  */
+  flush_writes (np);
+
   if (mapped_time->seconds - np->nn->stat_updated < stat_timeout)
     return 0;
 
@@ -310,6 +332,9 @@ netfs_attempt_utimes (struct iouser *cred, struct node *np,
       current.tv_nsec = tv.tv_usec * 1000;
     }
 
+  /* Don't let a write still outstanding change the times after us.  */
+  flush_writes (np);
+
   p = nfs_initialize_rpc (NFSPROC_SETATTR (protocol_version),
 			  cred, 0, &rpcbuf, np, -1);
   if (! p)
@@ -345,6 +370,9 @@ netfs_attempt_set_size (struct iouser *cred, struct node *np,
   void *rpcbuf;
   error_t err;
 
+  drop_reads (np);
+  flush_writes (np);
+
   p = nfs_initialize_rpc (NFSPROC_SETATTR (protocol_version),
 			  cred, 0, &rpcbuf, np, -1);
   if (! p)
@@ -364,6 +392,9 @@ netfs_attempt_set_size (struct iouser *cred, struct node *np,
 	p = process_wcc_stat (np, p, !err);
     }
 
+  /* Whatever happened, the cached data may be past the end now.  */
+  data_cache_purge (np);
+
   /* If we got EACCES, but the user has the file open for writing,
      then the NFS protocol has screwed us.  There's nothing we can do,
      except in the important case of opens with
@@ -432,8 +463,13 @@ netfs_attempt_statfs (struct iouser *cred, struct node *np,
 error_t
 netfs_attempt_sync (struct iouser *cred, struct node *np, int wait)
 {
-  /* We are already completely synchronous. */
-  return 0;
+  error_t err;
+
+  /* Everything but write behind is completely synchronous.  */
+  flush_writes (np);
+  err = np->nn->write_err;
+  np->nn->write_err = 0;
+  return err;
 }
 
 /* Implement the netfs_attempt_syncfs callback as described in
@@ -441,129 +477,473 @@ netfs_attempt_sync (struct iouser *cred, struct node *np, int wait)
 error_t
 netfs_attempt_syncfs (struct iouser *cred, int wait)
 {
+  flush_write_behind ();
   return 0;
 }
 
-/* Implement the netfs_attempt_read callback as described in
-   <hurd/netfs.h>.  */
-error_t
-netfs_attempt_read (struct iouser *cred, struct node *np,
-		    off_t offset, size_t *len, void *data)
+/* A READ RPC for part of a file.  These are queued on the file's netnode
+   in order of offset, so that several can be outstanding at once, and so
+   that data read ahead of one read can be used by the next.  */
+struct read_chunk
 {
-  int *p;
+  struct read_chunk *next;
   void *rpcbuf;
-  size_t trans_len;
+  off_t offset;			/* Where the data starts.  */
+  size_t len;			/* How much was asked for.  */
+  time_t sent;
+
+  /* Filled in by finish_read.  */
+  int done;
   error_t err;
-  size_t amt, thisamt;
+  char *data;			/* The data, in RPCBUF.  */
+  size_t avail;			/* How much there is.  */
   int eof;
+};
 
-  for (amt = *len; amt;)
+/* Send a READ RPC for LEN bytes at OFFSET in NP on behalf of CRED, and
+   queue it on NP.  */
+static error_t
+start_read (struct iouser *cred, struct node *np, off_t offset, size_t len)
+{
+  struct read_chunk *chunk, **tailp;
+  int *p;
+  error_t err;
+
+  chunk = malloc (sizeof *chunk);
+  if (! chunk)
+    return ENOMEM;
+
+  p = nfs_initialize_rpc (NFSPROC_READ (protocol_version),
+			  cred, 0, &chunk->rpcbuf, np, -1);
+  if (! p)
     {
-      thisamt = amt;
-      if (thisamt > read_size)
-	thisamt = read_size;
+      err = errno;
+      free (chunk);
+      return err;
+    }
 
-      p = nfs_initialize_rpc (NFSPROC_READ (protocol_version),
-			      cred, 0, &rpcbuf, np, -1);
-      if (! p)
-        return errno;
+  p = xdr_encode_fhandle (p, &np->nn->handle);
+  if (protocol_version == 3)
+    *(p++) = htonl ((uint64_t) offset >> 32);
+  *(p++) = htonl (offset);
+  *(p++) = htonl (len);
+  if (protocol_version == 2)
+    *(p++) = 0;
 
-      p = xdr_encode_fhandle (p, &np->nn->handle);
-      *(p++) = htonl (offset);
-      *(p++) = htonl (thisamt);
-      if (protocol_version == 2)
-	*(p++) = 0;
+  err = start_rpc (&chunk->rpcbuf, &p);
+  if (err)
+    {
+      free (chunk->rpcbuf);
+      free (chunk);
+      return err;
+    }
 
-      err = conduct_rpc (&rpcbuf, &p);
-      if (!err)
-	{
-	  err = nfs_error_trans (ntohl (*p));
-	  p++;
+  chunk->next = 0;
+  chunk->offset = offset;
+  chunk->len = len;
+  chunk->sent = mapped_time->seconds;
+  chunk->done = 0;
 
-	  if (!err || protocol_version == 3)
-	    p = process_returned_stat (np, p, !err);
+  for (tailp = &np->nn->reads; *tailp; tailp = &(*tailp)->next)
+    ;
+  *tailp = chunk;
+  return 0;
+}
 
-	  if (err)
-	    {
-	      free (rpcbuf);
-	      return err;
-	    }
+/* Wait for the reply to CHUNK, a READ of NP, and find its data.  */
+static void
+finish_read (struct node *np, struct read_chunk *chunk)
+{
+  int *p;
+  error_t err;
 
-	  trans_len = ntohl (*p);
+  err = finish_rpc (&chunk->rpcbuf, &p);
+  if (!err)
+    {
+      err = nfs_error_trans (ntohl (*p));
+      p++;
+
+      if (!err || protocol_version == 3)
+	p = process_returned_stat (np, p, !err);
+
+      if (!err)
+	{
+	  chunk->avail = ntohl (*p);
 	  p++;
-	  if (trans_len > thisamt)
-	    trans_len = thisamt;	/* ??? */
+	  if (chunk->avail > chunk->len)
+	    chunk->avail = chunk->len;	/* ??? */
 
 	  if (protocol_version == 3)
 	    {
-	      eof = ntohl (*p);
+	      chunk->eof = ntohl (*p);
 	      p++;
 	    }
 	  else
-	    eof = (trans_len < thisamt);
+	    chunk->eof = (chunk->avail < chunk->len);
 
-	  memcpy (data, p, trans_len);
-	  free (rpcbuf);
+	  chunk->data = (char *) p;
+
+	  data_cache_check (np);
+	  data_cache_fill (np, chunk->offset, chunk->data, chunk->avail,
+			   chunk->eof);
+	}
+    }
+
+  chunk->err = err;
+  chunk->done = 1;
+}
+
+static void
+free_read (struct read_chunk *chunk)
+{
+  if (chunk->done)
+    free (chunk->rpcbuf);
+  else
+    abandon_rpc (chunk->rpcbuf);
+  free (chunk);
+}
+
+/* Forget the reads queued on NP, including any data read ahead.  */
+void
+drop_reads (struct node *np)
+{
+  while (np->nn->reads)
+    {
+      struct read_chunk *chunk = np->nn->reads;
+      np->nn->reads = chunk->next;
+      free_read (chunk);
+    }
+
+  if (np->nn->reads_cred)
+    {
+      iohelp_free_iouser (np->nn->reads_cred);
+      np->nn->reads_cred = 0;
+    }
+}
+
+/* Return true if data read for OTHER may be given to CRED.  */
+static int
+same_user (struct iouser *cred, struct iouser *other)
+{
+  return (cred != (struct iouser *) -1 && other
+	  && idvec_equal (cred->uids, other->uids)
+	  && idvec_equal (cred->gids, other->gids));
+}
+
+/* Read *LEN bytes of NP at OFFSET into DATA from the server, for
+   netfs_attempt_read.  */
+static error_t
+read_from_server (struct iouser *cred, struct node *np,
+		  off_t offset, size_t *len, void *data)
+{
+  struct netnode *nn = np->nn;
+  unsigned int window = rpc_window > 0 ? rpc_window : 1;
+  unsigned int queued = 0;
+  off_t pos = offset, end = offset + *len, next, limit;
+  struct read_chunk *chunk;
+  error_t err = 0;
+  int eof = 0;
+
+  /* Send READs for the data from NEXT up to LIMIT, keeping no more than
+     WINDOW outstanding.  */
+  void fill (void)
+    {
+      while (queued < window && next < limit)
+	{
+	  size_t thisamt = limit - next;
+	  error_t serr;
+
+	  if (thisamt > read_size)
+	    thisamt = read_size;
+
+	  serr = start_read (cred, np, next, thisamt);
+	  if (serr)
+	    {
+	      if (! nn->reads)
+		err = serr;
+	      break;
+	    }
+	  next += thisamt;
+	  queued++;
+	}
+    }
+
+  /* Data read ahead can only be used if this read carries on from the
+     last one, for the same user, and the data is fresh enough.  */
+  if (nn->reads
+      && (offset != nn->read_next
+	  || mapped_time->seconds - nn->reads->sent >= cache_timeout
+	  || ! same_user (cred, nn->reads_cred)))
+    drop_reads (np);
+
+  next = pos;
+  for (chunk = nn->reads; chunk; chunk = chunk->next)
+    {
+      next = chunk->offset + chunk->len;
+      queued++;
+    }
+
+  /* Read ahead of sequential reads, but not past the end of the file as
+     far as we know.  */
+  limit = end;
+  if (offset == nn->read_next && offset > 0 && read_ahead > 0
+      && cred != (struct iouser *) -1)
+    {
+      limit = end + (off_t) read_ahead * read_size;
+      if (limit > np->nn_stat.st_size)
+	limit = end > np->nn_stat.st_size ? end : np->nn_stat.st_size;
+    }
+
+  while (pos < end && !err && !eof)
+    {
+      size_t skip;
 
-	  data += trans_len;
-	  offset += trans_len;
-	  amt -= trans_len;
+      fill ();
+      if (err)
+	break;
+
+      chunk = nn->reads;
+      if (! chunk->done)
+	finish_read (np, chunk);
+      if (chunk->err)
+	{
+	  err = chunk->err;
+	  break;
+	}
+
+      skip = pos - chunk->offset;
+      if (skip < chunk->avail)
+	{
+	  size_t n = chunk->avail - skip;
+	  if (n > end - pos)
+	    n = end - pos;
+	  memcpy (data + (pos - offset), chunk->data + skip, n);
+	  pos += n;
+	  skip += n;
+	}
 
-	  if (eof)
+      if (skip >= chunk->avail)
+	/* CHUNK is used up.  */
+	{
+	  nn->reads = chunk->next;
+	  queued--;
+
+	  if (chunk->eof)
+	    eof = 1;
+	  else if (chunk->avail < chunk->len)
+	    /* A short read that isn't at the end of the file.  The data that
+	       was asked for after this chunk's is fine, but it's simpler to
+	       start over from here.  */
 	    {
-	      *len -= amt;
-	      return 0;
+	      drop_reads (np);
+	      queued = 0;
+	      next = pos;
 	    }
+
+	  free_read (chunk);
 	}
     }
+
+  if (err || eof)
+    drop_reads (np);
+  else
+    /* Start reading ahead for the next read.  */
+    fill ();
+
+  if (err && pos == offset)
+    return err;
+
+  *len = pos - offset;
+  nn->read_next = pos;
+
+  if (nn->reads && ! nn->reads_cred
+      && (cred == (struct iouser *) -1
+	  || iohelp_dup_iouser (&nn->reads_cred, cred)))
+    drop_reads (np);
+
   return 0;
 }
 
-/* Implement the netfs_attempt_write callback as described in
+/* Implement the netfs_attempt_read callback as described in
    <hurd/netfs.h>.  */
 error_t
-netfs_attempt_write (struct iouser *cred, struct node *np,
-		     off_t offset, size_t *len, void *data)
+netfs_attempt_read (struct iouser *cred, struct node *np,
+		    off_t offset, size_t *len, void *data)
 {
-  int *p;
+  struct netnode *nn = np->nn;
+  size_t n, rest;
+  int eof;
+  error_t err;
+
+  /* Our own writes must reach the server before we read from it, and
+     before we look at the attributes.  */
+  flush_writes (np);
+
+  /* Use cached data only if the file hasn't changed on the server since
+     it was read, as far as recent attributes tell.  */
+  if (mapped_time->seconds - nn->stat_updated >= cache_timeout)
+    {
+      nn->stat_updated = 0;
+      err = netfs_validate_stat (np, cred);
+      if (err)
+	return err;
+    }
+  data_cache_check (np);
+
+  n = data_cache_read (np, offset, *len, data, &eof);
+  if (n == *len || eof)
+    {
+      if (offset == nn->read_next)
+	nn->read_next = offset + n;
+      *len = n;
+      return 0;
+    }
+
+  if (n > 0 && offset == nn->read_next)
+    /* Keep the read sequential for read_from_server.  */
+    nn->read_next = offset + n;
+
+  rest = *len - n;
+  err = read_from_server (cred, np, offset + n, &rest, data + n);
+  if (err && n == 0)
+    return err;
+
+  *len = n + (err ? 0 : rest);
+  return 0;
+}
+
+/* A WRITE RPC in flight.  These are queued on the file's netnode, oldest
+   first, so that several can be outstanding at once, and so that a
+   sequential write can return before the server has answered.  */
+struct write_chunk
+{
+  struct write_chunk *next;
   void *rpcbuf;
+  off_t offset;
+  size_t len;
+
+  /* The data and the user it is written for, which are needed to send
+     the rest again if the server only writes part of it.  While the
+     write that queued this is running, they are the caller's; once it
+     has returned, DETACHED is set and they are our own copies.  */
+  char *data;
+  struct iouser *cred;
+  int detached;
+};
+
+/* Nodes with WRITEs outstanding whose writers have returned, linked
+   through their netnodes' WB_NEXT fields.  Each holds a reference.  */
+static struct node *write_behind_nodes;
+static pthread_mutex_t write_behind_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Send a WRITE of the LEN bytes at DATA to NP at OFFSET on behalf of
+   CRED, and return the RPC in *RPCBUF.  */
+static error_t
+send_write (struct iouser *cred, struct node *np, off_t offset,
+	    char *data, size_t len, void **rpcbuf)
+{
   error_t err;
-  size_t amt, thisamt;
-  size_t count;
+  int *p;
 
-  for (amt = *len; amt;)
+  p = nfs_initialize_rpc (NFSPROC_WRITE (protocol_version),
+			  cred, len, rpcbuf, np, -1);
+  if (! p)
+    return errno;
+
+  p = xdr_encode_fhandle (p, &np->nn->handle);
+  if (protocol_version == 2)
+    *(p++) = 0;
+  else
+    *(p++) = htonl ((uint64_t) offset >> 32);
+  *(p++) = htonl (offset);
+  if (protocol_version == 2)
+    *(p++) = 0;
+  if (protocol_version == 3)
     {
-      thisamt = amt;
-      if (thisamt > write_size)
-	thisamt = write_size;
+      *(p++) = htonl (len);
+      *(p++) = htonl (FILE_SYNC);
+    }
+  p = xdr_encode_data (p, data, len);
 
-      p = nfs_initialize_rpc (NFSPROC_WRITE (protocol_version),
-			      cred, thisamt, &rpcbuf, np, -1);
-      if (! p)
-        return errno;
+  err = start_rpc (rpcbuf, &p);
+  if (err)
+    free (*rpcbuf);
+  return err;
+}
 
-      p = xdr_encode_fhandle (p, &np->nn->handle);
-      if (protocol_version == 2)
-	*(p++) = 0;
-      *(p++) = htonl (offset);
-      if (protocol_version == 2)
-	*(p++) = 0;
-      if (protocol_version == 3)
-	*(p++) = htonl (FILE_SYNC);
-      p = xdr_encode_data (p, data, thisamt);
+/* Queue a WRITE of the LEN bytes at DATA to NP at OFFSET on behalf of
+   CRED.  */
+static error_t
+start_write (struct iouser *cred, struct node *np, off_t offset,
+	     char *data, size_t len)
+{
+  struct write_chunk *chunk, **tailp;
+  error_t err;
 
-      err = conduct_rpc (&rpcbuf, &p);
+  chunk = malloc (sizeof *chunk);
+  if (! chunk)
+    return ENOMEM;
+
+  err = send_write (cred, np, offset, data, len, &chunk->rpcbuf);
+  if (err)
+    {
+      free (chunk);
+      return err;
+    }
+
+  chunk->next = 0;
+  chunk->offset = offset;
+  chunk->len = len;
+  chunk->data = data;
+  chunk->cred = cred;
+  chunk->detached = 0;
+
+  for (tailp = &np->nn->writes; *tailp; tailp = &(*tailp)->next)
+    ;
+  *tailp = chunk;
+  np->nn->nwrites++;
+  return 0;
+}
+
+/* Collect the reply to the oldest WRITE queued on NP, and return how much
+   of it was written in *COUNT.  If the server wrote only part of it, send
+   the rest again.  */
+static error_t
+finish_write (struct node *np, size_t *count)
+{
+  struct write_chunk *chunk = np->nn->writes;
+  error_t err;
+
+  np->nn->writes = chunk->next;
+  np->nn->nwrites--;
+  *count = 0;
+
+  for (;;)
+    {
+      size_t n = 0;
+      int *p;
+      struct timespec pre_mtime, pre_ctime;
+      int pre_exist;
+
+      err = finish_rpc (&chunk->rpcbuf, &p);
       if (!err)
 	{
 	  err = nfs_error_trans (ntohl (*p));
 	  p++;
+	  /* Version 2 doesn't say what the times were before the write;
+	     take the ones we have, but only if they were had from the
+	     server just now.  */
+	  pre_mtime = np->nn_stat.st_mtim;
+	  pre_ctime = np->nn_stat.st_ctim;
+	  pre_exist = np->nn->stat_updated == mapped_time->seconds;
 	  if (!err || protocol_version == 3)
-	    p = process_wcc_stat (np, p, !err);
+	    p = process_wcc_stat_pre (np, p, !err, &pre_mtime, &pre_ctime,
+				      &pre_exist);
 	  if (!err)
 	    {
 	      if (protocol_version == 3)
 		{
-		  count = ntohl (*p);
+		  n = ntohl (*p);
 		  p++;
 		  p++;		/* ignore COMMITTED */
 		  /* ignore verf for now */
@@ -571,28 +951,247 @@ netfs_attempt_write (struct iouser *cred, struct node *np,
 		}
 	      else
 		/* assume it wrote the whole thing */
-		count = thisamt;
+		n = chunk->len - *count;
 
-	      amt -= count;
-	      data += count;
-	      offset += count;
+	      /* The attributes changed because of our own write, which the
+		 cached data already has, unless someone else changed the
+		 file before it.  */
+	      if (pre_exist)
+		data_cache_written (np, &pre_mtime, &pre_ctime);
+	      else
+		data_cache_purge (np);
 	    }
 	}
+      free (chunk->rpcbuf);
 
-      free (rpcbuf);
-
-      if (err == EINTR && amt != *len)
+      if (err)
+	break;
+      if (n == 0)
 	{
-	  *len -= amt;
-	  return 0;
+	  err = EIO;		/* Don't retry forever.  */
+	  break;
+	}
+      *count += n;
+      if (*count >= chunk->len)
+	{
+	  *count = chunk->len;
+	  break;
 	}
 
+      err = send_write (chunk->cred, np, chunk->offset + *count,
+			chunk->data + *count, chunk->len - *count,
+			&chunk->rpcbuf);
       if (err)
+	break;
+    }
+
+  if (err)
+    /* What we cached for this may not be what the server has.  */
+    data_cache_purge (np);
+
+  if (chunk->detached)
+    {
+      free (chunk->data);
+      iohelp_free_iouser (chunk->cred);
+    }
+  free (chunk);
+  return err;
+}
+
+/* Wait for all the WRITEs queued on NP.  The first error is kept in
+   NP->nn->write_err for the next write or sync to return.  NP must be
+   locked.  */
+void
+flush_writes (struct node *np)
+{
+  while (np->nn->writes)
+    {
+      size_t count;
+      error_t err = finish_write (np, &count);
+      if (err && ! np->nn->write_err)
+	np->nn->write_err = err;
+    }
+}
+
+/* Make the WRITEs queued on NP by the running write independent of its
+   caller, so that it can return before they are answered.  Return
+   nonzero on success; otherwise nothing has changed.  */
+static int
+detach_writes (struct node *np)
+{
+  struct write_chunk *chunk;
+
+  for (chunk = np->nn->writes; chunk; chunk = chunk->next)
+    if (! chunk->detached)
+      {
+	char *copy = malloc (chunk->len);
+	struct iouser *cred;
+
+	if (! copy)
+	  return 0;
+	if (iohelp_dup_iouser (&cred, chunk->cred))
+	  {
+	    free (copy);
+	    return 0;
+	  }
+	memcpy (copy, chunk->data, chunk->len);
+	chunk->data = copy;
+	chunk->cred = cred;
+	chunk->detached = 1;
+      }
+
+  if (np->nn->writes && ! np->nn->wb_listed)
+    {
+      np->nn->wb_listed = 1;
+      netfs_nref (np);
+      pthread_mutex_lock (&write_behind_lock);
+      np->nn->wb_next = write_behind_nodes;
+      write_behind_nodes = np;
+      pthread_mutex_unlock (&write_behind_lock);
+    }
+  return 1;
+}
+
+/* Wait for the WRITEs of all the nodes whose writers have returned.  */
+void
+flush_write_behind (void)
+{
+  struct node *np, *next;
+
+  pthread_mutex_lock (&write_behind_lock);
+  np = write_behind_nodes;
+  write_behind_nodes = 0;
+  pthread_mutex_unlock (&write_behind_lock);
+
+  for (; np; np = next)
+    {
+      pthread_mutex_lock (&np->lock);
+      next = np->nn->wb_next;
+      np->nn->wb_next = 0;
+      np->nn->wb_listed = 0;
+      flush_writes (np);
+      netfs_nput (np);
+    }
+}
+
+/* Dedicated thread to collect the replies to WRITEs left behind by
+   sequential writers, so that errors are noticed and the data isn't held
+   longer than need be.  */
+void *
+write_behind_thread (void *arg)
+{
+  for (;;)
+    {
+      sleep (1);
+      flush_write_behind ();
+    }
+
+  return NULL;
+}
+
+/* Implement the netfs_attempt_write callback as described in
+   <hurd/netfs.h>.  */
+error_t
+netfs_attempt_write (struct iouser *cred, struct node *np,
+		     off_t offset, size_t *len, void *data)
+{
+  struct netnode *nn = np->nn;
+  unsigned int window = rpc_window > 0 ? rpc_window : 1;
+  size_t sent = 0, done = 0;
+  error_t err = 0;
+  int behind;
+
+  /* Anything read ahead may be overwritten.  */
+  drop_reads (np);
+
+  /* A write continuing the last one needn't wait for it; anything else
+     does, so that writes reach the server in order.  */
+  behind = write_behind && offset == nn->write_next;
+  if (! behind)
+    flush_writes (np);
+
+  /* An earlier write we returned from early has failed; say so now.  */
+  if (nn->write_err)
+    {
+      err = nn->write_err;
+      nn->write_err = 0;
+      *len = 0;
+      return err;
+    }
+
+  data_cache_write (np, offset, data, *len);
+
+  /* Chunks not yet detached are ours; the older ones are finished first,
+     and their errors are kept for later.  */
+  while (!err && sent < *len)
+    {
+      size_t thisamt = *len - sent;
+
+      if (nn->nwrites >= window)
 	{
-	  *len = 0;
-	  return err;
+	  size_t count;
+	  int ours = ! nn->writes->detached;
+	  error_t werr = finish_write (np, &count);
+
+	  if (ours)
+	    {
+	      err = werr;
+	      done += count;
+	    }
+	  else if (werr && ! nn->write_err)
+	    nn->write_err = werr;
+	  continue;
+	}
+
+      if (thisamt > write_size)
+	thisamt = write_size;
+
+      err = start_write (cred, np, offset + sent, data + sent, thisamt);
+      if (!err)
+	sent += thisamt;
+    }
+
+  if (behind && !err && detach_writes (np))
+    {
+      nn->write_next = offset + *len;
+      return 0;
+    }
+
+  /* Wait for everything.  Replies after an error are waited for, but
+     don't count.  */
+  while (nn->writes)
+    {
+      size_t count;
+      int ours = ! nn->writes->detached;
+      error_t werr = finish_write (np, &count);
+
+      if (! ours)
+	{
+	  if (werr && ! nn->write_err)
+	    nn->write_err = werr;
 	}
+      else if (!err)
+	{
+	  err = werr;
+	  done += count;
+	}
+    }
+
+  nn->write_next = offset + done;
+
+  if (err == EINTR && done > 0)
+    {
+      *len = done;
+      return 0;
+    }
+
+  if (err)
+    {
+      *len = 0;
+      return err;
     }
+
+  *len = done;
   return 0;
 }
 
@@ -1472,6 +2071,10 @@ netfs_check_open_permissions (struct iouser *cred, struct node *np,
   if (newnode || (flags & (O_READ|O_WRITE|O_EXEC)) == 0)
     return 0;
 
+  /* Fetch fresh attributes on every open, so that cached data changed on
+     the server since is noticed (close-to-open consistency).  */
+  np->nn->stat_updated = 0;
+
   netfs_report_access (cred, np, &modes);
   if ((flags & (O_READ|O_WRITE|O_EXEC)) == (flags & modes))
     return 0;
@@ -30,7 +30,9 @@
 
 #undef malloc			/* Get rid of the sun block.  */
 
+#include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <assert.h>
 #include <errno.h>
 #include <error.h>
@@ -42,6 +44,13 @@ struct rpc_list
 {
   struct rpc_list *next, **prevp;
   void *reply;
+
+  /* Transmission state, used by start_rpc and finish_rpc.  */
+  size_t len;			/* Size of the message.  */
+  time_t lasttrans;		/* When it was last sent.  */
+  int timeout;			/* How long to wait before resending.  */
+  int ntransmit;		/* How many times it has been sent.  */
+  int generation;		/* STREAM_GENERATION when last sent.  */
 };
 
 /* A list of all pending RPCs.  */
@@ -54,6 +63,30 @@ static pthread_cond_t rpc_wakeup = PTHREAD_COND_INITIALIZER;
 /* Lock the global data and the REPLY fields of outstanding RPC's.  */
 static pthread_mutex_t outstanding_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* If this is nonzero, RPCs are sent as records on a TCP connection to
+   STREAM_ADDR instead of as datagrams on main_udp_socket.  Set once by
+   start_tcp_rpc.  */
+static int use_stream;
+static struct sockaddr_in stream_addr;
+
+/* The connected socket, or -1 while the connection is being
+   reestablished, and how many times it has been established.  Both are
+   protected by STREAM_LOCK; STREAM_GENERATION is changed with
+   OUTSTANDING_LOCK held too.  Take STREAM_LOCK first.  */
+static int stream_socket = -1;
+static int stream_generation;
+static pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The largest reply record we accept from the server.  */
+#define MAX_RECORD (16 * 1024 * 1024)
+
+/* The bit in a record mark saying this is the last fragment.  */
+#define LAST_FRAGMENT 0x80000000
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
 
 
 /* Generate and return a new transaction ID.  */
@@ -166,63 +199,189 @@ link_rpc (struct rpc_list **list, struct rpc_list *hdr)
   *list = hdr;
 }
 
-/* Send the specified RPC message.  *RPCBUF is the initialized buffer
-   from a previous initialize_rpc call; *PP, the payload, points past
-   the filledin args.  Set *PP to the address of the reply contents
-   themselves.  The user will be expected to free *RPCBUF (which will
-   have changed) when done with the reply contents.  The old value of
-   *RPCBUF will be freed by this routine.  */
+/* Bind SOCK to a privileged port, if we are allowed one, so that
+   servers which insist on that will talk to us.  */
 error_t
-conduct_rpc (void **rpcbuf, int **pp)
+bind_reserved_port (int sock)
+{
+  struct sockaddr_in addr;
+  int ret;
+
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = INADDR_ANY;
+  addr.sin_port = htons (IPPORT_RESERVED);
+  do
+    {
+      addr.sin_port = htons (ntohs (addr.sin_port) - 1);
+      ret = bind (sock, (struct sockaddr *)&addr, 
+		  sizeof (struct sockaddr_in));
+      if (ret == -1 && errno == EACCES)
+	/* We aren't allowed privileged ports; no matter;
+	   let the server deny us later if it wants. */
+	return 0;
+    }
+  while ((ret == -1) && (errno == EADDRINUSE));
+
+  return ret == -1 ? errno : 0;
+}
+
+/* Send the RPC HDR as a single record on the TCP connection, if there is
+   one.  If the connection is down, or breaks, the RPC is sent again once
+   rpc_stream_thread has reconnected.  */
+static void
+stream_send (struct rpc_list *hdr)
+{
+  uint32_t mark = htonl (LAST_FRAGMENT | hdr->len);
+  struct iovec iov[2] =
+    {
+      { &mark, sizeof mark },
+      { (void *) hdr + sizeof (struct rpc_list), hdr->len },
+    };
+  struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+
+  pthread_mutex_lock (&stream_lock);
+  hdr->generation = stream_generation;
+  if (stream_socket != -1)
+    while (msg.msg_iovlen > 0)
+      {
+	ssize_t cc = sendmsg (stream_socket, &msg, MSG_NOSIGNAL);
+	if (cc <= 0)
+	  {
+	    if (cc == -1 && errno == EINTR)
+	      continue;
+	    /* Make the receiving thread notice, and start over.  */
+	    shutdown (stream_socket, SHUT_RDWR);
+	    break;
+	  }
+	while (msg.msg_iovlen > 0 && cc >= msg.msg_iov->iov_len)
+	  {
+	    cc -= msg.msg_iov->iov_len;
+	    msg.msg_iov++;
+	    msg.msg_iovlen--;
+	  }
+	if (msg.msg_iovlen > 0)
+	  {
+	    msg.msg_iov->iov_base += cc;
+	    msg.msg_iov->iov_len -= cc;
+	  }
+      }
+  pthread_mutex_unlock (&stream_lock);
+}
+
+/* Send the RPC HDR (again).  OUTSTANDING_LOCK must be held.  */
+static error_t
+transmit_rpc (struct rpc_list *hdr)
+{
+  size_t cc;
+
+  /* If we've sent enough, give up.  */
+  if (mounted_soft && hdr->ntransmit == soft_retries)
+    return ETIMEDOUT;
+
+  hdr->lasttrans = mapped_time->seconds;
+  hdr->ntransmit++;
+
+  if (use_stream)
+    {
+      /* TCP doesn't lose messages, so only send again if the connection
+	 the RPC went out on has been lost since.  Don't hold
+	 OUTSTANDING_LOCK while sending, so that replies can still be
+	 taken while the connection is backed up.  */
+      if (hdr->ntransmit == 1 || hdr->generation != stream_generation)
+	{
+	  pthread_mutex_unlock (&outstanding_lock);
+	  stream_send (hdr);
+	  pthread_mutex_lock (&outstanding_lock);
+	}
+      return 0;
+    }
+
+  cc = write (main_udp_socket, (void *) hdr + sizeof (struct rpc_list),
+	      hdr->len);
+  if (cc == -1)
+    return errno;
+  else
+    assert (cc == hdr->len);
+
+  return 0;
+}
+
+/* Send the specified RPC message without waiting for the reply, so that
+   several RPCs can be outstanding at once.  *RPCBUF is the initialized
+   buffer from a previous initialize_rpc call; *PP, the payload, points
+   past the filledin args.  The reply is collected by finish_rpc; if it
+   is no longer wanted, the RPC must be given to abandon_rpc instead.  On
+   error, nothing has been sent, and *RPCBUF must be freed by the
+   user.  */
+error_t
+start_rpc (void **rpcbuf, int **pp)
+{
+  struct rpc_list *hdr = *rpcbuf;
+  error_t err;
+
+  hdr->len = (void *) *pp - *rpcbuf - sizeof (struct rpc_list);
+  hdr->timeout = initial_transmit_timeout;
+  hdr->ntransmit = 0;
+
+  pthread_mutex_lock (&outstanding_lock);
+  link_rpc (&outstanding_rpcs, hdr);
+  err = transmit_rpc (hdr);
+  if (err)
+    unlink_rpc (hdr);
+  pthread_mutex_unlock (&outstanding_lock);
+
+  return err;
+}
+
+/* Forget the RPC in RPCBUF, which was sent by start_rpc, and free it
+   along with its reply, if any.  */
+void
+abandon_rpc (void *rpcbuf)
+{
+  struct rpc_list *hdr = rpcbuf;
+
+  pthread_mutex_lock (&outstanding_lock);
+  /* If the reply has come, rpc_receive_thread unlinked HDR.  */
+  if (! hdr->reply)
+    unlink_rpc (hdr);
+  pthread_mutex_unlock (&outstanding_lock);
+
+  free (hdr->reply);
+  free (hdr);
+}
+
+/* Wait for the reply to the RPC in *RPCBUF, which was sent by start_rpc,
+   resending it as necessary.  Set *PP to the address of the reply
+   contents themselves.  The user will be expected to free *RPCBUF (which
+   will have changed) when done with the reply contents.  The old value
+   of *RPCBUF will be freed by this routine.  */
+error_t
+finish_rpc (void **rpcbuf, int **pp)
 {
   struct rpc_list *hdr = *rpcbuf;
   error_t err;
-  size_t cc, nc;
-  int timeout = initial_transmit_timeout;
-  time_t lasttrans;
-  int ntransmit = 0;
   int *p;
   int xid;
   int n;
   int cancel;
-  
-  pthread_mutex_lock (&outstanding_lock);
-
-  link_rpc (&outstanding_rpcs, hdr);
 
   xid = * (int *) (*rpcbuf + sizeof (struct rpc_list));
 
-  do
-    {
-      /* If we've sent enough, give up.  */
-      if (mounted_soft && ntransmit == soft_retries)
-	{
-	  unlink_rpc (hdr);
-	  pthread_mutex_unlock (&outstanding_lock);
-	  return ETIMEDOUT;
-	}
+  pthread_mutex_lock (&outstanding_lock);
 
-      /* Issue the RPC.  */
-      lasttrans = mapped_time->seconds;
-      ntransmit++;
-      nc = (void *) *pp - *rpcbuf - sizeof (struct rpc_list);
-      cc = write (main_udp_socket, *rpcbuf + sizeof (struct rpc_list), nc);
-      if (cc == -1)
-	{
-	  unlink_rpc (hdr);
-	  pthread_mutex_unlock (&outstanding_lock);
-	  return errno;
-	}
-      else 
-	assert (cc == nc);
-      
+  while (!hdr->reply)
+    {
       /* Wait for reply.  */
       cancel = 0;
       while (!hdr->reply
-	     && (mapped_time->seconds - lasttrans < timeout)
+	     && (mapped_time->seconds - hdr->lasttrans < hdr->timeout)
+	     && !(use_stream && hdr->generation != stream_generation)
 	     && !cancel)
 	cancel = pthread_hurd_cond_wait_np (&rpc_wakeup, &outstanding_lock);
-  
+
+      if (hdr->reply)
+	break;
+
       if (cancel)
 	{
 	  unlink_rpc (hdr);
@@ -233,14 +392,18 @@ conduct_rpc (void **rpcbuf, int **pp)
       /* hdr->reply will have been filled in by rpc_receive_thread,
          if it has been filled in, then the rpc has been fulfilled,
          otherwise, retransmit and continue to wait.  */
-      if (!hdr->reply)
+      hdr->timeout *= 2;
+      if (hdr->timeout > max_transmit_timeout)
+	hdr->timeout = max_transmit_timeout;
+
+      err = transmit_rpc (hdr);
+      if (err)
 	{
-	  timeout *= 2;
-	  if (timeout > max_transmit_timeout)
-	    timeout = max_transmit_timeout;
+	  unlink_rpc (hdr);
+	  pthread_mutex_unlock (&outstanding_lock);
+	  return err;
 	}
     }
-  while (!hdr->reply);
 
   pthread_mutex_unlock (&outstanding_lock);
 
@@ -347,6 +510,18 @@ conduct_rpc (void **rpcbuf, int **pp)
   return err;
 }
 
+/* Send the specified RPC message.  *RPCBUF is the initialized buffer
+   from a previous initialize_rpc call; *PP, the payload, points past
+   the filledin args.  Set *PP to the address of the reply contents
+   themselves.  The user will be expected to free *RPCBUF (which will
+   have changed) when done with the reply contents.  The old value of
+   *RPCBUF will be freed by this routine.  */
+error_t
+conduct_rpc (void **rpcbuf, int **pp)
+{
+  return start_rpc (rpcbuf, pp) ?: finish_rpc (rpcbuf, pp);
+}
+
 /* Dedicated thread to signal those waiting on rpc_wakeup
    once a second.  */
 void *
@@ -365,6 +540,37 @@ timeout_service_thread (void *arg)
   return NULL;
 }
 
+/* Hand the reply in BUF to the RPC it answers, if that is still
+   pending.  Return nonzero if it was, in which case BUF now belongs to
+   that RPC.  */
+static int
+deliver_reply (void *buf)
+{
+  struct rpc_list *r;
+  int xid = *(int *)buf;
+
+  pthread_mutex_lock (&outstanding_lock);
+
+  /* Find the rpc that we just fulfilled.  */
+  for (r = outstanding_rpcs; r; r = r->next)
+    {
+      if (* (int *) &r[1] == xid)
+	{
+	  unlink_rpc (r);
+	  r->reply = buf;
+	  pthread_cond_broadcast (&rpc_wakeup);
+	  break;
+	}
+    }
+#if 0
+  if (! r)
+    fprintf (stderr, "NFS dropping reply xid %d\n", xid);
+#endif
+  pthread_mutex_unlock (&outstanding_lock);
+
+  return r != 0;
+}
+
 /* Dedicate thread to receive RPC replies, register them on the queue
    of pending wakeups, and deal appropriately.  */
 void *
@@ -386,40 +592,186 @@ rpc_receive_thread (void *arg)
           error (0, errno, "nfs read");
           continue;
         }
-      else
-        {
-          struct rpc_list *r;
-          int xid = *(int *)buf;
-
-          pthread_mutex_lock (&outstanding_lock);
-
-          /* Find the rpc that we just fulfilled.  */
-          for (r = outstanding_rpcs; r; r = r->next)
-    	    {
-    	      if (* (int *) &r[1] == xid)
-	        {
-	          unlink_rpc (r);
-	          r->reply = buf;
-	          pthread_cond_broadcast (&rpc_wakeup);
-		  break;
-	        }
-	    }
-#if 0
-	  if (! r)
-	    fprintf (stderr, "NFS dropping reply xid %d\n", xid);
-#endif
-	  pthread_mutex_unlock (&outstanding_lock);
+      else if (cc >= sizeof (int) && deliver_reply (buf))
+	{
+	  /* We had a message from a pending (i.e. known) rpc.  Thus,
+	     it was fulfilled and if we want to get another request, a
+	     new buffer is needed.  */
+	  buf = malloc (1024 + read_size);
+	  assert (buf);
+	}
+    }
 
-	  /* If r is not null then we had a message from a pending
-	     (i.e. known) rpc.  Thus, it was fulfilled and if we want
-	     to get another request, a new buffer is needed.  */
-	  if (r)
-	    {
-              buf = malloc (1024 + read_size);
-              assert (buf);
-	    }
-        }
+  return NULL;
+}
+
+/* Read exactly LEN bytes from SOCK into BUF.  */
+static error_t
+read_fully (int sock, void *buf, size_t len)
+{
+  while (len > 0)
+    {
+      ssize_t cc = read (sock, buf, len);
+      if (cc == -1 && errno == EINTR)
+	continue;
+      if (cc <= 0)
+	return cc == 0 ? ECONNRESET : errno;
+      buf += cc;
+      len -= cc;
+    }
+  return 0;
+}
+
+/* Read one record, which may be made of several fragments, from SOCK.
+   Return it in malloced storage in *BUF, and its size in *LEN.  */
+static error_t
+read_record (int sock, void **buf, size_t *len)
+{
+  uint32_t mark;
+  size_t fraglen;
+  error_t err;
+
+  *buf = 0;
+  *len = 0;
+  do
+    {
+      void *new;
+
+      err = read_fully (sock, &mark, sizeof mark);
+      if (err)
+	break;
+      mark = ntohl (mark);
+      fraglen = mark & ~LAST_FRAGMENT;
+      if (fraglen > MAX_RECORD - *len)
+	{
+	  err = EMSGSIZE;
+	  break;
+	}
+
+      new = realloc (*buf, *len + fraglen ?: 1);
+      if (! new)
+	{
+	  err = ENOMEM;
+	  break;
+	}
+      *buf = new;
+
+      err = read_fully (sock, *buf + *len, fraglen);
+      if (err)
+	break;
+      *len += fraglen;
+    }
+  while (! (mark & LAST_FRAGMENT));
+
+  if (err)
+    {
+      free (*buf);
+      *buf = 0;
+    }
+  return err;
+}
+
+/* Open a new TCP connection to STREAM_ADDR, and return it in *SOCK.  */
+static error_t
+open_stream (int *sock)
+{
+  int one = 1;
+  error_t err;
+
+  *sock = socket (PF_INET, SOCK_STREAM, 0);
+  if (*sock == -1)
+    return errno;
+
+  err = bind_reserved_port (*sock);
+  if (!err && connect (*sock, (struct sockaddr *) &stream_addr,
+		       sizeof stream_addr) == -1)
+    err = errno;
+  if (err)
+    {
+      close (*sock);
+      return err;
+    }
+
+  /* RPCs are sent whole; don't hold them back waiting for more.  */
+  setsockopt (*sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+  return 0;
+}
+
+/* Make SOCK the connection to send RPCs on, and get the RPCs which were
+   sent on the previous one sent again.  */
+static void
+set_stream (int sock)
+{
+  pthread_mutex_lock (&stream_lock);
+  pthread_mutex_lock (&outstanding_lock);
+  stream_socket = sock;
+  stream_generation++;
+  pthread_cond_broadcast (&rpc_wakeup);
+  pthread_mutex_unlock (&outstanding_lock);
+  pthread_mutex_unlock (&stream_lock);
+}
+
+/* Dedicated thread to receive RPC replies on the TCP connection, and to
+   reconnect when the connection is lost.  */
+static void *
+rpc_stream_thread (void *arg)
+{
+  int sock = (int) arg;
+
+  for (;;)
+    {
+      void *buf;
+      size_t len;
+      error_t err;
+
+      err = read_record (sock, &buf, &len);
+      if (! err)
+	{
+	  if (len < sizeof (int) || ! deliver_reply (buf))
+	    free (buf);
+	  continue;
+	}
+
+      error (0, err, "connection to nfs server lost");
+      pthread_mutex_lock (&stream_lock);
+      close (sock);
+      stream_socket = -1;
+      pthread_mutex_unlock (&stream_lock);
+
+      while ((err = open_stream (&sock)))
+	sleep (1);
+      set_stream (sock);
     }
 
   return NULL;
 }
+
+/* Send all NFS RPCs from now on over TCP to the server at ADDR.  If no
+   connection can be made, return an error and keep using UDP.  */
+error_t
+start_tcp_rpc (const struct sockaddr_in *addr)
+{
+  pthread_t thread;
+  int sock;
+  error_t err;
+
+  assert (! use_stream);
+  stream_addr = *addr;
+
+  err = open_stream (&sock);
+  if (err)
+    return err;
+
+  set_stream (sock);
+  err = pthread_create (&thread, NULL, rpc_stream_thread, (void *) sock);
+  if (err)
+    {
+      close (sock);
+      stream_socket = -1;
+      return err;
+    }
+  pthread_detach (thread);
+
+  use_stream = 1;
+  return 0;
+}
@@ -36,6 +36,7 @@
 #define malloc spoogie_woogie	/* ugh^2. */
 #include <rpc/types.h>
 #include <rpc/auth.h>
+#include <rpc/auth_unix.h>
 #undef malloc
 
 #define IDHASH_TABLE_SIZE 1024
@@ -134,6 +135,8 @@ process_cred (int *p, struct idspec **credp)
   int firstgid;
   int i;
 
+  /* The lengths below are clamped to what RPC allows, so that a bogus
+     call can't take us beyond the call buffer (see MAXCALLSIZE).  */
   type = ntohl (*p);
   p++;
 
@@ -141,6 +144,8 @@ process_cred (int *p, struct idspec **credp)
     {
       int size = ntohl (*p);
       p++;
+      if (size < 0 || size > MAX_AUTH_BYTES)
+	size = MAX_AUTH_BYTES;
       *credp = idspec_lookup (0, 0, 0, 0);
       p += INTSIZE (size);
     }
@@ -150,6 +155,8 @@ process_cred (int *p, struct idspec **credp)
       p++;			/* Skip seconds.  */
       len = ntohl (*p);
       p++;
+      if (len < 0 || len > MAX_MACHINE_NAME)
+	len = MAX_MACHINE_NAME;
       p += INTSIZE (len);	/* Skip hostname.  */
 
       uid = p++;		/* Remember location of uid.  */
@@ -159,6 +166,8 @@ process_cred (int *p, struct idspec **credp)
       gids = p;			/* Here is where the array will start.  */
       ngids = ntohl (*p);
       p++;
+      if (ngids < 0 || ngids > NGRPS)
+	ngids = NGRPS;
 
       /* Now swap the first gid to be the first element of the
 	 array.  */
@@ -178,6 +187,8 @@ process_cred (int *p, struct idspec **credp)
   p++;				/* Skip ID.  */
   len = htonl (*p);
   p++;
+  if (len < 0 || len > MAX_AUTH_BYTES)
+    len = MAX_AUTH_BYTES;
   p += INTSIZE (len);
 
   return p;
@@ -268,14 +279,31 @@ fh_hash (char *fhandle, struct idspec *i)
   return hash % FHHASH_TABLE_SIZE;
 }
 
+/* Look up the file handle at P, sent by the user I in a call of protocol
+   VERSION, and return it with a new reference in *CP (or 0 if it is
+   stale).  Return the next thing to come after it.  */
 int *
-lookup_cache_handle (int *p, struct cache_handle **cp, struct idspec *i)
+lookup_cache_handle (int *p, struct cache_handle **cp, struct idspec *i,
+		     int version)
 {
   int hash;
   struct cache_handle *c;
   fsys_t fsys;
   file_t port;
 
+  if (version == 3)
+    {
+      /* Version 3 handles are counted; all of ours are the size of
+	 version 2 ones.  */
+      size_t len = ntohl (*p);
+      p++;
+      if (len != NFS2_FHSIZE)
+	{
+	  *cp = 0;
+	  return p + INTSIZE (len > NFS3_FHSIZE ? NFS3_FHSIZE : len);
+	}
+    }
+
   hash = fh_hash ((char *)p, i);
   pthread_mutex_lock (&fhhashlock);
   for (c = fhhashtable[hash]; c; c = c->next)
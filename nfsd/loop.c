@@ -20,6 +20,9 @@
 
 #include <string.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <netinet/tcp.h>
 
 #include "nfsd.h"
 
@@ -35,190 +38,515 @@
 #include <rpc/rpc_msg.h>
 #undef malloc
 
-void *
-server_loop (void *arg)
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* Process the RPC call of LEN bytes in BUF from SENDER.  Return the
+   cached reply to send back, which the caller must release with
+   release_cached_reply, or 0 if the call should be ignored.  */
+static struct cached_reply *
+process_call (char *buf, size_t len, struct sockaddr_in *sender)
 {
-  int fd = (int) arg;
-  char buf[MAXIOSIZE];
   int xid;
   int *p, *r;
   char *rbuf;
   struct cached_reply *cr;
   int program;
-  struct sockaddr_in sender;
-  int version;
+  int version, minversion, maxversion;
   int procedure;
   struct proctable *table = 0;
   struct procedure *proc;
   struct idspec *cred;
   struct cache_handle *c, fakec;
   error_t err;
-  socklen_t addrlen;
-  int cc;
 
   memset (&fakec, 0, sizeof (struct cache_handle));
 
+  p = (int *) buf;
+  proc = 0;
+  if (len < 2 * sizeof (int))
+    return 0;
+  xid = *(p++);
+
+  /* Ignore things that aren't proper RPCs.  */
+  if (ntohl (*p) != CALL)
+    return 0;
+  p++;
+
+  cr = check_cached_replies (xid, sender);
+  if (cr->data)
+    /* This transacation has already completed.  */
+    return cr;
+
+  r = (int *) (rbuf = malloc (MAXIOSIZE));
+
+  if (ntohl (*p) != RPC_MSG_VERSION)
+    {
+      /* Reject RPC.  */
+      *(r++) = xid;
+      *(r++) = htonl (REPLY);
+      *(r++) = htonl (MSG_DENIED);
+      *(r++) = htonl (RPC_MISMATCH);
+      *(r++) = htonl (RPC_MSG_VERSION);
+      *(r++) = htonl (RPC_MSG_VERSION);
+      goto send_reply;
+    }
+  p++;
+
+  program = ntohl (*p);
+  p++;
+  switch (program)
+    {
+    case MOUNTPROG:
+      minversion = MOUNTVERS;
+      maxversion = MOUNTVERS3;
+      table = &mounttable;
+      break;
+
+    case NFS_PROGRAM:
+      minversion = NFS_VERSION;
+      maxversion = NFS3_VERSION;
+      table = &nfs2table;
+      break;
+
+    case PMAPPROG:
+      minversion = maxversion = PMAPVERS;
+      table = &pmaptable;
+      break;
+
+    default:
+      /* Program unavailable.  */
+      *(r++) = xid;
+      *(r++) = htonl (REPLY);
+      *(r++) = htonl (MSG_ACCEPTED);
+      *(r++) = htonl (AUTH_NULL);
+      *(r++) = htonl (0);
+      *(r++) = htonl (PROG_UNAVAIL);
+      goto send_reply;
+    }
+
+  version = ntohl (*p);
+  if (version < minversion || version > maxversion)
+    {
+      /* Program mismatch.  */
+      *(r++) = xid;
+      *(r++) = htonl (REPLY);
+      *(r++) = htonl (MSG_ACCEPTED);
+      *(r++) = htonl (AUTH_NULL);
+      *(r++) = htonl (0);
+      *(r++) = htonl (PROG_MISMATCH);
+      *(r++) = htonl (minversion);
+      *(r++) = htonl (maxversion);
+      goto send_reply;
+    }
+  p++;
+
+  if (program == NFS_PROGRAM && version == NFS3_VERSION)
+    table = &nfs3table;
+
+  procedure = htonl (*p);
+  p++;
+  if (procedure < table->min
+      || procedure > table->max
+      || table->procs[procedure - table->min].func == 0)
+    {
+      /* Procedure unavailable.  */
+      *(r++) = xid;
+      *(r++) = htonl (REPLY);
+      *(r++) = htonl (MSG_ACCEPTED);
+      *(r++) = htonl (AUTH_NULL);
+      *(r++) = htonl (0);
+      *(r++) = htonl (PROC_UNAVAIL);
+      *(r++) = htonl (table->min);
+      *(r++) = htonl (table->max);
+      goto send_reply;
+    }
+  proc = &table->procs[procedure - table->min];
+
+  p = process_cred (p, &cred);
+
+  if (proc->need_handle)
+    p = lookup_cache_handle (p, &c, cred, version);
+  else
+    {
+      fakec.ids = cred;
+      c = &fakec;
+    }
+
+  if (proc->alloc_reply)
+    {
+      size_t amt;
+      amt = (*proc->alloc_reply) (p, version) + 256;
+      if (amt > MAXIOSIZE)
+	{
+	  free (rbuf);
+	  r = (int *) (rbuf = malloc (amt));
+	}
+    }
+
+  /* Fill in beginning of reply.  */
+  *(r++) = xid;
+  *(r++) = htonl (REPLY);
+  *(r++) = htonl (MSG_ACCEPTED);
+  *(r++) = htonl (AUTH_NULL);
+  *(r++) = htonl (0);
+  *(r++) = htonl (SUCCESS);
+  if (!proc->process_error)
+    /* The function does its own error processing, and we ignore
+       its return value.  */
+    (void) (*proc->func) (c, p, &r, version);
+  else
+    {
+      if (c)
+	{
+	  /* Assume success for now and patch it later if necessary.  */
+	  int *errloc = r;
+	  *(r++) = htonl (0);
+	  if (proc->args_size
+	      && ((char *) p > buf + len
+		  || ((*proc->args_size) (p, version)
+		      > (size_t) (buf + len - (char *) p))))
+	    /* The arguments run past the end of the call.  */
+	    err = EINVAL;
+	  else
+	    /* Call processing function, its output after error code.  */
+	    err = (*proc->func) (c, p, &r, version);
+	  if (err)
+	    {
+	      r = errloc;	/* Back up, patch error code, discard rest.  */
+	      *(r++) = htonl (nfs_error_trans (err, version));
+	    }
+	}
+      else
+	{
+	  err = ESTALE;
+	  *(r++) = htonl (nfs_error_trans (ESTALE, version));
+	}
+
+      if (err)
+	{
+	  int n;
+	  for (n = 0; n < proc->error_words; n++)
+	    *(r++) = 0;
+	}
+    }
+
+  cred_rele (cred);
+  if (c && c != &fakec)
+    cache_handle_rele (c);
+
+ send_reply:
+  cr->data = rbuf;
+  cr->len = (char *)r - rbuf;
+  return cr;
+}
+
+/* Serve RPCs arriving as datagrams on the UDP socket ARG.  */
+void *
+server_loop (void *arg)
+{
+  int fd = (int) arg;
+  char buf[MAXCALLSIZE];
+  struct cached_reply *cr;
+  struct sockaddr_in sender;
+  socklen_t addrlen;
+  int cc;
+
   for (;;)
     {
-      p = (int *) buf;
-      proc = 0;
       addrlen = sizeof (struct sockaddr_in);
-      cc = recvfrom (fd, buf, MAXIOSIZE, 0, &sender, &addrlen);
+      cc = recvfrom (fd, buf, sizeof buf, 0, &sender, &addrlen);
       if (cc == -1)
 	continue;		/* Ignore errors.  */
-      xid = *(p++);
+      memset (buf + cc, 0, sizeof buf - cc);
 
-      /* Ignore things that aren't proper RPCs.  */
-      if (ntohl (*p) != CALL)
+      cr = process_call (buf, cc, &sender);
+      if (! cr)
 	continue;
-      p++;
 
-      cr = check_cached_replies (xid, &sender);
-      if (cr->data)
-	/* This transacation has already completed.  */
-	goto repost_reply;
+      sendto (fd, cr->data, cr->len, 0,
+	      (struct sockaddr *) &sender, addrlen);
+      release_cached_reply (cr);
+    }
+}
 
-      r = (int *) (rbuf = malloc (MAXIOSIZE));
+/* A TCP connection from a client.  */
+struct tcp_conn
+{
+  int fd;
+  struct sockaddr_in peer;
 
-      if (ntohl (*p) != RPC_MSG_VERSION)
-	{
-	  /* Reject RPC.  */
-	  *(r++) = xid;
-	  *(r++) = htonl (REPLY);
-	  *(r++) = htonl (MSG_DENIED);
-	  *(r++) = htonl (RPC_MISMATCH);
-	  *(r++) = htonl (RPC_MSG_VERSION);
-	  *(r++) = htonl (RPC_MSG_VERSION);
-	  goto send_reply;
-	}
-      p++;
+  /* Held while sending a reply, so that replies aren't interleaved.  */
+  pthread_mutex_t send_lock;
+
+  /* The reading thread holds one reference, and each queued call one
+     more.  Protected by TCP_QUEUE_LOCK.  */
+  int references;
+
+  /* Signalled when a call of this connection is done, for the reading
+     thread to wait on when too many are queued.  */
+  pthread_cond_t call_done;
+};
 
-      program = ntohl (*p);
-      p++;
-      switch (program)
+/* A call read from a TCP connection, waiting for a server thread.  */
+struct tcp_call
+{
+  struct tcp_call *next;
+  struct tcp_conn *conn;
+  size_t len;
+  char *buf;
+};
+
+/* Calls waiting to be processed by tcp_server_loop, oldest first.  */
+static struct tcp_call *tcp_queue, **tcp_queue_tail = &tcp_queue;
+static pthread_mutex_t tcp_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tcp_queue_wakeup = PTHREAD_COND_INITIALIZER;
+
+/* The number of threads running tcp_server_loop, which is also how many
+   calls a connection can have queued before we stop reading from it.
+   Protected by TCP_QUEUE_LOCK.  */
+static int tcp_server_threads;
+
+/* The bit in a record mark saying this is the last fragment.  */
+#define LAST_FRAGMENT 0x80000000
+
+static void
+tcp_conn_rele (struct tcp_conn *conn)
+{
+  int last;
+
+  pthread_mutex_lock (&tcp_queue_lock);
+  last = --conn->references == 0;
+  if (! last)
+    pthread_cond_signal (&conn->call_done);
+  pthread_mutex_unlock (&tcp_queue_lock);
+
+  if (last)
+    {
+      close (conn->fd);
+      pthread_mutex_destroy (&conn->send_lock);
+      pthread_cond_destroy (&conn->call_done);
+      free (conn);
+    }
+}
+
+/* Read exactly LEN bytes from FD into BUF.  */
+static error_t
+read_fully (int fd, void *buf, size_t len)
+{
+  while (len > 0)
+    {
+      ssize_t cc = read (fd, buf, len);
+      if (cc == -1 && errno == EINTR)
+	continue;
+      if (cc <= 0)
+	return cc == 0 ? ECONNRESET : errno;
+      buf += cc;
+      len -= cc;
+    }
+  return 0;
+}
+
+/* Read one record, which may be made of several fragments, from FD.
+   Return it in malloced storage of MAXCALLSIZE bytes in *BUF, the
+   rest of which is zeroed, and its size in *LEN.  */
+static error_t
+read_record (int fd, char **buf, size_t *len)
+{
+  uint32_t mark;
+  size_t fraglen;
+  error_t err;
+
+  *len = 0;
+  *buf = malloc (MAXCALLSIZE);
+  if (! *buf)
+    return ENOMEM;
+
+  do
+    {
+      err = read_fully (fd, &mark, sizeof mark);
+      if (err)
+	break;
+      mark = ntohl (mark);
+      fraglen = mark & ~LAST_FRAGMENT;
+      if (fraglen > MAXCALLSIZE - *len)
 	{
-	case MOUNTPROG:
-	  version = MOUNTVERS;
-	  table = &mounttable;
+	  err = EMSGSIZE;
 	  break;
+	}
 
-	case NFS_PROGRAM:
-	  version = NFS_VERSION;
-	  table = &nfs2table;
-	  break;
+      err = read_fully (fd, *buf + *len, fraglen);
+      if (err)
+	break;
+      *len += fraglen;
+    }
+  while (! (mark & LAST_FRAGMENT));
 
-	case PMAPPROG:
-	  version = PMAPVERS;
-	  table = &pmaptable;
-	  break;
+  if (err)
+    {
+      free (*buf);
+      *buf = 0;
+    }
+  else
+    memset (*buf + *len, 0, MAXCALLSIZE - *len);
+  return err;
+}
 
-	default:
-	  /* Program unavailable.  */
-	  *(r++) = xid;
-	  *(r++) = htonl (REPLY);
-	  *(r++) = htonl (MSG_ACCEPTED);
-	  *(r++) = htonl (AUTH_NULL);
-	  *(r++) = htonl (0);
-	  *(r++) = htonl (PROG_UNAVAIL);
-	  goto send_reply;
-	}
+/* Send the LEN bytes at DATA as one record on CONN.  */
+static void
+send_record (struct tcp_conn *conn, char *data, size_t len)
+{
+  uint32_t mark = htonl (LAST_FRAGMENT | len);
+  struct iovec iov[2] = { { &mark, sizeof mark }, { data, len } };
+  struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
 
-      if (ntohl (*p) != version)
+  pthread_mutex_lock (&conn->send_lock);
+  while (msg.msg_iovlen > 0)
+    {
+      ssize_t cc = sendmsg (conn->fd, &msg, MSG_NOSIGNAL);
+      if (cc <= 0)
 	{
-	  /* Program mismatch.  */
-	  *(r++) = xid;
-	  *(r++) = htonl (REPLY);
-	  *(r++) = htonl (MSG_ACCEPTED);
-	  *(r++) = htonl (AUTH_NULL);
-	  *(r++) = htonl (0);
-	  *(r++) = htonl (PROG_MISMATCH);
-	  *(r++) = htonl (version);
-	  *(r++) = htonl (version);
-	  goto send_reply;
+	  if (cc == -1 && errno == EINTR)
+	    continue;
+	  /* Give up on the connection; the client will make a new one and
+	     send its calls again.  */
+	  shutdown (conn->fd, SHUT_RDWR);
+	  break;
 	}
-      p++;
-
-      procedure = htonl (*p);
-      p++;
-      if (procedure < table->min
-	  || procedure > table->max
-	  || table->procs[procedure - table->min].func == 0)
+      while (msg.msg_iovlen > 0 && cc >= msg.msg_iov->iov_len)
 	{
-	  /* Procedure unavailable.  */
-	  *(r++) = xid;
-	  *(r++) = htonl (REPLY);
-	  *(r++) = htonl (MSG_ACCEPTED);
-	  *(r++) = htonl (AUTH_NULL);
-	  *(r++) = htonl (0);
-	  *(r++) = htonl (PROC_UNAVAIL);
-	  *(r++) = htonl (table->min);
-	  *(r++) = htonl (table->max);
-	  goto send_reply;
+	  cc -= msg.msg_iov->iov_len;
+	  msg.msg_iov++;
+	  msg.msg_iovlen--;
+	}
+      if (msg.msg_iovlen > 0)
+	{
+	  msg.msg_iov->iov_base += cc;
+	  msg.msg_iov->iov_len -= cc;
 	}
-      proc = &table->procs[procedure - table->min];
+    }
+  pthread_mutex_unlock (&conn->send_lock);
+}
 
-      p = process_cred (p, &cred);
+/* Read calls from the TCP connection ARG and queue them for the server
+   threads, so that a client can have several calls outstanding on one
+   connection.  Stop reading while it has as many queued as there are
+   server threads, so that a client cannot make us hold an unbounded
+   number of calls.  */
+static void *
+tcp_conn_loop (void *arg)
+{
+  struct tcp_conn *conn = arg;
+  struct tcp_call *call;
+  error_t err;
 
-      if (proc->need_handle)
-	p = lookup_cache_handle (p, &c, cred);
-      else
+  for (;;)
+    {
+      call = malloc (sizeof (struct tcp_call));
+      if (! call)
+	{
+	  err = ENOMEM;
+	  break;
+	}
+      err = read_record (conn->fd, &call->buf, &call->len);
+      if (err)
 	{
-	  fakec.ids = cred;
-	  c = &fakec;
+	  free (call);
+	  break;
 	}
+      call->conn = conn;
+      call->next = 0;
 
-      if (proc->alloc_reply)
+      pthread_mutex_lock (&tcp_queue_lock);
+      conn->references++;
+      *tcp_queue_tail = call;
+      tcp_queue_tail = &call->next;
+      pthread_cond_signal (&tcp_queue_wakeup);
+      while (conn->references - 1 >= (tcp_server_threads ?: 1))
+	pthread_cond_wait (&conn->call_done, &tcp_queue_lock);
+      pthread_mutex_unlock (&tcp_queue_lock);
+    }
+
+  if (err != ECONNRESET)
+    /* We've lost our place in the stream; make the client start over.  */
+    shutdown (conn->fd, SHUT_RDWR);
+  tcp_conn_rele (conn);
+  return 0;
+}
+
+/* Accept TCP connections on the listening socket ARG, and start a thread
+   reading calls from each.  */
+void *
+tcp_listen_loop (void *arg)
+{
+  int fd = (int) arg;
+
+  for (;;)
+    {
+      struct tcp_conn *conn;
+      socklen_t addrlen = sizeof (struct sockaddr_in);
+      pthread_t thread;
+      int one = 1;
+
+      conn = malloc (sizeof (struct tcp_conn));
+      if (! conn)
 	{
-	  size_t amt;
-	  amt = (*proc->alloc_reply) (p, version) + 256;
-	  if (amt > MAXIOSIZE)
-	    {
-	      free (rbuf);
-	      r = (int *) (rbuf = malloc (amt));
-	    }
+	  sleep (1);
+	  continue;
 	}
 
-      /* Fill in beginning of reply.  */
-      *(r++) = xid;
-      *(r++) = htonl (REPLY);
-      *(r++) = htonl (MSG_ACCEPTED);
-      *(r++) = htonl (AUTH_NULL);
-      *(r++) = htonl (0);
-      *(r++) = htonl (SUCCESS);
-      if (!proc->process_error)
-	/* The function does its own error processing, and we ignore
-	   its return value.  */
-	(void) (*proc->func) (c, p, &r, version);
-      else
+      conn->fd = accept (fd, (struct sockaddr *) &conn->peer, &addrlen);
+      if (conn->fd == -1)
 	{
-	  if (c)
-	    {
-	      /* Assume success for now and patch it later if necessary.  */
-	      int *errloc = r;
-	      *(r++) = htonl (0);
-	      /* Call processing function, its output after error code.  */
-	      err = (*proc->func) (c, p, &r, version);
-	      if (err)
-		{
-		  r = errloc;	/* Back up, patch error code, discard rest.  */
-		  *(r++) = htonl (nfs_error_trans (err, version));
-		}
-	    }
-	  else
-	    *(r++) = htonl (nfs_error_trans (ESTALE, version));
+	  free (conn);
+	  continue;		/* Ignore errors.  */
 	}
+      setsockopt (conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+      pthread_mutex_init (&conn->send_lock, NULL);
+      pthread_cond_init (&conn->call_done, NULL);
+      conn->references = 1;
+
+      if (pthread_create (&thread, NULL, tcp_conn_loop, conn))
+	tcp_conn_rele (conn);
+      else
+	pthread_detach (thread);
+    }
+}
+
+/* Serve RPCs read from TCP connections.  */
+void *
+tcp_server_loop (void *arg)
+{
+  struct tcp_call *call;
+  struct cached_reply *cr;
 
-      cred_rele (cred);
-      if (c && c != &fakec)
-	cache_handle_rele (c);
+  (void) arg;
 
-    send_reply:
-      cr->data = rbuf;
-      cr->len = (char *)r - rbuf;
+  pthread_mutex_lock (&tcp_queue_lock);
+  tcp_server_threads++;
+  pthread_mutex_unlock (&tcp_queue_lock);
 
-    repost_reply:
-      sendto (fd, cr->data, cr->len, 0,
-	      (struct sockaddr *) &sender, addrlen);
-      release_cached_reply (cr);
+  for (;;)
+    {
+      pthread_mutex_lock (&tcp_queue_lock);
+      while (! tcp_queue)
+	pthread_cond_wait (&tcp_queue_wakeup, &tcp_queue_lock);
+      call = tcp_queue;
+      tcp_queue = call->next;
+      if (! tcp_queue)
+	tcp_queue_tail = &tcp_queue;
+      pthread_mutex_unlock (&tcp_queue_lock);
+
+      cr = process_call (call->buf, call->len, &call->conn->peer);
+      if (cr)
+	{
+	  send_record (call->conn, cr->data, cr->len);
+	  release_cached_reply (cr);
+	}
+
+      tcp_conn_rele (call->conn);
+      free (call->buf);
+      free (call);
     }
 }
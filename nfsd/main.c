@@ -28,18 +28,20 @@
 #include <error.h>
 
 int main_udp_socket, pmap_udp_socket;
+int main_tcp_socket = -1;
 struct sockaddr_in main_address, pmap_address;
 static char index_file[] = LOCALSTATEDIR "/state/misc/nfsd.index";
 char *index_file_name = index_file;
+int start_time;
 
-/* Launch a server loop thread */
+/* Launch a server loop thread running LOOP on SOCKET */
 static void
-create_server_thread (int socket)
+create_thread (void *(*loop) (void *), int socket)
 {
   pthread_t thread;
   int fail;
 
-  fail = pthread_create (&thread, NULL, server_loop, (void *) socket);
+  fail = pthread_create (&thread, NULL, loop, (void *) socket);
   if (fail)
     error (1, fail, "Creating main server thread");
 
@@ -68,6 +70,7 @@ main (int argc, char **argv)
 
   authserver = getauth ();
   maptime_map (0, 0, &mapped_time);
+  start_time = mapped_time->seconds;
 
   main_address.sin_family = AF_INET;
   main_address.sin_port = htons (NFS_PORT);
@@ -88,12 +91,40 @@ main (int argc, char **argv)
   if (fail)
     error (1, errno, "Binding PMAP socket");
 
+  /* Serve TCP too if we can, so clients can make larger transfers than
+     fit in a datagram.  */
+  main_tcp_socket = socket (PF_INET, SOCK_STREAM, 0);
+  if (main_tcp_socket != -1)
+    {
+      int one = 1;
+
+      setsockopt (main_tcp_socket, SOL_SOCKET, SO_REUSEADDR,
+		  &one, sizeof one);
+      if (bind (main_tcp_socket, (struct sockaddr *)&main_address,
+		sizeof (struct sockaddr_in))
+	  || listen (main_tcp_socket, 16))
+	{
+	  error (0, errno, "Binding NFS TCP socket; serving UDP only");
+	  close (main_tcp_socket);
+	  main_tcp_socket = -1;
+	}
+    }
+
   init_filesystems ();
 
-  create_server_thread (pmap_udp_socket);
+  create_thread (server_loop, pmap_udp_socket);
+
+  if (main_tcp_socket != -1)
+    {
+      int n;
+
+      create_thread (tcp_listen_loop, main_tcp_socket);
+      for (n = 0; n < nthreads; n++)
+	create_thread (tcp_server_loop, -1);
+    }
 
   while (nthreads--)
-    create_server_thread (main_udp_socket);
+    create_thread (server_loop, main_udp_socket);
 
   for (;;)
     {
@@ -19,6 +19,7 @@
    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111, USA. */
 
 #include <sys/types.h>
+#include <stdint.h>
 #include <sys/socket.h>
 #include <errno.h>
 #include <netinet/in.h>
@@ -32,6 +33,14 @@
 #define FH_KEEP_TIMEOUT 600	/* ten minutes */
 #define REPLY_KEEP_TIMEOUT 120	/* two minutes */
 #define MAXIOSIZE 10240
+#define NFS3_MAXDATA 32768	/* largest NFSv3 READ or WRITE */
+
+/* The largest call we take, over UDP or TCP.  Calls are decoded without
+   checking each step against their length, so every call is read into
+   a buffer this big whose unused tail is zeroed.  This caps TCP records
+   too, so transfers are no larger over TCP than over UDP: FSINFO
+   advertises NFS3_MAXDATA as the largest READ and WRITE for both.  */
+#define MAXCALLSIZE (MAXIOSIZE + NFS3_MAXDATA)
 
 struct idspec
 {
@@ -75,6 +84,15 @@ struct procedure
   size_t (*alloc_reply) (int *, int);
   int need_handle;
   int process_error;
+
+  /* How many words of zeros follow the status in an error reply (as
+     when the reply carries attributes only if they follow).  */
+  int error_words;
+
+  /* If set, return how many bytes of arguments follow the file handle
+     in the call at P, so that calls cut short can be refused before
+     their arguments are used.  */
+  size_t (*args_size) (int *, int);
 };
 
 struct proctable
@@ -91,8 +109,17 @@ volatile struct mapped_time_value *mapped_time;
 /* We don't actually distinguish between these two sockets, but
    we have to listen on two different ports, so that's why they're here. */
 extern int main_udp_socket, pmap_udp_socket;
+
+/* The socket listening for TCP connections on the NFS port, or -1 if
+   there is none; calls on the connections are served like those on
+   main_udp_socket. */
+extern int main_tcp_socket;
 extern struct sockaddr_in main_address, pmap_address;
 
+/* When we started.  NFSv3 clients see it in replies to unstable writes,
+   so that they can tell when we may have lost them.  */
+extern int start_time;
+
 /* Name of the file on disk containing the filesystem index table */
 extern char *index_file_name;
 
@@ -105,7 +132,8 @@ int *process_cred (int *, struct idspec **);
 void cred_rele (struct idspec *);
 void cred_ref (struct idspec *);
 void scan_creds (void);
-int *lookup_cache_handle (int *, struct cache_handle **, struct idspec *);
+int *lookup_cache_handle (int *, struct cache_handle **, struct idspec *,
+			  int);
 void cache_handle_rele (struct cache_handle *);
 void scan_fhs (void);
 struct cache_handle *create_cached_handle (int, struct cache_handle *, file_t);
@@ -115,15 +143,22 @@ void scan_replies (void);
 
 /* loop.c */
 void * server_loop (void *);
+void *tcp_listen_loop (void *);
+void *tcp_server_loop (void *);
 
 /* ops.c */
 extern struct proctable nfs2table, mounttable, pmaptable;
 
+/* ops3.c */
+extern struct proctable nfs3table;
+
 /* xdr.c */
 int nfs_error_trans (error_t, int);
+int *encode_hyper (int *, uint64_t);
 int *encode_fattr (int *, struct stat *, int version);
+int *encode_wcc_attr (int *, struct stat *);
 int *decode_name (int *, char **);
-int *encode_fhandle (int *, char *);
+int *encode_fhandle (int *, char *, int version);
 int *encode_string (int *, char *);
 int *encode_data (int *, char *, size_t);
 int *encode_statfs (int *, struct statfs *);
@@ -184,7 +184,7 @@ op_lookup (struct cache_handle *c,
   newc = create_cached_handle (c->handle.fs, c, newport);
   if (!newc)
     return ESTALE;
-  *reply = encode_fhandle (*reply, newc->handle.array);
+  *reply = encode_fhandle (*reply, newc->handle.array, version);
   *reply = encode_fattr (*reply, &st, version);
   return 0;
 }
@@ -287,7 +287,11 @@ op_write (struct cache_handle *c,
   p++;
   count = ntohl (*p);
   p++;
-  bp = (char *) *reply;
+  bp = (char *) p;
+
+  /* count_write_args has made sure that the data is all in the call.  */
+  if (count > NFS_MAXDATA)
+    return EINVAL;
 
   while (count)
     {
@@ -310,6 +314,18 @@ op_write (struct cache_handle *c,
   return 0;
 }
 
+static size_t
+count_write_args (int *p, int version)
+{
+  size_t len;
+
+  p += 3;			/* Skip BEGINOFFSET, OFFSET and TOTALCOUNT.  */
+  len = ntohl (*p);
+  if (len > MAXCALLSIZE)
+    len = MAXCALLSIZE;		/* Too long anyway; avoid overflow.  */
+  return 4 * sizeof (int) + INTSIZE (len) * sizeof (int);
+}
+
 static error_t
 op_create (struct cache_handle *c,
 	   int *p,
@@ -379,7 +395,7 @@ op_create (struct cache_handle *c,
   if (!newc)
     return ESTALE;
 
-  *reply = encode_fhandle (*reply, newc->handle.array);
+  *reply = encode_fhandle (*reply, newc->handle.array, version);
   *reply = encode_fattr (*reply, &st, version);
   return 0;
 }
@@ -412,7 +428,7 @@ op_rename (struct cache_handle *fromc,
   error_t err = 0;
 
   p = decode_name (p, &fromname);
-  p = lookup_cache_handle (p, &toc, fromc->ids);
+  p = lookup_cache_handle (p, &toc, fromc->ids, version);
   decode_name (p, &toname);
 
   if (!toc)
@@ -434,7 +450,7 @@ op_link (struct cache_handle *filec,
   char *name;
   error_t err = 0;
 
-  p = lookup_cache_handle (p, &dirc, filec->ids);
+  p = lookup_cache_handle (p, &dirc, filec->ids, version);
   decode_name (p, &name);
 
   if (!dirc)
@@ -536,7 +552,7 @@ op_mkdir (struct cache_handle *c,
   newc = create_cached_handle (c->handle.fs, c, newport);
   if (!newc)
     return ESTALE;
-  *reply = encode_fhandle (*reply, newc->handle.array);
+  *reply = encode_fhandle (*reply, newc->handle.array, version);
   *reply = encode_fattr (*reply, &st, version);
   return 0;
 }
@@ -666,7 +682,13 @@ op_mnt (struct cache_handle *c,
   free (name);
   if (!newc)
     return ESTALE;
-  *reply = encode_fhandle (*reply, newc->handle.array);
+  *reply = encode_fhandle (*reply, newc->handle.array, version);
+  if (version == MOUNTVERS3)
+    {
+      /* The authentication flavors we accept.  */
+      *(*reply)++ = htonl (1);
+      *(*reply)++ = htonl (1);	/* AUTH_UNIX */
+    }
   return 0;
 }
 
@@ -685,10 +707,21 @@ op_getport (struct cache_handle *c,
   prot = ntohl (*p);
   p++;
 
-  if (prot != IPPROTO_UDP)
+  if (prot == IPPROTO_TCP)
+    {
+      if (main_tcp_socket != -1
+	  && ((prog == MOUNTPROG && vers >= MOUNTVERS && vers <= MOUNTVERS3)
+	      || (prog == NFS_PROGRAM
+		  && (vers == NFS_VERSION || vers == NFS3_VERSION))))
+	*(*reply)++ = htonl (NFS_PORT);
+      else
+	*(*reply)++ = htonl (0);
+    }
+  else if (prot != IPPROTO_UDP)
     *(*reply)++ = htonl (0);
-  else if ((prog == MOUNTPROG && vers == MOUNTVERS)
-	   || (prog == NFS_PROGRAM && vers == NFS_VERSION))
+  else if ((prog == MOUNTPROG && vers >= MOUNTVERS && vers <= MOUNTVERS3)
+	   || (prog == NFS_PROGRAM
+	       && (vers == NFS_VERSION || vers == NFS3_VERSION)))
     *(*reply)++ = htonl (NFS_PORT);
   else if (prog == PMAPPROG && vers == PMAPVERS)
     *(*reply)++ = htonl (PMAPPORT);
@@ -712,7 +745,7 @@ struct proctable nfs2table =
     { op_readlink, 0, 1, 1},
     { op_read, count_read_buffersize, 1, 1},
     { 0, 0, 0, 0 },		/* Nonexistent NFSPROC_WRITECACHE.  */
-    { op_write, 0, 1, 1},
+    { op_write, 0, 1, 1, 0, count_write_args},
     { op_create, 0, 1, 1},
     { op_remove, 0, 1, 1},
     { op_rename, 0, 1, 1},
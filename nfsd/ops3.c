@@ -0,0 +1,1113 @@
+/* ops3.c NFS daemon protocol operations, version 3.
+
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This file is part of the GNU Hurd.
+
+   The GNU Hurd is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   The GNU Hurd is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111, USA. */
+
+/* The procedures of NFS version 3 (RFC 1813).  Compared with version 2,
+   offsets and sizes are 64 bits, transfers may be larger (up to
+   NFS3_MAXDATA), most replies carry attributes so that clients needn't
+   ask for them separately, READDIRPLUS returns the attributes and handles
+   of the entries with their names, and writes may be unstable, to be
+   made stable later by COMMIT.  */
+
+#include <hurd/io.h>
+#include <hurd/fs.h>
+#include <fcntl.h>
+#include <hurd/paths.h>
+#include <hurd.h>
+#include <dirent.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "nfsd.h"
+
+/* Bits of the properties returned by FSINFO.  */
+#define FSF3_LINK		0x0001
+#define FSF3_SYMLINK		0x0002
+#define FSF3_HOMOGENEOUS	0x0008
+#define FSF3_CANSETTIME		0x0010
+
+/* Decode the 64-bit number at P into *N and return the next thing to
+   come after it.  */
+static int *
+decode_hyper (int *p, uint64_t *n)
+{
+  *n = (uint64_t) ntohl (p[0]) << 32 | (uint32_t) ntohl (p[1]);
+  return p + 2;
+}
+
+/* Encode the attributes of PORT, if we can get them, into P as a
+   post_op_attr and return the next thing to come after it.  */
+static int *
+encode_post_op_attr (int *p, file_t port)
+{
+  struct stat st;
+
+  if (port != MACH_PORT_NULL && io_stat (port, &st) == 0)
+    {
+      *(p++) = htonl (1);
+      p = encode_fattr (p, &st, 3);
+    }
+  else
+    *(p++) = 0;
+  return p;
+}
+
+/* Encode PRE, the attributes of PORT before an operation (null if
+   unknown), and its attributes now into P as a wcc_data and return the
+   next thing to come after it.  */
+static int *
+encode_wcc_data (int *p, struct stat *pre, file_t port)
+{
+  if (pre)
+    {
+      *(p++) = htonl (1);
+      p = encode_wcc_attr (p, pre);
+    }
+  else
+    *(p++) = 0;
+  return encode_post_op_attr (p, port);
+}
+
+/* Encode the write verifier into P and return the next thing to come
+   after it.  It changes whenever we restart, which tells clients to
+   send again the unstable writes they haven't seen committed.  */
+static int *
+encode_write_verf (int *p)
+{
+  *(p++) = htonl (start_time);
+  *(p++) = htonl (getpid ());
+  return p;
+}
+
+/* The settable attributes of a file (a sattr3).  */
+struct sattr
+{
+  int set_mode, set_uid, set_gid, set_size;
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+  uint64_t size;
+
+  /* How to set the times; see enum sattr_time_how.  */
+  int set_atime, set_mtime;
+  time_value_t atime, mtime;
+};
+
+/* Decode the time setting at P into *HOW and *TIME and return the next
+   thing to come after it.  */
+static int *
+decode_set_time (int *p, int *how, time_value_t *time)
+{
+  *how = ntohl (*p);
+  p++;
+  if (*how == SET_TO_CLIENT_TIME)
+    {
+      time->seconds = ntohl (*p);
+      p++;
+      time->microseconds = (unsigned int) ntohl (*p) / 1000;
+      p++;
+    }
+  else if (*how == SET_TO_SERVER_TIME)
+    {
+      /* This means `now' to file_utimes.  */
+      time->seconds = -1;
+      time->microseconds = -1;
+    }
+  return p;
+}
+
+/* Decode the sattr3 at P into *SA and return the next thing to come
+   after it.  */
+static int *
+decode_sattr (int *p, struct sattr *sa)
+{
+  sa->set_mode = ntohl (*p);
+  p++;
+  if (sa->set_mode)
+    {
+      sa->mode = ntohl (*p);
+      p++;
+    }
+  sa->set_uid = ntohl (*p);
+  p++;
+  if (sa->set_uid)
+    {
+      sa->uid = ntohl (*p);
+      p++;
+    }
+  sa->set_gid = ntohl (*p);
+  p++;
+  if (sa->set_gid)
+    {
+      sa->gid = ntohl (*p);
+      p++;
+    }
+  sa->set_size = ntohl (*p);
+  p++;
+  if (sa->set_size)
+    p = decode_hyper (p, &sa->size);
+  p = decode_set_time (p, &sa->set_atime, &sa->atime);
+  p = decode_set_time (p, &sa->set_mtime, &sa->mtime);
+  return p;
+}
+
+/* Change the attributes of PORT, whose current ones are ST, as SA
+   says.  */
+static error_t
+apply_sattr (file_t port, struct stat *st, struct sattr *sa)
+{
+  error_t err = 0;
+
+  if (sa->set_mode && (sa->mode & 07777) != (st->st_mode & 07777))
+    err = file_chmod (port, sa->mode & 07777);
+
+  if (!err
+      && ((sa->set_uid && sa->uid != st->st_uid)
+	  || (sa->set_gid && sa->gid != st->st_gid)))
+    err = file_chown (port,
+		      sa->set_uid ? sa->uid : st->st_uid,
+		      sa->set_gid ? sa->gid : st->st_gid);
+
+  if (!err && sa->set_size && sa->size != st->st_size)
+    err = file_set_size (port, sa->size);
+
+  if (!err && (sa->set_atime != DONT_CHANGE || sa->set_mtime != DONT_CHANGE))
+    {
+      time_value_t atime = sa->atime, mtime = sa->mtime;
+
+      if (sa->set_atime == DONT_CHANGE)
+	{
+	  atime.seconds = st->st_atim.tv_sec;
+	  atime.microseconds = st->st_atim.tv_nsec / 1000;
+	}
+      if (sa->set_mtime == DONT_CHANGE)
+	{
+	  mtime.seconds = st->st_mtim.tv_sec;
+	  mtime.microseconds = st->st_mtim.tv_nsec / 1000;
+	}
+      err = file_utimes (port, atime, mtime);
+    }
+
+  return err;
+}
+
+/* Look up NAME in DIR, refusing to leave the file system, and return the
+   port in *PORT and its attributes in *ST.  */
+static error_t
+lookup_in (file_t dir, char *name, int flags, mode_t mode,
+	   file_t *port, struct stat *st)
+{
+  retry_type do_retry;
+  char retry_name [1024];
+  error_t err;
+
+  err = dir_lookup (dir, name, flags | O_NOTRANS, mode,
+		    &do_retry, retry_name, port);
+  if (err)
+    return err;
+
+  /* Block attempts to bounce out of this filesystem by any technique.  */
+  if (do_retry != FS_RETRY_NORMAL || retry_name[0] != '\0')
+    err = EACCES;
+  if (!err)
+    err = io_stat (*port, st);
+  if (err)
+    mach_port_deallocate (mach_task_self (), *port);
+  return err;
+}
+
+/* Encode the handle of PORT, a file in the file system of C, and its
+   attributes ST into P as a post_op_fh3 and a post_op_attr, and return
+   the next thing to come after them.  PORT is consumed.  */
+static int *
+encode_new_file (int *p, struct cache_handle *c, file_t port,
+		 struct stat *st)
+{
+  struct cache_handle *newc;
+
+  newc = create_cached_handle (c->handle.fs, c, port);
+  if (newc)
+    {
+      *(p++) = htonl (1);
+      p = encode_fhandle (p, newc->handle.array, 3);
+      cache_handle_rele (newc);
+    }
+  else
+    *(p++) = 0;
+
+  *(p++) = htonl (1);
+  return encode_fattr (p, st, 3);
+}
+
+static error_t
+op3_getattr (struct cache_handle *c,
+	     int *p,
+	     int **reply,
+	     int version)
+{
+  struct stat st;
+  error_t err;
+
+  err = io_stat (c->port, &st);
+  if (!err)
+    *reply = encode_fattr (*reply, &st, version);
+  return err;
+}
+
+/* SETATTR does its own error processing, to report a failed guard.  */
+static error_t
+op3_setattr (struct cache_handle *c,
+	     int *p,
+	     int **reply,
+	     int version)
+{
+  struct sattr sa;
+  struct stat st;
+  int guarded;
+  error_t err;
+  int *r = *reply;
+
+  if (!c)
+    {
+      *(r++) = htonl (nfs_error_trans (ESTALE, version));
+      *(r++) = 0;
+      *(r++) = 0;
+      *reply = r;
+      return 0;
+    }
+
+  p = decode_sattr (p, &sa);
+
+  err = io_stat (c->port, &st);
+  if (err)
+    {
+      *(r++) = htonl (nfs_error_trans (err, version));
+      r = encode_wcc_data (r, 0, c->port);
+      *reply = r;
+      return 0;
+    }
+
+  guarded = ntohl (*p);
+  p++;
+  if (guarded
+      && (ntohl (p[0]) != st.st_ctim.tv_sec
+	  || ntohl (p[1]) != st.st_ctim.tv_nsec))
+    *(r++) = htonl (NFSERR_NOT_SYNC);
+  else
+    *(r++) = htonl (nfs_error_trans (apply_sattr (c->port, &st, &sa),
+				     version));
+
+  r = encode_wcc_data (r, &st, c->port);
+  *reply = r;
+  return 0;
+}
+
+static error_t
+op3_lookup (struct cache_handle *c,
+	    int *p,
+	    int **reply,
+	    int version)
+{
+  error_t err;
+  char *name;
+  file_t newport;
+  struct stat st;
+  struct cache_handle *newc;
+
+  decode_name (p, &name);
+  err = lookup_in (c->port, name, 0, 0, &newport, &st);
+  free (name);
+  if (err)
+    return err;
+
+  newc = create_cached_handle (c->handle.fs, c, newport);
+  if (!newc)
+    return ESTALE;
+
+  *reply = encode_fhandle (*reply, newc->handle.array, version);
+  cache_handle_rele (newc);
+  *(*reply)++ = htonl (1);
+  *reply = encode_fattr (*reply, &st, version);
+  *reply = encode_post_op_attr (*reply, c->port);
+  return 0;
+}
+
+static error_t
+op3_access (struct cache_handle *c,
+	    int *p,
+	    int **reply,
+	    int version)
+{
+  int wanted, allowed, granted = 0;
+  struct stat st;
+  error_t err;
+
+  wanted = ntohl (*p);
+  p++;
+
+  err = io_stat (c->port, &st);
+  if (!err)
+    err = file_check_access (c->port, &allowed);
+  if (err)
+    return err;
+
+  if (allowed & O_READ)
+    granted |= ACCESS3_READ;
+  if (allowed & O_WRITE)
+    granted |= (S_ISDIR (st.st_mode)
+		? ACCESS3_MODIFY | ACCESS3_EXTEND | ACCESS3_DELETE
+		: ACCESS3_MODIFY | ACCESS3_EXTEND);
+  if (allowed & O_EXEC)
+    granted |= S_ISDIR (st.st_mode) ? ACCESS3_LOOKUP : ACCESS3_EXECUTE;
+
+  *(*reply)++ = htonl (1);
+  *reply = encode_fattr (*reply, &st, version);
+  *(*reply)++ = htonl (granted & wanted);
+  return 0;
+}
+
+static error_t
+op3_readlink (struct cache_handle *c,
+	      int *p,
+	      int **reply,
+	      int version)
+{
+  char buf[2048], *transp = buf;
+  mach_msg_type_number_t len = sizeof (buf);
+  error_t err;
+
+  err = file_get_translator (c->port, &transp, &len);
+  if (!err
+      && (len < sizeof (_HURD_SYMLINK)
+	  || memcmp (transp, _HURD_SYMLINK, sizeof (_HURD_SYMLINK))))
+    err = EINVAL;
+
+  if (!err)
+    {
+      *reply = encode_post_op_attr (*reply, c->port);
+      *reply = encode_string (*reply, transp + sizeof (_HURD_SYMLINK));
+    }
+
+  if (transp != buf)
+    munmap (transp, len);
+  return err;
+}
+
+static size_t
+count_read_buffersize (int *p, int version)
+{
+  size_t count;
+
+  p += 2;			/* Skip OFFSET.  */
+  count = ntohl (*p);
+  return count > NFS3_MAXDATA ? NFS3_MAXDATA : count;
+}
+
+static error_t
+op3_read (struct cache_handle *c,
+	  int *p,
+	  int **reply,
+	  int version)
+{
+  uint64_t offset;
+  size_t count;
+  char buf[2048], *bp = buf;
+  mach_msg_type_number_t buflen = sizeof (buf);
+  struct stat st;
+  error_t err;
+
+  p = decode_hyper (p, &offset);
+  count = ntohl (*p);
+  p++;
+  if (count > NFS3_MAXDATA)
+    count = NFS3_MAXDATA;
+
+  err = io_read (c->port, &bp, &buflen, offset, count);
+  if (!err)
+    err = io_stat (c->port, &st);
+  if (err)
+    {
+      if (bp != buf)
+	munmap (bp, buflen);
+      return err;
+    }
+
+  *(*reply)++ = htonl (1);
+  *reply = encode_fattr (*reply, &st, version);
+  *(*reply)++ = htonl (buflen);
+  *(*reply)++ = htonl (offset + buflen >= (uint64_t) st.st_size);
+  *reply = encode_data (*reply, bp, buflen);
+
+  if (bp != buf)
+    munmap (bp, buflen);
+  return 0;
+}
+
+static error_t
+op3_write (struct cache_handle *c,
+	   int *p,
+	   int **reply,
+	   int version)
+{
+  uint64_t offset;
+  size_t count, done = 0;
+  int stable;
+  error_t err;
+  mach_msg_type_number_t amt;
+  char *bp;
+  struct stat pre;
+
+  p = decode_hyper (p, &offset);
+  count = ntohl (*p);
+  p++;
+  stable = ntohl (*p);
+  p++;
+  if (ntohl (*p) < count)
+    count = ntohl (*p);		/* The data is all there is.  */
+  p++;
+  bp = (char *) p;
+
+  /* count_write3_args has made sure that the data is all in the call.  */
+  if (count > NFS3_MAXDATA)
+    return EINVAL;
+
+  err = io_stat (c->port, &pre);
+  if (err)
+    return err;
+
+  while (done < count)
+    {
+      err = io_write (c->port, bp + done, count - done, offset + done, &amt);
+      if (!err && amt == 0)
+	err = EIO;
+      if (err)
+	break;
+      done += amt;
+    }
+  /* If some of the data was written before an error, report a short
+     write; the client will send the rest again and get the error
+     then.  */
+  if (err && done == 0)
+    return err;
+
+  /* Unstable writes are left to the file system to write back as it
+     likes, until COMMIT.  If syncing fails, the data is still written,
+     so just don't claim it is stable; the client will COMMIT it.  */
+  if (stable != UNSTABLE && file_sync (c->port, 1, 0))
+    stable = UNSTABLE;
+
+  *reply = encode_wcc_data (*reply, &pre, c->port);
+  *(*reply)++ = htonl (done);
+  *(*reply)++ = htonl (stable == UNSTABLE ? UNSTABLE : FILE_SYNC);
+  *reply = encode_write_verf (*reply);
+  return 0;
+}
+
+static size_t
+count_write3_args (int *p, int version)
+{
+  size_t len;
+
+  p += 4;			/* Skip OFFSET, COUNT and STABLE.  */
+  len = ntohl (*p);
+  if (len > MAXCALLSIZE)
+    len = MAXCALLSIZE;		/* Too long anyway; avoid overflow.  */
+  return 5 * sizeof (int) + INTSIZE (len) * sizeof (int);
+}
+
+static error_t
+op3_commit (struct cache_handle *c,
+	    int *p,
+	    int **reply,
+	    int version)
+{
+  struct stat pre;
+  error_t err;
+
+  /* We sync the whole file whatever range is asked for.  */
+  err = io_stat (c->port, &pre);
+  if (!err)
+    err = file_sync (c->port, 1, 0);
+  if (err)
+    return err;
+
+  *reply = encode_wcc_data (*reply, &pre, c->port);
+  *reply = encode_write_verf (*reply);
+  return 0;
+}
+
+static error_t
+op3_create (struct cache_handle *c,
+	    int *p,
+	    int **reply,
+	    int version)
+{
+  error_t err;
+  char *name;
+  file_t newport;
+  struct stat st, dirpre;
+  struct sattr sa;
+  int how, flags;
+  int verf[2];
+
+  p = decode_name (p, &name);
+  how = ntohl (*p);
+  p++;
+  if (how == EXCLUSIVE)
+    {
+      verf[0] = ntohl (*p++);
+      verf[1] = ntohl (*p++);
+      flags = O_CREAT | O_EXCL;
+      sa.set_mode = 0;
+    }
+  else
+    {
+      p = decode_sattr (p, &sa);
+      flags = how == GUARDED ? O_CREAT | O_EXCL : O_CREAT;
+    }
+
+  err = io_stat (c->port, &dirpre);
+  if (err)
+    {
+      free (name);
+      return err;
+    }
+
+  err = lookup_in (c->port, name, flags,
+		   sa.set_mode ? sa.mode & 07777 : 0600, &newport, &st);
+
+  if (how == EXCLUSIVE)
+    {
+      /* The verifier is kept in the times of the new file, so that a
+	 retransmitted CREATE finds it there and succeeds.  The client sets
+	 the real times afterwards.  */
+      if (err == EEXIST)
+	{
+	  err = lookup_in (c->port, name, 0, 0, &newport, &st);
+	  if (!err && (st.st_atim.tv_sec != verf[0]
+		       || st.st_mtim.tv_sec != verf[1]))
+	    {
+	      mach_port_deallocate (mach_task_self (), newport);
+	      err = EEXIST;
+	    }
+	}
+      else if (!err)
+	{
+	  time_value_t atime = { verf[0], 0 }, mtime = { verf[1], 0 };
+
+	  err = file_utimes (newport, atime, mtime);
+	  if (!err)
+	    err = io_stat (newport, &st);
+	  if (err)
+	    {
+	      mach_port_deallocate (mach_task_self (), newport);
+	      dir_unlink (c->port, name);
+	    }
+	}
+    }
+  else if (!err)
+    {
+      /* The mode was given when creating the file, or it already
+	 existed and an unchecked create doesn't change the mode.  */
+      sa.set_mode = 0;
+      err = apply_sattr (newport, &st, &sa);
+      if (!err)
+	err = io_stat (newport, &st);
+      if (err)
+	mach_port_deallocate (mach_task_self (), newport);
+    }
+  free (name);
+
+  if (err)
+    return err;
+
+  *reply = encode_new_file (*reply, c, newport, &st);
+  *reply = encode_wcc_data (*reply, &dirpre, c->port);
+  return 0;
+}
+
+static error_t
+op3_mkdir (struct cache_handle *c,
+	   int *p,
+	   int **reply,
+	   int version)
+{
+  char *name;
+  struct sattr sa;
+  file_t newport;
+  struct stat st, dirpre;
+  error_t err;
+
+  p = decode_name (p, &name);
+  p = decode_sattr (p, &sa);
+
+  err = io_stat (c->port, &dirpre);
+  if (!err)
+    err = dir_mkdir (c->port, name, sa.set_mode ? sa.mode & 07777 : 0777);
+  if (!err)
+    err = lookup_in (c->port, name, 0, 0, &newport, &st);
+  free (name);
+  if (err)
+    return err;
+
+  *reply = encode_new_file (*reply, c, newport, &st);
+  *reply = encode_wcc_data (*reply, &dirpre, c->port);
+  return 0;
+}
+
+static error_t
+op3_symlink (struct cache_handle *c,
+	     int *p,
+	     int **reply,
+	     int version)
+{
+  char *name, *target;
+  struct sattr sa;
+  error_t err;
+  file_t newport = MACH_PORT_NULL;
+  struct stat st, dirpre;
+  size_t len;
+  char *buf;
+
+  p = decode_name (p, &name);
+  p = decode_sattr (p, &sa);
+  p = decode_name (p, &target);
+
+  len = strlen (target) + 1;
+  buf = alloca (sizeof (_HURD_SYMLINK) + len);
+  memcpy (buf, _HURD_SYMLINK, sizeof (_HURD_SYMLINK));
+  memcpy (buf + sizeof (_HURD_SYMLINK), target, len);
+
+  err = io_stat (c->port, &dirpre);
+  if (!err)
+    err = dir_mkfile (c->port, O_WRITE, sa.set_mode ? sa.mode & 07777 : 0777,
+		      &newport);
+  if (!err)
+    err = file_set_translator (newport,
+			       FS_TRANS_EXCL|FS_TRANS_SET,
+			       FS_TRANS_EXCL|FS_TRANS_SET, 0,
+			       buf, sizeof (_HURD_SYMLINK) + len,
+			       MACH_PORT_NULL, MACH_MSG_TYPE_COPY_SEND);
+  if (!err)
+    err = dir_link (c->port, newport, name, 1);
+  if (!err)
+    err = io_stat (newport, &st);
+
+  free (name);
+  free (target);
+
+  if (err)
+    {
+      if (newport != MACH_PORT_NULL)
+	mach_port_deallocate (mach_task_self (), newport);
+      return err;
+    }
+
+  *reply = encode_new_file (*reply, c, newport, &st);
+  *reply = encode_wcc_data (*reply, &dirpre, c->port);
+  return 0;
+}
+
+static error_t
+op3_mknod (struct cache_handle *c,
+	   int *p,
+	   int **reply,
+	   int version)
+{
+  return EOPNOTSUPP;
+}
+
+/* REMOVE and RMDIR.  */
+static error_t
+remove_name (struct cache_handle *c, int *p, int **reply,
+	     error_t (*remove) (file_t, char *))
+{
+  char *name;
+  struct stat dirpre;
+  error_t err;
+
+  decode_name (p, &name);
+  err = io_stat (c->port, &dirpre);
+  if (!err)
+    err = (*remove) (c->port, name);
+  free (name);
+  if (err)
+    return err;
+
+  *reply = encode_wcc_data (*reply, &dirpre, c->port);
+  return 0;
+}
+
+static error_t
+op3_remove (struct cache_handle *c,
+	    int *p,
+	    int **reply,
+	    int version)
+{
+  return remove_name (c, p, reply, dir_unlink);
+}
+
+static error_t
+op3_rmdir (struct cache_handle *c,
+	   int *p,
+	   int **reply,
+	   int version)
+{
+  return remove_name (c, p, reply, dir_rmdir);
+}
+
+static error_t
+op3_rename (struct cache_handle *fromc,
+	    int *p,
+	    int **reply,
+	    int version)
+{
+  struct cache_handle *toc;
+  char *fromname, *toname;
+  struct stat frompre, topre;
+  error_t err = 0;
+
+  p = decode_name (p, &fromname);
+  p = lookup_cache_handle (p, &toc, fromc->ids, version);
+  decode_name (p, &toname);
+
+  if (!toc)
+    err = ESTALE;
+  if (!err)
+    err = io_stat (fromc->port, &frompre);
+  if (!err)
+    err = io_stat (toc->port, &topre);
+  if (!err)
+    err = dir_rename (fromc->port, fromname, toc->port, toname, 0);
+  free (fromname);
+  free (toname);
+
+  if (!err)
+    {
+      *reply = encode_wcc_data (*reply, &frompre, fromc->port);
+      *reply = encode_wcc_data (*reply, &topre, toc->port);
+    }
+  if (toc)
+    cache_handle_rele (toc);
+  return err;
+}
+
+static error_t
+op3_link (struct cache_handle *filec,
+	  int *p,
+	  int **reply,
+	  int version)
+{
+  struct cache_handle *dirc;
+  struct stat dirpre;
+  char *name;
+  error_t err = 0;
+
+  p = lookup_cache_handle (p, &dirc, filec->ids, version);
+  decode_name (p, &name);
+
+  if (!dirc)
+    err = ESTALE;
+  if (!err)
+    err = io_stat (dirc->port, &dirpre);
+  if (!err)
+    err = dir_link (dirc->port, filec->port, name, 1);
+  free (name);
+
+  if (!err)
+    {
+      *reply = encode_post_op_attr (*reply, filec->port);
+      *reply = encode_wcc_data (*reply, &dirpre, dirc->port);
+    }
+  if (dirc)
+    cache_handle_rele (dirc);
+  return err;
+}
+
+/* Encode the attributes and handle of the entry NAME in C into P, as a
+   post_op_attr and a post_op_fh3, and return the next thing to come
+   after them.  */
+static int *
+encode_entry_plus (int *p, struct cache_handle *c, char *name)
+{
+  file_t port;
+  struct stat st;
+  struct cache_handle *newc = 0;
+
+  if (lookup_in (c->port, name, 0, 0, &port, &st) == 0)
+    newc = create_cached_handle (c->handle.fs, c, port);
+
+  if (! newc)
+    {
+      *(p++) = 0;
+      *(p++) = 0;
+      return p;
+    }
+
+  *(p++) = htonl (1);
+  p = encode_fattr (p, &st, 3);
+  *(p++) = htonl (1);
+  p = encode_fhandle (p, newc->handle.array, 3);
+  cache_handle_rele (newc);
+  return p;
+}
+
+/* READDIR and READDIRPLUS (if PLUS).  Cookies are entry numbers.  */
+static error_t
+readdir3 (struct cache_handle *c, int *p, int **reply, int plus)
+{
+  uint64_t cookie;
+  size_t count;
+  error_t err;
+  char *buf = 0;
+  size_t bufsize = 0;
+  struct dirent *dp;
+  int nentries;
+  int i, full = 0, eof = 0;
+  int *r, *limit;
+
+  p = decode_hyper (p, &cookie);
+  p += NFS3_COOKIEVERFSIZE / sizeof (int);
+  if (plus)
+    p++;			/* Skip DIRCOUNT; MAXCOUNT limits us.  */
+  count = ntohl (*p);
+  p++;
+  if (count > NFS3_MAXDATA)
+    count = NFS3_MAXDATA;
+
+  err = dir_readdir (c->port, &buf, &bufsize, cookie, -1, count, &nentries);
+  if (err)
+    {
+      if (buf)
+	munmap (buf, bufsize);
+      return err;
+    }
+
+  r = *reply;
+  limit = (int *) ((char *) r + count) - 2;	/* Leave room for the end.  */
+  r = encode_post_op_attr (r, c->port);
+  *(r++) = 0;			/* The cookie verifier.  */
+  *(r++) = 0;
+
+  for (i = 0, dp = (struct dirent *) buf;
+       (char *) dp < buf + bufsize && i < nentries;
+       i++, dp = (struct dirent *) ((char *) dp + dp->d_reclen))
+    {
+      size_t namelen = strlen (dp->d_name);
+      size_t need = 6 + INTSIZE (namelen);
+
+      if (plus)
+	need += 2 + 21 + 1 + INTSIZE (NFS2_FHSIZE);
+      if (r + need > limit)
+	{
+	  full = 1;
+	  break;
+	}
+
+      *(r++) = htonl (1);			/* Entry present.  */
+      r = encode_hyper (r, dp->d_ino);
+      r = encode_string (r, dp->d_name);
+      r = encode_hyper (r, cookie + i + 1);	/* Next entry.  */
+      if (plus)
+	r = encode_entry_plus (r, c, dp->d_name);
+    }
+
+  if (buf)
+    munmap (buf, bufsize);
+
+  if (full && i == 0)
+    /* Not even one entry fits.  */
+    return EMSGSIZE;
+
+  if (! full)
+    {
+      /* See whether there are more entries, so that the client needn't
+	 ask again to find out.  */
+      buf = 0;
+      bufsize = 0;
+      if (dir_readdir (c->port, &buf, &bufsize, cookie + i, 1, 0, &nentries)
+	  == 0)
+	eof = nentries == 0;
+      if (buf)
+	munmap (buf, bufsize);
+    }
+
+  *(r++) = htonl (0);			/* No more entries.  */
+  *(r++) = htonl (eof);
+  *reply = r;
+  return 0;
+}
+
+static error_t
+op3_readdir (struct cache_handle *c,
+	     int *p,
+	     int **reply,
+	     int version)
+{
+  return readdir3 (c, p, reply, 0);
+}
+
+static error_t
+op3_readdirplus (struct cache_handle *c,
+		 int *p,
+		 int **reply,
+		 int version)
+{
+  return readdir3 (c, p, reply, 1);
+}
+
+static size_t
+count_readdir_buffersize (int *p, int version)
+{
+  size_t count;
+
+  p += 2;				/* Skip COOKIE.  */
+  p += NFS3_COOKIEVERFSIZE / sizeof (int);
+  count = ntohl (*p);
+  return count > NFS3_MAXDATA ? NFS3_MAXDATA : count;
+}
+
+static size_t
+count_readdirplus_buffersize (int *p, int version)
+{
+  size_t count;
+
+  p += 2;				/* Skip COOKIE.  */
+  p += NFS3_COOKIEVERFSIZE / sizeof (int);
+  p++;					/* Skip DIRCOUNT.  */
+  count = ntohl (*p);
+  return count > NFS3_MAXDATA ? NFS3_MAXDATA : count;
+}
+
+static error_t
+op3_fsstat (struct cache_handle *c,
+	    int *p,
+	    int **reply,
+	    int version)
+{
+  struct statfs st;
+  error_t err;
+
+  err = file_statfs (c->port, &st);
+  if (err)
+    return err;
+
+  *reply = encode_post_op_attr (*reply, c->port);
+  *reply = encode_hyper (*reply, (uint64_t) st.f_blocks * st.f_bsize);
+  *reply = encode_hyper (*reply, (uint64_t) st.f_bfree * st.f_bsize);
+  *reply = encode_hyper (*reply, (uint64_t) st.f_bavail * st.f_bsize);
+  *reply = encode_hyper (*reply, st.f_files);
+  *reply = encode_hyper (*reply, st.f_ffree);
+  *reply = encode_hyper (*reply, st.f_ffree);
+  *(*reply)++ = 0;		/* Nothing is invariant.  */
+  return 0;
+}
+
+static error_t
+op3_fsinfo (struct cache_handle *c,
+	    int *p,
+	    int **reply,
+	    int version)
+{
+  int *r;
+
+  r = encode_post_op_attr (*reply, c->port);
+  /* A WRITE of more than NFS3_MAXDATA would not fit in MAXCALLSIZE, even
+     over TCP.  */
+  *(r++) = htonl (NFS3_MAXDATA);	/* rtmax */
+  *(r++) = htonl (NFS3_MAXDATA);	/* rtpref */
+  *(r++) = htonl (512);			/* rtmult */
+  *(r++) = htonl (NFS3_MAXDATA);	/* wtmax */
+  *(r++) = htonl (NFS3_MAXDATA);	/* wtpref */
+  *(r++) = htonl (512);			/* wtmult */
+  *(r++) = htonl (NFS3_MAXDATA);	/* dtpref */
+  r = encode_hyper (r, INT64_MAX);	/* maxfilesize */
+  *(r++) = 0;				/* time_delta: file_utimes */
+  *(r++) = htonl (1000);		/* takes microseconds.  */
+  *(r++) = htonl (FSF3_LINK | FSF3_SYMLINK | FSF3_HOMOGENEOUS
+		  | FSF3_CANSETTIME);
+  *reply = r;
+  return 0;
+}
+
+static error_t
+op3_pathconf (struct cache_handle *c,
+	      int *p,
+	      int **reply,
+	      int version)
+{
+  int linkmax, namemax;
+  int *r;
+
+  if (io_pathconf (c->port, _PC_LINK_MAX, &linkmax))
+    linkmax = 1;
+  if (io_pathconf (c->port, _PC_NAME_MAX, &namemax))
+    namemax = NFS_MAXNAMLEN;
+
+  r = encode_post_op_attr (*reply, c->port);
+  *(r++) = htonl (linkmax);
+  *(r++) = htonl (namemax);
+  *(r++) = htonl (1);		/* no_trunc */
+  *(r++) = htonl (1);		/* chown_restricted */
+  *(r++) = htonl (0);		/* case_insensitive */
+  *(r++) = htonl (1);		/* case_preserving */
+  *reply = r;
+  return 0;
+}
+
+static error_t
+op3_null (struct cache_handle *c,
+	  int *p,
+	  int **reply,
+	  int version)
+{
+  return 0;
+}
+
+
+struct proctable nfs3table =
+{
+  NFS3PROC_NULL,		/* First proc.  */
+  NFS3PROC_COMMIT,		/* Last proc.  */
+  {
+    { op3_null, 0, 0, 0, 0},
+    { op3_getattr, 0, 1, 1, 0},
+    { op3_setattr, 0, 1, 0, 0},
+    { op3_lookup, 0, 1, 1, 1},
+    { op3_access, 0, 1, 1, 1},
+    { op3_readlink, 0, 1, 1, 1},
+    { op3_read, count_read_buffersize, 1, 1, 1},
+    { op3_write, 0, 1, 1, 2, count_write3_args},
+    { op3_create, 0, 1, 1, 2},
+    { op3_mkdir, 0, 1, 1, 2},
+    { op3_symlink, 0, 1, 1, 2},
+    { op3_mknod, 0, 1, 1, 2},
+    { op3_remove, 0, 1, 1, 2},
+    { op3_rmdir, 0, 1, 1, 2},
+    { op3_rename, 0, 1, 1, 4},
+    { op3_link, 0, 1, 1, 3},
+    { op3_readdir, count_readdir_buffersize, 1, 1, 1},
+    { op3_readdirplus, count_readdirplus_buffersize, 1, 1, 1},
+    { op3_fsstat, 0, 1, 1, 1},
+    { op3_fsinfo, 0, 1, 1, 1},
+    { op3_pathconf, 0, 1, 1, 1},
+    { op3_commit, 0, 1, 1, 2},
+  }
+};
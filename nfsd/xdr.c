@@ -23,6 +23,7 @@
 #include <sys/stat.h>
 #include <sys/statfs.h>
 #include <string.h>
+#include <sys/sysmacros.h>
 #include "nfsd.h"
 
 /* Any better ideas?  */
@@ -63,10 +64,42 @@ hurd_mode_to_nfs_type (mode_t m, int version)
     }
 }
 
+/* Encode the 64-bit N into P and return the next thing to come after
+   it.  */
+int *
+encode_hyper (int *p, uint64_t n)
+{
+  *(p++) = htonl (n >> 32);
+  *(p++) = htonl (n);
+  return p;
+}
+
 /* Encode ST into P and return the next thing to come after it.  */
 int *
 encode_fattr (int *p, struct stat *st, int version)
 {
+  if (version == 3)
+    {
+      *(p++) = htonl (hurd_mode_to_nfs_type (st->st_mode, version));
+      *(p++) = htonl (hurd_mode_to_nfs_mode (st->st_mode));
+      *(p++) = htonl (st->st_nlink);
+      *(p++) = htonl (st->st_uid);
+      *(p++) = htonl (st->st_gid);
+      p = encode_hyper (p, st->st_size);
+      p = encode_hyper (p, (uint64_t) st->st_blocks * 512);
+      *(p++) = htonl (major (st->st_rdev));
+      *(p++) = htonl (minor (st->st_rdev));
+      p = encode_hyper (p, st->st_fsid);
+      p = encode_hyper (p, st->st_ino);
+      *(p++) = htonl (st->st_atim.tv_sec);
+      *(p++) = htonl (st->st_atim.tv_nsec);
+      *(p++) = htonl (st->st_mtim.tv_sec);
+      *(p++) = htonl (st->st_mtim.tv_nsec);
+      *(p++) = htonl (st->st_ctim.tv_sec);
+      *(p++) = htonl (st->st_ctim.tv_nsec);
+      return p;
+    }
+
   *(p++) = htonl (hurd_mode_to_nfs_type (st->st_mode, version));
   *(p++) = htonl (hurd_mode_to_nfs_mode (st->st_mode));
   *(p++) = htonl (st->st_nlink);
@@ -87,6 +120,19 @@ encode_fattr (int *p, struct stat *st, int version)
   return p;
 }
 
+/* Encode the attributes of ST that NFSv3 uses to check caches (a
+   wcc_attr) into P and return the next thing to come after it.  */
+int *
+encode_wcc_attr (int *p, struct stat *st)
+{
+  p = encode_hyper (p, st->st_size);
+  *(p++) = htonl (st->st_mtim.tv_sec);
+  *(p++) = htonl (st->st_mtim.tv_nsec);
+  *(p++) = htonl (st->st_ctim.tv_sec);
+  *(p++) = htonl (st->st_ctim.tv_nsec);
+  return p;
+}
+
 /* Decode P into NAME and return the next thing to come after it.  */
 int *
 decode_name (int *p, char **name)
@@ -95,16 +141,23 @@ decode_name (int *p, char **name)
   
   len = ntohl (*p);
   p++;
+  /* Don't read beyond the call buffer (see MAXCALLSIZE); a name this
+     long is bogus anyway.  */
+  if (len < 0 || len > NFS_MAXPATHLEN)
+    len = NFS_MAXPATHLEN;
   *name = malloc (len + 1);
   memcpy (*name, p, len);
   (*name)[len] = '\0';
   return p + INTSIZE (len);
 }
 
-/* Encode HANDLE into P and return the next thing to come after it.  */
+/* Encode HANDLE into P and return the next thing to come after it.
+   Version 3 handles (of NFS or MOUNT) are counted.  */
 int *
-encode_fhandle (int *p, char *handle)
+encode_fhandle (int *p, char *handle, int version)
 {
+  if (version == 3)
+    *(p++) = htonl (NFS2_FHSIZE);
   memcpy (p, handle, NFS2_FHSIZE);
   return p + INTSIZE (NFS2_FHSIZE);
 }
@@ -210,6 +263,12 @@ nfs_error_trans (error_t err, int version)
 	  
 	case EOPNOTSUPP:
 	  return NFSERR_NOTSUPP;	/* Are we sure here?  */
+
+	case EMLINK:
+	  return NFSERR_MLINK;
+
+	case EMSGSIZE:
+	  return NFSERR_TOOSMALL;	/* READDIR reply too small.  */
 	  
 	default:
 	  return NFSERR_IO;